@@ -0,0 +1,112 @@
+# Compiles the HLSL shaders to SPIR-V at build time with glslc and embeds them in the executable, so
+# it neither links shaderc nor reads shader files at startup. Every variant a renderer asks for is
+# listed with embed_shader, ShaderCompiler finds them by file name, stage and options.
+# Configure with -DRUNTIME_SHADERS=ON to compile at run-time with shaderc instead, which hot reload needs.
+
+option(RUNTIME_SHADERS "Compile shaders at run-time with shaderc (needed to hot reload them) instead of embedding them" OFF)
+
+set(EMBEDDED_SHADER_DIR ${CMAKE_CURRENT_BINARY_DIR}/EmbeddedShaders)
+
+if(NOT RUNTIME_SHADERS)
+	find_program(GLSLC_EXECUTABLE glslc HINTS $ENV{VULKAN_SDK}/bin $ENV{VULKAN_SDK}/Bin)
+	if(NOT GLSLC_EXECUTABLE)
+		message(FATAL_ERROR "glslc was not found, install the Vulkan SDK or configure with -DRUNTIME_SHADERS=ON")
+	endif()
+endif()
+
+# embed_shader(<target> <file.hlsl> <vert|frag> [INVERT_Y] [NAME[=VALUE] ...])
+# compiles one variant of a shader for <target>, INVERT_Y and the macros must match the ShaderOptions
+# the renderer compiles it with (debug info is added to Debug builds like the renderers do)
+function(embed_shader TARGET FILE STAGE)
+	if(RUNTIME_SHADERS)
+		return()
+	endif()
+	get_filename_component(SOURCE ${FILE} ABSOLUTE)
+	get_filename_component(NAME ${FILE} NAME)
+	get_target_property(INDEX ${TARGET} EMBEDDED_SHADER_COUNT)
+	if(NOT INDEX)
+		set(INDEX 0)
+	endif()
+
+	# the key is written like ShaderOptions::GetEmbeddedKey, macros sorted after the flags
+	set(FLAGS "")
+	set(MACROS "")
+	set(KEY "")
+	foreach(DEFINE ${ARGN})
+		if(DEFINE STREQUAL "INVERT_Y")
+			list(APPEND FLAGS -finvert-y)
+			set(KEY "INVERT_Y|")
+		else()
+			if(NOT DEFINE MATCHES "=")
+				set(DEFINE "${DEFINE}=1")
+			endif()
+			list(APPEND FLAGS -D${DEFINE})
+			list(APPEND MACROS ${DEFINE})
+		endif()
+	endforeach()
+	list(SORT MACROS)
+	foreach(DEFINE ${MACROS})
+		set(KEY "${KEY}${DEFINE}|")
+	endforeach()
+
+	# includes may sit next to any shader, a change to one of them rebuilds every variant
+	get_filename_component(DIRECTORY ${SOURCE} DIRECTORY)
+	file(GLOB DEPENDENCIES ${DIRECTORY}/*.hlsl ${DIRECTORY}/*.hlsli)
+	set(OUTPUT ${EMBEDDED_SHADER_DIR}/${NAME}.${INDEX}.inc)
+	add_custom_command(OUTPUT ${OUTPUT}
+		COMMAND ${CMAKE_COMMAND} -E make_directory ${EMBEDDED_SHADER_DIR}
+		COMMAND ${GLSLC_EXECUTABLE} -x hlsl -fshader-stage=${STAGE} -fentry-point=main ${FLAGS}
+			$<$<CONFIG:Debug>:-g> -mfmt=c -o ${OUTPUT} ${SOURCE}
+		DEPENDS ${DEPENDENCIES}
+		COMMENT "Compiling ${NAME} ${KEY}"
+		COMMAND_EXPAND_LISTS
+		VERBATIM)
+	set_source_files_properties(${OUTPUT} PROPERTIES GENERATED TRUE HEADER_FILE_ONLY TRUE)
+	target_sources(${TARGET} PRIVATE ${OUTPUT})
+
+	# one property per shader, an empty key would get lost in a list
+	set_property(TARGET ${TARGET} PROPERTY EMBEDDED_SHADER_${INDEX} "${NAME}" ${STAGE} "${KEY}")
+	math(EXPR INDEX "${INDEX} + 1")
+	set_property(TARGET ${TARGET} PROPERTY EMBEDDED_SHADER_COUNT ${INDEX})
+endfunction()
+
+# write_embedded_shaders(<target>)
+# writes EmbeddedShaders.h with every shader embedded for <target>, call it after the last embed_shader
+function(write_embedded_shaders TARGET)
+	if(RUNTIME_SHADERS)
+		target_compile_definitions(${TARGET} PRIVATE RUNTIME_SHADERS)
+		return()
+	endif()
+	get_target_property(COUNT ${TARGET} EMBEDDED_SHADER_COUNT)
+	if(NOT COUNT)
+		message(FATAL_ERROR "no shaders were embedded into ${TARGET}")
+	endif()
+
+	set(ARRAYS "")
+	set(ENTRIES "")
+	math(EXPR LAST "${COUNT} - 1")
+	foreach(INDEX RANGE ${LAST})
+		get_target_property(SHADER ${TARGET} EMBEDDED_SHADER_${INDEX})
+		list(GET SHADER 0 NAME)
+		list(GET SHADER 1 STAGE)
+		list(LENGTH SHADER LENGTH)
+		set(KEY "")
+		if(LENGTH GREATER 2)
+			list(GET SHADER 2 KEY)
+		endif()
+		if(STAGE STREQUAL "vert")
+			set(KIND SHADER_STAGE_VERTEX)
+		else()
+			set(KIND SHADER_STAGE_FRAGMENT)
+		endif()
+		string(APPEND ARRAYS "static const uint32_t embeddedShader${INDEX}[] =\n#include \"${NAME}.${INDEX}.inc\"\n;\n")
+		string(APPEND ENTRIES "\t{ \"${NAME}\", ${KIND}, \"${KEY}\", embeddedShader${INDEX}, sizeof(embeddedShader${INDEX}) / sizeof(uint32_t) },\n")
+	endforeach()
+
+	# only replaced when the list changed, so configuring again doesn't rebuild the renderer
+	set(HEADER ${EMBEDDED_SHADER_DIR}/EmbeddedShaders.h)
+	file(WRITE ${HEADER}.tmp "// generated by EmbedShaders.cmake from the embed_shader calls in CMakeLists.txt\n\n"
+		"${ARRAYS}\nstatic const EmbeddedShader embeddedShaders[] =\n{\n${ENTRIES}};\n")
+	configure_file(${HEADER}.tmp ${HEADER} COPYONLY)
+	target_include_directories(${TARGET} PRIVATE ${EMBEDDED_SHADER_DIR})
+endfunction()
@@ -18,27 +18,116 @@ struct OUT_V
 
 cbuffer SHADER_VARS : register(b0, space0)
 {
-    float4x4 world;
     float4x4 view;
     float4x4 projection;
     float4 sunDir;
     float4 camPos;
+    float4 feedbackParams; // pixel of each feedback cell that writes this frame, feedback size in cells
+};
+
+// world matrix and textures of the current draw, -1 when the material has none
+[[vk::push_constant]]
+cbuffer DRAW_VARS
+{
+    float4x4 world;
+    float4 positionScale, positionOffset;
+    int baseColorMap, metallicRoughnessMap;
+    int baseColorLayer, metallicRoughnessLayer; // -1 for a standalone texture, else the map indexes textureArrays
 };
 
 Texture2D    textures[] : register(t0, space1);
 SamplerState samplers[] : register(s0, space1);
+Texture2DArray textureArrays[] : register(t1, space1);
+SamplerState   arraySamplers[] : register(s1, space1);
+
+#if VIRTUAL_TEXTURES
+// see VirtualTexture.h for the layouts
+#define VT_PAGE_SIZE 128
+#define VT_PAGE_BORDER 4
+#define VT_PAGE_STRIDE 136
+#define VT_CACHE_PAGES 16
+#define VT_FEEDBACK_SCALE 8
+
+Texture2D                caches[]        : register(t0, space2);
+SamplerState             cacheSamplers[] : register(s0, space2);
+StructuredBuffer<uint>   pageTable       : register(t1, space2);
+RWStructuredBuffer<uint> feedback        : register(u2, space2);
+
+// texels and pages of a virtual texture at a level
+uint2 LevelSize(uint2 size, uint level)
+{
+    return max(size >> level, 1);
+}
+
+uint2 PageOf(float2 uv, uint2 size, uint level)
+{
+    uint2 pages = (LevelSize(size, level) + VT_PAGE_SIZE - 1) / VT_PAGE_SIZE;
+    return min((uint2)(uv * LevelSize(size, level)) / VT_PAGE_SIZE, pages - 1);
+}
+
+// samples a virtual texture through the page table, from the page wanted or the coarser one standing
+// in for it, one pixel of every feedback cell reports the page it wanted
+float4 SampleVirtual(uint map, uint record, uint role, float2 uv, float2 pixel)
+{
+    uint2 size = uint2(pageTable[record], pageTable[record + 1]);
+    uint levels = pageTable[record + 2];
+    uint cache = pageTable[record + 3];
+
+    // uvs are clamped like the sampler of the other textures
+    float2 dx = ddx(uv * size), dy = ddy(uv * size);
+    float lod = 0.5f * log2(max(max(dot(dx, dx), dot(dy, dy)), 1e-8f));
+    uint level = (uint)clamp(lod, 0.0f, levels - 1.0f);
+    uv = saturate(uv);
+
+    uint2 page = PageOf(uv, size, level);
+    uint2 cell = (uint2)pixel / VT_FEEDBACK_SCALE;
+    if (all((uint2)pixel % VT_FEEDBACK_SCALE == (uint2)feedbackParams.xy) && all(cell < (uint2)feedbackParams.zw))
+        feedback[(cell.y * (uint)feedbackParams.z + cell.x) * 2 + role] = (map << 24) | (level << 20) | (page.y << 10) | page.x;
+
+    uint2 pages = (LevelSize(size, level) + VT_PAGE_SIZE - 1) / VT_PAGE_SIZE;
+    uint entry = pageTable[pageTable[record + 4 + level] + page.y * pages.x + page.x];
+    if ((entry & 0x80000000) == 0)
+        return 1;
+    uint resident = (entry >> 16) & 0xFF;
+    uint2 slot = uint2(entry & 0xFF, (entry >> 8) & 0xFF);
+
+    // the texel in the resident page, which has its neighbours' edges around it
+    float2 texel = uv * LevelSize(size, resident);
+    float2 inPage = texel - PageOf(uv, size, resident) * VT_PAGE_SIZE;
+    float2 cacheUV = (slot * VT_PAGE_STRIDE + VT_PAGE_BORDER + inPage) / (VT_PAGE_STRIDE * VT_CACHE_PAGES);
+    return caches[cache].SampleLevel(cacheSamplers[cache], cacheUV, 0);
+}
+#endif
+
+// samples texture map from textures, from layer layer of textureArrays[map] when it is packed
+// or from the virtual texture cache when it is virtual
+float4 SampleMap(int map, int layer, uint role, float2 uv, float2 pixel)
+{
+    if (layer >= 0)
+        return textureArrays[map].Sample(arraySamplers[map], float3(uv, layer));
+#if VIRTUAL_TEXTURES
+    uint record = pageTable[map];
+    if (record != 0)
+        return SampleVirtual(map, record, role, uv, pixel);
+#endif
+    return textures[map].Sample(samplers[map], uv);
+}
 
 float4 main(OUT_V inputVert) : SV_TARGET
 {
     float3 lightDir = normalize(sunDir.xyz);
 
-    float4 diffuseColor = textures[0].Sample(samplers[0], inputVert.uv);
-    float4 roughnessMettalic = textures[1].Sample(samplers[1], inputVert.uv);
+    float4 diffuseColor = 1;
+    if (baseColorMap >= 0)
+        diffuseColor = SampleMap(baseColorMap, baseColorLayer, 0, inputVert.uv, inputVert.pos.xy);
+    float4 roughnessMettalic = 1;
+    if (metallicRoughnessMap >= 0)
+        roughnessMettalic = SampleMap(metallicRoughnessMap, metallicRoughnessLayer, 1, inputVert.uv, inputVert.pos.xy);
     
     float occulssion = roughnessMettalic.x;
     float roughness = roughnessMettalic.y;
     
-    float3 normal = mul(float4(inputVert.nrm, 1), world);
+    float3 normal = mul(float4(inputVert.nrm, 0), world).xyz;
     float  lightRatio = dot(-lightDir, normal);
     
     float3 viewDir = normalize(camPos.xyz - inputVert.posW.xyz);
@@ -0,0 +1,264 @@
+#ifndef MIPGENERATOR_H
+#define MIPGENERATOR_H
+
+// Requires Gateware.h
+
+// Cook time mip generation for 8 bit RGBA images. Every level is resampled from the one above it in
+// float, so the chain loses no precision on the way down, and only quantized to 8 bits when it is
+// written out. Colour images are averaged in linear space and stored as sRGB again, alpha tested
+// images have each level's alpha scaled so as many texels pass the test as at the top. The inner
+// loops work on whole RGBA texels so the compiler can keep them in one SIMD register, rows are
+// spread over all cores.
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <atomic>
+#include <thread>
+
+#define MIP_FILTER_BOX 0 // average of the texels under each smaller texel
+#define MIP_FILTER_KAISER 1 // Kaiser windowed sinc, keeps distant textures sharper
+#define MIP_KAISER_WIDTH 3.0f // filter radius, in texels of the smaller level
+#define MIP_KAISER_ALPHA 4.0f // window shape, higher rings less but blurs more
+#define MIP_COVERAGE_STEPS 12 // binary search steps when matching alpha coverage
+
+// how the mips of one image are built
+struct MipSettings
+{
+	unsigned int filter = MIP_FILTER_BOX; // MIP_FILTER_*
+	bool srgb = false; // rgb holds sRGB encoded colour
+	float alphaCutoff = -1.0f; // alpha test the coverage is kept for, negative for none
+};
+
+unsigned int GetMipLevelCount(unsigned int _width, unsigned int _height)
+{
+	unsigned int levels = 1;
+	for (unsigned int size = G_LARGER(_width, _height); size > 1; size /= 2)
+		levels++;
+	return levels;
+}
+
+// bytes of the whole mip chain of 8 bit RGBA pixels, levels are stored largest first
+size_t GetMipChainSize(unsigned int _width, unsigned int _height)
+{
+	size_t size = 0;
+	for (unsigned int level = 0; level < GetMipLevelCount(_width, _height); level++)
+		size += static_cast<size_t>(G_LARGER(_width >> level, 1u)) * G_LARGER(_height >> level, 1u) * 4;
+	return size;
+}
+
+float SRGBToLinear(float _value)
+{
+	return (_value <= 0.04045f) ? _value / 12.92f : powf((_value + 0.055f) / 1.055f, 2.4f);
+}
+
+float LinearToSRGB(float _value)
+{
+	return (_value <= 0.0031308f) ? _value * 12.92f : 1.055f * powf(_value, 1.0f / 2.4f) - 0.055f;
+}
+
+// runs _body for every row below _rows, rows are handed out to all cores as they finish
+template <typename Body>
+void ForEachMipRow(unsigned int _rows, const Body& _body)
+{
+	std::atomic<unsigned int> next(0);
+	auto work = [&]()
+		{
+			for (unsigned int row = next++; row < _rows; row = next++)
+				_body(row);
+		};
+	unsigned int threads = G_SMALLER(std::thread::hardware_concurrency(), _rows);
+	std::vector<std::thread> workers;
+	for (unsigned int i = 1; i < threads; i++)
+		workers.emplace_back(work);
+	work();
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+// zeroth order modified Bessel function of the first kind, the Kaiser window is built from it
+float BesselI0(float _x)
+{
+	float sum = 1.0f, term = 1.0f;
+	for (int k = 1; k < 32 && term > sum * 1e-7f; k++)
+	{
+		term *= (_x * _x) / (4.0f * k * k);
+		sum += term;
+	}
+	return sum;
+}
+
+// Weights resampling one axis from _size texels down to _smaller. Every smaller texel reads the
+// same number of taps so the loops stay simple, taps past the edge repeat the last texel.
+struct MipTaps
+{
+	unsigned int count = 0; // taps per smaller texel
+	std::vector<unsigned int> sources; // count texels per smaller texel
+	std::vector<float> weights; // count weights per smaller texel, they sum to one
+};
+
+void GetMipTaps(unsigned int _size, unsigned int _smaller, unsigned int _filter, MipTaps& _outTaps)
+{
+	float scale = static_cast<float>(_size) / _smaller;
+	float radius = (_filter == MIP_FILTER_KAISER) ? MIP_KAISER_WIDTH * scale : scale * 0.5f;
+	_outTaps.count = static_cast<unsigned int>(ceilf(radius * 2.0f)) + 1;
+	_outTaps.sources.resize(static_cast<size_t>(_smaller) * _outTaps.count);
+	_outTaps.weights.resize(static_cast<size_t>(_smaller) * _outTaps.count);
+	float window = BesselI0(MIP_KAISER_ALPHA);
+	for (unsigned int x = 0; x < _smaller; x++)
+	{
+		float center = (x + 0.5f) * scale;
+		int first = static_cast<int>(floorf(center - radius));
+		unsigned int* sources = &_outTaps.sources[static_cast<size_t>(x) * _outTaps.count];
+		float* weights = &_outTaps.weights[static_cast<size_t>(x) * _outTaps.count];
+		float sum = 0.0f;
+		for (unsigned int t = 0; t < _outTaps.count; t++)
+		{
+			int source = first + static_cast<int>(t);
+			float weight = 0.0f;
+			if (_filter == MIP_FILTER_KAISER)
+			{
+				// distance in smaller texels, sinc cuts off at the smaller level's frequency
+				float d = (source + 0.5f - center) / scale;
+				if (fabsf(d) < MIP_KAISER_WIDTH)
+				{
+					float r = d / MIP_KAISER_WIDTH;
+					float sinc = (fabsf(d) < 1e-5f) ? 1.0f : sinf(3.14159265f * d) / (3.14159265f * d);
+					weight = sinc * BesselI0(MIP_KAISER_ALPHA * sqrtf(1.0f - r * r)) / window;
+				}
+			}
+			else
+			{
+				// the part of the texel inside the smaller texel's footprint
+				float low = G_LARGER(static_cast<float>(source), center - radius);
+				float high = G_SMALLER(static_cast<float>(source + 1), center + radius);
+				weight = G_LARGER(high - low, 0.0f);
+			}
+			sources[t] = static_cast<unsigned int>(G_SMALLER(G_LARGER(source, 0), static_cast<int>(_size) - 1));
+			weights[t] = weight;
+			sum += weight;
+		}
+		for (unsigned int t = 0; t < _outTaps.count; t++)
+			weights[t] /= sum;
+	}
+}
+
+// resamples float RGBA texels to the next level down, one axis at a time
+void BuildMipLevel(const float* _texels, unsigned int _width, unsigned int _height, unsigned int _filter, std::vector<float>& _outTexels)
+{
+	unsigned int width = G_LARGER(_width / 2, 1u), height = G_LARGER(_height / 2, 1u);
+	MipTaps columns, rows;
+	GetMipTaps(_width, width, _filter, columns);
+	GetMipTaps(_height, height, _filter, rows);
+
+	std::vector<float> narrow(static_cast<size_t>(width) * _height * 4);
+	ForEachMipRow(_height, [&](unsigned int _y)
+		{
+			const float* source = _texels + static_cast<size_t>(_y) * _width * 4;
+			float* destination = narrow.data() + static_cast<size_t>(_y) * width * 4;
+			for (unsigned int x = 0; x < width; x++)
+			{
+				float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+				const unsigned int* sources = &columns.sources[static_cast<size_t>(x) * columns.count];
+				const float* weights = &columns.weights[static_cast<size_t>(x) * columns.count];
+				for (unsigned int t = 0; t < columns.count; t++)
+					for (int c = 0; c < 4; c++)
+						sum[c] += source[sources[t] * 4 + c] * weights[t];
+				memcpy(destination + x * 4, sum, sizeof(sum));
+			}
+		});
+
+	_outTexels.resize(static_cast<size_t>(width) * height * 4);
+	ForEachMipRow(height, [&](unsigned int _y)
+		{
+			float* destination = _outTexels.data() + static_cast<size_t>(_y) * width * 4;
+			const unsigned int* sources = &rows.sources[static_cast<size_t>(_y) * rows.count];
+			const float* weights = &rows.weights[static_cast<size_t>(_y) * rows.count];
+			memset(destination, 0, static_cast<size_t>(width) * 4 * sizeof(float));
+			for (unsigned int t = 0; t < rows.count; t++)
+			{
+				const float* source = narrow.data() + static_cast<size_t>(sources[t]) * width * 4;
+				for (unsigned int i = 0; i < width * 4; i++)
+					destination[i] += source[i] * weights[t];
+			}
+		});
+}
+
+// fraction of _count texels whose alpha, scaled by _scale, passes _cutoff
+float GetAlphaCoverage(const float* _texels, size_t _count, float _cutoff, float _scale)
+{
+	size_t passed = 0;
+	for (size_t i = 0; i < _count; i++)
+		passed += (_texels[i * 4 + 3] * _scale > _cutoff) ? 1 : 0;
+	return static_cast<float>(passed) / _count;
+}
+
+// alpha scale that gives the texels the same coverage as _coverage, found by binary search
+float GetAlphaCoverageScale(const float* _texels, size_t _count, float _cutoff, float _coverage)
+{
+	// coverage only grows with the scale, search the threshold the unscaled alpha is tested against
+	float low = 0.0f, high = 1.0f;
+	for (int i = 0; i < MIP_COVERAGE_STEPS; i++)
+	{
+		float middle = (low + high) * 0.5f;
+		if (GetAlphaCoverage(_texels, _count, middle, 1.0f) > _coverage)
+			low = middle;
+		else
+			high = middle;
+	}
+	float threshold = (low + high) * 0.5f;
+	return (threshold > 0.0f) ? _cutoff / threshold : 1.0f;
+}
+
+// builds every mip level of 8 bit RGBA pixels into _outLevels, largest first, level 0 is _pixels as is
+void BuildMipChain(const unsigned char* _pixels, unsigned int _width, unsigned int _height, const MipSettings& _settings,
+				std::vector<unsigned char>& _outLevels)
+{
+	_outLevels.resize(GetMipChainSize(_width, _height));
+	size_t texelCount = static_cast<size_t>(_width) * _height;
+	memcpy(_outLevels.data(), _pixels, texelCount * 4);
+
+	float decode[256];
+	for (int i = 0; i < 256; i++)
+		decode[i] = (_settings.srgb) ? SRGBToLinear(i / 255.0f) : i / 255.0f;
+	std::vector<float> level(texelCount * 4), smaller;
+	for (size_t i = 0; i < texelCount; i++)
+	{
+		for (int c = 0; c < 3; c++)
+			level[i * 4 + c] = decode[_pixels[i * 4 + c]];
+		level[i * 4 + 3] = _pixels[i * 4 + 3] / 255.0f;
+	}
+	bool keepCoverage = _settings.alphaCutoff >= 0.0f;
+	float coverage = (keepCoverage) ? GetAlphaCoverage(level.data(), texelCount, _settings.alphaCutoff, 1.0f) : 0.0f;
+
+	unsigned char* output = _outLevels.data() + texelCount * 4;
+	unsigned int width = _width, height = _height;
+	for (unsigned int i = 1; i < GetMipLevelCount(_width, _height); i++)
+	{
+		BuildMipLevel(level.data(), width, height, _settings.filter, smaller);
+		level.swap(smaller);
+		width = G_LARGER(width / 2, 1u);
+		height = G_LARGER(height / 2, 1u);
+		texelCount = static_cast<size_t>(width) * height;
+
+		// the scale only goes into the stored level, the next one is built from the unscaled alpha
+		float alphaScale = (keepCoverage) ? GetAlphaCoverageScale(level.data(), texelCount, _settings.alphaCutoff, coverage) : 1.0f;
+		ForEachMipRow(height, [&](unsigned int _y)
+			{
+				const float* texels = level.data() + static_cast<size_t>(_y) * width * 4;
+				unsigned char* pixels = output + static_cast<size_t>(_y) * width * 4;
+				for (unsigned int x = 0; x < width * 4; x += 4)
+				{
+					for (int c = 0; c < 3; c++)
+					{
+						float value = G_SMALLER(G_LARGER(texels[x + c], 0.0f), 1.0f);
+						pixels[x + c] = static_cast<unsigned char>(((_settings.srgb) ? LinearToSRGB(value) : value) * 255.0f + 0.5f);
+					}
+					float alpha = G_SMALLER(G_LARGER(texels[x + 3] * alphaScale, 0.0f), 1.0f);
+					pixels[x + 3] = static_cast<unsigned char>(alpha * 255.0f + 0.5f);
+				}
+			});
+		output += texelCount * 4;
+	}
+}
+
+#endif // !MIPGENERATOR_H
@@ -0,0 +1,316 @@
+#ifndef STAGINGRING_H
+#define STAGINGRING_H
+
+// Requires Gateware.h
+
+// One persistently mapped host visible buffer every upload to device local memory is staged
+// through. Space is handed out front to back and wraps around, each allocation stays in use until
+// the submission that read it completes. Submissions are numbered in order like the values of a
+// timeline semaphore, so anything that uploaded can later ask whether its value has completed
+// instead of waiting on the queue. TransferBatch records the copies and submits them, flushing
+// early whenever the ring runs out of room.
+#include <deque>
+#include <vector>
+
+#define STAGING_RING_SIZE (64ull << 20) // bytes
+#define STAGING_RING_ALIGNMENT 16 // covers every texel size and the 4 byte buffer copy rule
+
+class StagingRing
+{
+	// a range of the ring, value is 0 until the submission reading it is made
+	struct Region
+	{
+		VkDeviceSize begin;
+		VkDeviceSize end;
+		unsigned long long value;
+	};
+
+	// a submission still in flight, its command buffer is freed once it completes
+	struct Submission
+	{
+		unsigned long long value;
+		VkFence fence;
+		VkCommandPool commandPool;
+		VkCommandBuffer commandBuffer;
+	};
+
+	VkDevice device = nullptr;
+	VkBuffer buffer = nullptr;
+	VkDeviceMemory memory = nullptr;
+	unsigned char* mapped = nullptr;
+	VkDeviceSize capacity = 0;
+	std::deque<Region> regions; // oldest first
+	std::deque<Submission> submissions; // oldest first
+	std::vector<VkFence> freeFences;
+	unsigned long long submitted = 0;
+	unsigned long long completed = 0;
+
+	// retires the submissions that are done and drops the regions they were reading
+	void Reclaim()
+	{
+		while (!submissions.empty() && vkGetFenceStatus(device, submissions.front().fence) == VK_SUCCESS)
+		{
+			Submission& done = submissions.front();
+			vkResetFences(device, 1, &done.fence);
+			freeFences.push_back(done.fence);
+			vkFreeCommandBuffers(device, done.commandPool, 1, &done.commandBuffer);
+			completed = done.value;
+			submissions.pop_front();
+		}
+		while (!regions.empty() && regions.front().value != 0 && regions.front().value <= completed)
+			regions.pop_front();
+	}
+
+public:
+	VkResult Create(GW::GRAPHICS::GVulkanSurface _surface, VkDeviceSize _size = STAGING_RING_SIZE)
+	{
+		VkPhysicalDevice physicalDevice;
+		_surface.GetDevice(reinterpret_cast<void**>(&device));
+		_surface.GetPhysicalDevice(reinterpret_cast<void**>(&physicalDevice));
+		capacity = _size;
+		VkResult r = GvkHelper::create_buffer(physicalDevice, device, capacity,
+			VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			&buffer, &memory);
+		if (r == VK_SUCCESS)
+			r = vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, reinterpret_cast<void**>(&mapped));
+		return r;
+	}
+
+	// waits for every submission still reading the ring and frees it
+	void Destroy()
+	{
+		if (device == nullptr)
+			return;
+		Wait(submitted);
+		for (VkFence fence : freeFences)
+			vkDestroyFence(device, fence, nullptr);
+		freeFences.clear();
+		if (mapped != nullptr)
+			vkUnmapMemory(device, memory);
+		vkDestroyBuffer(device, buffer, nullptr);
+		vkFreeMemory(device, memory, nullptr);
+		mapped = nullptr;
+		device = nullptr;
+	}
+
+	VkBuffer GetBuffer() const
+	{
+		return buffer;
+	}
+
+	VkDeviceSize GetCapacity() const
+	{
+		return capacity;
+	}
+
+	// value of the newest submission that has completed, along with every one before it
+	unsigned long long GetCompleted()
+	{
+		Reclaim();
+		return completed;
+	}
+
+	// blocks until submission _value has completed
+	void Wait(unsigned long long _value)
+	{
+		Reclaim();
+		if (_value <= completed)
+			return;
+		for (const Submission& submission : submissions)
+			if (submission.value >= _value)
+			{
+				vkWaitForFences(device, 1, &submission.fence, VK_TRUE, UINT64_MAX);
+				break;
+			}
+		Reclaim();
+	}
+
+	// Space for _size bytes, waits on older submissions when the ring is full. Returns nullptr when
+	// the ring holds nothing but unsubmitted data, the caller has to submit that first.
+	unsigned char* Allocate(VkDeviceSize _size, VkDeviceSize& _outOffset)
+	{
+		if (_size > capacity)
+			return nullptr;
+		for (;;)
+		{
+			Reclaim();
+			bool fits = false;
+			VkDeviceSize offset = 0;
+			if (regions.empty())
+				fits = true;
+			else
+			{
+				VkDeviceSize tail = regions.front().begin;
+				VkDeviceSize head = regions.back().end;
+				offset = (head + STAGING_RING_ALIGNMENT - 1) & ~VkDeviceSize(STAGING_RING_ALIGNMENT - 1);
+				if (head > tail)
+				{
+					// free space is past the head and, after wrapping, before the tail
+					if (offset + _size <= capacity)
+						fits = true;
+					else if (_size <= tail)
+					{
+						offset = 0;
+						fits = true;
+					}
+				}
+				else if (head < tail)
+					fits = offset + _size <= tail;
+				// head == tail means the ring is full
+			}
+			if (fits)
+			{
+				regions.push_back({ offset, offset + _size, 0 });
+				_outOffset = offset;
+				return mapped + offset;
+			}
+
+			// wait for the oldest submission, unless it hasn't been made yet
+			if (regions.front().value == 0)
+				return nullptr;
+			Wait(regions.front().value);
+		}
+	}
+
+	// Numbers the submission of _commandBuffer, which reads everything allocated since the last
+	// call. It has to be submitted with _outFence, the ring frees the command buffer once it is done.
+	unsigned long long Close(VkCommandPool _commandPool, VkCommandBuffer _commandBuffer, VkFence& _outFence)
+	{
+		Reclaim();
+		_outFence = nullptr;
+		if (!freeFences.empty())
+		{
+			_outFence = freeFences.back();
+			freeFences.pop_back();
+		}
+		else
+		{
+			VkFenceCreateInfo fenceInfo = {};
+			fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+			vkCreateFence(device, &fenceInfo, nullptr, &_outFence);
+		}
+		submitted++;
+		for (auto region = regions.rbegin(); region != regions.rend() && region->value == 0; ++region)
+			region->value = submitted;
+		submissions.push_back({ submitted, _outFence, _commandPool, _commandBuffer });
+		return submitted;
+	}
+};
+
+// Records copies out of a StagingRing into one command buffer. Submit runs them and waits, a
+// batch bigger than the ring is split into several submissions along the way. SubmitAsync returns
+// straight away with the value to check the ring's progress against.
+class TransferBatch
+{
+protected:
+	StagingRing* staging = nullptr;
+	VkDevice device = nullptr;
+	VkPhysicalDevice physicalDevice = nullptr;
+	VkQueue queue = nullptr;
+	VkCommandPool commandPool = nullptr;
+	VkCommandBuffer commandBuffer = nullptr;
+	unsigned long long value = 0; // of the latest submission
+
+	// submits what was recorded so far, recording carries on in a new command buffer if _restart
+	VkResult Flush(bool _restart)
+	{
+		VkResult r = vkEndCommandBuffer(commandBuffer);
+		VkFence fence;
+		value = staging->Close(commandPool, commandBuffer, fence);
+
+		VkSubmitInfo submitInfo = {};
+		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submitInfo.commandBufferCount = 1;
+		submitInfo.pCommandBuffers = &commandBuffer;
+		if (r == VK_SUCCESS)
+			r = vkQueueSubmit(queue, 1, &submitInfo, fence);
+		if (r != VK_SUCCESS)
+			vkQueueSubmit(queue, 0, nullptr, fence); // the fence still has to signal for the ring to move on
+
+		commandBuffer = nullptr;
+		if (_restart && r == VK_SUCCESS)
+			r = GvkHelper::signal_command_start(device, commandPool, &commandBuffer);
+		return r;
+	}
+
+	// _size bytes of the ring for this batch, submits early when the ring is full
+	unsigned char* Stage(VkDeviceSize _size, VkDeviceSize& _outOffset)
+	{
+		unsigned char* data = staging->Allocate(_size, _outOffset);
+		if (data == nullptr && _size <= staging->GetCapacity() && Flush(true) == VK_SUCCESS)
+			data = staging->Allocate(_size, _outOffset);
+		return data;
+	}
+
+public:
+	// starts recording on the surface's graphics queue
+	VkResult Begin(GW::GRAPHICS::GVulkanSurface _surface, StagingRing& _staging)
+	{
+		staging = &_staging;
+		_surface.GetDevice(reinterpret_cast<void**>(&device));
+		_surface.GetPhysicalDevice(reinterpret_cast<void**>(&physicalDevice));
+		_surface.GetGraphicsQueue(reinterpret_cast<void**>(&queue));
+		_surface.GetCommandPool(reinterpret_cast<void**>(&commandPool));
+		return GvkHelper::signal_command_start(device, commandPool, &commandBuffer);
+	}
+
+	// queues a copy of _size bytes into _buffer at _offset, _data may be reused as soon as this returns
+	bool CopyToBuffer(const void* _data, VkDeviceSize _size, VkBuffer _buffer, VkDeviceSize _offset = 0)
+	{
+		// big copies go in pieces so they never need the whole ring at once
+		VkDeviceSize chunk = G_LARGER(staging->GetCapacity() / 4, VkDeviceSize(STAGING_RING_ALIGNMENT));
+		for (VkDeviceSize done = 0; done < _size; done += chunk)
+		{
+			VkDeviceSize size = G_SMALLER(chunk, _size - done);
+			VkDeviceSize stagingOffset = 0;
+			unsigned char* destination = Stage(size, stagingOffset);
+			if (destination == nullptr)
+				return false;
+			memcpy(destination, static_cast<const unsigned char*>(_data) + done, static_cast<size_t>(size));
+			VkBufferCopy region = { stagingOffset, _offset + done, size };
+			vkCmdCopyBuffer(commandBuffer, staging->GetBuffer(), _buffer, 1, &region);
+		}
+		return true;
+	}
+
+	// makes buffers written by this batch visible to _dstStage before anything after it runs
+	void BufferBarrier(VkPipelineStageFlags _dstStage, VkAccessFlags _dstAccess)
+	{
+		VkMemoryBarrier barrier = {};
+		barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = _dstAccess;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, _dstStage, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+	}
+
+	// submits everything recorded since Begin and waits for it
+	VkResult Submit()
+	{
+		VkResult r = Flush(false);
+		staging->Wait(value);
+		return r;
+	}
+
+	// submits everything recorded since Begin without waiting, the work is done once the ring's
+	// completed value reaches _outValue
+	VkResult SubmitAsync(unsigned long long& _outValue)
+	{
+		VkResult r = Flush(false);
+		_outValue = value;
+		return r;
+	}
+};
+
+// creates a device local buffer and queues _size bytes of _data into it
+VkResult CreateDeviceBuffer(TransferBatch& _batch, VkPhysicalDevice _physicalDevice, VkDevice _device, const void* _data,
+							VkDeviceSize _size, VkBufferUsageFlags _usage, VkBuffer& _outBuffer, VkDeviceMemory& _outMemory)
+{
+	VkResult r = GvkHelper::create_buffer(_physicalDevice, _device, _size, _usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &_outBuffer, &_outMemory);
+	if (r == VK_SUCCESS && _data != nullptr && !_batch.CopyToBuffer(_data, _size, _outBuffer))
+		r = VK_ERROR_OUT_OF_HOST_MEMORY;
+	return r;
+}
+
+#endif // !STAGINGRING_H
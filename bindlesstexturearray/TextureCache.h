@@ -0,0 +1,196 @@
+#ifndef TEXTURECACHE_H
+#define TEXTURECACHE_H
+
+// Requires Gateware.h, MappedFile.h, ModelCache.h and TextureUtils.h
+
+// Shared textures and samplers. A texture is found by a hash of its content and format, so pixels
+// used by several materials or models go to the GPU once, and a sampler by its create info, so
+// identical samplers are created once. Every user gets the same handle and holds a reference,
+// the last Release destroys it.
+#include <cstddef>
+#include <unordered_map>
+
+// key of a model image's texture, its content hash mixed with everything that picks the format
+unsigned long long GetTextureKey(const ModelImage& _image)
+{
+	unsigned int format[7] = { _image.width, _image.height, _image.bits, _image.compression, _image.channels, _image.swizzle, _image.levels };
+	return HashBytes(format, sizeof(format), _image.hash);
+}
+
+class TextureCache
+{
+	struct Entry
+	{
+		VkDeviceMemory memory = nullptr;
+		VkImage image = nullptr;
+		VkImageView imageView = nullptr;
+		unsigned int references = 0;
+	};
+	VkDevice device = nullptr;
+	std::unordered_map<unsigned long long, Entry> entries; // by key
+	std::unordered_map<VkImageView, unsigned long long> keys; // of every view handed out
+
+	void DestroyEntry(const Entry& _entry)
+	{
+		vkDestroyImageView(device, _entry.imageView, nullptr);
+		vkDestroyImage(device, _entry.image, nullptr);
+		vkFreeMemory(device, _entry.memory, nullptr);
+	}
+
+public:
+	void Create(GW::GRAPHICS::GVulkanSurface _surface)
+	{
+		_surface.GetDevice(reinterpret_cast<void**>(&device));
+	}
+
+	// the view of the texture with _key, the first time a key is seen _upload(memory, image, view) creates it
+	template <typename Upload>
+	bool Acquire(unsigned long long _key, const Upload& _upload, VkImageView& _outView)
+	{
+		auto found = entries.find(_key);
+		if (found == entries.end())
+		{
+			Entry entry;
+			if (!_upload(entry.memory, entry.image, entry.imageView))
+			{
+				DestroyEntry(entry);
+				return false;
+			}
+			found = entries.emplace(_key, entry).first;
+			keys[entry.imageView] = _key;
+		}
+		found->second.references++;
+		_outView = found->second.imageView;
+		return true;
+	}
+
+	// same as above for a model image, queued on _batch when it is new
+	bool Acquire(TextureUploadBatch& _batch, const ModelImage& _image, VkImageView& _outView)
+	{
+		return Acquire(GetTextureKey(_image), [&](VkDeviceMemory& _outMemory, VkImage& _outImage, VkImageView& _outImageView)
+			{
+				return _batch.Add(_image, _outMemory, _outImage, _outImageView);
+			}, _outView);
+	}
+
+	// same as above for an 8 bit image file, keyed by the bytes of the file
+	bool Acquire(TextureUploadBatch& _batch, const std::string& _file, VkImageView& _outView)
+	{
+		MappedFile file;
+		if (!file.Open(_file))
+			return false;
+		unsigned long long key = HashBytes(file.data, file.size, HashBytes("file", 4));
+		file.Close();
+		return Acquire(key, [&](VkDeviceMemory& _outMemory, VkImage& _outImage, VkImageView& _outImageView)
+			{
+				return _batch.Add(_file, _outMemory, _outImage, _outImageView);
+			}, _outView);
+	}
+
+	// drops a reference to _view, the last one destroys the texture so the GPU must be done with it
+	void Release(VkImageView _view)
+	{
+		auto key = keys.find(_view);
+		if (key == keys.end())
+			return;
+		auto found = entries.find(key->second);
+		if (--found->second.references > 0)
+			return;
+		DestroyEntry(found->second);
+		entries.erase(found);
+		keys.erase(key);
+	}
+
+	// destroys every texture whatever its references
+	void Destroy()
+	{
+		for (auto& entry : entries)
+			DestroyEntry(entry.second);
+		entries.clear();
+		keys.clear();
+	}
+};
+
+class SamplerCache
+{
+	struct Entry
+	{
+		VkSamplerCreateInfo info;
+		VkSampler sampler = nullptr;
+		unsigned int references = 0;
+	};
+	VkDevice device = nullptr;
+	std::unordered_map<unsigned long long, std::vector<Entry>> entries; // by hash of the state
+
+	// the state is every member from flags on, all 4 bytes wide so there is no padding to skip.
+	// pNext chains aren't followed, samplers that need one shouldn't come from here
+	static const unsigned char* GetState(const VkSamplerCreateInfo& _info)
+	{
+		return reinterpret_cast<const unsigned char*>(&_info) + offsetof(VkSamplerCreateInfo, flags);
+	}
+	static constexpr size_t STATE_SIZE = sizeof(VkSamplerCreateInfo) - offsetof(VkSamplerCreateInfo, flags);
+
+public:
+	void Create(GW::GRAPHICS::GVulkanSurface _surface)
+	{
+		_surface.GetDevice(reinterpret_cast<void**>(&device));
+	}
+
+	// a sampler made from _info, created the first time its state is seen
+	VkResult Acquire(const VkSamplerCreateInfo& _info, VkSampler& _outSampler)
+	{
+		std::vector<Entry>& bucket = entries[HashBytes(GetState(_info), STATE_SIZE)];
+		for (Entry& entry : bucket)
+			if (memcmp(GetState(entry.info), GetState(_info), STATE_SIZE) == 0)
+			{
+				entry.references++;
+				_outSampler = entry.sampler;
+				return VK_SUCCESS;
+			}
+
+		Entry entry;
+		entry.info = _info;
+		entry.info.pNext = nullptr;
+		VkResult r = vkCreateSampler(device, &_info, nullptr, &entry.sampler);
+		if (r != VK_SUCCESS)
+			return r;
+		entry.references = 1;
+		bucket.push_back(entry);
+		_outSampler = entry.sampler;
+		return VK_SUCCESS;
+	}
+
+	// same as above with the state CreateSampler uses
+	VkResult Acquire(VkSampler& _outSampler, VkSamplerAddressMode _addressMode = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+					VkFilter _filter = VK_FILTER_LINEAR, float _anisotropy = 4.0f)
+	{
+		return Acquire(GetSamplerCreateInfo(_addressMode, _filter, _anisotropy), _outSampler);
+	}
+
+	// drops a reference to _sampler, the last one destroys it so the GPU must be done with it
+	void Release(VkSampler _sampler)
+	{
+		for (auto& bucket : entries)
+			for (size_t i = 0; i < bucket.second.size(); i++)
+				if (bucket.second[i].sampler == _sampler)
+				{
+					if (--bucket.second[i].references == 0)
+					{
+						vkDestroySampler(device, _sampler, nullptr);
+						bucket.second.erase(bucket.second.begin() + i);
+					}
+					return;
+				}
+	}
+
+	// destroys every sampler whatever its references
+	void Destroy()
+	{
+		for (auto& bucket : entries)
+			for (Entry& entry : bucket.second)
+				vkDestroySampler(device, entry.sampler, nullptr);
+		entries.clear();
+	}
+};
+
+#endif // !TEXTURECACHE_H
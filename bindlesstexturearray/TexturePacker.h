@@ -0,0 +1,163 @@
+#ifndef TEXTUREPACKER_H
+#define TEXTUREPACKER_H
+
+// Requires Gateware.h, MipGenerator.h, TextureCompressor.h, ModelCache.h, StagingRing.h, TextureUtils.h and TextureCache.h
+
+// Packs textures of the same size and format into the layers of 2D array images, so a big material
+// library needs a handful of image objects, allocations and descriptors instead of one of each per
+// texture. Every layer keeps its own mip chain and the sampler clamps per layer, so unlike an atlas
+// nothing bleeds between textures, no padding is wasted and the uvs stay as they are, a draw just
+// picks a layer. Equal textures share a layer. Groups too small to pay off stay standalone images.
+#include <cstdio>
+#include <unordered_map>
+
+#define TEXTURE_ARRAY_MIN_LAYERS 2 // smaller groups stay standalone images
+#define TEXTURE_ARRAY_MAX_LAYERS 256 // the least maxImageArrayLayers a device may have
+
+struct TextureArrayGroup
+{
+	unsigned int width, height, compression, channels, swizzle;
+	std::vector<unsigned int> layers; // image each layer is uploaded from
+};
+
+struct TexturePacking
+{
+	std::vector<TextureArrayGroup> groups;
+	std::vector<int> arrays; // by image, group it is drawn from, -1 for a standalone image
+	std::vector<unsigned int> layers; // by image, its layer in that group
+	unsigned int textures = 0; // distinct textures, the image objects it would take without arrays
+	unsigned int packed = 0; // distinct textures in arrays
+};
+
+// images an array can hold, cooked mip chains of 8 bit pixels
+bool IsTextureArrayCandidate(const ModelImage& _image)
+{
+	return _image.pixels != nullptr && _image.bits == 8 && _image.levels == GetMipLevelCount(_image.width, _image.height);
+}
+
+// groups _images by size and format, images marked in _skip stay standalone
+void PackTextureArrays(const std::vector<ModelImage>& _images, const std::vector<bool>& _skip, TexturePacking& _outPacking)
+{
+	_outPacking = TexturePacking();
+	_outPacking.arrays.assign(_images.size(), -1);
+	_outPacking.layers.assign(_images.size(), 0);
+
+	// every distinct texture goes in the first group of its size and format with room left
+	std::unordered_map<unsigned long long, unsigned int> first; // texture key to the first image with it
+	std::vector<int> original(_images.size(), -1); // image an equal earlier image was packed as
+	std::vector<TextureArrayGroup> groups;
+	std::vector<int> group(_images.size(), -1);
+	for (unsigned int i = 0; i < _images.size(); i++)
+	{
+		auto found = first.emplace(GetTextureKey(_images[i]), i);
+		if (!found.second)
+		{
+			original[i] = static_cast<int>(found.first->second);
+			continue;
+		}
+		_outPacking.textures++;
+		const ModelImage& image = _images[i];
+		if (_skip[i] || !IsTextureArrayCandidate(image))
+			continue;
+
+		size_t g = 0;
+		for (; g < groups.size(); g++)
+			if (groups[g].width == image.width && groups[g].height == image.height && groups[g].compression == image.compression
+				&& groups[g].channels == image.channels && groups[g].swizzle == image.swizzle && groups[g].layers.size() < TEXTURE_ARRAY_MAX_LAYERS)
+				break;
+		if (g == groups.size())
+			groups.push_back({ image.width, image.height, image.compression, image.channels, image.swizzle, {} });
+		group[i] = static_cast<int>(g);
+		_outPacking.layers[i] = static_cast<unsigned int>(groups[g].layers.size());
+		groups[g].layers.push_back(i);
+	}
+
+	// only the groups that pay off are kept
+	std::vector<int> kept(groups.size(), -1);
+	for (size_t g = 0; g < groups.size(); g++)
+		if (groups[g].layers.size() >= TEXTURE_ARRAY_MIN_LAYERS)
+		{
+			kept[g] = static_cast<int>(_outPacking.groups.size());
+			_outPacking.packed += static_cast<unsigned int>(groups[g].layers.size());
+			_outPacking.groups.push_back(std::move(groups[g]));
+		}
+	for (size_t i = 0; i < _images.size(); i++)
+	{
+		size_t source = (original[i] >= 0) ? static_cast<size_t>(original[i]) : i;
+		if (group[source] >= 0 && kept[group[source]] >= 0)
+		{
+			_outPacking.arrays[i] = kept[group[source]];
+			_outPacking.layers[i] = _outPacking.layers[source];
+		}
+	}
+}
+
+// one line on how much the packing saved
+void PrintTexturePacking(const TexturePacking& _packing)
+{
+	unsigned int objects = _packing.textures - _packing.packed + static_cast<unsigned int>(_packing.groups.size());
+	printf("Texture packing: %u of %u textures in %u arrays (%.0f%%), %u image objects instead of %u\n", _packing.packed, _packing.textures,
+		static_cast<unsigned int>(_packing.groups.size()), (_packing.textures > 0) ? 100.0f * _packing.packed / _packing.textures : 0.0f,
+		objects, _packing.textures);
+}
+
+// A TextureUploadBatch that also creates texture arrays and fills their layers one at a time
+class TextureArrayUploadBatch : public TextureUploadBatch
+{
+public:
+	// queues the creation of the array of _group, its layers are shader readable but hold nothing until AddLayer
+	bool CreateArray(const TextureArrayGroup& _group, VkDeviceMemory& _outMemory, VkImage& _outImage, VkImageView& _outImageView)
+	{
+		VkFormat format = GetCookedFormat(_group.compression, _group.channels);
+		uint32_t mipLevels = GetMipLevelCount(_group.width, _group.height);
+		uint32_t layers = static_cast<uint32_t>(_group.layers.size());
+
+		VkImageCreateInfo imageInfo = {};
+		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+		imageInfo.imageType = VK_IMAGE_TYPE_2D;
+		imageInfo.format = format;
+		imageInfo.extent = { _group.width, _group.height, 1 };
+		imageInfo.mipLevels = mipLevels;
+		imageInfo.arrayLayers = layers;
+		imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+		imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+		imageInfo.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+		imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		if (vkCreateImage(device, &imageInfo, nullptr, &_outImage) != VK_SUCCESS)
+			return false;
+		VkMemoryRequirements requirements;
+		vkGetImageMemoryRequirements(device, _outImage, &requirements);
+		VkMemoryAllocateInfo allocateInfo = {};
+		allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		allocateInfo.allocationSize = requirements.size;
+		GvkHelper::find_memory_type(physicalDevice, requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &allocateInfo.memoryTypeIndex);
+		if (vkAllocateMemory(device, &allocateInfo, nullptr, &_outMemory) != VK_SUCCESS)
+			return false;
+		vkBindImageMemory(device, _outImage, _outMemory, 0);
+
+		// the descriptor covers every layer, so they are all in the layout it names from the start
+		VkImageMemoryBarrier barrier = {};
+		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.image = _outImage;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.srcAccessMask = 0;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, mipLevels, 0, layers };
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+			0, nullptr, 0, nullptr, 1, &barrier);
+
+		return CreateTextureView(device, _outImage, format, VK_IMAGE_VIEW_TYPE_2D_ARRAY, mipLevels, layers, _group.swizzle, _outImageView) == VK_SUCCESS;
+	}
+
+	// queues the upload of _image's mip chain into layer _layer of _array, no frame may be reading that layer
+	bool AddLayer(const ModelImage& _image, VkImage _array, unsigned int _layer)
+	{
+		return CopyLevels(_image.pixels, _image.width, _image.height, _image.compression, _image.channels, _array, _layer);
+	}
+};
+
+#endif // !TEXTUREPACKER_H
@@ -0,0 +1,131 @@
+#ifndef TEXTURESTREAMER_H
+#define TEXTURESTREAMER_H
+
+// Requires Gateware.h, MipGenerator.h, TextureCompressor.h and ModelCache.h
+
+// Background texture loading. A worker thread reads each image in, which for a memory mapped
+// cooked model is where the pages actually come off the disk, and the render thread uploads a few
+// loaded textures per frame through the staging ring. Until its turn comes a texture is drawn with
+// a 1x1 placeholder of its average colour, so the first frame doesn't wait on any of them.
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#define STREAM_TEXTURES_PER_FRAME 1 // loaded textures made resident each frame
+#define PLACEHOLDER_SAMPLES 16 // texels averaged along each axis for a placeholder
+#define STREAM_PAGE_SIZE 4096 // stride the worker touches pixels with
+
+// 1x1 stand in for _image in the same format, its pixels are written to _outTexel
+ModelImage GetPlaceholderImage(const ModelImage& _image, unsigned char _outTexel[16])
+{
+	unsigned int texelSize = _image.channels * (_image.bits / 8);
+	ModelImage placeholder = { 1, 1, _image.bits, _outTexel, texelSize, TEXTURE_COMPRESSION_NONE, _image.channels, _image.swizzle, 1, 0 };
+	memset(_outTexel, 0xFF, 16);
+	if (_image.pixels == nullptr || _image.width == 0 || _image.height == 0)
+	{
+		placeholder.hash = HashBytes(_outTexel, placeholder.size);
+		return placeholder;
+	}
+
+	// the last texel or block of a cooked mip chain is its 1x1 level, already the average colour
+	if (_image.levels > 1 || _image.compression != TEXTURE_COMPRESSION_NONE)
+	{
+		if (_image.compression != TEXTURE_COMPRESSION_NONE)
+			placeholder.size = GetCompressedBlockSize(_image.compression);
+		placeholder.compression = _image.compression;
+		memcpy(_outTexel, _image.pixels + _image.size - placeholder.size, placeholder.size);
+		placeholder.hash = HashBytes(_outTexel, placeholder.size);
+		return placeholder;
+	}
+
+	// 16 and 32 bit images hold floats, the centre texel is close enough for a few frames
+	if (_image.bits != 8)
+	{
+		size_t center = (static_cast<size_t>(_image.height / 2) * _image.width + _image.width / 2) * texelSize;
+		memcpy(_outTexel, _image.pixels + center, texelSize);
+		placeholder.hash = HashBytes(_outTexel, placeholder.size);
+		return placeholder;
+	}
+
+	unsigned int sum[4] = { 0, 0, 0, 0 };
+	unsigned int count = 0;
+	for (unsigned int y = 0; y < PLACEHOLDER_SAMPLES; y++)
+		for (unsigned int x = 0; x < PLACEHOLDER_SAMPLES; x++)
+		{
+			size_t row = static_cast<size_t>(y) * _image.height / PLACEHOLDER_SAMPLES;
+			size_t column = static_cast<size_t>(x) * _image.width / PLACEHOLDER_SAMPLES;
+			const unsigned char* texel = _image.pixels + (row * _image.width + column) * _image.channels;
+			for (unsigned int c = 0; c < _image.channels; c++)
+				sum[c] += texel[c];
+			count++;
+		}
+	for (unsigned int c = 0; c < _image.channels; c++)
+		_outTexel[c] = static_cast<unsigned char>(sum[c] / count);
+	placeholder.hash = HashBytes(_outTexel, placeholder.size);
+	return placeholder;
+}
+
+// Loads images on a worker thread and hands their indices to the render thread in order
+class TextureStreamer
+{
+	std::thread worker;
+	std::mutex lock;
+	std::vector<unsigned int> loaded; // guarded by lock
+	std::atomic<bool> stop{ false };
+	unsigned int remaining = 0; // textures Take has not handed out yet
+
+public:
+	~TextureStreamer()
+	{
+		Stop();
+	}
+
+	// starts loading _images, their pixels must stay valid until Stop
+	void Start(const std::vector<ModelImage>& _images)
+	{
+		remaining = static_cast<unsigned int>(_images.size());
+		stop = false;
+		worker = std::thread([this, _images]()
+			{
+				for (unsigned int i = 0; i < _images.size() && !stop; i++)
+				{
+					// touching every page is enough to have the OS read it in
+					const ModelImage& image = _images[i];
+					volatile unsigned char sink = 0;
+					for (size_t offset = 0; offset < image.size; offset += STREAM_PAGE_SIZE)
+						sink = sink + image.pixels[offset];
+
+					std::lock_guard<std::mutex> guard(lock);
+					loaded.push_back(i);
+				}
+			});
+	}
+
+	// moves the indices of up to _max loaded textures into _out
+	void Take(std::vector<unsigned int>& _out, unsigned int _max)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		unsigned int count = G_SMALLER(_max, static_cast<unsigned int>(loaded.size()));
+		_out.insert(_out.end(), loaded.begin(), loaded.begin() + count);
+		loaded.erase(loaded.begin(), loaded.begin() + count);
+		remaining -= count;
+	}
+
+	// every texture has been handed out
+	bool Done() const
+	{
+		return remaining == 0;
+	}
+
+	// waits for the worker, whatever was never taken is dropped
+	void Stop()
+	{
+		stop = true;
+		if (worker.joinable())
+			worker.join();
+		loaded.clear();
+		remaining = 0;
+	}
+};
+
+#endif // !TEXTURESTREAMER_H
@@ -0,0 +1,856 @@
+#ifndef VIRTUALTEXTURE_H
+#define VIRTUALTEXTURE_H
+
+// Requires Gateware.h, MipGenerator.h, TextureCompressor.h, ModelCache.h, StagingRing.h and TextureUtils.h
+
+// Software virtual texturing. Big images are cut into fixed size pages, written once to a page file
+// next to the model, and only the pages the camera actually sees are kept on the GPU, in one
+// physical cache image per format. The fragment shader looks every sample up in a page table,
+// falling back to the nearest coarser page that is resident, and writes the pages it wanted to a
+// small feedback buffer. The render thread reads that buffer back a few frames later, worker
+// threads read the missing pages off the disk and the least recently used pages make room for them.
+// The coarsest level of every texture is always resident so there is something to draw.
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <unordered_set>
+
+#define VT_PAGE_SIZE 128 // texels along each side of a page
+#define VT_PAGE_BORDER 4 // texels of the neighbouring pages around each page so filtering never leaves it, one BC block
+#define VT_PAGE_STRIDE (VT_PAGE_SIZE + 2 * VT_PAGE_BORDER) // texels a page takes in the cache
+#define VT_CACHE_PAGES 16 // the cache of each format holds VT_CACHE_PAGES x VT_CACHE_PAGES pages
+#define VT_FEEDBACK_SCALE 8 // one feedback cell per VT_FEEDBACK_SCALE x VT_FEEDBACK_SCALE pixels
+#define VT_LOADER_THREADS 2
+#define VT_PAGES_PER_FRAME 8 // loaded pages copied into the caches each frame
+#define VT_PAGE_LIFETIME (VT_FEEDBACK_SCALE * VT_FEEDBACK_SCALE) // frames a page is kept after the feedback last asked for it, every pixel of a cell reports once in that time
+#define VT_MAX_LOADED_PAGES 32 // loaded pages waiting for the render thread before the loaders pause
+#define VT_MAX_TEXTURES 255 // texture indices the feedback can hold, 255 marks an empty cell
+#define VT_PAGE_FILE_EXTENSION ".pages"
+#define VT_PAGE_FILE_VERSION 2
+
+// page table entries, the cache slot and the level of the page a sample really reads
+#define VT_ENTRY(_x, _y, _level) ((_x) | ((_y) << 8) | ((_level) << 16) | 0x80000000u)
+
+// feedback entries, the page a sample wanted
+#define VT_FEEDBACK_EMPTY 0xFFFFFFFFu
+#define VT_FEEDBACK_X(_entry) ((_entry) & 0x3FFu)
+#define VT_FEEDBACK_Y(_entry) (((_entry) >> 10) & 0x3FFu)
+#define VT_FEEDBACK_LEVEL(_entry) (((_entry) >> 20) & 0xFu)
+#define VT_FEEDBACK_TEXTURE(_entry) ((_entry) >> 24)
+
+struct PageFileHeader
+{
+	char magic[4]; // "VTPG"
+	unsigned int version; // VT_PAGE_FILE_VERSION
+	unsigned long long hash; // ModelImage::hash of the image the pages were cut from
+	unsigned int width, height, levels, compression, channels, swizzle;
+};
+
+// texels along each side of the smallest unit a page is cut in, a BC block or a texel
+unsigned int GetPageBlockDimension(unsigned int _compression)
+{
+	return (_compression != TEXTURE_COMPRESSION_NONE) ? 4 : 1;
+}
+
+unsigned int GetPageBlockBytes(unsigned int _compression, unsigned int _channels)
+{
+	return (_compression != TEXTURE_COMPRESSION_NONE) ? GetCompressedBlockSize(_compression) : _channels;
+}
+
+// bytes of one page with its border
+size_t GetPageBytes(unsigned int _compression, unsigned int _channels)
+{
+	size_t blocks = VT_PAGE_STRIDE / GetPageBlockDimension(_compression);
+	return blocks * blocks * GetPageBlockBytes(_compression, _channels);
+}
+
+// pages along an axis of _size texels at _level
+unsigned int GetPageCount(unsigned int _size, unsigned int _level)
+{
+	return (G_LARGER(_size >> _level, 1u) + VT_PAGE_SIZE - 1) / VT_PAGE_SIZE;
+}
+
+std::string GetPageFilePath(const std::string& _modelPath, unsigned int _image)
+{
+	return _modelPath + "." + std::to_string(_image) + VT_PAGE_FILE_EXTENSION;
+}
+
+// images worth paging, 8 bit ones with a cooked mip chain that are at least _minSize on a side
+bool IsVirtualTextureCandidate(const ModelImage& _image, unsigned int _index, unsigned int _minSize)
+{
+	unsigned int levels = GetMipLevelCount(_image.width, _image.height);
+	return _minSize > 0 && _index < VT_MAX_TEXTURES && _image.pixels != nullptr && _image.bits == 8 && _image.levels == levels
+		&& levels <= 16 && (_image.width >= _minSize || _image.height >= _minSize)
+		&& GetPageCount(_image.width, 0) <= 1024 && GetPageCount(_image.height, 0) <= 1024;
+}
+
+// copies page _x,_y of a level with _blocksWide x _blocksHigh blocks into _outPage, the border
+// comes from the neighbouring pages and repeats the edge of the level past it
+void CutPage(const unsigned char* _level, unsigned int _blocksWide, unsigned int _blocksHigh, unsigned int _x, unsigned int _y,
+			unsigned int _compression, unsigned int _channels, unsigned char* _outPage)
+{
+	unsigned int dimension = GetPageBlockDimension(_compression), bytes = GetPageBlockBytes(_compression, _channels);
+	int page = VT_PAGE_SIZE / dimension, border = VT_PAGE_BORDER / dimension, stride = VT_PAGE_STRIDE / dimension;
+	for (int y = 0; y < stride; y++)
+	{
+		int sourceY = G_SMALLER(G_LARGER(static_cast<int>(_y) * page - border + y, 0), static_cast<int>(_blocksHigh) - 1);
+		for (int x = 0; x < stride; x++)
+		{
+			int sourceX = G_SMALLER(G_LARGER(static_cast<int>(_x) * page - border + x, 0), static_cast<int>(_blocksWide) - 1);
+			memcpy(_outPage + (static_cast<size_t>(y) * stride + x) * bytes,
+				_level + (static_cast<size_t>(sourceY) * _blocksWide + sourceX) * bytes, bytes);
+		}
+	}
+}
+
+// opens _path if it holds the pages of _image, nullptr otherwise
+FILE* OpenPageFile(const std::string& _path, const ModelImage& _image)
+{
+	FILE* file = fopen(_path.c_str(), "rb");
+	if (file == nullptr)
+		return nullptr;
+	PageFileHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "VTPG", 4) != 0 || header.version != VT_PAGE_FILE_VERSION
+		|| header.hash != _image.hash || header.width != _image.width || header.height != _image.height
+		|| header.levels != _image.levels || header.compression != _image.compression || header.channels != _image.channels
+		|| header.swizzle != _image.swizzle)
+	{
+		fclose(file);
+		return nullptr;
+	}
+	return file;
+}
+
+// cuts every level of _image into pages, level by level and row by row, and writes them after a
+// header, through a temporary file like the cooked model
+bool WritePageFile(const std::string& _path, const ModelImage& _image)
+{
+	std::string temporary = _path + ".tmp";
+	FILE* file = fopen(temporary.c_str(), "wb");
+	if (file == nullptr)
+		return false;
+	PageFileHeader header = { { 'V', 'T', 'P', 'G' }, VT_PAGE_FILE_VERSION, _image.hash, _image.width, _image.height, _image.levels,
+		_image.compression, _image.channels, _image.swizzle };
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+
+	unsigned int dimension = GetPageBlockDimension(_image.compression);
+	std::vector<unsigned char> page(GetPageBytes(_image.compression, _image.channels));
+	const unsigned char* level = _image.pixels;
+	for (unsigned int i = 0; i < _image.levels && written; i++)
+	{
+		unsigned int blocksWide = (G_LARGER(_image.width >> i, 1u) + dimension - 1) / dimension;
+		unsigned int blocksHigh = (G_LARGER(_image.height >> i, 1u) + dimension - 1) / dimension;
+		for (unsigned int y = 0; y < GetPageCount(_image.height, i) && written; y++)
+			for (unsigned int x = 0; x < GetPageCount(_image.width, i) && written; x++)
+			{
+				CutPage(level, blocksWide, blocksHigh, x, y, _image.compression, _image.channels, page.data());
+				written = fwrite(page.data(), 1, page.size(), file) == page.size();
+			}
+		level += static_cast<size_t>(blocksWide) * blocksHigh * GetPageBlockBytes(_image.compression, _image.channels);
+	}
+	written = (fclose(file) == 0) && written;
+	remove(_path.c_str());
+	if (!written || rename(temporary.c_str(), _path.c_str()) != 0)
+	{
+		remove(temporary.c_str());
+		return false;
+	}
+	return true;
+}
+
+// reads page _page of a page file with _pageBytes pages
+bool ReadPage(FILE* _file, unsigned int _page, size_t _pageBytes, unsigned char* _outPage)
+{
+	long long offset = static_cast<long long>(sizeof(PageFileHeader)) + static_cast<long long>(_page) * _pageBytes;
+#ifdef _WIN32
+	bool found = _fseeki64(_file, offset, SEEK_SET) == 0;
+#else
+	bool found = fseeko(_file, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+	return found && fread(_outPage, 1, _pageBytes, _file) == _pageBytes;
+}
+
+struct VirtualPage
+{
+	unsigned int texture, page;
+	std::vector<unsigned char> data; // empty when the read failed
+};
+
+// Reads requested pages on worker threads, the newest request first since that is what the camera
+// looks at now. The workers pause while too many loaded pages wait for the render thread.
+class VirtualPageLoader
+{
+	struct Source
+	{
+		std::string path; // empty when the texture isn't virtual
+		size_t pageBytes = 0;
+	};
+	std::vector<Source> sources; // by texture
+	std::vector<std::thread> workers;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::vector<VirtualPage> requests; // guarded by lock, data is empty
+	std::vector<VirtualPage> loaded; // guarded by lock
+	bool stop = false; // guarded by lock
+
+	void Work()
+	{
+		std::vector<FILE*> files(sources.size(), nullptr);
+		std::unique_lock<std::mutex> guard(lock);
+		while (true)
+		{
+			wake.wait(guard, [this]() { return stop || (!requests.empty() && loaded.size() < VT_MAX_LOADED_PAGES); });
+			if (stop)
+				break;
+			VirtualPage page = std::move(requests.back());
+			requests.pop_back();
+			guard.unlock();
+
+			const Source& source = sources[page.texture];
+			if (files[page.texture] == nullptr)
+				files[page.texture] = fopen(source.path.c_str(), "rb");
+			page.data.resize(source.pageBytes);
+			if (files[page.texture] == nullptr || !ReadPage(files[page.texture], page.page, source.pageBytes, page.data.data()))
+				page.data.clear();
+
+			guard.lock();
+			loaded.push_back(std::move(page));
+		}
+		for (FILE* file : files)
+			if (file != nullptr)
+				fclose(file);
+	}
+
+public:
+	~VirtualPageLoader()
+	{
+		Stop();
+	}
+
+	// _paths and _pageBytes are by texture, an empty path for a texture that is never requested
+	void Start(const std::vector<std::string>& _paths, const std::vector<size_t>& _pageBytes)
+	{
+		sources.resize(_paths.size());
+		for (size_t i = 0; i < _paths.size(); i++)
+			sources[i] = { _paths[i], _pageBytes[i] };
+		stop = false;
+		for (unsigned int i = 0; i < VT_LOADER_THREADS; i++)
+			workers.emplace_back(&VirtualPageLoader::Work, this);
+	}
+
+	void Request(unsigned int _texture, unsigned int _page)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		requests.push_back({ _texture, _page });
+		wake.notify_one();
+	}
+
+	// moves up to _max loaded pages into _out
+	void Take(std::vector<VirtualPage>& _out, unsigned int _max)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		unsigned int count = G_SMALLER(_max, static_cast<unsigned int>(loaded.size()));
+		for (unsigned int i = 0; i < count; i++)
+			_out.push_back(std::move(loaded[i]));
+		loaded.erase(loaded.begin(), loaded.begin() + count);
+		if (count > 0)
+			wake.notify_all();
+	}
+
+	// waits for the workers, pending requests and loaded pages are dropped
+	void Stop()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stop = true;
+			wake.notify_all();
+		}
+		for (std::thread& worker : workers)
+			worker.join();
+		workers.clear();
+		requests.clear();
+		loaded.clear();
+	}
+};
+
+// Copies pages into the caches, which stay in VK_IMAGE_LAYOUT_GENERAL so a copy into one slot never
+// has to move the pages other frames are reading
+class VirtualPageBatch : public TransferBatch
+{
+public:
+	// queues the copy of a page into slot _x,_y of _cache, the page is copied right away
+	bool AddPage(VkImage _cache, unsigned int _x, unsigned int _y, const std::vector<unsigned char>& _page)
+	{
+		VkDeviceSize stagingOffset = 0;
+		unsigned char* destination = Stage(_page.size(), stagingOffset);
+		if (destination == nullptr)
+			return false;
+		memcpy(destination, _page.data(), _page.size());
+
+		VkBufferImageCopy copy = {};
+		copy.bufferOffset = stagingOffset;
+		copy.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+		copy.imageOffset = { static_cast<int32_t>(_x * VT_PAGE_STRIDE), static_cast<int32_t>(_y * VT_PAGE_STRIDE), 0 };
+		copy.imageExtent = { VT_PAGE_STRIDE, VT_PAGE_STRIDE, 1 };
+		vkCmdCopyBufferToImage(commandBuffer, staging->GetBuffer(), _cache, VK_IMAGE_LAYOUT_GENERAL, 1, &copy);
+		return true;
+	}
+
+	// moves a new cache to VK_IMAGE_LAYOUT_GENERAL, or makes the copies into it visible to fragment shaders
+	void CacheBarrier(VkImage _cache, bool _created)
+	{
+		VkImageMemoryBarrier barrier = {};
+		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.image = _cache;
+		barrier.oldLayout = (_created) ? VK_IMAGE_LAYOUT_UNDEFINED : VK_IMAGE_LAYOUT_GENERAL;
+		barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.srcAccessMask = (_created) ? 0 : VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = (_created) ? VK_ACCESS_TRANSFER_WRITE_BIT : VK_ACCESS_SHADER_READ_BIT;
+		barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+		vkCmdPipelineBarrier(commandBuffer, (_created) ? VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT : VK_PIPELINE_STAGE_TRANSFER_BIT,
+			(_created) ? VK_PIPELINE_STAGE_TRANSFER_BIT : VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+	}
+};
+
+// Every virtual texture of a model with its caches, page table, feedback and loaders. Descriptor set
+// 2 of the fragment shader holds the caches at binding 0, the page table at 1 and the feedback at 2.
+//
+// The page table is a storage buffer, a header with the record offset of every texture, 0 when it
+// isn't virtual, then per virtual texture { width, height, levels, cache, first entry of each level }
+// and one VT_ENTRY per page, level by level and row by row. Each frame in flight has its own copy.
+class VirtualTextures
+{
+	struct Texture
+	{
+		unsigned int width = 0, height = 0, levels = 0, compression = 0;
+		unsigned int cache = 0;
+		unsigned int record = 0; // offset in the page table, 0 when the texture isn't virtual
+		std::vector<unsigned int> levelStart; // first page of each level
+		std::vector<int> slots; // cache slot of every page, -1 when it isn't resident
+	};
+	struct Slot
+	{
+		unsigned int texture = ~0u, page = 0; // page it holds, texture is ~0u when it holds none
+		unsigned long long lastUsed = 0; // frame the feedback last asked for it
+		unsigned long long reusable = 0; // an empty slot waits for this frame so no frame in flight still reads it
+		bool pinned = false; // the coarsest level, never evicted
+		bool pending = false; // its copy is not done yet
+	};
+	struct Cache
+	{
+		unsigned int compression = 0, channels = 4, swizzle = TEXTURE_SWIZZLE_NONE; // pages of every format and swizzle have their own cache
+		VkDeviceMemory memory = nullptr;
+		VkImage image = nullptr;
+		VkImageView imageView = nullptr;
+		std::vector<Slot> slots; // row by row
+	};
+	struct Upload
+	{
+		unsigned int cache, slot;
+		unsigned long long value; // staging ring submission it completes with
+	};
+
+	GW::GRAPHICS::GVulkanSurface surface;
+	VkDevice device = nullptr;
+	VkPhysicalDevice physicalDevice = nullptr;
+	StagingRing* staging = nullptr;
+	unsigned int frames = 0;
+	VkSampler sampler = nullptr; // of every cache
+
+	std::vector<Texture> textures; // by model image
+	std::vector<Cache> caches;
+	VirtualPageLoader loader;
+	std::unordered_set<unsigned long long> requested; // texture << 32 | page of pages asked for but not resident yet
+	std::vector<Upload> uploads; // oldest first
+	std::vector<VirtualPage> arrived; // reused every frame
+	std::unordered_set<unsigned int> wanted; // reused every frame
+
+	std::vector<unsigned int> table;
+	unsigned int tableVersion = 0; // bumped whenever a page comes or goes
+	std::vector<unsigned int> tableVersions; // tableVersion each frame's copy was written at
+	std::vector<VkBuffer> tableHandles;
+	std::vector<VkDeviceMemory> tableData;
+
+	unsigned int feedbackWidth = 0, feedbackHeight = 0; // in cells
+	std::vector<VkBuffer> feedbackHandles;
+	std::vector<VkDeviceMemory> feedbackData;
+
+	VkDescriptorSetLayout descriptorSetLayout = nullptr;
+	VkDescriptorPool descriptorPool = nullptr;
+	std::vector<VkDescriptorSet> descriptorSets;
+
+	static unsigned long long GetPageKey(unsigned int _texture, unsigned int _page)
+	{
+		return (static_cast<unsigned long long>(_texture) << 32) | _page;
+	}
+
+	unsigned int GetPageIndex(const Texture& _texture, unsigned int _level, unsigned int _x, unsigned int _y) const
+	{
+		return _texture.levelStart[_level] + _y * GetPageCount(_texture.width, _level) + _x;
+	}
+
+	// a host visible buffer per frame in flight
+	void CreateFrameBuffers(VkDeviceSize _size, VkBufferUsageFlags _usage, std::vector<VkBuffer>& _outHandles, std::vector<VkDeviceMemory>& _outData)
+	{
+		_outHandles.resize(frames);
+		_outData.resize(frames);
+		for (unsigned int i = 0; i < frames; i++)
+			GvkHelper::create_buffer(physicalDevice, device, _size, _usage,
+				VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &_outHandles[i], &_outData[i]);
+	}
+
+	void Assign(Cache& _cache, unsigned int _slot, unsigned int _texture, unsigned int _page, unsigned long long _frame)
+	{
+		Slot& slot = _cache.slots[_slot];
+		slot.texture = _texture;
+		slot.page = _page;
+		slot.lastUsed = _frame;
+		slot.pending = true;
+	}
+
+	// empty slot of _cache no frame in flight can read, -1 when there is none
+	int FindFreeSlot(const Cache& _cache, unsigned long long _frame) const
+	{
+		for (size_t i = 0; i < _cache.slots.size(); i++)
+			if (_cache.slots[i].texture == ~0u && !_cache.slots[i].pending && _cache.slots[i].reusable <= _frame)
+				return static_cast<int>(i);
+		return -1;
+	}
+
+	// evicts least recently used pages until VT_PAGES_PER_FRAME slots are empty or waiting to be,
+	// pages the feedback asked for within VT_PAGE_LIFETIME frames stay
+	void Evict(Cache& _cache, unsigned long long _frame)
+	{
+		unsigned int empty = 0;
+		for (const Slot& slot : _cache.slots)
+			empty += (slot.texture == ~0u && !slot.pending) ? 1 : 0;
+		for (; empty < VT_PAGES_PER_FRAME; empty++)
+		{
+			Slot* oldest = nullptr;
+			for (Slot& slot : _cache.slots)
+				if (slot.texture != ~0u && !slot.pinned && !slot.pending && slot.lastUsed + VT_PAGE_LIFETIME < _frame
+					&& (oldest == nullptr || slot.lastUsed < oldest->lastUsed))
+					oldest = &slot;
+			if (oldest == nullptr)
+				return;
+			textures[oldest->texture].slots[oldest->page] = -1;
+			oldest->texture = ~0u;
+			oldest->reusable = _frame + frames;
+			tableVersion++;
+		}
+	}
+
+	// marks the pages of the feedback of _frameIndex as used and requests the missing ones, then clears it
+	void ReadFeedback(unsigned int _frameIndex, unsigned long long _frame)
+	{
+		size_t count = static_cast<size_t>(feedbackWidth) * feedbackHeight * 2;
+		unsigned int* feedback = nullptr;
+		if (vkMapMemory(device, feedbackData[_frameIndex], 0, VK_WHOLE_SIZE, 0, reinterpret_cast<void**>(&feedback)) != VK_SUCCESS)
+			return;
+		wanted.clear();
+		for (size_t i = 0; i < count; i++)
+			if (feedback[i] != VT_FEEDBACK_EMPTY)
+				wanted.insert(feedback[i]);
+		memset(feedback, 0xFF, count * sizeof(unsigned int));
+		vkUnmapMemory(device, feedbackData[_frameIndex]);
+
+		for (unsigned int entry : wanted)
+		{
+			unsigned int index = VT_FEEDBACK_TEXTURE(entry), level = VT_FEEDBACK_LEVEL(entry);
+			if (index >= textures.size() || textures[index].record == 0 || level >= textures[index].levels)
+				continue;
+			Texture& texture = textures[index];
+			unsigned int x = VT_FEEDBACK_X(entry), y = VT_FEEDBACK_Y(entry);
+			if (x >= GetPageCount(texture.width, level) || y >= GetPageCount(texture.height, level))
+				continue;
+
+			unsigned int page = GetPageIndex(texture, level, x, y);
+			if (texture.slots[page] < 0 && requested.insert(GetPageKey(index, page)).second)
+				loader.Request(index, page);
+
+			// the page and the coarser ones drawn until it arrives are all in use
+			for (; level < texture.levels; level++, x /= 2, y /= 2)
+			{
+				x = G_SMALLER(x, GetPageCount(texture.width, level) - 1);
+				y = G_SMALLER(y, GetPageCount(texture.height, level) - 1);
+				int slot = texture.slots[GetPageIndex(texture, level, x, y)];
+				if (slot >= 0)
+					caches[texture.cache].slots[slot].lastUsed = _frame;
+			}
+		}
+	}
+
+	// copies the pages the loaders finished into the caches without waiting for them
+	void UploadPages(unsigned long long _frame)
+	{
+		arrived.clear();
+		loader.Take(arrived, VT_PAGES_PER_FRAME);
+		if (arrived.empty())
+			return;
+
+		VirtualPageBatch batch;
+		batch.Begin(surface, *staging);
+		std::vector<Upload> added;
+		std::vector<bool> touched(caches.size(), false);
+		for (const VirtualPage& page : arrived)
+		{
+			Texture& texture = textures[page.texture];
+			Cache& cache = caches[texture.cache];
+			int slot = (page.data.empty()) ? -1 : FindFreeSlot(cache, _frame);
+			// without room the page is dropped, the feedback asks for it again if it is still wanted
+			if (slot < 0 || !batch.AddPage(cache.image, slot % VT_CACHE_PAGES, slot / VT_CACHE_PAGES, page.data))
+			{
+				requested.erase(GetPageKey(page.texture, page.page));
+				continue;
+			}
+			Assign(cache, slot, page.texture, page.page, _frame);
+			added.push_back({ texture.cache, static_cast<unsigned int>(slot), 0 });
+			touched[texture.cache] = true;
+		}
+		for (size_t i = 0; i < caches.size(); i++)
+			if (touched[i])
+				batch.CacheBarrier(caches[i].image, false);
+		unsigned long long value = 0;
+		batch.SubmitAsync(value);
+		for (Upload& upload : added)
+		{
+			upload.value = value;
+			uploads.push_back(upload);
+		}
+	}
+
+	// pages whose copies completed go into the page table
+	void CompleteUploads()
+	{
+		unsigned long long completed = staging->GetCompleted();
+		size_t done = 0;
+		for (; done < uploads.size() && uploads[done].value <= completed; done++)
+		{
+			Slot& slot = caches[uploads[done].cache].slots[uploads[done].slot];
+			slot.pending = false;
+			textures[slot.texture].slots[slot.page] = static_cast<int>(uploads[done].slot);
+			requested.erase(GetPageKey(slot.texture, slot.page));
+		}
+		if (done > 0)
+		{
+			uploads.erase(uploads.begin(), uploads.begin() + done);
+			tableVersion++;
+		}
+	}
+
+	// rewrites the page table, pages that aren't resident point at the same slot as their parent
+	void BuildTable()
+	{
+		for (size_t i = 0; i < textures.size(); i++)
+		{
+			const Texture& texture = textures[i];
+			table[i] = texture.record;
+			if (texture.record == 0)
+				continue;
+			unsigned int* record = &table[texture.record];
+			unsigned int* entries = record + 4 + texture.levels;
+			record[0] = texture.width;
+			record[1] = texture.height;
+			record[2] = texture.levels;
+			record[3] = texture.cache;
+			for (unsigned int level = 0; level < texture.levels; level++)
+				record[4 + level] = static_cast<unsigned int>(entries - table.data()) + texture.levelStart[level];
+
+			for (unsigned int level = texture.levels; level-- > 0;)
+			{
+				unsigned int pagesWide = GetPageCount(texture.width, level), pagesHigh = GetPageCount(texture.height, level);
+				for (unsigned int y = 0; y < pagesHigh; y++)
+					for (unsigned int x = 0; x < pagesWide; x++)
+					{
+						unsigned int page = GetPageIndex(texture, level, x, y);
+						int slot = texture.slots[page];
+						if (slot >= 0)
+							entries[page] = VT_ENTRY(slot % VT_CACHE_PAGES, slot / VT_CACHE_PAGES, level);
+						else if (level + 1 < texture.levels)
+							entries[page] = entries[GetPageIndex(texture, level + 1, G_SMALLER(x / 2, GetPageCount(texture.width, level + 1) - 1),
+								G_SMALLER(y / 2, GetPageCount(texture.height, level + 1) - 1))];
+						else
+							entries[page] = 0;
+					}
+			}
+		}
+	}
+
+	void CreateDescriptors()
+	{
+		VkDescriptorSetLayoutBinding bindings[3] = {};
+		bindings[0].binding = 0;
+		bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		bindings[0].descriptorCount = static_cast<uint32_t>(caches.size());
+		bindings[0].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+		for (uint32_t i = 1; i < 3; i++)
+		{
+			bindings[i].binding = i;
+			bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			bindings[i].descriptorCount = 1;
+			bindings[i].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+		}
+		VkDescriptorSetLayoutCreateInfo layoutCreateInfo = {};
+		layoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+		layoutCreateInfo.bindingCount = 3;
+		layoutCreateInfo.pBindings = bindings;
+		vkCreateDescriptorSetLayout(device, &layoutCreateInfo, nullptr, &descriptorSetLayout);
+
+		VkDescriptorPoolSize poolSizes[2] = {};
+		poolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		poolSizes[0].descriptorCount = static_cast<uint32_t>(caches.size() * frames);
+		poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		poolSizes[1].descriptorCount = 2 * frames;
+		VkDescriptorPoolCreateInfo poolCreateInfo = {};
+		poolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+		poolCreateInfo.poolSizeCount = 2;
+		poolCreateInfo.pPoolSizes = poolSizes;
+		poolCreateInfo.maxSets = frames;
+		vkCreateDescriptorPool(device, &poolCreateInfo, nullptr, &descriptorPool);
+
+		VkDescriptorSetAllocateInfo allocateInfo = {};
+		allocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+		allocateInfo.descriptorPool = descriptorPool;
+		allocateInfo.descriptorSetCount = 1;
+		allocateInfo.pSetLayouts = &descriptorSetLayout;
+		descriptorSets.resize(frames);
+		for (unsigned int i = 0; i < frames; i++)
+		{
+			vkAllocateDescriptorSets(device, &allocateInfo, &descriptorSets[i]);
+
+			std::vector<VkDescriptorImageInfo> images(caches.size());
+			for (size_t j = 0; j < caches.size(); j++)
+				images[j] = { sampler, caches[j].imageView, VK_IMAGE_LAYOUT_GENERAL };
+			VkDescriptorBufferInfo buffers[2] = { { tableHandles[i], 0, VK_WHOLE_SIZE }, { feedbackHandles[i], 0, VK_WHOLE_SIZE } };
+
+			VkWriteDescriptorSet writes[3] = {};
+			for (uint32_t j = 0; j < 3; j++)
+			{
+				writes[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+				writes[j].dstSet = descriptorSets[i];
+				writes[j].dstBinding = j;
+				writes[j].descriptorCount = (j == 0) ? static_cast<uint32_t>(images.size()) : 1;
+				writes[j].descriptorType = (j == 0) ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			}
+			writes[0].pImageInfo = images.data();
+			writes[1].pBufferInfo = &buffers[0];
+			writes[2].pBufferInfo = &buffers[1];
+			vkUpdateDescriptorSets(device, 3, writes, 0, nullptr);
+		}
+	}
+
+public:
+	~VirtualTextures()
+	{
+		loader.Stop();
+	}
+
+	// Pages the images at least _minSize on a side, writing their page files next to _modelPath
+	// when they are missing or stale, and loads the coarsest level of each. _frames is the number of
+	// frames in flight, _width and _height the size the feedback covers. Returns false when no image
+	// is virtual, nothing is created then.
+	bool Create(GW::GRAPHICS::GVulkanSurface _surface, StagingRing& _staging, const std::string& _modelPath, const std::vector<ModelImage>& _images,
+				unsigned int _minSize, unsigned int _frames, unsigned int _width, unsigned int _height, VkSampler _sampler)
+	{
+		surface = _surface;
+		staging = &_staging;
+		frames = _frames;
+		sampler = _sampler;
+		_surface.GetDevice(reinterpret_cast<void**>(&device));
+		_surface.GetPhysicalDevice(reinterpret_cast<void**>(&physicalDevice));
+
+		textures.assign(_images.size(), Texture());
+		std::vector<std::string> paths(_images.size());
+		std::vector<size_t> pageBytes(_images.size(), 0);
+		unsigned int tableSize = static_cast<unsigned int>(_images.size());
+		for (unsigned int i = 0; i < _images.size(); i++)
+		{
+			const ModelImage& image = _images[i];
+			if (!IsVirtualTextureCandidate(image, i, _minSize))
+				continue;
+			std::string path = GetPageFilePath(_modelPath, i);
+			FILE* file = OpenPageFile(path, image);
+			if (file == nullptr && WritePageFile(path, image))
+				file = OpenPageFile(path, image);
+			if (file == nullptr)
+				continue;
+			fclose(file);
+
+			Texture& texture = textures[i];
+			texture.width = image.width;
+			texture.height = image.height;
+			texture.levels = image.levels;
+			texture.compression = image.compression;
+			unsigned int pages = 0;
+			for (unsigned int level = 0; level < image.levels; level++)
+			{
+				texture.levelStart.push_back(pages);
+				pages += GetPageCount(image.width, level) * GetPageCount(image.height, level);
+			}
+			texture.slots.assign(pages, -1);
+			texture.record = tableSize;
+			tableSize += 4 + texture.levels + pages;
+
+			texture.cache = ~0u;
+			for (size_t j = 0; j < caches.size(); j++)
+				if (caches[j].compression == image.compression && caches[j].channels == image.channels && caches[j].swizzle == image.swizzle)
+					texture.cache = static_cast<unsigned int>(j);
+			if (texture.cache == ~0u)
+			{
+				texture.cache = static_cast<unsigned int>(caches.size());
+				caches.emplace_back();
+				caches.back().compression = image.compression;
+				caches.back().channels = image.channels;
+				caches.back().swizzle = image.swizzle;
+			}
+			paths[i] = path;
+			pageBytes[i] = GetPageBytes(image.compression, image.channels);
+		}
+		if (caches.empty())
+			return false;
+
+		// the caches, with the coarsest page of every texture pinned in them
+		VirtualPageBatch batch;
+		batch.Begin(surface, *staging);
+		for (Cache& cache : caches)
+		{
+			VkFormat format = GetCookedFormat(cache.compression, cache.channels);
+			VkExtent3D extent = { VT_PAGE_STRIDE * VT_CACHE_PAGES, VT_PAGE_STRIDE * VT_CACHE_PAGES, 1 };
+			GvkHelper::create_image(physicalDevice, device, extent, 1, VK_SAMPLE_COUNT_1_BIT, format, VK_IMAGE_TILING_OPTIMAL,
+				VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, nullptr, &cache.image, &cache.memory);
+			CreateTextureView(device, cache.image, format, VK_IMAGE_VIEW_TYPE_2D, 1, 1, cache.swizzle, cache.imageView);
+			cache.slots.resize(VT_CACHE_PAGES * VT_CACHE_PAGES);
+			batch.CacheBarrier(cache.image, true);
+		}
+		std::vector<unsigned char> page;
+		for (unsigned int i = 0; i < textures.size(); i++)
+		{
+			Texture& texture = textures[i];
+			if (texture.record == 0)
+				continue;
+			Cache& cache = caches[texture.cache];
+			unsigned int coarsest = texture.levelStart[texture.levels - 1];
+			int slot = FindFreeSlot(cache, 0);
+			FILE* file = fopen(paths[i].c_str(), "rb");
+			page.resize(pageBytes[i]);
+			bool loaded = slot >= 0 && file != nullptr && ReadPage(file, coarsest, page.size(), page.data())
+				&& batch.AddPage(cache.image, slot % VT_CACHE_PAGES, slot / VT_CACHE_PAGES, page);
+			if (file != nullptr)
+				fclose(file);
+			if (!loaded)
+				continue;
+			Assign(cache, slot, i, coarsest, 0);
+			cache.slots[slot].pinned = true;
+			cache.slots[slot].pending = false;
+			texture.slots[coarsest] = slot;
+		}
+		for (Cache& cache : caches)
+			batch.CacheBarrier(cache.image, false);
+		batch.Submit();
+
+		table.assign(tableSize, 0);
+		BuildTable();
+		CreateFrameBuffers(table.size() * sizeof(unsigned int), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, tableHandles, tableData);
+		tableVersions.assign(frames, ~0u);
+
+		feedbackWidth = (_width + VT_FEEDBACK_SCALE - 1) / VT_FEEDBACK_SCALE;
+		feedbackHeight = (_height + VT_FEEDBACK_SCALE - 1) / VT_FEEDBACK_SCALE;
+		// a cell for the base colour and one for the metallic roughness sample
+		std::vector<unsigned int> empty(static_cast<size_t>(feedbackWidth) * feedbackHeight * 2, VT_FEEDBACK_EMPTY);
+		CreateFrameBuffers(empty.size() * sizeof(unsigned int), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, feedbackHandles, feedbackData);
+		for (unsigned int i = 0; i < frames; i++)
+			GvkHelper::write_to_buffer(device, feedbackData[i], empty.data(), static_cast<unsigned int>(empty.size() * sizeof(unsigned int)));
+
+		CreateDescriptors();
+		loader.Start(paths, pageBytes);
+		return true;
+	}
+
+	// some image is virtual, the fragment shader has to be compiled with VIRTUAL_TEXTURES
+	bool IsActive() const
+	{
+		return !caches.empty();
+	}
+
+	bool IsVirtual(unsigned int _texture) const
+	{
+		return _texture < textures.size() && textures[_texture].record != 0;
+	}
+
+	VkDescriptorSetLayout GetDescriptorSetLayout() const
+	{
+		return descriptorSetLayout;
+	}
+
+	VkDescriptorSet GetDescriptorSet(unsigned int _frameIndex) const
+	{
+		return descriptorSets[_frameIndex];
+	}
+
+	// Once a frame before recording it, _frameIndex is the frame in flight being recorded, whose
+	// previous use the GPU is done with, and _frame counts every frame. Reads that frame's feedback,
+	// retires finished copies, makes room, copies in what the loaders read and updates its page table.
+	void Update(unsigned int _frameIndex, unsigned long long _frame)
+	{
+		if (caches.empty())
+			return;
+		ReadFeedback(_frameIndex, _frame);
+		CompleteUploads();
+		for (Cache& cache : caches)
+			Evict(cache, _frame);
+		UploadPages(_frame);
+
+		if (tableVersions[_frameIndex] != tableVersion)
+		{
+			BuildTable();
+			GvkHelper::write_to_buffer(device, tableData[_frameIndex], table.data(), static_cast<unsigned int>(table.size() * sizeof(unsigned int)));
+			tableVersions[_frameIndex] = tableVersion;
+		}
+	}
+
+	// x,y is the pixel of each feedback cell that writes this frame, it walks every pixel of the cell
+	// over VT_FEEDBACK_SCALE squared frames, z,w is the size of the feedback in cells
+	GW::MATH::GVECTORF GetFeedbackParams(unsigned long long _frame) const
+	{
+		unsigned int pixel = static_cast<unsigned int>((_frame * 37) % (VT_FEEDBACK_SCALE * VT_FEEDBACK_SCALE));
+		return GW::MATH::GVECTORF{ static_cast<float>(pixel % VT_FEEDBACK_SCALE), static_cast<float>(pixel / VT_FEEDBACK_SCALE),
+			static_cast<float>(feedbackWidth), static_cast<float>(feedbackHeight) };
+	}
+
+	// the GPU must be done with every frame
+	void Destroy()
+	{
+		loader.Stop();
+		for (Cache& cache : caches)
+		{
+			vkDestroyImageView(device, cache.imageView, nullptr);
+			vkDestroyImage(device, cache.image, nullptr);
+			vkFreeMemory(device, cache.memory, nullptr);
+		}
+		caches.clear();
+		for (unsigned int i = 0; i < tableHandles.size(); i++)
+		{
+			vkDestroyBuffer(device, tableHandles[i], nullptr);
+			vkFreeMemory(device, tableData[i], nullptr);
+			vkDestroyBuffer(device, feedbackHandles[i], nullptr);
+			vkFreeMemory(device, feedbackData[i], nullptr);
+		}
+		tableHandles.clear();
+		tableData.clear();
+		feedbackHandles.clear();
+		feedbackData.clear();
+		if (descriptorPool != nullptr)
+			vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+		if (descriptorSetLayout != nullptr)
+			vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
+		descriptorPool = nullptr;
+		descriptorSetLayout = nullptr;
+	}
+};
+
+#endif // !VIRTUALTEXTURE_H
@@ -1,16 +1,63 @@
+#ifdef RUNTIME_SHADERS
 #include "shaderc/shaderc.h" // needed for compiling shaders at runtime
 #ifdef _WIN32 // must use MT platform DLL libraries on windows
 #pragma comment(lib, "shaderc_combined.lib") 
 #endif
+#endif
+#include "ShaderCache.h"
+#include "PipelineCache.h"
 
 // define the path to the model files
 #define MODEL_PATH "../../bindlesstexturearray/Models/"
 
+// memory map .glb/.bin files and stream their buffer views straight to the GPU
+// instead of letting TinyGLTF copy them to the heap first
+#define LOAD_MODEL_MAPPED true
+
+// keep a cooked copy of the model next to it and load that instead when it is up to date
+#define LOAD_MODEL_COOKED true
+
+// cook the vertices into 16 bit positions, octahedral normals/tangents and half uvs,
+// the vertex shader is compiled with QUANTIZED_VERTICES to decode them
+#define QUANTIZE_MODEL_VERTICES true
+
+// cook 8 bit images into BC1/BC4/BC5/BC7 mip chains by what the materials use them for,
+// ignored when the GPU can't sample them
+#define COMPRESS_MODEL_TEXTURES true
+
+// filter the cook builds the mips of 8 bit images with, MIP_FILTER_BOX or MIP_FILTER_KAISER
+#define MODEL_MIP_FILTER MIP_FILTER_KAISER
+
+// draw the first frame with 1x1 placeholders and load the textures on a background thread,
+// swapping each one in as it arrives
+#define STREAM_MODEL_TEXTURES true
+
+// page images at least this wide or high in through the virtual texture cache instead of uploading
+// them whole, only the pages the camera sees are loaded, 0 turns it off
+#define VIRTUAL_TEXTURE_MIN_SIZE 2048
+
+// pack textures of the same size and format into texture arrays, one image and descriptor per group
+// instead of per texture, groups too small to pay off stay standalone images
+#define PACK_MODEL_TEXTURES true
+
 #define TINYGLTF_IMPLEMENTATION
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "TinyGLTF/tiny_gltf.h"
+#include "MappedFile.h"
+#include "ModelUtils.h"
+#include "MeshOptimizer.h"
+#include "MeshSimplifier.h"
+#include "MeshletUtils.h"
+#include "MipGenerator.h"
+#include "TextureCompressor.h"
+#include "ModelCache.h"
+#include "StagingRing.h"
 #include "TextureUtils.h"
+#include "TextureCache.h"
+#include "TexturePacker.h"
+#include "TextureStreamer.h"
+#include "VirtualTexture.h"
 #include <chrono>
 
 void PrintLabeledDebugString(const char* label, const char* toPrint)
@@ -40,41 +87,73 @@ class Renderer
 	VkBuffer geometryHandle = nullptr;
 	VkDeviceMemory geometryData = nullptr;
 
-	// Texture Data
-	struct TextureData
+	// Texture Data, one view per descriptor, equal textures share one
+	TextureCache textureCache;
+	std::vector<VkImageView> textures;
+	std::vector<VkImageView> placeholders; // drawn in place of textures that are not resident yet
+	std::vector<bool> resident;
+	TextureStreamer textureStreamer;
+	bool streamingTextures = false;
+	unsigned int residentVersion = 0; // bumped whenever a texture becomes resident
+	struct StreamedUpload
 	{
-		VkBuffer buffer;
-		VkDeviceMemory memory;
-		VkImage image;
-		VkImageView imageView;
+		unsigned int texture;
+		unsigned long long value; // staging ring submission it completes with
 	};
-	std::vector<TextureData> textures;
-
-	// Texture Sampler
+	std::vector<StreamedUpload> streamedUploads; // submitted, oldest first, but not resident yet
+	VirtualTextures virtualTextures; // drawn from set 2, their placeholders stay in the texture array
+	VkSampler virtualSampler = nullptr;
+	unsigned long long frameCount = 0;
+	// texture arrays, a packed texture is drawn from its layer once resident and from its placeholder until then
+	TexturePacking packing;
+	std::vector<VkDeviceMemory> textureArrayData;
+	std::vector<VkImage> textureArrayImages;
+	std::vector<VkImageView> textureArrays;
+	std::vector<std::vector<bool>> queuedLayers; // by array and layer, its upload has been recorded
+	VkSampler textureArraySampler = nullptr;
+
+	// Texture Sampler, they all have the same state so they are all the same one
+	SamplerCache samplerCache;
 	std::vector<VkSampler> textureSamplers;
 
+	// shaders compile on worker threads while the textures upload, the pipeline waits for them
+	ShaderCompileService shaderCompiler;
+	std::future<CompiledShader> vertexShaderSpirv;
+	std::future<CompiledShader> fragmentShaderSpirv;
 	VkShaderModule vertexShader = nullptr;
 	VkShaderModule fragmentShader = nullptr;
-	// pipeline settings for drawing (also required)
-	VkPipeline pipeline = nullptr;
+	// pipeline settings for drawing (also required), one pipeline per vertex layout in the draw list
+	std::vector<VkPipeline> pipelines;
 	VkPipelineLayout pipelineLayout = nullptr;
+	PipelineCache pipelineCache; // every pipeline is created through it, kept on disk between launches
 
 	unsigned int windowWidth, windowHeight;
 
-	Model model;
 	TinyGLTF loader;
+	CookedModel scene; // draw list, geometry and images of the model
+	StagingRing staging; // every upload to device local memory goes through it
+	std::vector<MeshletRange> visibleRanges; // reused by DrawScene every frame
 	std::string err;
 	std::string warn;
 
 	struct SHADER_VARS
 	{
-		GW::MATH::GMATRIXF worldMatrix;
 		GW::MATH::GMATRIXF viewMatrix;
 		GW::MATH::GMATRIXF projectionMatrix;
 		GW::MATH::GVECTORF sunDir;
 		GW::MATH::GVECTORF camPos;
+		GW::MATH::GVECTORF feedbackParams; // virtual texture feedback pixel and size
 	} shaderVars;
 
+	// pushed per draw, -1 means the material has no such texture
+	struct DRAW_VARS
+	{
+		GW::MATH::GMATRIXF worldMatrix;
+		PositionDequantization dequantization;
+		int baseColorMap, metallicRoughnessMap;
+		int baseColorLayer, metallicRoughnessLayer; // -1 for a standalone texture, else the map is a texture array
+	};
+
 	// Declare Uniform Buffers
 	std::vector<VkBuffer> uniformHandle;
 	std::vector<VkDeviceMemory> uniformData;
@@ -85,7 +164,9 @@ class Renderer
 	VkDescriptorSetLayout pixel_descriptor_set_layout;
 	VkDescriptorPool _descriptorPool;
 	std::vector<VkDescriptorSet> descriptorSets;
-	VkDescriptorSet textureDescriptorSet;
+	// one texture set per frame so a set still in flight is never rewritten
+	std::vector<VkDescriptorSet> textureDescriptorSets;
+	std::vector<unsigned int> textureDescriptorVersions; // residentVersion each set was written at
 
 	// Camera Matrices
 	GW::MATH::GMATRIXF viewMatrix;
@@ -100,8 +181,11 @@ public:
 	{
 		win = _win;
 		vlk = _vlk;
+		staging.Create(vlk);
 
-		bool ret = loader.LoadASCIIFromFile(&model, &err, &warn, "../../bindlesstexturearray/Models/BarramundiFish2.gltf");
+		std::string modelFile = MODEL_PATH "BarramundiFish2.gltf";
+		bool ret = LoadCookedModel(loader, modelFile, LOAD_MODEL_MAPPED, LOAD_MODEL_COOKED, QUANTIZE_MODEL_VERTICES,
+			COMPRESS_MODEL_TEXTURES && IsTextureCompressionSupported(vlk), MODEL_MIP_FILTER, true, scene, err, warn);
 
 		if (!warn.empty())
 			printf("Warn %s\n", warn.c_str());
@@ -112,33 +196,59 @@ public:
 		if (!ret)
 			printf("Failed to parse glTF\n");
 
-		textures.resize(model.images.size());
-		textureSamplers.resize(model.images.size());
-		std::string baseTexturePath;
-		std::string ambientMetallicRoughnessTexturePath;
-		std::string normalTexturePath;
-		std::string fullTexturePath;
-		for (size_t i = 0; i < model.images.size(); i++)
+		// texture i is model.images[i], the material table points at them
+		// all of them are recorded into one batch so loading waits on the queue only once
+		textures.resize(scene.images.size());
+		placeholders.resize(scene.images.size());
+		resident.assign(scene.images.size(), !STREAM_MODEL_TEXTURES);
+		textureSamplers.resize(scene.images.size());
+		textureCache.Create(vlk);
+		samplerCache.Create(vlk);
+
+		// the biggest images are paged in as the camera needs them and never uploaded whole
+		unsigned int frames = 0;
+		vlk.GetSwapchainImageCount(frames);
+		UpdateWindowDimensions();
+		samplerCache.Acquire(virtualSampler);
+		virtualTextures.Create(vlk, staging, modelFile, scene.images, VIRTUAL_TEXTURE_MIN_SIZE, frames, windowWidth, windowHeight, virtualSampler);
+		CompileShaders(); // the shaders only depend on whether virtual textures are on, they compile while the textures upload
+
+		// images of the same size and format share texture arrays, virtual ones stay out of them
+		std::vector<bool> standalone(scene.images.size(), !PACK_MODEL_TEXTURES);
+		for (size_t i = 0; i < scene.images.size(); i++)
+			standalone[i] = standalone[i] || virtualTextures.IsVirtual(static_cast<unsigned int>(i));
+		PackTextureArrays(scene.images, standalone, packing);
+		if (PACK_MODEL_TEXTURES)
+			PrintTexturePacking(packing);
+		samplerCache.Acquire(textureArraySampler);
+
+		TextureArrayUploadBatch uploads;
+		uploads.Begin(vlk, staging);
+		textureArrayData.resize(packing.groups.size());
+		textureArrayImages.resize(packing.groups.size());
+		textureArrays.resize(packing.groups.size());
+		queuedLayers.resize(packing.groups.size());
+		for (size_t i = 0; i < packing.groups.size(); i++)
 		{
-			if (baseTexturePath.empty())
-			{
-				baseTexturePath = model.images[model.materials[model.meshes[0].primitives[0].material].pbrMetallicRoughness.baseColorTexture.index].uri;
-				fullTexturePath = MODEL_PATH + baseTexturePath;
-			}
-			else if (ambientMetallicRoughnessTexturePath.empty())
-			{
-				ambientMetallicRoughnessTexturePath = model.images[model.materials[model.meshes[0].primitives[0].material].pbrMetallicRoughness.metallicRoughnessTexture.index].uri;
-				fullTexturePath = MODEL_PATH + ambientMetallicRoughnessTexturePath;
-			}
-			else if (normalTexturePath.empty())
+			uploads.CreateArray(packing.groups[i], textureArrayData[i], textureArrayImages[i], textureArrays[i]);
+			queuedLayers[i].assign(packing.groups[i].layers.size(), false);
+		}
+		for (size_t i = 0; i < scene.images.size(); i++)
+		{
+			if (virtualTextures.IsVirtual(static_cast<unsigned int>(i)))
+				resident[i] = false;
+			if (STREAM_MODEL_TEXTURES || virtualTextures.IsVirtual(static_cast<unsigned int>(i)))
 			{
-				normalTexturePath = model.images[model.materials[model.meshes[0].primitives[0].material].normalTexture.index].uri;
-				fullTexturePath = MODEL_PATH + normalTexturePath;
+				unsigned char texel[16];
+				textureCache.Acquire(uploads, GetPlaceholderImage(scene.images[i], texel), placeholders[i]);
 			}
-
-			UploadTextureToGPU(vlk, fullTexturePath, textures[i].buffer, textures[i].memory, textures[i].image, textures[i].imageView);
-			CreateSampler(vlk, textureSamplers[i]);
+			else if (packing.arrays[i] >= 0)
+				QueueTextureLayer(uploads, static_cast<unsigned int>(i));
+			else
+				textureCache.Acquire(uploads, scene.images[i], textures[i]);
+			samplerCache.Acquire(textureSamplers[i]);
 		}
+		uploads.Submit();
 
 		// Set up the camera
 		CreateViewMatrix();
@@ -149,7 +259,6 @@ public:
 		// Initialize the shader variables
 		shaderVars.viewMatrix = viewMatrix;
 		shaderVars.projectionMatrix = projectionMatrix;
-		shaderVars.worldMatrix = GW::MATH::GIdentityMatrixF;
 		shaderVars.sunDir = GW::MATH::GVECTORF{ -1.5f, -1, -2 };
 
 		// Create Proxies for Keyboard and Controller
@@ -160,6 +269,17 @@ public:
 
 		InitializeGraphics();
 		BindShutdownCallback();
+
+		if (STREAM_MODEL_TEXTURES)
+		{
+			// virtual textures are left out, the worker has nothing of theirs to touch
+			std::vector<ModelImage> streamed = scene.images;
+			for (size_t i = 0; i < streamed.size(); i++)
+				if (virtualTextures.IsVirtual(static_cast<unsigned int>(i)))
+					streamed[i].size = 0;
+			textureStreamer.Start(streamed);
+			streamingTextures = true;
+		}
 	}
 
 	void CreateViewMatrix()
@@ -282,12 +402,12 @@ private:
 	void InitializeGraphics()
 	{
 		GetHandlesFromSurface();
+		pipelineCache.Create(vlk, "../../bindlesstexturearray/Pipelines.vkcache");
 		InitializeGeometry();
 
 		// Function to setup Descritor Sets
 		SetupDescriptorSets();
 
-		CompileShaders();
 		InitializeGraphicsPipeline();
 	}
 
@@ -314,14 +434,14 @@ private:
 		arrPoolSize[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
 		arrPoolSize[0].descriptorCount = static_cast<uint32_t>(maxFrames);
 		arrPoolSize[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-		arrPoolSize[1].descriptorCount = 1;
+		arrPoolSize[1].descriptorCount = static_cast<uint32_t>((textures.size() + G_LARGER(textureArrays.size(), size_t(1))) * maxFrames);
 
 		// setup descriptor pool create info
 		VkDescriptorPoolCreateInfo poolCreateInfo = {};
 		poolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
 		poolCreateInfo.poolSizeCount = 2;
 		poolCreateInfo.pPoolSizes = arrPoolSize;
-		poolCreateInfo.maxSets = static_cast<uint32_t>(maxFrames) + 1;
+		poolCreateInfo.maxSets = static_cast<uint32_t>(maxFrames) * 2;
 		poolCreateInfo.flags = 0;
 		poolCreateInfo.pNext = nullptr;
 
@@ -342,6 +462,7 @@ private:
 
 		std::vector<VkDescriptorBindingFlagsEXT> descriptorBindingflags =
 		{
+			VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT,
 			VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT
 		};
 		bindingFlags.pBindingFlags = descriptorBindingflags.data();
@@ -357,15 +478,20 @@ private:
 		// create descriptor set layout
 		vkCreateDescriptorSetLayout(device, &layoutCreateInfo, nullptr, &descriptor_set_layout);
 
-		// Create descriptor set layout for the pixel shader
-		VkDescriptorSetLayoutBinding pixelLayoutBinding = {};
-		pixelLayoutBinding.binding = 0;
-		pixelLayoutBinding.descriptorCount = textures.size();
-		pixelLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-		pixelLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
-		pixelLayoutBinding.pImmutableSamplers = nullptr;
-
-		layoutCreateInfo.pBindings = &pixelLayoutBinding;
+		// Create descriptor set layout for the pixel shader, the textures then the texture arrays
+		VkDescriptorSetLayoutBinding pixelLayoutBindings[2] = {};
+		pixelLayoutBindings[0].binding = 0;
+		pixelLayoutBindings[0].descriptorCount = textures.size();
+		pixelLayoutBindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		pixelLayoutBindings[0].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+		pixelLayoutBindings[0].pImmutableSamplers = nullptr;
+		pixelLayoutBindings[1] = pixelLayoutBindings[0];
+		pixelLayoutBindings[1].binding = 1;
+		pixelLayoutBindings[1].descriptorCount = static_cast<uint32_t>(G_LARGER(textureArrays.size(), size_t(1)));
+
+		bindingFlags.bindingCount = 2;
+		layoutCreateInfo.bindingCount = 2;
+		layoutCreateInfo.pBindings = pixelLayoutBindings;
 		vkCreateDescriptorSetLayout(device, &layoutCreateInfo, nullptr, &pixel_descriptor_set_layout);
 
 		// setup descriptor set allocate info
@@ -385,7 +511,10 @@ private:
 		allocateInfo.pSetLayouts = &pixel_descriptor_set_layout;
 		allocateInfo.descriptorPool = _descriptorPool;
 		allocateInfo.pNext = &pixelAllocateInfoExt;
-		vkAllocateDescriptorSets(device, &allocateInfo, &textureDescriptorSet);
+		textureDescriptorSets.resize(maxFrames);
+		textureDescriptorVersions.assign(maxFrames, ~0u);
+		for (unsigned int i = 0; i < maxFrames; i++)
+			vkAllocateDescriptorSets(device, &allocateInfo, &textureDescriptorSets[i]);
 
 		allocateInfo.pSetLayouts = &descriptor_set_layout;
 		allocateInfo.pNext = nullptr;
@@ -415,20 +544,104 @@ private:
 			vkUpdateDescriptorSets(device, 1, &writeDescriptorSet, 0, nullptr);
 		}
 
-		// update the texture descriptor set
+		// update the texture descriptor sets
+		for (unsigned int i = 0; i < maxFrames; i++)
+			UpdateTextureDescriptors(i);
+	}
+
+	// rewrites a frame's texture set if textures became resident since it was last written
+	void UpdateTextureDescriptors(unsigned int _frame)
+	{
+		if (textureDescriptorVersions[_frame] == residentVersion || textures.empty())
+			return;
+
 		std::vector<VkDescriptorImageInfo> textureDescriptors(textures.size());
 		for (size_t i = 0; i < textures.size(); i++)
 		{
 			textureDescriptors[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-			textureDescriptors[i].imageView = textures[i].imageView;
+			textureDescriptors[i].imageView = (resident[i]) ? textures[i] : placeholders[i];
 			textureDescriptors[i].sampler = textureSamplers[i];
 		}
 
+		VkWriteDescriptorSet writeDescriptorSet = {};
+		writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writeDescriptorSet.dstBinding = 0;
+		writeDescriptorSet.dstArrayElement = 0;
 		writeDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
 		writeDescriptorSet.descriptorCount = static_cast<uint32_t>(textures.size());
-		writeDescriptorSet.dstSet = textureDescriptorSet;
+		writeDescriptorSet.dstSet = textureDescriptorSets[_frame];
 		writeDescriptorSet.pImageInfo = textureDescriptors.data();
 		vkUpdateDescriptorSets(device, 1, &writeDescriptorSet, 0, nullptr);
+
+		if (!textureArrays.empty())
+		{
+			std::vector<VkDescriptorImageInfo> arrayDescriptors(textureArrays.size());
+			for (size_t i = 0; i < textureArrays.size(); i++)
+				arrayDescriptors[i] = { textureArraySampler, textureArrays[i], VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+			writeDescriptorSet.dstBinding = 1;
+			writeDescriptorSet.descriptorCount = static_cast<uint32_t>(arrayDescriptors.size());
+			writeDescriptorSet.pImageInfo = arrayDescriptors.data();
+			vkUpdateDescriptorSets(device, 1, &writeDescriptorSet, 0, nullptr);
+		}
+		textureDescriptorVersions[_frame] = residentVersion;
+	}
+
+	// records the upload of a packed texture's layer, unless an equal texture in the same layer already did
+	void QueueTextureLayer(TextureArrayUploadBatch& _uploads, unsigned int _image)
+	{
+		unsigned int array = packing.arrays[_image], layer = packing.layers[_image];
+		if (queuedLayers[array][layer])
+			return;
+		_uploads.AddLayer(scene.images[_image], textureArrayImages[array], layer);
+		queuedLayers[array][layer] = true;
+	}
+
+	// Uploads the next loaded textures without waiting for them and makes the ones whose uploads
+	// completed resident, the others keep drawing with their placeholders
+	void StreamTextures()
+	{
+		if (!streamingTextures)
+			return;
+
+		unsigned long long completed = staging.GetCompleted();
+		size_t done = 0;
+		while (done < streamedUploads.size() && streamedUploads[done].value <= completed)
+			resident[streamedUploads[done++].texture] = true;
+		if (done > 0)
+		{
+			streamedUploads.erase(streamedUploads.begin(), streamedUploads.begin() + done);
+			residentVersion++;
+		}
+
+		std::vector<unsigned int> arrived;
+		textureStreamer.Take(arrived, STREAM_TEXTURES_PER_FRAME);
+		arrived.erase(std::remove_if(arrived.begin(), arrived.end(), [this](unsigned int _index) { return virtualTextures.IsVirtual(_index); }),
+			arrived.end());
+		if (!arrived.empty())
+		{
+			TextureArrayUploadBatch uploads;
+			uploads.Begin(vlk, staging);
+			// a texture equal to one already uploaded just shares it, its value is no earlier than that upload's
+			for (unsigned int index : arrived)
+			{
+				if (packing.arrays[index] >= 0)
+					QueueTextureLayer(uploads, index);
+				else
+					textureCache.Acquire(uploads, scene.images[index], textures[index]);
+			}
+			unsigned long long value = 0;
+			uploads.SubmitAsync(value);
+			for (unsigned int index : arrived)
+				streamedUploads.push_back({ index, value });
+		}
+
+		// all of them are on the GPU now, let go of the cooked data
+		if (textureStreamer.Done() && streamedUploads.empty())
+		{
+			textureStreamer.Stop();
+			scene.ReleaseData();
+			streamingTextures = false;
+		}
 	}
 
 
@@ -441,90 +654,67 @@ private:
 
 	void InitializeGeometry()
 	{
+		CreateGeometryBuffer(scene.geometrySize);
 
-		CreateGeometryBuffer(model.buffers[0].data.data(), sizeof(unsigned char) * model.buffers[0].data.size());
+		// everything is on the GPU now, let go of the cooked data
+		// (streamed textures still read their pixels, StreamTextures lets go once they are resident)
+		if (!STREAM_MODEL_TEXTURES)
+			scene.ReleaseData();
 	}
 
-	void CreateGeometryBuffer(const void* data, unsigned int sizeInBytes)
+	void CreateGeometryBuffer(size_t sizeInBytes)
 	{
-		GvkHelper::create_buffer(physicalDevice, device, sizeInBytes,
-			VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &geometryHandle, &geometryData);
-		// Transfer triangle data to the vertex buffer. (staging would be prefered here)
-		GvkHelper::write_to_buffer(device, geometryData, data, sizeInBytes);
+		// The cooked geometry is already laid out the way the draw list expects it, it goes to device local memory through the staging ring
+		TransferBatch uploads;
+		uploads.Begin(vlk, staging);
+		CreateDeviceBuffer(uploads, physicalDevice, device, scene.geometry, sizeInBytes,
+			VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, geometryHandle, geometryData);
+		uploads.BufferBarrier(VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT);
+		uploads.Submit();
 	}
 
 	void CompileShaders()
 	{
-		// Intialize runtime shader compiler HLSL -> SPIRV
-		shaderc_compiler_t compiler = shaderc_compiler_initialize();
-		shaderc_compile_options_t options = CreateCompileOptions();
-
-		CompileVertexShader(compiler, options);
-		CompilePixelShader(compiler, options);
-
-		// Free runtime shader compiler resources
-		shaderc_compile_options_release(options);
-		shaderc_compiler_release(compiler);
+		// Queue shader compiles HLSL -> SPIRV, at runtime shaderc only starts for shaders the cache doesn't have
+		ShaderOptions options = CreateCompileOptions();
+		vertexShaderSpirv = shaderCompiler.Compile("../../bindlesstexturearray/VertexShader.hlsl", SHADER_STAGE_VERTEX, options);
+		fragmentShaderSpirv = shaderCompiler.Compile("../../bindlesstexturearray/FragmentShader.hlsl", SHADER_STAGE_FRAGMENT, options);
 	}
 
-	shaderc_compile_options_t CreateCompileOptions()
+	ShaderOptions CreateCompileOptions()
 	{
-		shaderc_compile_options_t retval = shaderc_compile_options_initialize();
-		shaderc_compile_options_set_source_language(retval, shaderc_source_language_hlsl);
-		shaderc_compile_options_set_invert_y(retval, false);
+		ShaderOptions retval;
+		retval.invertY = false;
+		if (QUANTIZE_MODEL_VERTICES)
+			retval.Define("QUANTIZED_VERTICES");
+		if (virtualTextures.IsActive())
+			retval.Define("VIRTUAL_TEXTURES");
 #ifndef NDEBUG
-		shaderc_compile_options_set_generate_debug_info(retval);
+		retval.debugInfo = true;
 #endif
 		return retval;
 	}
 
-	void CompileVertexShader(const shaderc_compiler_t& compiler, const shaderc_compile_options_t& options)
-	{
-		std::string vertexShaderSource = ReadFileIntoString("../../bindlesstexturearray/VertexShader.hlsl");
-
-		shaderc_compilation_result_t result = shaderc_compile_into_spv( // compile
-			compiler, vertexShaderSource.c_str(), vertexShaderSource.length(),
-			shaderc_vertex_shader, "main.vert", "main", options);
-
-		if (shaderc_result_get_compilation_status(result) != shaderc_compilation_status_success) // errors?
-		{
-			PrintLabeledDebugString("Vertex Shader Errors:\n", shaderc_result_get_error_message(result));
-			abort();
-			return;
-		}
-
-		GvkHelper::create_shader_module(device, shaderc_result_get_length(result), // load into Vulkan
-			(char*)shaderc_result_get_bytes(result), &vertexShader);
-
-		shaderc_result_release(result); // done
-	}
-
-	void CompilePixelShader(const shaderc_compiler_t& compiler, const shaderc_compile_options_t& options)
+	// waits for a queued shader and loads it into Vulkan
+	void LoadShaderModule(std::future<CompiledShader>& compiling, const char* label, VkShaderModule& module)
 	{
-		std::string fragmentShaderSource = ReadFileIntoString("../../bindlesstexturearray/FragmentShader.hlsl");
-
-		shaderc_compilation_result_t result;
-
-		result = shaderc_compile_into_spv( // compile
-			compiler, fragmentShaderSource.c_str(), fragmentShaderSource.length(),
-			shaderc_fragment_shader, "main.frag", "main", options);
-
-		if (shaderc_result_get_compilation_status(result) != shaderc_compilation_status_success) // errors?
+		CompiledShader shader = compiling.get();
+		if (!shader.compiled) // errors?
 		{
-			PrintLabeledDebugString("Fragment Shader Errors:\n", shaderc_result_get_error_message(result));
+			PrintLabeledDebugString(label, shader.errors.c_str());
 			abort();
 			return;
 		}
 
-		GvkHelper::create_shader_module(device, shaderc_result_get_length(result), // load into Vulkan
-			(char*)shaderc_result_get_bytes(result), &fragmentShader);
-
-		shaderc_result_release(result); // done
+		GvkHelper::create_shader_module(device, shader.spirv.size() * sizeof(uint32_t), // load into Vulkan
+			reinterpret_cast<char*>(shader.spirv.data()), &module);
 	}
 
 	void InitializeGraphicsPipeline()
 	{
+		LoadShaderModule(vertexShaderSpirv, "Vertex Shader Errors:\n", vertexShader);
+		LoadShaderModule(fragmentShaderSpirv, "Fragment Shader Errors:\n", fragmentShader);
+
 		// Create Pipeline & Layout (Thanks Tiny!)
 		VkPipelineShaderStageCreateInfo stage_create_info[2] = {};
 		// Create Stage Info for Vertex Shader
@@ -540,47 +730,6 @@ private:
 		stage_create_info[1].pName = "main";
 
 		VkPipelineInputAssemblyStateCreateInfo assembly_create_info = CreateVkPipelineInputAssemblyStateCreateInfo();
-		VkVertexInputBindingDescription vertex_binding_description[4] = {};
-
-		// create string for attributes
-		std::string attr[] =
-		{
-			"POSITION",
-			"NORMAL",
-			"TEXCOORD_0",
-			"TANGENT"
-		};
-
-		for (int i = 0; i < 4; i++)
-		{
-			Accessor& Accessor = model.accessors[model.meshes[0].primitives[0].attributes[attr[i]]];
-			BufferView& BufferView = model.bufferViews[Accessor.bufferView];
-
-			vertex_binding_description[i] = CreateVkVertexInputBindingDescription(i, Accessor.ByteStride(BufferView));
-		}
-
-		VkVertexInputAttributeDescription vertex_attribute_description[4];
-		vertex_attribute_description[0].binding = 0;
-		vertex_attribute_description[0].location = 0;
-		vertex_attribute_description[0].format = VK_FORMAT_R32G32B32_SFLOAT;
-		vertex_attribute_description[0].offset = 0;
-
-		vertex_attribute_description[1].binding = 1;
-		vertex_attribute_description[1].location = 1;
-		vertex_attribute_description[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-		vertex_attribute_description[1].offset = 0;
-
-		vertex_attribute_description[2].binding = 2;
-		vertex_attribute_description[2].location = 2;
-		vertex_attribute_description[2].format = VK_FORMAT_R32G32_SFLOAT;
-		vertex_attribute_description[2].offset = 0;
-
-		vertex_attribute_description[3].binding = 3;
-		vertex_attribute_description[3].location = 3;
-		vertex_attribute_description[3].format = VK_FORMAT_R32G32B32A32_SFLOAT;
-		vertex_attribute_description[3].offset = 0;
-
-		VkPipelineVertexInputStateCreateInfo input_vertex_info = CreateVkPipelineVertexInputStateCreateInfo(vertex_binding_description, 4, vertex_attribute_description, 4);
 		VkViewport viewport = CreateViewportFromWindowDimensions();
 		VkRect2D scissor = CreateScissorFromWindowDimensions();
 		VkPipelineViewportStateCreateInfo viewport_create_info = CreateVkPipelineViewportStateCreateInfo(&viewport, 1, &scissor, 1);
@@ -607,7 +756,6 @@ private:
 		pipeline_create_info.stageCount = 2;
 		pipeline_create_info.pStages = stage_create_info;
 		pipeline_create_info.pInputAssemblyState = &assembly_create_info;
-		pipeline_create_info.pVertexInputState = &input_vertex_info;
 		pipeline_create_info.pViewportState = &viewport_create_info;
 		pipeline_create_info.pRasterizationState = &rasterization_create_info;
 		pipeline_create_info.pMultisampleState = &multisample_create_info;
@@ -619,7 +767,78 @@ private:
 		pipeline_create_info.subpass = 0;
 		pipeline_create_info.basePipelineHandle = VK_NULL_HANDLE;
 
-		vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipeline_create_info, nullptr, &pipeline);
+		// every vertex layout used by the draw list gets its own pipeline
+		pipelines.resize(scene.drawList.layouts.size());
+		for (size_t i = 0; i < scene.drawList.layouts.size(); i++)
+		{
+			VkVertexInputBindingDescription vertex_binding_description[DRAW_ATTRIBUTE_COUNT] = {};
+			VkVertexInputAttributeDescription vertex_attribute_description[DRAW_ATTRIBUTE_COUNT] = {};
+			for (unsigned int j = 0; j < DRAW_ATTRIBUTE_COUNT; j++)
+			{
+				// one binding per attribute so glTF buffer views can be bound as they are
+				vertex_binding_description[j] = CreateVkVertexInputBindingDescription(j, scene.drawList.layouts[i].streams[j].stride);
+
+				vertex_attribute_description[j].binding = j;
+				vertex_attribute_description[j].location = j;
+				vertex_attribute_description[j].format = GetVertexFormat(scene.drawList.layouts[i].streams[j]);
+				vertex_attribute_description[j].offset = 0;
+			}
+
+			VkPipelineVertexInputStateCreateInfo input_vertex_info = CreateVkPipelineVertexInputStateCreateInfo(vertex_binding_description, DRAW_ATTRIBUTE_COUNT,
+				vertex_attribute_description, DRAW_ATTRIBUTE_COUNT);
+			pipeline_create_info.pVertexInputState = &input_vertex_info;
+
+			vkCreateGraphicsPipelines(device, pipelineCache.Get(), 1, &pipeline_create_info, nullptr, &pipelines[i]);
+		}
+	}
+
+	// Vulkan format matching a glTF accessor, integer data without normalization is converted to float as is
+	VkFormat GetVertexFormat(const VertexStream& _stream)
+	{
+		int components = GetNumComponentsInType(_stream.type);
+		if (components < 1 || components > 4)
+			return VK_FORMAT_UNDEFINED;
+
+		// glTF pads 3 component 8 and 16 bit attributes to 4 bytes, those are read as 4 components
+		switch (_stream.componentType)
+		{
+		case TINYGLTF_COMPONENT_TYPE_FLOAT:
+		{
+			const VkFormat formats[] = { VK_FORMAT_R32_SFLOAT, VK_FORMAT_R32G32_SFLOAT, VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32B32A32_SFLOAT };
+			return formats[components - 1];
+		}
+		case TINYGLTF_COMPONENT_TYPE_BYTE:
+		{
+			const VkFormat normalized[] = { VK_FORMAT_R8_SNORM, VK_FORMAT_R8G8_SNORM, VK_FORMAT_R8G8B8A8_SNORM, VK_FORMAT_R8G8B8A8_SNORM };
+			const VkFormat scaled[] = { VK_FORMAT_R8_SSCALED, VK_FORMAT_R8G8_SSCALED, VK_FORMAT_R8G8B8A8_SSCALED, VK_FORMAT_R8G8B8A8_SSCALED };
+			return (_stream.normalized) ? normalized[components - 1] : scaled[components - 1];
+		}
+		case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+		{
+			const VkFormat normalized[] = { VK_FORMAT_R8_UNORM, VK_FORMAT_R8G8_UNORM, VK_FORMAT_R8G8B8A8_UNORM, VK_FORMAT_R8G8B8A8_UNORM };
+			const VkFormat scaled[] = { VK_FORMAT_R8_USCALED, VK_FORMAT_R8G8_USCALED, VK_FORMAT_R8G8B8A8_USCALED, VK_FORMAT_R8G8B8A8_USCALED };
+			return (_stream.normalized) ? normalized[components - 1] : scaled[components - 1];
+		}
+		case TINYGLTF_COMPONENT_TYPE_SHORT:
+		{
+			const VkFormat normalized[] = { VK_FORMAT_R16_SNORM, VK_FORMAT_R16G16_SNORM, VK_FORMAT_R16G16B16A16_SNORM, VK_FORMAT_R16G16B16A16_SNORM };
+			const VkFormat scaled[] = { VK_FORMAT_R16_SSCALED, VK_FORMAT_R16G16_SSCALED, VK_FORMAT_R16G16B16A16_SSCALED, VK_FORMAT_R16G16B16A16_SSCALED };
+			return (_stream.normalized) ? normalized[components - 1] : scaled[components - 1];
+		}
+		case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+		{
+			const VkFormat normalized[] = { VK_FORMAT_R16_UNORM, VK_FORMAT_R16G16_UNORM, VK_FORMAT_R16G16B16A16_UNORM, VK_FORMAT_R16G16B16A16_UNORM };
+			const VkFormat scaled[] = { VK_FORMAT_R16_USCALED, VK_FORMAT_R16G16_USCALED, VK_FORMAT_R16G16B16A16_USCALED, VK_FORMAT_R16G16B16A16_USCALED };
+			return (_stream.normalized) ? normalized[components - 1] : scaled[components - 1];
+		}
+		case VERTEX_COMPONENT_TYPE_HALF_FLOAT:
+		{
+			const VkFormat formats[] = { VK_FORMAT_R16_SFLOAT, VK_FORMAT_R16G16_SFLOAT, VK_FORMAT_R16G16B16A16_SFLOAT, VK_FORMAT_R16G16B16A16_SFLOAT };
+			return formats[components - 1];
+		}
+		default:
+			return VK_FORMAT_UNDEFINED;
+		}
 	}
 
 	VkPipelineInputAssemblyStateCreateInfo CreateVkPipelineInputAssemblyStateCreateInfo()
@@ -770,14 +989,21 @@ private:
 
 	void CreatePipelineLayout()
 	{
+		// per draw world matrix and texture indices
+		VkPushConstantRange push_constants = {};
+		push_constants.offset = 0;
+		push_constants.size = sizeof(DRAW_VARS);
+		push_constants.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+
 		VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
 		pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-		pipeline_layout_create_info.setLayoutCount = 2;
+		// virtual textures add their own set
+		pipeline_layout_create_info.setLayoutCount = (virtualTextures.IsActive()) ? 3 : 2;
 
-		VkDescriptorSetLayout layouts[2] = { descriptor_set_layout, pixel_descriptor_set_layout };
+		VkDescriptorSetLayout layouts[3] = { descriptor_set_layout, pixel_descriptor_set_layout, virtualTextures.GetDescriptorSetLayout() };
 		pipeline_layout_create_info.pSetLayouts = layouts;
-		pipeline_layout_create_info.pushConstantRangeCount = 0;
-		pipeline_layout_create_info.pPushConstantRanges = nullptr;
+		pipeline_layout_create_info.pushConstantRangeCount = 1;
+		pipeline_layout_create_info.pPushConstantRanges = &push_constants;
 
 		vkCreatePipelineLayout(device, &pipeline_layout_create_info, nullptr, &pipelineLayout);
 	}
@@ -796,24 +1022,29 @@ private:
 public:
 	void Render()
 	{
+		StreamTextures();
+
 		VkCommandBuffer commandBuffer = GetCurrentCommandBuffer();
 		SetUpPipeline(commandBuffer);
 
-		// write to the uniform buffer
-		for (int i = 0; i < maxFrames; i++)
+		// only the buffers of the frame being recorded may be touched
+		unsigned int currentImage;
+		vlk.GetSwapchainCurrentImage(currentImage);
+		// this frame's feedback from its last use is complete, the pages it asked for start loading
+		virtualTextures.Update(currentImage, frameCount);
+		shaderVars.feedbackParams = virtualTextures.GetFeedbackParams(frameCount++);
+		GvkHelper::write_to_buffer(device, uniformData[currentImage], &shaderVars, sizeof(SHADER_VARS));
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[currentImage], 0, nullptr);
+
+		UpdateTextureDescriptors(currentImage);
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 1, 1, &textureDescriptorSets[currentImage], 0, nullptr);
+		if (virtualTextures.IsActive())
 		{
-			GvkHelper::write_to_buffer(device, uniformData[i], &shaderVars, sizeof(SHADER_VARS));
-			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[i], 0, nullptr);
+			VkDescriptorSet virtualSet = virtualTextures.GetDescriptorSet(currentImage);
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 2, 1, &virtualSet, 0, nullptr);
 		}
 
-		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 1, 1, &textureDescriptorSet, 0, nullptr);
-
-		Accessor& indexAccessor = model.accessors[model.meshes[0].primitives[0].indices];
-
-		Accessor& vertexAccessor = model.accessors[model.meshes[0].primitives[0].attributes["POSITION"]];
-		BufferView& vertexBufferView = model.bufferViews[vertexAccessor.bufferView];
-
-		vkCmdDrawIndexed(commandBuffer, indexAccessor.count, 1, 0, vertexBufferView.byteOffset + vertexAccessor.byteOffset, 1);
+		DrawScene(commandBuffer);
 	}
 
 private:
@@ -832,9 +1063,6 @@ private:
 		UpdateWindowDimensions(); // what is the current client area dimensions?
 		SetViewport(commandBuffer);
 		SetScissor(commandBuffer);
-
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
-		BindGeometryBuffers(commandBuffer);
 	}
 
 	void SetViewport(const VkCommandBuffer& commandBuffer)
@@ -849,37 +1077,93 @@ private:
 		vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
 	}
 
-	void BindGeometryBuffers(VkCommandBuffer& commandBuffer)
+	DRAW_VARS GetDrawVars(const DrawItem& _draw)
 	{
-		// bind the vertex buffer from the geometry
+		DRAW_VARS retval = { scene.drawList.worldMatrices[_draw.instance], GetDequantization(scene.drawList, _draw.mesh), -1, -1, -1, -1 };
+		if (_draw.material >= 0)
+		{
+			const MaterialTextures& material = scene.drawList.materials[_draw.material];
+			GetTextureSlot(material.baseColor, retval.baseColorMap, retval.baseColorLayer);
+			GetTextureSlot(material.metallicRoughness, retval.metallicRoughnessMap, retval.metallicRoughnessLayer);
+		}
+		return retval;
+	}
 
-		std::string attr[] =
+	// where the shader finds texture _image, the layer of its texture array once it is resident there
+	void GetTextureSlot(int _image, int& _outMap, int& _outLayer)
+	{
+		_outMap = _image;
+		_outLayer = -1;
+		if (_image >= 0 && packing.arrays[_image] >= 0 && resident[_image])
 		{
-			"POSITION",
-			"NORMAL",
-			"TEXCOORD_0",
-			"TANGENT"
-		};
+			_outMap = packing.arrays[_image];
+			_outLayer = static_cast<int>(packing.layers[_image]);
+		}
+	}
+
+	// walks the sorted draw list, only rebinding what changed since the previous draw
+	void DrawScene(VkCommandBuffer& commandBuffer)
+	{
+		const DrawItem* previous = nullptr;
+		unsigned int boundIndexSize = 0;
+		VkBuffer vertexBuffers[DRAW_ATTRIBUTE_COUNT] = { geometryHandle, geometryHandle, geometryHandle, geometryHandle };
 
-		for (size_t i = 0; i < 4; i++)
+		for (const DrawItem& draw : scene.drawList.draws)
 		{
-			Accessor& Accessor = model.accessors[model.meshes[0].primitives[0].attributes[attr[i]]];
-			BufferView& BufferView = model.bufferViews[Accessor.bufferView];
+			if (previous == nullptr || previous->layout != draw.layout)
+				vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines[draw.layout]);
 
-			VkDeviceSize offset[] = { BufferView.byteOffset + Accessor.byteOffset };
-			vkCmdBindVertexBuffers(commandBuffer, i, 1, &geometryHandle, offset);
-		}
+			if (previous == nullptr || memcmp(previous->vertexOffsets, draw.vertexOffsets, sizeof(draw.vertexOffsets)) != 0)
+			{
+				VkDeviceSize offsets[DRAW_ATTRIBUTE_COUNT];
+				for (int i = 0; i < DRAW_ATTRIBUTE_COUNT; i++)
+					offsets[i] = draw.vertexOffsets[i];
+				vkCmdBindVertexBuffers(commandBuffer, 0, DRAW_ATTRIBUTE_COUNT, vertexBuffers, offsets);
+			}
+
+			if (previous == nullptr || previous->instance != draw.instance || previous->material != draw.material
+				|| previous->mesh != draw.mesh)
+			{
+				DRAW_VARS drawVars = GetDrawVars(draw);
+				vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(DRAW_VARS), &drawVars);
+			}
+			previous = &draw;
 
-		// bind the index buffer from the geometry
-		Accessor& indexAccessor = model.accessors[model.meshes[0].primitives[0].indices];
-		BufferView& indexBufferView = model.bufferViews[indexAccessor.bufferView];
-		vkCmdBindIndexBuffer(commandBuffer, geometryHandle, indexBufferView.byteOffset + indexAccessor.byteOffset, VK_INDEX_TYPE_UINT16);
+			if (draw.indexSize == 0)
+			{
+				vkCmdDraw(commandBuffer, draw.count, 1, 0, 0);
+				continue;
+			}
+
+			// the index buffer stays bound to the start of the geometry, draws pick their range with firstIndex
+			if (boundIndexSize != draw.indexSize)
+			{
+				vkCmdBindIndexBuffer(commandBuffer, geometryHandle, 0, (draw.indexSize == 4) ? VK_INDEX_TYPE_UINT32 : VK_INDEX_TYPE_UINT16);
+				boundIndexSize = draw.indexSize;
+			}
+			// the coarsest LOD that still looks the same from where the camera is
+			const DrawLod* lod = SelectDrawLod(scene.drawList, draw, scene.drawList.worldMatrices[draw.instance], shaderVars.camPos,
+				fabsf(projectionMatrix.row2.y), static_cast<float>(windowHeight));
+			if (lod != nullptr && lod->indexOffset != draw.indexOffset)
+			{
+				vkCmdDrawIndexed(commandBuffer, lod->count, 1, static_cast<uint32_t>(lod->indexOffset / draw.indexSize), 0, 0);
+				continue;
+			}
+			// full detail, only the meshlets on screen and facing the camera are drawn
+			visibleRanges.clear();
+			CullDrawMeshlets(scene.drawList, draw, scene.drawList.worldMatrices[draw.instance], viewMatrix, projectionMatrix, visibleRanges);
+			for (const MeshletRange& range : visibleRanges)
+				vkCmdDrawIndexed(commandBuffer, range.count, 1, range.firstIndex, 0, 0);
+		}
 	}
 
 	void CleanUp()
 	{
 		// wait till everything has completed
 		vkDeviceWaitIdle(device);
+		textureStreamer.Stop();
+		virtualTextures.Destroy();
+		staging.Destroy();
 
 		// release allocated descriptor sets
 		for (unsigned int i = 0; i < maxFrames; i++)
@@ -897,17 +1181,20 @@ private:
 		vkFreeMemory(device, geometryData, nullptr);
 		vkDestroyShaderModule(device, vertexShader, nullptr);
 		vkDestroyShaderModule(device, fragmentShader, nullptr);
+		pipelineCache.Save(); // back to disk while the device is still alive
+		pipelineCache.Destroy();
 		vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
-		vkDestroyPipeline(device, pipeline, nullptr);
+		for (size_t i = 0; i < pipelines.size(); i++)
+			vkDestroyPipeline(device, pipelines[i], nullptr);
 
-		// clean up texture variables
-		for (size_t i = 0; i < textures.size(); i++)
+		// clean up texture variables, each shared one is destroyed once
+		textureCache.Destroy();
+		samplerCache.Destroy();
+		for (size_t i = 0; i < textureArrays.size(); i++)
 		{
-			vkDestroyImageView(device, textures[i].imageView, nullptr);
-			vkDestroyImage(device, textures[i].image, nullptr);
-			vkDestroySampler(device, textureSamplers[i], nullptr);
-			vkDestroyBuffer(device, textures[i].buffer, nullptr);
-			vkFreeMemory(device, textures[i].memory, nullptr);
+			vkDestroyImageView(device, textureArrays[i], nullptr);
+			vkDestroyImage(device, textureArrayImages[i], nullptr);
+			vkFreeMemory(device, textureArrayData[i], nullptr);
 		}
 	}
 };
@@ -19,18 +19,24 @@ struct OUT_V
 
 cbuffer SHADER_VARS : register(b0, space0)
 {
-    float4x4 world;
     float4x4 view;
     float4x4 projection;
     float4 sunDir;
     float4 camPos;
 };
 
+// world matrix of the current draw
+[[vk::push_constant]]
+cbuffer DRAW_VARS
+{
+    float4x4 world;
+};
+
 float4 main(OUT_V inputVert) : SV_TARGET
 {
     float3 lightDir = normalize(sunDir.xyz);
     
-    float3 normal = mul(normalize(float4(inputVert.nrm, 1)), world);
+    float3 normal = mul(float4(normalize(inputVert.nrm), 0), world).xyz;
     float lightRatio = dot(-lightDir, normal);
     
     float3 viewDir = normalize(camPos.xyz - inputVert.posW.xyz);
@@ -0,0 +1,431 @@
+#ifndef MESHSIMPLIFIER_H
+#define MESHSIMPLIFIER_H
+
+// Requires tinygltf.h, Gateware.h (MATH), ModelUtils.h and MeshOptimizer.h
+
+// Import time LOD chains. Every indexed primitive is simplified with quadric error metrics by
+// collapsing vertices onto their neighbours, so each LOD is just another index list over the same
+// vertices. Vertices on UV/normal seams and open borders are locked so the LODs never tear.
+// At draw time SelectDrawLod picks the coarsest LOD whose error stays under a pixel on screen.
+#include <cmath>
+#include <cfloat>
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <array>
+#include <algorithm>
+
+#define LOD_MAX_LEVELS 5 // including the full resolution one
+#define LOD_REDUCTION 0.5f // triangles each LOD keeps from the previous one
+#define LOD_MIN_TRIANGLES 64 // primitives smaller than this keep only their full resolution
+#define LOD_MAX_SCREEN_ERROR 1.0f // pixels
+
+// symmetric 4x4 matrix accumulating squared distances to planes
+struct Quadric
+{
+	float a00, a01, a02, a11, a12, a22; // plane normal outer products
+	float b0, b1, b2; // normal * distance
+	float c; // distance squared
+	float weight; // total area of the planes
+
+	void AddPlane(const float _normal[3], float _distance, float _weight)
+	{
+		a00 += _weight * _normal[0] * _normal[0];
+		a01 += _weight * _normal[0] * _normal[1];
+		a02 += _weight * _normal[0] * _normal[2];
+		a11 += _weight * _normal[1] * _normal[1];
+		a12 += _weight * _normal[1] * _normal[2];
+		a22 += _weight * _normal[2] * _normal[2];
+		b0 += _weight * _normal[0] * _distance;
+		b1 += _weight * _normal[1] * _distance;
+		b2 += _weight * _normal[2] * _distance;
+		c += _weight * _distance * _distance;
+		weight += _weight;
+	}
+
+	void Add(const Quadric& _other)
+	{
+		a00 += _other.a00; a01 += _other.a01; a02 += _other.a02;
+		a11 += _other.a11; a12 += _other.a12; a22 += _other.a22;
+		b0 += _other.b0; b1 += _other.b1; b2 += _other.b2;
+		c += _other.c;
+		weight += _other.weight;
+	}
+
+	// area weighted mean squared distance of _point to the accumulated planes
+	float Evaluate(const float _point[3]) const
+	{
+		if (weight <= 0)
+			return 0;
+		float x = _point[0], y = _point[1], z = _point[2];
+		float error = a00 * x * x + a11 * y * y + a22 * z * z + 2 * (a01 * x * y + a02 * x * z + a12 * y * z)
+			+ 2 * (b0 * x + b1 * y + b2 * z) + c;
+		return G_LARGER(error / weight, 0.0f);
+	}
+};
+
+// Vertex data the simplifier looks at, positions plus the attributes seams are found with
+struct SimplifyMesh
+{
+	std::vector<float> positions; // 3 per vertex
+	std::vector<float> attributes; // SIMPLIFY_ATTRIBUTES per vertex
+	size_t vertexCount;
+};
+#define SIMPLIFY_ATTRIBUTES 5 // normal and uv
+#define SIMPLIFY_ATTRIBUTE_WEIGHT 0.05f
+
+// Simplifies _indices step by step, writing a snapshot into _outLevels each time the triangle count
+// falls under the next of _targets (in triangles, descending). _outErrors gets each snapshot's error.
+void SimplifyLevels(const SimplifyMesh& _mesh, const std::vector<unsigned int>& _indices, const std::vector<size_t>& _targets,
+					std::vector<std::vector<unsigned int>>& _outLevels, std::vector<float>& _outErrors)
+{
+	size_t vertexCount = _mesh.vertexCount;
+	const float* positions = _mesh.positions.data();
+	const float* attributes = _mesh.attributes.data();
+
+	// vertices sharing a position with a different vertex sit on a seam, they can't move
+	std::vector<unsigned int> weld(vertexCount);
+	{
+		std::map<std::array<float, 3>, unsigned int> first;
+		for (size_t v = 0; v < vertexCount; v++)
+		{
+			std::array<float, 3> key = { positions[v * 3], positions[v * 3 + 1], positions[v * 3 + 2] };
+			weld[v] = first.insert({ key, static_cast<unsigned int>(v) }).first->second;
+		}
+	}
+	std::vector<bool> locked(vertexCount, false);
+	for (size_t v = 0; v < vertexCount; v++)
+		if (weld[v] != v)
+			locked[v] = locked[weld[v]] = true;
+
+	// an edge only one triangle uses is an open border, its vertices can't move either
+	{
+		std::unordered_map<unsigned long long, unsigned int> edges;
+		for (size_t i = 0; i + 2 < _indices.size(); i += 3)
+			for (int e = 0; e < 3; e++)
+			{
+				unsigned int a = weld[_indices[i + e]], b = weld[_indices[i + (e + 1) % 3]];
+				edges[(static_cast<unsigned long long>(G_SMALLER(a, b)) << 32) | G_LARGER(a, b)]++;
+			}
+		for (const std::pair<const unsigned long long, unsigned int>& edge : edges)
+			if (edge.second == 1)
+			{
+				unsigned int a = static_cast<unsigned int>(edge.first >> 32), b = static_cast<unsigned int>(edge.first);
+				locked[a] = locked[b] = true;
+			}
+		for (size_t v = 0; v < vertexCount; v++)
+			locked[v] = locked[v] || locked[weld[v]];
+	}
+
+	auto normalOf = [&](unsigned int _a, unsigned int _b, unsigned int _c, float _out[3])
+		{
+			const float* a = positions + _a * 3;
+			const float* b = positions + _b * 3;
+			const float* c = positions + _c * 3;
+			float ab[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+			float ac[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+			_out[0] = ab[1] * ac[2] - ab[2] * ac[1];
+			_out[1] = ab[2] * ac[0] - ab[0] * ac[2];
+			_out[2] = ab[0] * ac[1] - ab[1] * ac[0];
+		};
+
+	// area weighted planes of the surrounding triangles
+	std::vector<Quadric> quadrics(vertexCount, Quadric{});
+	for (size_t i = 0; i + 2 < _indices.size(); i += 3)
+	{
+		float normal[3];
+		normalOf(_indices[i], _indices[i + 1], _indices[i + 2], normal);
+		float length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+		if (length == 0)
+			continue;
+		for (int k = 0; k < 3; k++)
+			normal[k] /= length;
+		const float* a = positions + _indices[i] * 3;
+		float distance = -(normal[0] * a[0] + normal[1] * a[1] + normal[2] * a[2]);
+		for (int k = 0; k < 3; k++)
+			quadrics[_indices[i + k]].AddPlane(normal, distance, length * 0.5f);
+	}
+
+	std::vector<unsigned int> indices = _indices;
+	std::vector<unsigned int> firstTriangle, adjacency;
+	std::vector<bool> touched(vertexCount);
+	struct Collapse
+	{
+		unsigned int from, to;
+		float cost; // decides the order
+		float error; // squared distance the surface moves
+	};
+	std::vector<Collapse> collapses;
+	float error = 0;
+	size_t target = 0;
+
+	while (target < _targets.size())
+	{
+		size_t triangleCount = indices.size() / 3;
+		if (triangleCount <= _targets[target])
+		{
+			_outLevels.push_back(indices);
+			_outErrors.push_back(sqrtf(error));
+			target++;
+			continue;
+		}
+
+		// every edge in both directions, moving an unlocked vertex onto its neighbour
+		collapses.clear();
+		for (size_t i = 0; i < indices.size(); i += 3)
+			for (int e = 0; e < 3; e++)
+			{
+				unsigned int a = indices[i + e], b = indices[i + (e + 1) % 3];
+				for (int direction = 0; direction < 2; direction++)
+				{
+					unsigned int from = direction ? b : a, to = direction ? a : b;
+					if (locked[from])
+						continue;
+					const float* p = positions + to * 3;
+					const float* q = positions + from * 3;
+					float edge = (p[0] - q[0]) * (p[0] - q[0]) + (p[1] - q[1]) * (p[1] - q[1]) + (p[2] - q[2]) * (p[2] - q[2]);
+					// attribute changes cost a little as if the surface moved by them along the edge, that keeps
+					// collapses off creases and UV stretches but leaves the reported error purely geometric
+					float attribute = 0;
+					for (int k = 0; k < SIMPLIFY_ATTRIBUTES; k++)
+					{
+						float delta = attributes[from * SIMPLIFY_ATTRIBUTES + k] - attributes[to * SIMPLIFY_ATTRIBUTES + k];
+						attribute += delta * delta;
+					}
+					Quadric merged = quadrics[from];
+					merged.Add(quadrics[to]);
+					float distance = merged.Evaluate(p);
+					collapses.push_back({ from, to, distance + SIMPLIFY_ATTRIBUTE_WEIGHT * attribute * edge, distance });
+				}
+			}
+		if (collapses.empty())
+			break;
+		std::sort(collapses.begin(), collapses.end(), [](const Collapse& _a, const Collapse& _b) { return _a.cost < _b.cost; });
+
+		// triangles around each vertex
+		firstTriangle.assign(vertexCount + 1, 0);
+		for (unsigned int index : indices)
+			firstTriangle[index + 1]++;
+		for (size_t v = 0; v < vertexCount; v++)
+			firstTriangle[v + 1] += firstTriangle[v];
+		adjacency.resize(indices.size());
+		{
+			std::vector<unsigned int> filled(firstTriangle.begin(), firstTriangle.end() - 1);
+			for (size_t i = 0; i < indices.size(); i++)
+				adjacency[filled[indices[i]]++] = static_cast<unsigned int>(i / 3);
+		}
+
+		// collapse the cheapest edges whose neighbourhoods don't overlap, flipped triangles are refused
+		std::fill(touched.begin(), touched.end(), false);
+		std::vector<unsigned int> remap(vertexCount);
+		for (size_t v = 0; v < vertexCount; v++)
+			remap[v] = static_cast<unsigned int>(v);
+		size_t removed = 0;
+		size_t passLimit = G_LARGER(triangleCount / 4, size_t(1)); // keep passes short so the costs stay current
+		for (const Collapse& collapse : collapses)
+		{
+			if (triangleCount - removed <= _targets[target] || removed >= passLimit)
+				break;
+			if (touched[collapse.from] || touched[collapse.to])
+				continue;
+
+			bool flips = false;
+			size_t degenerate = 0;
+			for (unsigned int t = firstTriangle[collapse.from]; t < firstTriangle[collapse.from + 1] && !flips; t++)
+			{
+				const unsigned int* corners = indices.data() + adjacency[t] * 3;
+				if (corners[0] == collapse.to || corners[1] == collapse.to || corners[2] == collapse.to)
+				{
+					degenerate++;
+					continue;
+				}
+				float before[3], after[3];
+				normalOf(corners[0], corners[1], corners[2], before);
+				unsigned int moved[3];
+				for (int k = 0; k < 3; k++)
+					moved[k] = (corners[k] == collapse.from) ? collapse.to : corners[k];
+				normalOf(moved[0], moved[1], moved[2], after);
+				flips = before[0] * after[0] + before[1] * after[1] + before[2] * after[2] <= 0;
+			}
+			if (flips)
+				continue;
+
+			remap[collapse.from] = collapse.to;
+			quadrics[collapse.to].Add(quadrics[collapse.from]);
+			error = G_LARGER(error, collapse.error);
+			removed += degenerate;
+			for (unsigned int t = firstTriangle[collapse.from]; t < firstTriangle[collapse.from + 1]; t++)
+				for (int k = 0; k < 3; k++)
+					touched[indices[adjacency[t] * 3 + k]] = true;
+		}
+		if (removed == 0)
+			break; // everything left is locked or would flip
+
+		size_t written = 0;
+		for (size_t i = 0; i < indices.size(); i += 3)
+		{
+			unsigned int a = remap[indices[i]], b = remap[indices[i + 1]], c = remap[indices[i + 2]];
+			if (a == b || b == c || a == c)
+				continue;
+			indices[written++] = a;
+			indices[written++] = b;
+			indices[written++] = c;
+		}
+		indices.resize(written);
+	}
+}
+
+// Builds a LOD chain and bounds for every unique primitive of _list, appending the LOD indices to _geometry
+void BuildDrawLods(DrawList& _list, std::vector<unsigned char>& _geometry)
+{
+	auto append = [&](const void* _data, size_t _size)
+		{
+			size_t offset = (_geometry.size() + 15) & ~size_t(15);
+			_geometry.resize(offset + _size);
+			memcpy(_geometry.data() + offset, _data, _size);
+			return offset;
+		};
+
+	std::map<std::array<size_t, DRAW_ATTRIBUTE_COUNT + 1>, DrawItem> built; // instances share the chain
+	for (DrawItem& draw : _list.draws)
+	{
+		std::array<size_t, DRAW_ATTRIBUTE_COUNT + 1> key;
+		for (int i = 0; i < DRAW_ATTRIBUTE_COUNT; i++)
+			key[i] = draw.vertexOffsets[i];
+		key[DRAW_ATTRIBUTE_COUNT] = draw.indexOffset;
+		auto found = built.find(key);
+		if (found != built.end())
+		{
+			memcpy(draw.center, found->second.center, sizeof(draw.center));
+			draw.radius = found->second.radius;
+			draw.lodFirst = found->second.lodFirst;
+			draw.lodCount = found->second.lodCount;
+			continue;
+		}
+
+		const VertexLayout& layout = _list.layouts[draw.layout];
+		SimplifyMesh mesh;
+		mesh.vertexCount = draw.vertexCount;
+		mesh.positions.resize(draw.vertexCount * 3);
+		mesh.attributes.resize(draw.vertexCount * SIMPLIFY_ATTRIBUTES);
+		float minimum[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, maximum[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		for (unsigned int v = 0; v < draw.vertexCount; v++)
+		{
+			float value[4];
+			ReadStreamElement(layout.streams[0], _geometry.data() + draw.vertexOffsets[0] + static_cast<size_t>(v) * layout.streams[0].stride, value);
+			for (int k = 0; k < 3; k++)
+			{
+				mesh.positions[v * 3 + k] = value[k];
+				minimum[k] = G_SMALLER(minimum[k], value[k]);
+				maximum[k] = G_LARGER(maximum[k], value[k]);
+			}
+			ReadStreamElement(layout.streams[1], _geometry.data() + draw.vertexOffsets[1] + static_cast<size_t>(v) * layout.streams[1].stride, value);
+			memcpy(&mesh.attributes[v * SIMPLIFY_ATTRIBUTES], value, sizeof(float) * 3);
+			ReadStreamElement(layout.streams[2], _geometry.data() + draw.vertexOffsets[2] + static_cast<size_t>(v) * layout.streams[2].stride, value);
+			memcpy(&mesh.attributes[v * SIMPLIFY_ATTRIBUTES + 3], value, sizeof(float) * 2);
+		}
+
+		// a sphere around the bounding box is plenty for picking a LOD
+		float radius = 0;
+		for (int k = 0; k < 3; k++)
+		{
+			draw.center[k] = (draw.vertexCount > 0) ? (minimum[k] + maximum[k]) * 0.5f : 0.0f;
+			float extent = (draw.vertexCount > 0) ? (maximum[k] - minimum[k]) * 0.5f : 0.0f;
+			radius += extent * extent;
+		}
+		draw.radius = sqrtf(radius);
+
+		draw.lodFirst = static_cast<unsigned int>(_list.lods.size());
+		draw.lodCount = 0;
+		if (draw.indexSize != 0)
+		{
+			_list.lods.push_back({ draw.indexOffset, draw.count, 0.0f });
+			draw.lodCount = 1;
+
+			size_t triangles = draw.count / 3;
+			if (triangles >= LOD_MIN_TRIANGLES && draw.count % 3 == 0)
+			{
+				std::vector<unsigned int> indices(draw.count);
+				for (unsigned int i = 0; i < draw.count; i++)
+				{
+					if (draw.indexSize == 2)
+					{
+						unsigned short index;
+						memcpy(&index, _geometry.data() + draw.indexOffset + i * 2, 2);
+						indices[i] = index;
+					}
+					else
+						memcpy(&indices[i], _geometry.data() + draw.indexOffset + i * 4, 4);
+				}
+
+				std::vector<size_t> targets;
+				for (size_t level = 1, count = triangles; level < LOD_MAX_LEVELS; level++)
+				{
+					count = static_cast<size_t>(count * LOD_REDUCTION);
+					if (count < LOD_MIN_TRIANGLES / 2)
+						break;
+					targets.push_back(count);
+				}
+				std::vector<std::vector<unsigned int>> levels;
+				std::vector<float> errors;
+				SimplifyLevels(mesh, indices, targets, levels, errors);
+
+				size_t previous = draw.count;
+				for (size_t level = 0; level < levels.size(); level++)
+				{
+					// locked seams can stop the simplifier early, a LOD that barely shrank is not worth a switch
+					if (levels[level].size() > previous * 0.9f)
+						break;
+					previous = levels[level].size();
+					OptimizeVertexCache(levels[level].data(), levels[level].size(), draw.vertexCount);
+					DrawLod lod = { 0, static_cast<unsigned int>(levels[level].size()), errors[level] };
+					if (draw.indexSize == 2)
+					{
+						std::vector<unsigned short> narrow(levels[level].begin(), levels[level].end());
+						lod.indexOffset = append(narrow.data(), narrow.size() * sizeof(unsigned short));
+					}
+					else
+						lod.indexOffset = append(levels[level].data(), levels[level].size() * sizeof(unsigned int));
+					_list.lods.push_back(lod);
+					draw.lodCount++;
+				}
+			}
+		}
+		built.insert({ key, draw });
+	}
+}
+
+// Coarsest LOD of _draw whose error covers at most _maxPixels when placed with _world and seen from
+// _cameraPosition. _projectionScale is the projection matrix's y scale, _screenHeight in pixels.
+const DrawLod* SelectDrawLod(const DrawList& _list, const DrawItem& _draw, const GW::MATH::GMATRIXF& _world,
+							const GW::MATH::GVECTORF& _cameraPosition, float _projectionScale, float _screenHeight,
+							float _maxPixels = LOD_MAX_SCREEN_ERROR)
+{
+	if (_draw.lodCount == 0)
+		return nullptr;
+	const DrawLod* lods = _list.lods.data() + _draw.lodFirst;
+
+	GW::MATH::GVECTORF center = { _draw.center[0], _draw.center[1], _draw.center[2], 1 };
+	GW::MATH::GVector::VectorXMatrixF(center, _world, center);
+	float scale = 0;
+	for (int row = 0; row < 3; row++)
+	{
+		const float* axis = _world.data + row * 4;
+		scale = G_LARGER(scale, axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+	}
+	scale = sqrtf(scale);
+
+	float dx = center.x - _cameraPosition.x, dy = center.y - _cameraPosition.y, dz = center.z - _cameraPosition.z;
+	float distance = sqrtf(dx * dx + dy * dy + dz * dz) - _draw.radius * scale;
+	if (distance <= 0)
+		return lods; // inside the bounds, full detail
+
+	// world space error projected to pixels
+	float pixelsPerUnit = _projectionScale * _screenHeight * 0.5f / distance;
+	unsigned int level = 0;
+	while (level + 1 < _draw.lodCount && lods[level + 1].error * scale * pixelsPerUnit <= _maxPixels)
+		level++;
+	return lods + level;
+}
+
+#endif // !MESHSIMPLIFIER_H
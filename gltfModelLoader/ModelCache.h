@@ -0,0 +1,764 @@
+#ifndef MODELCACHE_H
+#define MODELCACHE_H
+
+// Requires tinygltf.h (with stb_image), Gateware.h (MATH), MappedFile.h, ModelUtils.h, MeshOptimizer.h, MeshSimplifier.h, MeshletUtils.h,
+// MipGenerator.h and TextureCompressor.h
+
+// A cooked model is everything the renderer needs from a glTF in one flat file: the final geometry
+// buffer, the draw list, the material table and the mip chains of the decoded or block compressed images. It is
+// written next to the asset on first load and memory mapped on the following ones, so no JSON is
+// parsed and no image decoded.
+#include <cstdio>
+#include <sys/stat.h>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+
+// bump whenever the file layout, DrawItem or the way geometry is built changes
+#define COOKED_MODEL_VERSION 10
+#define COOKED_MODEL_EXTENSION ".cooked"
+
+// CookedHeader::settings bits, a cache cooked with other settings is rebuilt
+#define COOKED_MODEL_QUANTIZED 1u
+#define COOKED_MODEL_COMPRESSED 2u
+#define COOKED_MODEL_KAISER_MIPS 4u
+#define COOKED_MODEL_NO_IMAGES 8u // cooked without its images, for samples that draw without textures
+
+// ModelImage::swizzle values, how the stored channels are read back as RGBA
+#define TEXTURE_SWIZZLE_NONE 0 // as stored, channels that aren't read as 0 and alpha as 1
+#define TEXTURE_SWIZZLE_GREY 1 // one grey channel read as rgb
+#define TEXTURE_SWIZZLE_GREY_ALPHA 2 // grey in red and alpha in green
+#define TEXTURE_SWIZZLE_GREEN_BLUE 3 // metallic roughness without occlusion, green and blue stored in red and green, red reads 1
+
+// channels of an RGBA image GetModelImageChannels finds read
+#define TEXTURE_CHANNEL_RED 1u
+#define TEXTURE_CHANNEL_GREEN 2u
+#define TEXTURE_CHANNEL_BLUE 4u
+#define TEXTURE_CHANNEL_ALPHA 8u
+#define TEXTURE_CHANNEL_RGB 7u
+#define TEXTURE_CHANNEL_ALL 15u
+
+// decoded pixels of one model image, RGBA with 8 or 16 bits per channel or as few 8 bit channels as the
+// materials read, or its block compressed mip chain
+struct ModelImage
+{
+	unsigned int width;
+	unsigned int height;
+	unsigned int bits;
+	const unsigned char* pixels;
+	size_t size;
+	unsigned int compression; // TEXTURE_COMPRESSION_*
+	unsigned int channels; // stored per texel, 1, 2 or 4, block compressed images hold as many as their format
+	unsigned int swizzle; // TEXTURE_SWIZZLE_*
+	unsigned int levels; // mip levels in pixels, largest first, with just the one the GPU builds the rest
+	unsigned long long hash; // of the cooked content, images with the same hash and format hold the same pixels
+};
+
+struct CookedModel
+{
+	DrawList drawList; // world matrices are relative to the model root
+	const unsigned char* geometry = nullptr; // upload as is, draw offsets point into it
+	size_t geometrySize = 0;
+	std::vector<ModelImage> images; // one entry per model.images
+
+	MappedFile file; // backs geometry and images when loaded from the cache
+	std::vector<unsigned char> memory; // backs them when the cache could not be written
+
+	// drop the geometry and pixels once they are on the GPU, the draw list stays
+	void ReleaseData()
+	{
+		geometry = nullptr;
+		geometrySize = 0;
+		images.clear();
+		file.Close();
+		memory = std::vector<unsigned char>();
+	}
+};
+
+struct CookedHeader
+{
+	char magic[4];
+	unsigned int version;
+	unsigned long long sourceHash; // hash of the glTF JSON
+	unsigned int drawItemSize; // guards against builds where DrawItem differs
+	unsigned int dependencyCount;
+	unsigned int drawCount;
+	unsigned int instanceCount;
+	unsigned int layoutCount;
+	unsigned int materialCount;
+	unsigned int imageCount;
+	unsigned int settings; // COOKED_MODEL_* bits
+	unsigned int dequantizationCount;
+	unsigned int lodCount;
+	unsigned int meshletCount;
+	unsigned long long dependencyOffset;
+	unsigned long long drawOffset;
+	unsigned long long instanceOffset;
+	unsigned long long layoutOffset;
+	unsigned long long materialOffset;
+	unsigned long long imageOffset;
+	unsigned long long dequantizationOffset;
+	unsigned long long lodOffset;
+	unsigned long long meshletOffset;
+	unsigned long long geometryOffset;
+	unsigned long long geometrySize;
+	unsigned long long extraOffset;
+};
+
+// a file the cooked data was built from, any change to it makes the cache stale
+struct CookedDependency
+{
+	unsigned long long size;
+	long long modified;
+	unsigned long long pathOffset; // path relative to the model directory
+	unsigned long long pathLength;
+};
+
+struct CookedImage
+{
+	unsigned int width;
+	unsigned int height;
+	unsigned int bits;
+	unsigned int compression;
+	unsigned int channels;
+	unsigned int swizzle;
+	unsigned int levels;
+	unsigned int padding;
+	unsigned long long offset;
+	unsigned long long size;
+	unsigned long long hash;
+};
+
+// 64 bit FNV-1a
+unsigned long long HashBytes(const void* _data, size_t _size, unsigned long long _hash = 14695981039346656037ull)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(_data);
+	for (size_t i = 0; i < _size; i++)
+	{
+		_hash ^= bytes[i];
+		_hash *= 1099511628211ull;
+	}
+	return _hash;
+}
+
+bool GetFileStamp(const std::string& _path, unsigned long long& _outSize, long long& _outModified)
+{
+	struct stat info = {};
+	if (stat(_path.c_str(), &info) != 0)
+		return false;
+	_outSize = static_cast<unsigned long long>(info.st_size);
+	_outModified = static_cast<long long>(info.st_mtime);
+	return true;
+}
+
+// hashes the JSON part of a .gltf/.glb, returns false if the file can't be read
+bool HashModelSource(const std::string& _path, unsigned long long& _outHash)
+{
+	MappedFile source;
+	if (!source.Open(_path))
+		return false;
+
+	const unsigned char* json = source.data;
+	size_t jsonSize = source.size;
+	if (source.size >= 20 && memcmp(source.data, "glTF", 4) == 0)
+	{
+		// the first chunk of a .glb is the JSON, its length follows the 12 byte header
+		unsigned int chunkLength = 0;
+		memcpy(&chunkLength, source.data + 12, sizeof(chunkLength));
+		json = source.data + 20;
+		jsonSize = G_SMALLER(static_cast<size_t>(chunkLength), source.size - 20);
+	}
+	_outHash = HashBytes(json, jsonSize, HashBytes("cooked", 6) ^ COOKED_MODEL_VERSION);
+	return true;
+}
+
+// TinyGLTF image loader that only keeps the encoded bytes, DecodeModelImages decodes them afterwards
+bool KeepEncodedImage(tinygltf::Image* _image, const int _index, std::string* _err, std::string* _warn,
+					int _requiredWidth, int _requiredHeight, const unsigned char* _bytes, int _size, void* _userData)
+{
+	_image->image.assign(_bytes, _bytes + _size);
+	_image->component = 0; // marks the bytes as still encoded
+	return true;
+}
+
+// TinyGLTF image loader for models drawn without textures, the images stay empty and are never decoded
+bool SkipModelImage(tinygltf::Image* _image, const int _index, std::string* _err, std::string* _warn,
+					int _requiredWidth, int _requiredHeight, const unsigned char* _bytes, int _size, void* _userData)
+{
+	return true;
+}
+
+// decodes one image to RGBA the same way TinyGLTF does, 16 bit sources stay 16 bit
+void DecodeModelImage(tinygltf::Image& _image)
+{
+	if (_image.component != 0 || _image.image.empty())
+		return;
+	const unsigned char* bytes = _image.image.data();
+	int size = static_cast<int>(_image.image.size());
+	int width = 0, height = 0, channels = 0, bits = 8;
+	unsigned char* pixels = nullptr;
+	if (stbi_is_16_bit_from_memory(bytes, size))
+	{
+		pixels = reinterpret_cast<unsigned char*>(stbi_load_16_from_memory(bytes, size, &width, &height, &channels, 4));
+		bits = 16;
+	}
+	if (pixels == nullptr)
+	{
+		pixels = stbi_load_from_memory(bytes, size, &width, &height, &channels, 4);
+		bits = 8;
+	}
+	if (pixels == nullptr)
+	{
+		_image.image.clear(); // GetModelImages substitutes a white pixel
+		return;
+	}
+	_image.width = width;
+	_image.height = height;
+	_image.component = 4;
+	_image.bits = bits;
+	_image.pixel_type = (bits == 16) ? TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT : TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE;
+	_image.image.assign(pixels, pixels + static_cast<size_t>(width) * height * 4 * (bits / 8));
+	stbi_image_free(pixels);
+}
+
+// decodes every image loaded with KeepEncodedImage across all cores, the calling thread decodes too.
+// GConcurrent::Converge busy waits, which would take a core away from the decoders, so this uses plain threads.
+void DecodeModelImages(tinygltf::Model& _model)
+{
+	std::atomic<size_t> next(0);
+	auto decode = [&]()
+		{
+			for (size_t i = next++; i < _model.images.size(); i = next++)
+				DecodeModelImage(_model.images[i]);
+		};
+	size_t threads = G_SMALLER(static_cast<size_t>(std::thread::hardware_concurrency()), _model.images.size());
+	std::vector<std::thread> workers;
+	for (size_t i = 1; i < threads; i++)
+		workers.emplace_back(decode);
+	decode();
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+// the images as decoded by TinyGLTF, images that failed to decode become a white pixel
+void GetModelImages(const tinygltf::Model& _model, std::vector<ModelImage>& _outImages)
+{
+	static const unsigned char white[4] = { 255, 255, 255, 255 };
+
+	_outImages.resize(_model.images.size());
+	for (size_t i = 0; i < _model.images.size(); i++)
+	{
+		const tinygltf::Image& image = _model.images[i];
+		if (image.image.empty() || image.width <= 0 || image.height <= 0 || image.component != 4)
+		{
+			_outImages[i] = { 1, 1, 8, white, sizeof(white), TEXTURE_COMPRESSION_NONE, 4, TEXTURE_SWIZZLE_NONE, 1, 0 };
+			continue;
+		}
+		_outImages[i] = { static_cast<unsigned int>(image.width), static_cast<unsigned int>(image.height),
+			static_cast<unsigned int>(image.bits), image.image.data(), image.image.size(), TEXTURE_COMPRESSION_NONE, 4, TEXTURE_SWIZZLE_NONE, 1, 0 };
+	}
+}
+
+// The image a texture samples, -1 if there is none
+int GetModelTextureImage(const tinygltf::Model& _model, int _texture)
+{
+	if (_texture < 0 || _texture >= static_cast<int>(_model.textures.size()))
+		return -1;
+	int image = _model.textures[_texture].source;
+	return (image >= 0 && image < static_cast<int>(_model.images.size())) ? image : -1;
+}
+
+// Moves separate occlusion images into the unused red channel of the metallic roughness image they are
+// paired with, the glTF ORM layout, so one texture holds both and the occlusion image is no longer cooked.
+// Only pairs of decoded 8 bit images of the same size that nothing else samples are packed.
+void PackModelOcclusion(tinygltf::Model& _model)
+{
+	// the one image each image is paired with, -2 when it is used any other way
+	std::vector<int> partner(_model.images.size(), -1);
+	auto pair = [&](int _image, int _other)
+		{
+			if (_image >= 0)
+				partner[_image] = (partner[_image] == -1 || partner[_image] == _other) ? _other : -2;
+		};
+	for (const tinygltf::Material& material : _model.materials)
+	{
+		const tinygltf::TextureInfo& metallicRoughness = material.pbrMetallicRoughness.metallicRoughnessTexture;
+		int surface = GetModelTextureImage(_model, metallicRoughness.index);
+		int occlusion = GetModelTextureImage(_model, material.occlusionTexture.index);
+		bool packable = surface >= 0 && occlusion >= 0 && surface != occlusion && metallicRoughness.texCoord == material.occlusionTexture.texCoord;
+		pair(surface, (packable) ? occlusion : -2);
+		pair(occlusion, (packable) ? surface : -2);
+		pair(GetModelTextureImage(_model, material.pbrMetallicRoughness.baseColorTexture.index), -2);
+		pair(GetModelTextureImage(_model, material.normalTexture.index), -2);
+		pair(GetModelTextureImage(_model, material.emissiveTexture.index), -2);
+	}
+
+	std::vector<bool> packed(_model.images.size(), false);
+	for (tinygltf::Material& material : _model.materials)
+	{
+		int surface = GetModelTextureImage(_model, material.pbrMetallicRoughness.metallicRoughnessTexture.index);
+		int occlusion = GetModelTextureImage(_model, material.occlusionTexture.index);
+		if (surface < 0 || occlusion < 0 || partner[surface] != occlusion || partner[occlusion] != surface)
+			continue;
+		tinygltf::Image& target = _model.images[surface];
+		tinygltf::Image& source = _model.images[occlusion];
+		if (!packed[surface])
+		{
+			if (target.image.empty() || source.image.empty() || target.component != 4 || source.component != 4 || target.bits != 8
+				|| source.bits != 8 || target.width != source.width || target.height != source.height)
+				continue;
+			for (size_t i = 0; i < target.image.size(); i += 4)
+				target.image[i] = source.image[i];
+			source.image = std::vector<unsigned char>(); // cooked as a white pixel, nothing samples it anymore
+			packed[surface] = true;
+		}
+		material.occlusionTexture.index = material.pbrMetallicRoughness.metallicRoughnessTexture.index;
+	}
+}
+
+// TEXTURE_CHANNEL_* bits of each model image the materials read. An image nothing samples keeps all four.
+void GetModelImageChannels(const tinygltf::Model& _model, std::vector<unsigned int>& _outChannels)
+{
+	std::vector<unsigned int> used(_model.images.size(), 0);
+	auto use = [&](int _texture, unsigned int _channels)
+		{
+			int image = GetModelTextureImage(_model, _texture);
+			if (image >= 0)
+				used[image] |= _channels;
+		};
+	for (const tinygltf::Material& material : _model.materials)
+	{
+		use(material.pbrMetallicRoughness.baseColorTexture.index,
+			(material.alphaMode == "OPAQUE") ? TEXTURE_CHANNEL_RGB : TEXTURE_CHANNEL_ALL);
+		use(material.pbrMetallicRoughness.metallicRoughnessTexture.index, TEXTURE_CHANNEL_GREEN | TEXTURE_CHANNEL_BLUE);
+		use(material.normalTexture.index, TEXTURE_CHANNEL_RED | TEXTURE_CHANNEL_GREEN); // the shader rebuilds z
+		use(material.occlusionTexture.index, TEXTURE_CHANNEL_RED);
+		use(material.emissiveTexture.index, TEXTURE_CHANNEL_RGB);
+	}
+	_outChannels.resize(used.size());
+	for (size_t i = 0; i < used.size(); i++)
+		_outChannels[i] = (used[i] != 0) ? used[i] : TEXTURE_CHANNEL_ALL;
+}
+
+// How few channels the _texels 8 bit RGBA pixels can be stored in when only the _used TEXTURE_CHANNEL_*
+// bits are read. Alpha that is opaque everywhere is dropped and colour with equal channels becomes grey.
+void GetImageChannelLayout(const unsigned char* _pixels, size_t _texels, unsigned int _used,
+						unsigned int& _outChannels, unsigned int& _outSwizzle)
+{
+	bool opaque = true, grey = true;
+	for (size_t i = 0; i < _texels && (opaque || grey); i++)
+	{
+		const unsigned char* texel = _pixels + i * 4;
+		opaque = opaque && texel[3] == 255;
+		grey = grey && texel[0] == texel[1] && texel[1] == texel[2];
+	}
+	if (opaque)
+		_used &= ~TEXTURE_CHANNEL_ALPHA; // reads 1 without being stored
+
+	_outSwizzle = TEXTURE_SWIZZLE_NONE;
+	if ((_used & TEXTURE_CHANNEL_RGB) == TEXTURE_CHANNEL_RGB && grey)
+	{
+		_outChannels = (_used & TEXTURE_CHANNEL_ALPHA) ? 2 : 1;
+		_outSwizzle = (_used & TEXTURE_CHANNEL_ALPHA) ? TEXTURE_SWIZZLE_GREY_ALPHA : TEXTURE_SWIZZLE_GREY;
+	}
+	else if ((_used & ~TEXTURE_CHANNEL_RED) == 0)
+		_outChannels = 1;
+	else if ((_used & ~(TEXTURE_CHANNEL_RED | TEXTURE_CHANNEL_GREEN)) == 0)
+		_outChannels = 2;
+	else if (_used == (TEXTURE_CHANNEL_GREEN | TEXTURE_CHANNEL_BLUE))
+	{
+		_outChannels = 2;
+		_outSwizzle = TEXTURE_SWIZZLE_GREEN_BLUE;
+	}
+	else
+		_outChannels = 4;
+}
+
+// Moves the channels _swizzle stores to the front of every 8 bit RGBA texel of _pixels, where the block
+// encoders read them. With _compact the texels are then cut down to _channels bytes.
+void PackImageChannels(std::vector<unsigned char>& _pixels, unsigned int _channels, unsigned int _swizzle, bool _compact)
+{
+	static const unsigned int sources[4][4] = { { 0, 1, 2, 3 }, { 0, 1, 2, 3 }, { 0, 3, 2, 1 }, { 1, 2, 0, 3 } };
+	if (_swizzle == TEXTURE_SWIZZLE_NONE && (!_compact || _channels == 4))
+		return;
+	const unsigned int* source = sources[_swizzle];
+	size_t texels = _pixels.size() / 4;
+	unsigned int stride = (_compact) ? _channels : 4;
+	for (size_t i = 0; i < texels; i++)
+	{
+		unsigned char texel[4];
+		memcpy(texel, &_pixels[i * 4], 4);
+		for (unsigned int c = 0; c < stride; c++)
+			_pixels[i * stride + c] = texel[source[c]];
+	}
+	_pixels.resize(texels * stride);
+}
+
+// Block compression for each model image by what the materials sample it for. An image used for
+// more than one thing, or for nothing, keeps all four channels in BC7. CookModel takes BC4 or BC5 instead
+// for an image whose channel layout is down to one or two channels.
+void GetModelImageCompression(const tinygltf::Model& _model, std::vector<unsigned int>& _outCompression)
+{
+	_outCompression.assign(_model.images.size(), TEXTURE_COMPRESSION_NONE);
+	auto use = [&](int _texture, unsigned int _compression)
+		{
+			if (_texture < 0 || _texture >= static_cast<int>(_model.textures.size()))
+				return;
+			int source = _model.textures[_texture].source;
+			if (source < 0 || source >= static_cast<int>(_model.images.size()))
+				return;
+			unsigned int& compression = _outCompression[source];
+			compression = (compression == TEXTURE_COMPRESSION_NONE || compression == _compression) ? _compression : TEXTURE_COMPRESSION_BC7;
+		};
+	for (const tinygltf::Material& material : _model.materials)
+	{
+		use(material.pbrMetallicRoughness.baseColorTexture.index, TEXTURE_COMPRESSION_BC7);
+		use(material.pbrMetallicRoughness.metallicRoughnessTexture.index, TEXTURE_COMPRESSION_BC7); // green and blue
+		use(material.normalTexture.index, TEXTURE_COMPRESSION_BC5); // the shader rebuilds z
+		use(material.occlusionTexture.index, TEXTURE_COMPRESSION_BC4);
+		use(material.emissiveTexture.index, TEXTURE_COMPRESSION_BC1);
+	}
+	for (unsigned int& compression : _outCompression)
+		if (compression == TEXTURE_COMPRESSION_NONE)
+			compression = TEXTURE_COMPRESSION_BC7;
+}
+
+// How the mips of each model image are built. Base colour and emissive images are sRGB, unless something
+// else reads them as data too, and the base colour of an alpha tested material keeps its coverage.
+void GetModelImageMipSettings(const tinygltf::Model& _model, unsigned int _filter, std::vector<MipSettings>& _outSettings)
+{
+	_outSettings.assign(_model.images.size(), MipSettings());
+	std::vector<int> colour(_model.images.size(), 0), data(_model.images.size(), 0);
+	auto source = [&](int _texture)
+		{
+			if (_texture < 0 || _texture >= static_cast<int>(_model.textures.size()))
+				return -1;
+			int image = _model.textures[_texture].source;
+			return (image >= 0 && image < static_cast<int>(_model.images.size())) ? image : -1;
+		};
+	for (const tinygltf::Material& material : _model.materials)
+	{
+		int baseColor = source(material.pbrMetallicRoughness.baseColorTexture.index);
+		int emissive = source(material.emissiveTexture.index);
+		for (int image : { baseColor, emissive })
+			if (image >= 0)
+				colour[image]++;
+		for (int image : { source(material.pbrMetallicRoughness.metallicRoughnessTexture.index), source(material.normalTexture.index),
+				source(material.occlusionTexture.index) })
+			if (image >= 0)
+				data[image]++;
+		if (baseColor >= 0 && material.alphaMode == "MASK" && _outSettings[baseColor].alphaCutoff < 0.0f)
+			_outSettings[baseColor].alphaCutoff = static_cast<float>(material.alphaCutoff);
+	}
+	for (size_t i = 0; i < _outSettings.size(); i++)
+	{
+		_outSettings[i].filter = _filter;
+		_outSettings[i].srgb = colour[i] > 0 && data[i] == 0;
+	}
+}
+
+// appends _size bytes 16 byte aligned, returns where they start
+size_t AppendCooked(std::vector<unsigned char>& _blob, const void* _data, size_t _size)
+{
+	size_t offset = (_blob.size() + 15) & ~size_t(15);
+	_blob.resize(offset + _size);
+	if (_size)
+		memcpy(_blob.data() + offset, _data, _size);
+	return offset;
+}
+
+template <typename T>
+const T* GetCookedArray(const unsigned char* _data, size_t _size, unsigned long long _offset, unsigned int _count)
+{
+	if (_offset > _size || (_size - _offset) / sizeof(T) < _count)
+		return nullptr;
+	return reinterpret_cast<const T*>(_data + _offset);
+}
+
+// Fills _out from a cooked blob, returns false if it is malformed or out of date with the source files
+bool ParseCookedModel(const unsigned char* _data, size_t _size, const std::string& _path, unsigned int _settings, CookedModel& _out)
+{
+	if (_size < sizeof(CookedHeader))
+		return false;
+	CookedHeader header;
+	memcpy(&header, _data, sizeof(header));
+	if (memcmp(header.magic, "CKMD", 4) != 0 || header.version != COOKED_MODEL_VERSION || header.drawItemSize != sizeof(DrawItem)
+		|| header.settings != _settings)
+		return false;
+
+	unsigned long long sourceHash = 0;
+	if (!HashModelSource(_path, sourceHash) || sourceHash != header.sourceHash)
+		return false;
+
+	// every buffer and image the model was cooked from must still be the same
+	const CookedDependency* dependencies = GetCookedArray<CookedDependency>(_data, _size, header.dependencyOffset, header.dependencyCount);
+	if (dependencies == nullptr)
+		return false;
+	std::string directory = GetModelDirectory(_path);
+	for (unsigned int i = 0; i < header.dependencyCount; i++)
+	{
+		const char* path = GetCookedArray<char>(_data, _size, dependencies[i].pathOffset, static_cast<unsigned int>(dependencies[i].pathLength));
+		unsigned long long size = 0;
+		long long modified = 0;
+		if (path == nullptr || !GetFileStamp(directory + std::string(path, dependencies[i].pathLength), size, modified)
+			|| size != dependencies[i].size || modified != dependencies[i].modified)
+			return false;
+	}
+
+	const DrawItem* draws = GetCookedArray<DrawItem>(_data, _size, header.drawOffset, header.drawCount);
+	const GW::MATH::GMATRIXF* instances = GetCookedArray<GW::MATH::GMATRIXF>(_data, _size, header.instanceOffset, header.instanceCount);
+	const VertexLayout* layouts = GetCookedArray<VertexLayout>(_data, _size, header.layoutOffset, header.layoutCount);
+	const MaterialTextures* materials = GetCookedArray<MaterialTextures>(_data, _size, header.materialOffset, header.materialCount);
+	const CookedImage* images = GetCookedArray<CookedImage>(_data, _size, header.imageOffset, header.imageCount);
+	const PositionDequantization* dequantization = GetCookedArray<PositionDequantization>(_data, _size,
+		header.dequantizationOffset, header.dequantizationCount);
+	const DrawLod* lods = GetCookedArray<DrawLod>(_data, _size, header.lodOffset, header.lodCount);
+	const Meshlet* meshlets = GetCookedArray<Meshlet>(_data, _size, header.meshletOffset, header.meshletCount);
+	if (draws == nullptr || instances == nullptr || layouts == nullptr || materials == nullptr || images == nullptr
+		|| dequantization == nullptr || lods == nullptr || meshlets == nullptr
+		|| header.geometryOffset > _size || header.geometrySize > _size - header.geometryOffset)
+		return false;
+
+	_out.drawList = DrawList();
+	_out.drawList.draws.assign(draws, draws + header.drawCount);
+	_out.drawList.worldMatrices.assign(instances, instances + header.instanceCount);
+	_out.drawList.layouts.assign(layouts, layouts + header.layoutCount);
+	_out.drawList.materials.assign(materials, materials + header.materialCount);
+	_out.drawList.dequantization.assign(dequantization, dequantization + header.dequantizationCount);
+	_out.drawList.lods.assign(lods, lods + header.lodCount);
+	_out.drawList.meshlets.assign(meshlets, meshlets + header.meshletCount);
+	BuildMeshletBounds(_out.drawList);
+	_out.drawList.extraOffset = static_cast<size_t>(header.extraOffset);
+	_out.geometry = _data + header.geometryOffset;
+	_out.geometrySize = static_cast<size_t>(header.geometrySize);
+
+	_out.images.resize(header.imageCount);
+	for (unsigned int i = 0; i < header.imageCount; i++)
+	{
+		if (images[i].offset > _size || images[i].size > _size - images[i].offset
+			|| images[i].levels == 0 || images[i].levels > GetMipLevelCount(images[i].width, images[i].height)
+			|| (images[i].channels != 1 && images[i].channels != 2 && images[i].channels != 4) || images[i].swizzle > TEXTURE_SWIZZLE_GREEN_BLUE)
+			return false;
+		_out.images[i] = { images[i].width, images[i].height, images[i].bits, _data + images[i].offset, static_cast<size_t>(images[i].size),
+			images[i].compression, images[i].channels, images[i].swizzle, images[i].levels, images[i].hash };
+	}
+	return true;
+}
+
+// Serializes a freshly loaded model, _geometry is the complete geometry buffer including the draw list's extra data.
+// 8 bit images get their whole mip chain built here, 16 bit ones are left to the GPU. Images with the same
+// pixels and settings are cooked once and share their bytes. 8 bit images keep only the channels the
+// materials read, as R8 or R8G8 pixels or BC4 or BC5 blocks when that is all they need.
+// With _cacheImages compressed images are kept in KTX2 files next to the model and reused from there.
+void CookModel(const std::string& _path, unsigned int _settings, const tinygltf::Model& _model, const DrawList& _drawList,
+			const std::vector<unsigned char>& _geometry, bool _cacheImages, std::vector<unsigned char>& _outBlob)
+{
+	CookedHeader header = {};
+	memcpy(header.magic, "CKMD", 4);
+	header.version = COOKED_MODEL_VERSION;
+	HashModelSource(_path, header.sourceHash);
+	header.drawItemSize = sizeof(DrawItem);
+	header.settings = _settings;
+
+	_outBlob.clear();
+	AppendCooked(_outBlob, &header, sizeof(header));
+
+	// the model file itself plus every external buffer and image, the images only when they are cooked
+	bool cookImages = (_settings & COOKED_MODEL_NO_IMAGES) == 0;
+	std::vector<std::string> files;
+	size_t slash = _path.find_last_of("/\\");
+	files.push_back((slash == std::string::npos) ? _path : _path.substr(slash + 1));
+	for (const tinygltf::Buffer& buffer : _model.buffers)
+		if (!buffer.uri.empty() && buffer.uri.compare(0, 5, "data:") != 0)
+			files.push_back(buffer.uri);
+	for (const tinygltf::Image& image : _model.images)
+		if (cookImages && !image.uri.empty() && image.uri.compare(0, 5, "data:") != 0)
+			files.push_back(image.uri);
+
+	std::string directory = GetModelDirectory(_path);
+	std::vector<CookedDependency> dependencies;
+	for (const std::string& file : files)
+	{
+		CookedDependency dependency = {};
+		if (!GetFileStamp(directory + file, dependency.size, dependency.modified))
+			continue;
+		dependency.pathOffset = AppendCooked(_outBlob, file.data(), file.size());
+		dependency.pathLength = file.size();
+		dependencies.push_back(dependency);
+	}
+	header.dependencyCount = static_cast<unsigned int>(dependencies.size());
+	header.dependencyOffset = AppendCooked(_outBlob, dependencies.data(), dependencies.size() * sizeof(CookedDependency));
+
+	header.drawCount = static_cast<unsigned int>(_drawList.draws.size());
+	header.drawOffset = AppendCooked(_outBlob, _drawList.draws.data(), _drawList.draws.size() * sizeof(DrawItem));
+	header.instanceCount = static_cast<unsigned int>(_drawList.worldMatrices.size());
+	header.instanceOffset = AppendCooked(_outBlob, _drawList.worldMatrices.data(), _drawList.worldMatrices.size() * sizeof(GW::MATH::GMATRIXF));
+	header.layoutCount = static_cast<unsigned int>(_drawList.layouts.size());
+	header.layoutOffset = AppendCooked(_outBlob, _drawList.layouts.data(), _drawList.layouts.size() * sizeof(VertexLayout));
+	header.materialCount = static_cast<unsigned int>(_drawList.materials.size());
+	header.materialOffset = AppendCooked(_outBlob, _drawList.materials.data(), _drawList.materials.size() * sizeof(MaterialTextures));
+	header.dequantizationCount = static_cast<unsigned int>(_drawList.dequantization.size());
+	header.dequantizationOffset = AppendCooked(_outBlob, _drawList.dequantization.data(),
+		_drawList.dequantization.size() * sizeof(PositionDequantization));
+	header.lodCount = static_cast<unsigned int>(_drawList.lods.size());
+	header.lodOffset = AppendCooked(_outBlob, _drawList.lods.data(), _drawList.lods.size() * sizeof(DrawLod));
+	header.meshletCount = static_cast<unsigned int>(_drawList.meshlets.size());
+	header.meshletOffset = AppendCooked(_outBlob, _drawList.meshlets.data(), _drawList.meshlets.size() * sizeof(Meshlet));
+
+	header.geometrySize = _geometry.size();
+	header.geometryOffset = AppendCooked(_outBlob, _geometry.data(), _geometry.size());
+	header.extraOffset = _drawList.extraOffset;
+
+	std::vector<ModelImage> images;
+	if (cookImages)
+		GetModelImages(_model, images);
+	std::vector<unsigned int> compression, channels;
+	GetModelImageCompression(_model, compression);
+	GetModelImageChannels(_model, channels);
+	std::vector<MipSettings> mipSettings;
+	GetModelImageMipSettings(_model, (_settings & COOKED_MODEL_KAISER_MIPS) ? MIP_FILTER_KAISER : MIP_FILTER_BOX, mipSettings);
+	std::vector<CookedImage> cookedImages(images.size());
+	std::unordered_map<unsigned long long, size_t> cookedHashes; // first image cooked with each hash
+	std::vector<unsigned char> levels, compressed;
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		// the hash covers everything the cooked bytes depend on, so it addresses their content
+		const ModelImage& image = images[i];
+		bool compress = (_settings & COOKED_MODEL_COMPRESSED) != 0 && image.bits == 8;
+		unsigned int stored = 4, swizzle = TEXTURE_SWIZZLE_NONE;
+		if (image.bits == 8)
+			GetImageChannelLayout(image.pixels, static_cast<size_t>(image.width) * image.height, channels[i], stored, swizzle);
+		unsigned int format = (!compress) ? TEXTURE_COMPRESSION_NONE
+			: (stored == 1) ? TEXTURE_COMPRESSION_BC4 : (stored == 2) ? TEXTURE_COMPRESSION_BC5 : compression[i];
+		unsigned int recipe[9] = { image.width, image.height, image.bits, format, stored, swizzle,
+			mipSettings[i].filter, (mipSettings[i].srgb) ? 1u : 0u, 0 };
+		memcpy(&recipe[8], &mipSettings[i].alphaCutoff, sizeof(float));
+		unsigned long long hash = HashBytes(recipe, sizeof(recipe), HashBytes(image.pixels, image.size));
+		auto cooked = cookedHashes.find(hash);
+		if (cooked != cookedHashes.end())
+		{
+			cookedImages[i] = cookedImages[cooked->second];
+			continue;
+		}
+		cookedHashes[hash] = i;
+
+		cookedImages[i] = { image.width, image.height, image.bits, TEXTURE_COMPRESSION_NONE, stored, swizzle, 1, 0, 0, image.size, hash };
+		if (image.bits != 8)
+		{
+			cookedImages[i].offset = AppendCooked(_outBlob, image.pixels, image.size);
+			continue;
+		}
+		BuildMipChain(image.pixels, image.width, image.height, mipSettings[i], levels);
+		PackImageChannels(levels, stored, swizzle, !compress);
+		cookedImages[i].levels = GetMipLevelCount(image.width, image.height);
+		if (!compress)
+		{
+			cookedImages[i].size = levels.size();
+			cookedImages[i].offset = AppendCooked(_outBlob, levels.data(), levels.size());
+			continue;
+		}
+
+		// encoding is slow, the last result is kept next to the model until its mips change
+		unsigned long long key = HashBytes(levels.data(), levels.size(), HashBytes("encoded", 7) ^ TEXTURE_ENCODER_VERSION);
+		std::string cachePath = _path + ".image" + std::to_string(i) + TEXTURE_CACHE_EXTENSION;
+		if (!_cacheImages || !ReadCompressedImage(cachePath, image.width, image.height, format, key, compressed))
+		{
+			CompressImage(levels.data(), image.width, image.height, format, compressed);
+			if (_cacheImages)
+				WriteCompressedImage(cachePath, image.width, image.height, format, compressed, key);
+		}
+		cookedImages[i].compression = format;
+		cookedImages[i].size = compressed.size();
+		cookedImages[i].offset = AppendCooked(_outBlob, compressed.data(), compressed.size());
+	}
+	header.imageCount = static_cast<unsigned int>(cookedImages.size());
+	header.imageOffset = AppendCooked(_outBlob, cookedImages.data(), cookedImages.size() * sizeof(CookedImage));
+
+	memcpy(_outBlob.data(), &header, sizeof(header));
+}
+
+// writes to a temporary file first so a crash never leaves a half written cache behind
+bool WriteCookedModel(const std::string& _cookedPath, const std::vector<unsigned char>& _blob)
+{
+	std::string temporary = _cookedPath + ".tmp";
+	FILE* file = fopen(temporary.c_str(), "wb");
+	if (file == nullptr)
+		return false;
+	bool written = fwrite(_blob.data(), 1, _blob.size(), file) == _blob.size();
+	written = (fclose(file) == 0) && written;
+	remove(_cookedPath.c_str());
+	if (!written || rename(temporary.c_str(), _cookedPath.c_str()) != 0)
+	{
+		remove(temporary.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Loads _path through its cooked cache, cooking it first when the cache is missing or stale.
+// With _useCache false the model is always loaded from the glTF and nothing is written.
+// With _quantize the vertices use QUANTIZED_VERTEX_LAYOUT, the vertex shader has to decode them.
+// With _compress 8 bit images are block compressed, the device needs textureCompressionBC.
+// _mipFilter is the MIP_FILTER_* the mips of 8 bit images are built with.
+// With _images false the images are neither decoded nor cooked and edits to them don't invalidate the cache.
+bool LoadCookedModel(tinygltf::TinyGLTF& _loader, const std::string& _path, bool _mapped, bool _useCache, bool _quantize, bool _compress,
+					unsigned int _mipFilter, bool _images, CookedModel& _out, std::string& _err, std::string& _warn)
+{
+	unsigned int settings = (_quantize) ? COOKED_MODEL_QUANTIZED : 0;
+	if (!_images)
+		settings |= COOKED_MODEL_NO_IMAGES; // how images would have been cooked doesn't matter then
+	else if (_compress)
+		settings |= COOKED_MODEL_COMPRESSED;
+	if (_images && _mipFilter == MIP_FILTER_KAISER)
+		settings |= COOKED_MODEL_KAISER_MIPS;
+	std::string cookedPath = _path + COOKED_MODEL_EXTENSION;
+	if (_useCache && _out.file.Open(cookedPath))
+	{
+		if (ParseCookedModel(_out.file.data, _out.file.size, _path, settings, _out))
+			return true;
+		_out.file.Close();
+	}
+
+	// PNG/JPEG decoding dominates a cold load, keep TinyGLTF from doing it one image at a time
+	tinygltf::Model model;
+	ModelBuffers buffers;
+	_loader.SetImageLoader((_images) ? &KeepEncodedImage : &SkipModelImage, nullptr);
+	bool loaded = LoadModel(_loader, model, buffers, _err, _warn, _path, _mapped);
+	_loader.SetImageLoader(&tinygltf::LoadImageData, nullptr);
+	if (!loaded)
+		return false;
+	if (_images)
+	{
+		DecodeModelImages(model);
+		PackModelOcclusion(model);
+	}
+
+	std::vector<size_t> bufferOffsets;
+	size_t geometrySize = LayoutModelBuffers(buffers, bufferOffsets);
+	DrawList drawList;
+	geometrySize = BuildDrawList(model, buffers, bufferOffsets, geometrySize, GW::MATH::GIdentityMatrixF, drawList);
+
+	std::vector<unsigned char> geometry(geometrySize);
+	CopyModelBufferViews(model, buffers, bufferOffsets, geometry.data());
+	memcpy(geometry.data() + drawList.extraOffset, drawList.extraGeometry.data(), drawList.extraGeometry.size());
+	drawList.extraGeometry = std::vector<unsigned char>();
+	buffers = ModelBuffers();
+	OptimizeDrawList(drawList, geometry);
+	BuildDrawLods(drawList, geometry);
+	BuildDrawMeshlets(drawList, geometry);
+	if (_quantize)
+		QuantizeDrawList(drawList, geometry);
+
+	// the blob is parsed the same way whether it came from disk or not
+	CookModel(_path, settings, model, drawList, geometry, _useCache, _out.memory);
+	if (_useCache && WriteCookedModel(cookedPath, _out.memory) && _out.file.Open(cookedPath)
+		&& ParseCookedModel(_out.file.data, _out.file.size, _path, settings, _out))
+	{
+		_out.memory = std::vector<unsigned char>();
+		return true;
+	}
+	_out.file.Close();
+	return ParseCookedModel(_out.memory.data(), _out.memory.size(), _path, settings, _out);
+}
+
+#endif // !MODELCACHE_H
@@ -0,0 +1,152 @@
+#ifndef PIPELINECACHE_H
+#define PIPELINECACHE_H
+
+// Requires Gateware.h and ShaderCache.h
+
+// A VkPipelineCache kept on disk between launches. Every pipeline is created through it, so on a
+// warm start the driver finds the pipelines it compiled last time instead of compiling them again.
+// The file is only used by the GPU and driver that wrote it, anything else starts an empty cache.
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// bump whenever the file layout changes
+#define PIPELINE_CACHE_VERSION 1
+#define PIPELINE_CACHE_MAX_SIZE (256u << 20) // bigger files are treated as broken
+
+struct PipelineCacheHeader
+{
+	char magic[4]; // "VKPC"
+	unsigned int version; // PIPELINE_CACHE_VERSION
+	uint32_t vendorID, deviceID, driverVersion;
+	uint8_t uuid[VK_UUID_SIZE]; // pipelineCacheUUID of the device
+	unsigned long long size; // bytes of cache data after the header
+	unsigned long long hash; // HashShaderBytes of that data
+};
+
+class PipelineCache
+{
+	VkDevice device = nullptr;
+	VkPipelineCache cache = VK_NULL_HANDLE;
+	std::string path;
+	PipelineCacheHeader header = {}; // of this device, size and hash are what is on disk
+
+	// the data on disk if it was written by this device and driver and is intact
+	bool Read(std::vector<char>& _outData)
+	{
+		FILE* file = fopen(path.c_str(), "rb");
+		if (file == nullptr)
+			return false;
+		PipelineCacheHeader read;
+		bool valid = fread(&read, sizeof(read), 1, file) == 1 && memcmp(read.magic, header.magic, 4) == 0
+			&& read.version == header.version && read.vendorID == header.vendorID && read.deviceID == header.deviceID
+			&& read.driverVersion == header.driverVersion && memcmp(read.uuid, header.uuid, VK_UUID_SIZE) == 0
+			&& read.size > 0 && read.size < PIPELINE_CACHE_MAX_SIZE;
+		if (valid)
+		{
+			_outData.resize(static_cast<size_t>(read.size));
+			valid = fread(_outData.data(), 1, _outData.size(), file) == _outData.size()
+				&& HashShaderBytes(_outData.data(), _outData.size()) == read.hash;
+		}
+		fclose(file);
+		if (!valid)
+			return false;
+		header.size = read.size;
+		header.hash = read.hash;
+		return true;
+	}
+
+public:
+	// creates the cache, filled from the file at _path when it can be used
+	bool Create(GW::GRAPHICS::GVulkanSurface _surface, const std::string& _path)
+	{
+		VkPhysicalDevice physicalDevice = nullptr;
+		_surface.GetDevice(reinterpret_cast<void**>(&device));
+		_surface.GetPhysicalDevice(reinterpret_cast<void**>(&physicalDevice));
+		path = _path;
+
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+		header = PipelineCacheHeader();
+		memcpy(header.magic, "VKPC", 4);
+		header.version = PIPELINE_CACHE_VERSION;
+		header.vendorID = properties.vendorID;
+		header.deviceID = properties.deviceID;
+		header.driverVersion = properties.driverVersion;
+		memcpy(header.uuid, properties.pipelineCacheUUID, VK_UUID_SIZE);
+
+		std::vector<char> data;
+		VkPipelineCacheCreateInfo createInfo = {};
+		createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+		if (Read(data))
+		{
+			createInfo.initialDataSize = data.size();
+			createInfo.pInitialData = data.data();
+		}
+		if (vkCreatePipelineCache(device, &createInfo, nullptr, &cache) == VK_SUCCESS)
+			return true;
+
+		// the driver may still refuse what it wrote, an empty cache is better than none
+		header.size = header.hash = 0;
+		createInfo.initialDataSize = 0;
+		createInfo.pInitialData = nullptr;
+		return vkCreatePipelineCache(device, &createInfo, nullptr, &cache) == VK_SUCCESS;
+	}
+
+	// pass to every vkCreate*Pipelines, VK_NULL_HANDLE if it couldn't be created
+	VkPipelineCache Get() const
+	{
+		return cache;
+	}
+
+	// writes the cache back when the driver added to it, through a temporary file first so a crash
+	// never leaves a half written cache behind
+	bool Save()
+	{
+		if (cache == VK_NULL_HANDLE)
+			return false;
+		size_t size = 0;
+		if (vkGetPipelineCacheData(device, cache, &size, nullptr) != VK_SUCCESS || size == 0)
+			return false;
+		std::vector<char> data(size);
+		if (vkGetPipelineCacheData(device, cache, &size, data.data()) != VK_SUCCESS)
+			return false;
+		data.resize(size);
+		unsigned long long hash = HashShaderBytes(data.data(), data.size());
+		if (size == header.size && hash == header.hash)
+			return true; // nothing new since it was read
+
+		std::string temporary = path + ".tmp";
+		FILE* file = fopen(temporary.c_str(), "wb");
+		if (file == nullptr)
+			return false;
+		PipelineCacheHeader written = header;
+		written.size = size;
+		written.hash = hash;
+		bool complete = fwrite(&written, sizeof(written), 1, file) == 1 && fwrite(data.data(), 1, size, file) == size;
+		complete = (fclose(file) == 0) && complete;
+		// rename replaces the old file in one step, except on Windows where it must be removed first
+		if (complete && rename(temporary.c_str(), path.c_str()) != 0)
+		{
+			remove(path.c_str());
+			complete = rename(temporary.c_str(), path.c_str()) == 0;
+		}
+		if (!complete)
+		{
+			remove(temporary.c_str());
+			return false;
+		}
+		header = written;
+		return true;
+	}
+
+	void Destroy()
+	{
+		if (cache != VK_NULL_HANDLE)
+			vkDestroyPipelineCache(device, cache, nullptr);
+		cache = VK_NULL_HANDLE;
+	}
+};
+
+#endif // !PIPELINECACHE_H
@@ -12,21 +12,57 @@ struct OUT_V
 
 cbuffer SHADER_VARS : register(b0, space0)
 {
-    float4x4 world;
     float4x4 view;
     float4x4 projection;
     float4 sunDir;
     float4 camPos;
 };
 
+// world matrix of the current draw
+[[vk::push_constant]]
+cbuffer DRAW_VARS
+{
+    float4x4 world;
+    float4 positionScale, positionOffset; // dequantizes positions with QUANTIZED_VERTICES
+};
+
+#ifdef QUANTIZED_VERTICES
+// unfolds a unit vector stored in the [-1,1] square by octahedral encoding
+float3 DecodeOctahedral(float2 encoded)
+{
+    float3 v = float3(encoded, 1.0f - abs(encoded.x) - abs(encoded.y));
+    float fold = saturate(-v.z);
+    v.xy += (1.0f - 2.0f * step(0.0f, v.xy)) * fold;
+    return normalize(v);
+}
+#endif
+
 OUT_V main( float3 inputVertex : POSITION,
+#ifdef QUANTIZED_VERTICES
+			float2 inputNormal : NORMAL,
+			float2 inputUV : UV,
+			float2 inputTangent : TANGENT) 
+#else
 			float3 inputNormal : NORMAL,
 			float2 inputUV : UV,
 			float4 inputTangent : TANGENT) 
+#endif
 {
     OUT_V vOut;
     
-    vOut.pos = mul(float4(inputVertex, 1.0f), world);
+#ifdef QUANTIZED_VERTICES
+    float3 position = inputVertex * positionScale.xyz + positionOffset.xyz;
+    float3 normal = DecodeOctahedral(inputNormal);
+    // the sign of y is the handedness, y itself was remapped to [0,1]
+    float4 tangent = float4(DecodeOctahedral(float2(inputTangent.x, abs(inputTangent.y) * 2.0f - 1.0f)),
+                            (inputTangent.y < 0) ? -1.0f : 1.0f);
+#else
+    float3 position = inputVertex;
+    float3 normal = inputNormal;
+    float4 tangent = inputTangent;
+#endif
+    
+    vOut.pos = mul(float4(position, 1.0f), world);
     
     // get the vertex position in worldspace
     vOut.posW = vOut.pos;
@@ -36,8 +72,8 @@ OUT_V main( float3 inputVertex : POSITION,
     
     // Not used but initalize to avoid improper strides
     vOut.uv = inputUV;
-    vOut.nrm = inputNormal;
-    vOut.tan = inputTangent;
+    vOut.nrm = normal;
+    vOut.tan = tangent;
     
     return vOut;
 }
\ No newline at end of file
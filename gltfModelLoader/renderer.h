@@ -1,12 +1,42 @@
+#ifdef RUNTIME_SHADERS
 #include "shaderc/shaderc.h" // needed for compiling shaders at runtime
 #ifdef _WIN32 // must use MT platform DLL libraries on windows
 #pragma comment(lib, "shaderc_combined.lib") 
 #endif
+#endif
+#include "ShaderCache.h"
+#include "PipelineCache.h"
+
+// memory map .glb/.bin files and stream their buffer views straight to the GPU
+// instead of letting TinyGLTF copy them to the heap first
+#define LOAD_MODEL_MAPPED true
+
+// keep a cooked copy of the model next to it and load that instead when it is up to date
+#define LOAD_MODEL_COOKED true
+
+// cook the vertices into 16 bit positions, octahedral normals/tangents and half uvs,
+// the vertex shader is compiled with QUANTIZED_VERTICES to decode them
+#define QUANTIZE_MODEL_VERTICES true
+
+// filter the cook builds the mips of 8 bit images with, MIP_FILTER_BOX or MIP_FILTER_KAISER
+#define MODEL_MIP_FILTER MIP_FILTER_KAISER
+
+// the fragment shader samples no textures, so the cook neither decodes the model's images nor builds their mips
+#define LOAD_MODEL_IMAGES false
 
 #define TINYGLTF_IMPLEMENTATION
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "TinyGLTF/tiny_gltf.h"
+#include "MappedFile.h"
+#include "ModelUtils.h"
+#include "MeshOptimizer.h"
+#include "MeshSimplifier.h"
+#include "MeshletUtils.h"
+#include "MipGenerator.h"
+#include "TextureCompressor.h"
+#include "ModelCache.h"
+#include "StagingRing.h"
 #include <chrono>
 
 void PrintLabeledDebugString(const char* label, const char* toPrint)
@@ -36,28 +66,41 @@ class Renderer
 	VkBuffer geometryHandle = nullptr;
 	VkDeviceMemory geometryData = nullptr;
 
+	// shaders compile on worker threads while the model loads, the pipeline waits for them
+	ShaderCompileService shaderCompiler;
+	std::future<CompiledShader> vertexShaderSpirv;
+	std::future<CompiledShader> fragmentShaderSpirv;
 	VkShaderModule vertexShader = nullptr;
 	VkShaderModule fragmentShader = nullptr;
-	// pipeline settings for drawing (also required)
-	VkPipeline pipeline = nullptr;
+	// pipeline settings for drawing (also required), one pipeline per vertex layout in the draw list
+	std::vector<VkPipeline> pipelines;
 	VkPipelineLayout pipelineLayout = nullptr;
+	PipelineCache pipelineCache; // every pipeline is created through it, kept on disk between launches
 
 	unsigned int windowWidth, windowHeight;
 
-	Model model;
 	TinyGLTF loader;
+	CookedModel scene; // draw list, geometry and images of the model
+	StagingRing staging; // every upload to device local memory goes through it
+	std::vector<MeshletRange> visibleRanges; // reused by DrawScene every frame
 	std::string err;
 	std::string warn;
 
 	struct SHADER_VARS
 	{
-		GW::MATH::GMATRIXF worldMatrix;
 		GW::MATH::GMATRIXF viewMatrix;
 		GW::MATH::GMATRIXF projectionMatrix;
 		GW::MATH::GVECTORF sunDir;
 		GW::MATH::GVECTORF camPos;
 	} shaderVars;
 
+	// pushed per draw
+	struct DRAW_VARS
+	{
+		GW::MATH::GMATRIXF worldMatrix;
+		PositionDequantization dequantization;
+	};
+
 	// Declare Uniform Buffers
 	std::vector<VkBuffer> uniformHandle;
 	std::vector<VkDeviceMemory> uniformData;
@@ -82,8 +125,11 @@ public:
 	{
 		win = _win;
 		vlk = _vlk;
+		staging.Create(vlk);
+		CompileShaders();
 
-		bool ret = loader.LoadASCIIFromFile(&model, &err, &warn, "../../gltfModelLoader/Models/Doom_Sword.gltf");
+		bool ret = LoadCookedModel(loader, "../../gltfModelLoader/Models/Doom_Sword.gltf", LOAD_MODEL_MAPPED, LOAD_MODEL_COOKED, QUANTIZE_MODEL_VERTICES, false, MODEL_MIP_FILTER, LOAD_MODEL_IMAGES,
+			scene, err, warn);
 
 		if (!warn.empty())
 			printf("Warn %s\n", warn.c_str());
@@ -111,7 +157,6 @@ public:
 		// Initialize the shader variables
 		shaderVars.viewMatrix = viewMatrix;
 		shaderVars.projectionMatrix = projectionMatrix;
-		shaderVars.worldMatrix = GW::MATH::GIdentityMatrixF;
 		shaderVars.sunDir = GW::MATH::GVECTORF{ -1, -1, 2 };
 		shaderVars.camPos = GW::MATH::GVECTORF{ 0, 0, 0 };
 
@@ -232,12 +277,12 @@ private:
 	void InitializeGraphics()
 	{
 		GetHandlesFromSurface();
+		pipelineCache.Create(vlk, "../../gltfModelLoader/Pipelines.vkcache");
 		InitializeGeometry();
 
 		// Function to setup Descritor Sets
 		SetupDescriptorSets();
 
-		CompileShaders();
 		InitializeGraphicsPipeline();
 	}
 
@@ -337,92 +382,63 @@ private:
 
 	void InitializeGeometry()
 	{
-		auto* geometryBufData = model.buffers[0].data.data();
-		size_t geometryBufSize = sizeof(unsigned char) * model.buffers[0].data.size();
+		CreateGeometryBuffer(scene.geometrySize);
 
-		CreateGeometryBuffer(geometryBufData, geometryBufSize);
+		// everything is on the GPU now, let go of the cooked data
+		scene.ReleaseData();
 	}
 
-	void CreateGeometryBuffer(const void* data, unsigned int sizeInBytes)
+	void CreateGeometryBuffer(size_t sizeInBytes)
 	{
-		GvkHelper::create_buffer(physicalDevice, device, sizeInBytes,
-			VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &geometryHandle, &geometryData);
-		// Transfer triangle data to the vertex buffer. (staging would be prefered here)
-		GvkHelper::write_to_buffer(device, geometryData, data, sizeInBytes);
+		// The cooked geometry is already laid out the way the draw list expects it, it goes to device local memory through the staging ring
+		TransferBatch uploads;
+		uploads.Begin(vlk, staging);
+		CreateDeviceBuffer(uploads, physicalDevice, device, scene.geometry, sizeInBytes,
+			VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, geometryHandle, geometryData);
+		uploads.BufferBarrier(VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT);
+		uploads.Submit();
 	}
 
 	void CompileShaders()
 	{
-		// Intialize runtime shader compiler HLSL -> SPIRV
-		shaderc_compiler_t compiler = shaderc_compiler_initialize();
-		shaderc_compile_options_t options = CreateCompileOptions();
-
-		CompileVertexShader(compiler, options);
-		CompilePixelShader(compiler, options);
-
-		// Free runtime shader compiler resources
-		shaderc_compile_options_release(options);
-		shaderc_compiler_release(compiler);
+		// Queue shader compiles HLSL -> SPIRV, at runtime shaderc only starts for shaders the cache doesn't have
+		ShaderOptions options = CreateCompileOptions();
+		vertexShaderSpirv = shaderCompiler.Compile("../../gltfModelLoader/VertexShader.hlsl", SHADER_STAGE_VERTEX, options);
+		fragmentShaderSpirv = shaderCompiler.Compile("../../gltfModelLoader/FragmentShader.hlsl", SHADER_STAGE_FRAGMENT, options);
 	}
 
-	shaderc_compile_options_t CreateCompileOptions()
+	ShaderOptions CreateCompileOptions()
 	{
-		shaderc_compile_options_t retval = shaderc_compile_options_initialize();
-		shaderc_compile_options_set_source_language(retval, shaderc_source_language_hlsl);
-		shaderc_compile_options_set_invert_y(retval, false);
+		ShaderOptions retval;
+		retval.invertY = false;
+		if (QUANTIZE_MODEL_VERTICES)
+			retval.Define("QUANTIZED_VERTICES");
 #ifndef NDEBUG
-		shaderc_compile_options_set_generate_debug_info(retval);
+		retval.debugInfo = true;
 #endif
 		return retval;
 	}
 
-	void CompileVertexShader(const shaderc_compiler_t& compiler, const shaderc_compile_options_t& options)
-	{
-		std::string vertexShaderSource = ReadFileIntoString("../../gltfModelLoader/VertexShader.hlsl");
-
-		shaderc_compilation_result_t result = shaderc_compile_into_spv( // compile
-			compiler, vertexShaderSource.c_str(), vertexShaderSource.length(),
-			shaderc_vertex_shader, "main.vert", "main", options);
-
-		if (shaderc_result_get_compilation_status(result) != shaderc_compilation_status_success) // errors?
-		{
-			PrintLabeledDebugString("Vertex Shader Errors:\n", shaderc_result_get_error_message(result));
-			abort();
-			return;
-		}
-
-		GvkHelper::create_shader_module(device, shaderc_result_get_length(result), // load into Vulkan
-			(char*)shaderc_result_get_bytes(result), &vertexShader);
-
-		shaderc_result_release(result); // done
-	}
-
-	void CompilePixelShader(const shaderc_compiler_t& compiler, const shaderc_compile_options_t& options)
+	// waits for a queued shader and loads it into Vulkan
+	void LoadShaderModule(std::future<CompiledShader>& compiling, const char* label, VkShaderModule& module)
 	{
-		std::string fragmentShaderSource = ReadFileIntoString("../../gltfModelLoader/FragmentShader.hlsl");
-
-		shaderc_compilation_result_t result;
-
-		result = shaderc_compile_into_spv( // compile
-			compiler, fragmentShaderSource.c_str(), fragmentShaderSource.length(),
-			shaderc_fragment_shader, "main.frag", "main", options);
-
-		if (shaderc_result_get_compilation_status(result) != shaderc_compilation_status_success) // errors?
+		CompiledShader shader = compiling.get();
+		if (!shader.compiled) // errors?
 		{
-			PrintLabeledDebugString("Fragment Shader Errors:\n", shaderc_result_get_error_message(result));
+			PrintLabeledDebugString(label, shader.errors.c_str());
 			abort();
 			return;
 		}
 
-		GvkHelper::create_shader_module(device, shaderc_result_get_length(result), // load into Vulkan
-			(char*)shaderc_result_get_bytes(result), &fragmentShader);
-
-		shaderc_result_release(result); // done
+		GvkHelper::create_shader_module(device, shader.spirv.size() * sizeof(uint32_t), // load into Vulkan
+			reinterpret_cast<char*>(shader.spirv.data()), &module);
 	}
 
 	void InitializeGraphicsPipeline()
 	{
+		LoadShaderModule(vertexShaderSpirv, "Vertex Shader Errors:\n", vertexShader);
+		LoadShaderModule(fragmentShaderSpirv, "Fragment Shader Errors:\n", fragmentShader);
+
 		// Create Pipeline & Layout (Thanks Tiny!)
 		VkPipelineShaderStageCreateInfo stage_create_info[2] = {};
 		// Create Stage Info for Vertex Shader
@@ -438,49 +454,6 @@ private:
 		stage_create_info[1].pName = "main";
 
 		VkPipelineInputAssemblyStateCreateInfo assembly_create_info = CreateVkPipelineInputAssemblyStateCreateInfo();
-		VkVertexInputBindingDescription vertex_binding_description[4] = {};
-
-		// create string for attributes
-		std::string attr[] =
-		{
-			"POSITION",
-			"NORMAL",
-			"TEXCOORD_0",
-			"TANGENT"
-		};
-
-		for (int i = 0; i < 4; i++)
-		{
-			Accessor& Accessor = model.accessors[model.meshes[0].primitives[0].attributes[attr[i]]];
-			BufferView& BufferView = model.bufferViews[Accessor.bufferView];
-
-			vertex_binding_description[i].binding = i;
-			vertex_binding_description[i].stride = Accessor.ByteStride(BufferView);
-			vertex_binding_description[i].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-		}
-
-		VkVertexInputAttributeDescription vertex_attribute_description[4];
-		vertex_attribute_description[0].binding = 0;
-		vertex_attribute_description[0].location = 0;
-		vertex_attribute_description[0].format = VK_FORMAT_R32G32B32_SFLOAT;
-		vertex_attribute_description[0].offset = 0;
-
-		vertex_attribute_description[1].binding = 1;
-		vertex_attribute_description[1].location = 1;
-		vertex_attribute_description[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-		vertex_attribute_description[1].offset = 0;
-
-		vertex_attribute_description[2].binding = 2;
-		vertex_attribute_description[2].location = 2;
-		vertex_attribute_description[2].format = VK_FORMAT_R32G32_SFLOAT;
-		vertex_attribute_description[2].offset = 0;
-
-		vertex_attribute_description[3].binding = 3;
-		vertex_attribute_description[3].location = 3;
-		vertex_attribute_description[3].format = VK_FORMAT_R32G32B32A32_SFLOAT;
-		vertex_attribute_description[3].offset = 0;
-
-		VkPipelineVertexInputStateCreateInfo input_vertex_info = CreateVkPipelineVertexInputStateCreateInfo(vertex_binding_description, 4, vertex_attribute_description, 4);
 		VkViewport viewport = CreateViewportFromWindowDimensions();
 		VkRect2D scissor = CreateScissorFromWindowDimensions();
 		VkPipelineViewportStateCreateInfo viewport_create_info = CreateVkPipelineViewportStateCreateInfo(&viewport, 1, &scissor, 1);
@@ -507,7 +480,6 @@ private:
 		pipeline_create_info.stageCount = 2;
 		pipeline_create_info.pStages = stage_create_info;
 		pipeline_create_info.pInputAssemblyState = &assembly_create_info;
-		pipeline_create_info.pVertexInputState = &input_vertex_info;
 		pipeline_create_info.pViewportState = &viewport_create_info;
 		pipeline_create_info.pRasterizationState = &rasterization_create_info;
 		pipeline_create_info.pMultisampleState = &multisample_create_info;
@@ -519,7 +491,80 @@ private:
 		pipeline_create_info.subpass = 0;
 		pipeline_create_info.basePipelineHandle = VK_NULL_HANDLE;
 
-		vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipeline_create_info, nullptr, &pipeline);
+		// every vertex layout used by the draw list gets its own pipeline
+		pipelines.resize(scene.drawList.layouts.size());
+		for (size_t i = 0; i < scene.drawList.layouts.size(); i++)
+		{
+			VkVertexInputBindingDescription vertex_binding_description[DRAW_ATTRIBUTE_COUNT] = {};
+			VkVertexInputAttributeDescription vertex_attribute_description[DRAW_ATTRIBUTE_COUNT] = {};
+			for (unsigned int j = 0; j < DRAW_ATTRIBUTE_COUNT; j++)
+			{
+				// one binding per attribute so glTF buffer views can be bound as they are
+				vertex_binding_description[j].binding = j;
+				vertex_binding_description[j].stride = scene.drawList.layouts[i].streams[j].stride;
+				vertex_binding_description[j].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+				vertex_attribute_description[j].binding = j;
+				vertex_attribute_description[j].location = j;
+				vertex_attribute_description[j].format = GetVertexFormat(scene.drawList.layouts[i].streams[j]);
+				vertex_attribute_description[j].offset = 0;
+			}
+
+			VkPipelineVertexInputStateCreateInfo input_vertex_info = CreateVkPipelineVertexInputStateCreateInfo(vertex_binding_description, DRAW_ATTRIBUTE_COUNT,
+				vertex_attribute_description, DRAW_ATTRIBUTE_COUNT);
+			pipeline_create_info.pVertexInputState = &input_vertex_info;
+
+			vkCreateGraphicsPipelines(device, pipelineCache.Get(), 1, &pipeline_create_info, nullptr, &pipelines[i]);
+		}
+	}
+
+	// Vulkan format matching a glTF accessor, integer data without normalization is converted to float as is
+	VkFormat GetVertexFormat(const VertexStream& _stream)
+	{
+		int components = GetNumComponentsInType(_stream.type);
+		if (components < 1 || components > 4)
+			return VK_FORMAT_UNDEFINED;
+
+		// glTF pads 3 component 8 and 16 bit attributes to 4 bytes, those are read as 4 components
+		switch (_stream.componentType)
+		{
+		case TINYGLTF_COMPONENT_TYPE_FLOAT:
+		{
+			const VkFormat formats[] = { VK_FORMAT_R32_SFLOAT, VK_FORMAT_R32G32_SFLOAT, VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32B32A32_SFLOAT };
+			return formats[components - 1];
+		}
+		case TINYGLTF_COMPONENT_TYPE_BYTE:
+		{
+			const VkFormat normalized[] = { VK_FORMAT_R8_SNORM, VK_FORMAT_R8G8_SNORM, VK_FORMAT_R8G8B8A8_SNORM, VK_FORMAT_R8G8B8A8_SNORM };
+			const VkFormat scaled[] = { VK_FORMAT_R8_SSCALED, VK_FORMAT_R8G8_SSCALED, VK_FORMAT_R8G8B8A8_SSCALED, VK_FORMAT_R8G8B8A8_SSCALED };
+			return (_stream.normalized) ? normalized[components - 1] : scaled[components - 1];
+		}
+		case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+		{
+			const VkFormat normalized[] = { VK_FORMAT_R8_UNORM, VK_FORMAT_R8G8_UNORM, VK_FORMAT_R8G8B8A8_UNORM, VK_FORMAT_R8G8B8A8_UNORM };
+			const VkFormat scaled[] = { VK_FORMAT_R8_USCALED, VK_FORMAT_R8G8_USCALED, VK_FORMAT_R8G8B8A8_USCALED, VK_FORMAT_R8G8B8A8_USCALED };
+			return (_stream.normalized) ? normalized[components - 1] : scaled[components - 1];
+		}
+		case TINYGLTF_COMPONENT_TYPE_SHORT:
+		{
+			const VkFormat normalized[] = { VK_FORMAT_R16_SNORM, VK_FORMAT_R16G16_SNORM, VK_FORMAT_R16G16B16A16_SNORM, VK_FORMAT_R16G16B16A16_SNORM };
+			const VkFormat scaled[] = { VK_FORMAT_R16_SSCALED, VK_FORMAT_R16G16_SSCALED, VK_FORMAT_R16G16B16A16_SSCALED, VK_FORMAT_R16G16B16A16_SSCALED };
+			return (_stream.normalized) ? normalized[components - 1] : scaled[components - 1];
+		}
+		case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+		{
+			const VkFormat normalized[] = { VK_FORMAT_R16_UNORM, VK_FORMAT_R16G16_UNORM, VK_FORMAT_R16G16B16A16_UNORM, VK_FORMAT_R16G16B16A16_UNORM };
+			const VkFormat scaled[] = { VK_FORMAT_R16_USCALED, VK_FORMAT_R16G16_USCALED, VK_FORMAT_R16G16B16A16_USCALED, VK_FORMAT_R16G16B16A16_USCALED };
+			return (_stream.normalized) ? normalized[components - 1] : scaled[components - 1];
+		}
+		case VERTEX_COMPONENT_TYPE_HALF_FLOAT:
+		{
+			const VkFormat formats[] = { VK_FORMAT_R16_SFLOAT, VK_FORMAT_R16G16_SFLOAT, VK_FORMAT_R16G16B16A16_SFLOAT, VK_FORMAT_R16G16B16A16_SFLOAT };
+			return formats[components - 1];
+		}
+		default:
+			return VK_FORMAT_UNDEFINED;
+		}
 	}
 
 	VkPipelineInputAssemblyStateCreateInfo CreateVkPipelineInputAssemblyStateCreateInfo()
@@ -661,14 +706,19 @@ private:
 
 	void CreatePipelineLayout()
 	{
-		// Descriptor pipeline layout
+		// per draw world matrix
+		VkPushConstantRange push_constants = {};
+		push_constants.offset = 0;
+		push_constants.size = sizeof(DRAW_VARS);
+		push_constants.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
 
+		// Descriptor pipeline layout
 		VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
 		pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
 		pipeline_layout_create_info.setLayoutCount = 1;
 		pipeline_layout_create_info.pSetLayouts = &descriptor_set_layout;
-		pipeline_layout_create_info.pushConstantRangeCount = 0;
-		pipeline_layout_create_info.pPushConstantRanges = nullptr;
+		pipeline_layout_create_info.pushConstantRangeCount = 1;
+		pipeline_layout_create_info.pPushConstantRanges = &push_constants;
 
 		vkCreatePipelineLayout(device, &pipeline_layout_create_info, nullptr, &pipelineLayout);
 	}
@@ -690,19 +740,13 @@ public:
 		VkCommandBuffer commandBuffer = GetCurrentCommandBuffer();
 		SetUpPipeline(commandBuffer);
 
-		// write to the uniform buffer
-		for (int i = 0; i < maxFrames; i++)
-		{
-			GvkHelper::write_to_buffer(device, uniformData[i], &shaderVars, sizeof(SHADER_VARS));
-			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[i], 0, nullptr);
-		}
-
-		Accessor& indexAccessor = model.accessors[model.meshes[0].primitives[0].indices];
-
-		Accessor& vertexAccessor = model.accessors[model.meshes[0].primitives[0].attributes["POSITION"]];
-		BufferView& vertexBufferView = model.bufferViews[vertexAccessor.bufferView];
+		// only the buffers of the frame being recorded may be touched
+		unsigned int currentImage;
+		vlk.GetSwapchainCurrentImage(currentImage);
+		GvkHelper::write_to_buffer(device, uniformData[currentImage], &shaderVars, sizeof(SHADER_VARS));
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[currentImage], 0, nullptr);
 
-		vkCmdDrawIndexed(commandBuffer, indexAccessor.count, 1, 0, vertexBufferView.byteOffset + vertexAccessor.byteOffset, 1);
+		DrawScene(commandBuffer);
 	}
 
 private:
@@ -721,9 +765,6 @@ private:
 		UpdateWindowDimensions(); // what is the current client area dimensions?
 		SetViewport(commandBuffer);
 		SetScissor(commandBuffer);
-
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
-		BindGeometryBuffers(commandBuffer);
 	}
 
 	void SetViewport(const VkCommandBuffer& commandBuffer)
@@ -738,37 +779,66 @@ private:
 		vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
 	}
 
-	void BindGeometryBuffers(VkCommandBuffer& commandBuffer)
+	// walks the sorted draw list, only rebinding what changed since the previous draw
+	void DrawScene(VkCommandBuffer& commandBuffer)
 	{
-		// bind the vertex buffer from the geometry
+		const DrawItem* previous = nullptr;
+		unsigned int boundIndexSize = 0;
+		VkBuffer vertexBuffers[DRAW_ATTRIBUTE_COUNT] = { geometryHandle, geometryHandle, geometryHandle, geometryHandle };
 
-		std::string attr[] =
+		for (const DrawItem& draw : scene.drawList.draws)
 		{
-			"POSITION",
-			"NORMAL",
-			"TEXCOORD_0",
-			"TANGENT"
-		};
+			if (previous == nullptr || previous->layout != draw.layout)
+				vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines[draw.layout]);
+
+			if (previous == nullptr || memcmp(previous->vertexOffsets, draw.vertexOffsets, sizeof(draw.vertexOffsets)) != 0)
+			{
+				VkDeviceSize offsets[DRAW_ATTRIBUTE_COUNT];
+				for (int i = 0; i < DRAW_ATTRIBUTE_COUNT; i++)
+					offsets[i] = draw.vertexOffsets[i];
+				vkCmdBindVertexBuffers(commandBuffer, 0, DRAW_ATTRIBUTE_COUNT, vertexBuffers, offsets);
+			}
 
-		for (size_t i = 0; i < 4; i++)
-		{
-			Accessor& Accessor = model.accessors[model.meshes[0].primitives[0].attributes[attr[i]]];
-			BufferView& BufferView = model.bufferViews[Accessor.bufferView];
+			if (previous == nullptr || previous->instance != draw.instance || previous->mesh != draw.mesh)
+			{
+				DRAW_VARS drawVars = { scene.drawList.worldMatrices[draw.instance], GetDequantization(scene.drawList, draw.mesh) };
+				vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(DRAW_VARS), &drawVars);
+			}
+			previous = &draw;
 
-			VkDeviceSize offset[] = { BufferView.byteOffset + Accessor.byteOffset };
-			vkCmdBindVertexBuffers(commandBuffer, i, 1, &geometryHandle, offset);
-		}
+			if (draw.indexSize == 0)
+			{
+				vkCmdDraw(commandBuffer, draw.count, 1, 0, 0);
+				continue;
+			}
 
-		// bind the index buffer from the geometry
-		Accessor& indexAccessor = model.accessors[model.meshes[0].primitives[0].indices];
-		BufferView& indexBufferView = model.bufferViews[indexAccessor.bufferView];
-		vkCmdBindIndexBuffer(commandBuffer, geometryHandle, indexBufferView.byteOffset + indexAccessor.byteOffset, VK_INDEX_TYPE_UINT16);
+			// the index buffer stays bound to the start of the geometry, draws pick their range with firstIndex
+			if (boundIndexSize != draw.indexSize)
+			{
+				vkCmdBindIndexBuffer(commandBuffer, geometryHandle, 0, (draw.indexSize == 4) ? VK_INDEX_TYPE_UINT32 : VK_INDEX_TYPE_UINT16);
+				boundIndexSize = draw.indexSize;
+			}
+			// the coarsest LOD that still looks the same from where the camera is
+			const DrawLod* lod = SelectDrawLod(scene.drawList, draw, scene.drawList.worldMatrices[draw.instance], shaderVars.camPos,
+				fabsf(projectionMatrix.row2.y), static_cast<float>(windowHeight));
+			if (lod != nullptr && lod->indexOffset != draw.indexOffset)
+			{
+				vkCmdDrawIndexed(commandBuffer, lod->count, 1, static_cast<uint32_t>(lod->indexOffset / draw.indexSize), 0, 0);
+				continue;
+			}
+			// full detail, only the meshlets on screen and facing the camera are drawn
+			visibleRanges.clear();
+			CullDrawMeshlets(scene.drawList, draw, scene.drawList.worldMatrices[draw.instance], viewMatrix, projectionMatrix, visibleRanges);
+			for (const MeshletRange& range : visibleRanges)
+				vkCmdDrawIndexed(commandBuffer, range.count, 1, range.firstIndex, 0, 0);
+		}
 	}
 
 	void CleanUp()
 	{
 		// wait till everything has completed
 		vkDeviceWaitIdle(device);
+		staging.Destroy();
 
 		// release allocated descriptor sets
 		for (unsigned int i = 0; i < maxFrames; i++)
@@ -785,7 +855,10 @@ private:
 		vkFreeMemory(device, geometryData, nullptr);
 		vkDestroyShaderModule(device, vertexShader, nullptr);
 		vkDestroyShaderModule(device, fragmentShader, nullptr);
+		pipelineCache.Save(); // back to disk while the device is still alive
+		pipelineCache.Destroy();
 		vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
-		vkDestroyPipeline(device, pipeline, nullptr);
+		for (size_t i = 0; i < pipelines.size(); i++)
+			vkDestroyPipeline(device, pipelines[i], nullptr);
 	}
 };
@@ -16,6 +16,13 @@ static const float Epsilon = 0.00001;
 // Constant normal incidence Fresnel factor for all dielectrics.
 static const float3 Fdielectric = 0.04;
 
+// The renderer compiles a variant for every feature set its materials use, work a material has no
+// use for is left out instead of being branched over:
+// NORMAL_MAP           the normal map perturbs the vertex normal
+// EMISSIVE_MAP         the emissive map is added on top
+// IMAGE_BASED_LIGHTING ambient light comes from the environment maps instead of the flat sun ambient
+// ALPHA_MASK           pixels with less base color alpha than alphaCutoff are discarded
+
 // ********* BEGIN PBR Math Functions *********
 
 // GGX/Towbridge-Reitz normal distribution function.
@@ -74,17 +81,18 @@ struct V_OUT
     float4 tangent : TANGENT;
 };
 
-// Identify which 2D texture is which
-static const int albedoMap = 0;
-static const int roughnessMetalOcclusionMap = 1;
-static const int normalMap = 2;
-static const int emissiveMap = 3;
-static const int brdfMap = 4;
+// Identify which texture is which for the current draw, -1 when the material has none
+[[vk::push_constant]]
+cbuffer DRAW_VARS
+{
+    float4 positionScale, positionOffset;
+    uint instance;
+    int albedoMap, roughnessMetalOcclusionMap, normalMap, emissiveMap;
+    int brdfMap, irradianceMap, specularMap;
+    float alphaCutoff;
+};
 // Identify which sampler is which
 static const int defaultSampler = 0;
-// Identify which texture cube is which
-static const int irradianceMap = 5;
-static const int specularMap = 6;
 
 Texture2D textures[] : register(t0, space1);
 TextureCube cubeTextures[] : register(t0, space1); // can share space with 2D textures
@@ -94,9 +102,22 @@ SamplerState samplers[] : register(s0, space1);
 float4 main(V_OUT vin) : SV_TARGET
 {
    // Sample input textures to get shading model params.
-    float3 albedo = textures[albedoMap].Sample(samplers[defaultSampler], vin.uv).rgb;
-    float3 MRA = textures[roughnessMetalOcclusionMap].Sample(samplers[defaultSampler], vin.uv).rgb;
-    float3 emissive = textures[emissiveMap].Sample(samplers[defaultSampler], vin.uv).rgb;
+    // missing textures fall back to the glTF defaults
+    // (branches, not ?: which would sample index -1 as well)
+    float4 baseColor = 1.0;
+    if (albedoMap >= 0)
+        baseColor = textures[albedoMap].Sample(samplers[defaultSampler], vin.uv);
+#ifdef ALPHA_MASK
+    clip(baseColor.a - alphaCutoff);
+#endif
+    float3 albedo = baseColor.rgb;
+    float3 MRA = 1.0;
+    if (roughnessMetalOcclusionMap >= 0)
+        MRA = textures[roughnessMetalOcclusionMap].Sample(samplers[defaultSampler], vin.uv).rgb;
+    float3 emissive = 0.0;
+#ifdef EMISSIVE_MAP
+    emissive = textures[emissiveMap].Sample(samplers[defaultSampler], vin.uv).rgb;
+#endif
     float metalness = MRA.b;
     float roughness = MRA.g;
     float occlusion = MRA.r;
@@ -105,9 +126,12 @@ float4 main(V_OUT vin) : SV_TARGET
     float3 Lo = normalize(camPos.xyz - vin.posW);
 
 	// Get current fragment's normal and transform to world space.
-    float3 rawNrm = textures[normalMap].Sample(samplers[defaultSampler], vin.uv).rgb;
+#ifdef NORMAL_MAP
+    float2 rawNrm = textures[normalMap].Sample(samplers[defaultSampler], vin.uv).rg;
     rawNrm.g = 1.0f - rawNrm.g; // Invert green channel to match DirectX normal map convention.
-    float3 N = normalize(2.0 * rawNrm - 1.0);
+    // z is rebuilt from x and y, BC5 normal maps only store those two
+    float2 nrmXY = 2.0 * rawNrm - 1.0;
+    float3 N = normalize(float3(nrmXY, sqrt(saturate(1.0 - dot(nrmXY, nrmXY)))));
     // construct TBN
     vin.nrm = normalize(vin.nrm);
     vin.tangent.xyz = normalize(vin.tangent.xyz);
@@ -117,6 +141,9 @@ float4 main(V_OUT vin) : SV_TARGET
     float3x3 tbn = float3x3(vin.tangent.xyz, binormal, vin.nrm);
     // apply tbn matrix to normal
     N = normalize(mul(N, tbn));
+#else
+    float3 N = normalize(vin.nrm);
+#endif
 	// Angle between surface normal and outgoing light direction.
     float cosLo = max(0.0, dot(N, Lo));
 		
@@ -169,6 +196,9 @@ float4 main(V_OUT vin) : SV_TARGET
     // Teacher's note: This is the IBL part of the shader, its the light from your surroundings.
     // You should only do this once, though some engines have multiple IBLs. (e.g. skybox, reflection probes)
     float3 ambientLighting;
+#ifndef IMAGE_BASED_LIGHTING
+    ambientLighting = sunAmbient.rgb * albedo * occlusion;
+#else
 	{
 		// Sample diffuse irradiance at normal direction.
         float3 irradiance = cubeTextures[irradianceMap].Sample(samplers[defaultSampler], N).rgb;
@@ -200,6 +230,7 @@ float4 main(V_OUT vin) : SV_TARGET
 		// Total ambient lighting contribution.
         ambientLighting = diffuseIBL + specularIBL * occlusion;
     }
+#endif
     
 	// Final fragment color.
     return float4(directLighting + ambientLighting + emissive, 1.0);
@@ -0,0 +1,124 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+// Read-only memory mapping of a whole file.
+// The pages stay backed by the file itself so large assets never touch the heap.
+#include <string>
+#include <cstddef>
+#include <utility>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+struct MappedFile
+{
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif
+
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	MappedFile(MappedFile&& _other) noexcept { *this = std::move(_other); }
+	MappedFile& operator=(MappedFile&& _other) noexcept
+	{
+		if (this != &_other)
+		{
+			Close();
+			data = _other.data;
+			size = _other.size;
+#ifdef _WIN32
+			file = _other.file;
+			mapping = _other.mapping;
+			_other.file = INVALID_HANDLE_VALUE;
+			_other.mapping = nullptr;
+#endif
+			_other.data = nullptr;
+			_other.size = 0;
+		}
+		return *this;
+	}
+	~MappedFile() { Close(); }
+
+	// returns false if the file could not be opened or is empty
+	bool Open(const std::string& _path)
+	{
+		Close();
+#ifdef _WIN32
+		file = CreateFileA(_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER fileSize = {};
+		if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+		{
+			Close();
+			return false;
+		}
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping == nullptr)
+		{
+			Close();
+			return false;
+		}
+		data = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+		size = static_cast<size_t>(fileSize.QuadPart);
+#else
+		int fd = open(_path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat info = {};
+		if (fstat(fd, &info) != 0 || info.st_size == 0)
+		{
+			close(fd);
+			return false;
+		}
+		void* view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd); // the mapping keeps its own reference to the file
+		if (view == MAP_FAILED)
+			return false;
+		// we walk buffer views front to back, let the kernel read ahead
+		madvise(view, static_cast<size_t>(info.st_size), MADV_SEQUENTIAL);
+		data = static_cast<const unsigned char*>(view);
+		size = static_cast<size_t>(info.st_size);
+#endif
+		if (data == nullptr)
+		{
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	void Close()
+	{
+#ifdef _WIN32
+		if (data)
+			UnmapViewOfFile(data);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data)
+			munmap(const_cast<unsigned char*>(data), size);
+#endif
+		data = nullptr;
+		size = 0;
+	}
+};
+
+#endif // !MAPPEDFILE_H
@@ -0,0 +1,672 @@
+#ifndef MESHOPTIMIZER_H
+#define MESHOPTIMIZER_H
+
+// Requires tinygltf.h, Gateware.h (MATH) and ModelUtils.h
+
+// Import time reordering of every primitive so the GPU does less work for the same triangles:
+// indices are reordered for the post transform vertex cache (Forsyth), clusters of them are then
+// ordered front to back to cut overdraw (Tipsify style), and finally the vertices are rewritten in
+// the order the indices first fetch them. Optionally the streams are then quantized to 20 bytes a
+// vertex. Runs while a model is cooked so it only costs once.
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <array>
+#include <cfloat>
+
+#define VERTEX_CACHE_SCORE_SIZE 32 // LRU cache the scoring models, bigger than any real cache on purpose
+#define VERTEX_CACHE_ANALYZE_SIZE 16 // FIFO cache the statistics are measured with
+#define OVERDRAW_CACHE_THRESHOLD 1.05f // ACMR the overdraw ordering may cost relative to the cache order
+
+// post transform cache misses when drawing _indices through a FIFO cache of _cacheSize entries
+unsigned int CountVertexCacheMisses(const unsigned int* _indices, size_t _count, size_t _vertexCount,
+									unsigned int _cacheSize = VERTEX_CACHE_ANALYZE_SIZE)
+{
+	// a vertex is in the cache while fewer than _cacheSize misses happened since it was loaded
+	std::vector<unsigned int> loadedAt(_vertexCount, 0);
+	unsigned int misses = 0;
+	for (size_t i = 0; i < _count; i++)
+	{
+		unsigned int vertex = _indices[i];
+		if (loadedAt[vertex] == 0 || misses - loadedAt[vertex] >= _cacheSize)
+			loadedAt[vertex] = ++misses;
+	}
+	return misses;
+}
+
+unsigned int CountUniqueVertices(const unsigned int* _indices, size_t _count, size_t _vertexCount)
+{
+	std::vector<bool> used(_vertexCount, false);
+	unsigned int unique = 0;
+	for (size_t i = 0; i < _count; i++)
+		if (!used[_indices[i]])
+		{
+			used[_indices[i]] = true;
+			unique++;
+		}
+	return unique;
+}
+
+// Tom Forsyth's linear speed vertex cache optimization, rewrites _indices in place
+void OptimizeVertexCache(unsigned int* _indices, size_t _count, size_t _vertexCount)
+{
+	size_t triangleCount = _count / 3;
+	if (triangleCount == 0)
+		return;
+
+	// scores by cache position and by how many triangles still need the vertex
+	float cacheScores[VERTEX_CACHE_SCORE_SIZE];
+	for (int i = 0; i < VERTEX_CACHE_SCORE_SIZE; i++)
+		cacheScores[i] = (i < 3) ? 0.75f // the last triangle's vertices, don't favor reusing them right away
+			: powf(1.0f - (i - 3) / float(VERTEX_CACHE_SCORE_SIZE - 3), 1.5f);
+	float valenceScores[64];
+	for (int i = 0; i < 64; i++)
+		valenceScores[i] = (i == 0) ? 0.0f : 2.0f / sqrtf(float(i)); // finish off lonely vertices first
+
+	// triangles using each vertex
+	std::vector<unsigned int> remaining(_vertexCount, 0);
+	for (size_t i = 0; i < triangleCount * 3; i++)
+		remaining[_indices[i]]++;
+	std::vector<unsigned int> firstTriangle(_vertexCount + 1, 0);
+	for (size_t i = 0; i < _vertexCount; i++)
+		firstTriangle[i + 1] = firstTriangle[i] + remaining[i];
+	std::vector<unsigned int> adjacency(triangleCount * 3);
+	std::vector<unsigned int> filled(firstTriangle.begin(), firstTriangle.end() - 1);
+	for (size_t i = 0; i < triangleCount * 3; i++)
+		adjacency[filled[_indices[i]]++] = static_cast<unsigned int>(i / 3);
+
+	std::vector<int> cachePosition(_vertexCount, -1);
+	std::vector<float> vertexScores(_vertexCount);
+	auto scoreVertex = [&](unsigned int _vertex)
+		{
+			if (remaining[_vertex] == 0)
+				return -1.0f;
+			float score = valenceScores[G_SMALLER(remaining[_vertex], 63u)];
+			if (cachePosition[_vertex] >= 0)
+				score += cacheScores[cachePosition[_vertex]];
+			return score;
+		};
+	for (size_t i = 0; i < _vertexCount; i++)
+		vertexScores[i] = scoreVertex(static_cast<unsigned int>(i));
+
+	std::vector<float> triangleScores(triangleCount);
+	for (size_t i = 0; i < triangleCount; i++)
+		triangleScores[i] = vertexScores[_indices[i * 3]] + vertexScores[_indices[i * 3 + 1]] + vertexScores[_indices[i * 3 + 2]];
+
+	std::vector<bool> emitted(triangleCount, false);
+	std::vector<unsigned int> output;
+	output.reserve(triangleCount * 3);
+	unsigned int cache[VERTEX_CACHE_SCORE_SIZE + 3];
+	unsigned int cacheSize = 0;
+	size_t nextInOrder = 0; // where to restart when the cache has nothing left to offer
+	long long best = 0;
+
+	while (best >= 0)
+	{
+		unsigned int triangle = static_cast<unsigned int>(best);
+		emitted[triangle] = true;
+		const unsigned int* corners = _indices + triangle * 3;
+		output.insert(output.end(), corners, corners + 3);
+
+		// the triangle no longer needs its vertices
+		for (int i = 0; i < 3; i++)
+		{
+			unsigned int vertex = corners[i];
+			unsigned int* list = adjacency.data() + firstTriangle[vertex];
+			for (unsigned int j = 0; j < remaining[vertex]; j++)
+				if (list[j] == triangle)
+				{
+					list[j] = list[remaining[vertex] - 1];
+					break;
+				}
+			remaining[vertex]--;
+		}
+
+		// its vertices move to the front of the cache, whatever falls off the end is evicted
+		unsigned int newCache[VERTEX_CACHE_SCORE_SIZE + 3];
+		unsigned int newSize = 0;
+		for (int i = 0; i < 3; i++)
+			newCache[newSize++] = corners[i];
+		for (unsigned int i = 0; i < cacheSize; i++)
+			if (cache[i] != corners[0] && cache[i] != corners[1] && cache[i] != corners[2])
+				newCache[newSize++] = cache[i];
+		for (unsigned int i = 0; i < newSize; i++)
+			cachePosition[newCache[i]] = (i < VERTEX_CACHE_SCORE_SIZE) ? static_cast<int>(i) : -1;
+
+		// only triangles touching the old or new cache changed score, the best of them goes next
+		best = -1;
+		float bestScore = -1.0f;
+		for (unsigned int i = 0; i < newSize; i++)
+		{
+			unsigned int vertex = newCache[i];
+			float delta = scoreVertex(vertex) - vertexScores[vertex];
+			vertexScores[vertex] += delta;
+			const unsigned int* list = adjacency.data() + firstTriangle[vertex];
+			for (unsigned int j = 0; j < remaining[vertex]; j++)
+			{
+				triangleScores[list[j]] += delta;
+				if (triangleScores[list[j]] > bestScore)
+				{
+					bestScore = triangleScores[list[j]];
+					best = list[j];
+				}
+			}
+		}
+		cacheSize = G_SMALLER(newSize, static_cast<unsigned int>(VERTEX_CACHE_SCORE_SIZE));
+		memcpy(cache, newCache, cacheSize * sizeof(unsigned int));
+
+		if (best < 0)
+		{
+			// dead end, continue with the next triangle in the original order
+			while (nextInOrder < triangleCount && emitted[nextInOrder])
+				nextInOrder++;
+			if (nextInOrder < triangleCount)
+				best = static_cast<long long>(nextInOrder);
+		}
+	}
+	memcpy(_indices, output.data(), output.size() * sizeof(unsigned int));
+}
+
+// Splits cache ordered _indices into clusters where the cache starts over and draws the clusters
+// facing away from the mesh center first, those are the ones most likely to occlude the others
+void OptimizeOverdraw(unsigned int* _indices, size_t _count, size_t _vertexCount, const float* _positions, size_t _positionStride)
+{
+	size_t triangleCount = _count / 3;
+	if (triangleCount < 2)
+		return;
+	auto position = [&](unsigned int _vertex)
+		{
+			const float* p = reinterpret_cast<const float*>(reinterpret_cast<const unsigned char*>(_positions) + _vertex * _positionStride);
+			return GW::MATH::GVECTORF{ p[0], p[1], p[2], 0 };
+		};
+
+	// a cluster ends where a triangle misses the cache with all of its vertices
+	std::vector<size_t> clusterStarts;
+	std::vector<unsigned int> loadedAt(_vertexCount, 0);
+	unsigned int misses = 0;
+	for (size_t i = 0; i < triangleCount; i++)
+	{
+		unsigned int triangleMisses = 0;
+		for (int j = 0; j < 3; j++)
+		{
+			unsigned int vertex = _indices[i * 3 + j];
+			if (loadedAt[vertex] == 0 || misses - loadedAt[vertex] >= VERTEX_CACHE_ANALYZE_SIZE)
+			{
+				loadedAt[vertex] = ++misses;
+				triangleMisses++;
+			}
+		}
+		if (i == 0 || triangleMisses == 3)
+			clusterStarts.push_back(i);
+	}
+	if (clusterStarts.size() < 2)
+		return;
+	clusterStarts.push_back(triangleCount);
+
+	GW::MATH::GVECTORF meshCenter = {};
+	for (size_t i = 0; i < triangleCount * 3; i++)
+		GW::MATH::GVector::AddVectorF(meshCenter, position(_indices[i]), meshCenter);
+	GW::MATH::GVector::ScaleF(meshCenter, 1.0f / (triangleCount * 3), meshCenter);
+
+	// area weighted center and normal of every cluster
+	std::vector<std::pair<float, size_t>> order(clusterStarts.size() - 1);
+	for (size_t cluster = 0; cluster + 1 < clusterStarts.size(); cluster++)
+	{
+		GW::MATH::GVECTORF center = {}, normal = {};
+		float area = 0;
+		for (size_t i = clusterStarts[cluster]; i < clusterStarts[cluster + 1]; i++)
+		{
+			GW::MATH::GVECTORF a = position(_indices[i * 3]), b = position(_indices[i * 3 + 1]), c = position(_indices[i * 3 + 2]);
+			GW::MATH::GVECTORF ab, ac, cross;
+			GW::MATH::GVector::SubtractVectorF(b, a, ab);
+			GW::MATH::GVector::SubtractVectorF(c, a, ac);
+			GW::MATH::GVector::CrossVector3F(ab, ac, cross);
+			float doubleArea = sqrtf(cross.x * cross.x + cross.y * cross.y + cross.z * cross.z);
+			GW::MATH::GVector::AddVectorF(normal, cross, normal);
+			GW::MATH::GVECTORF sum;
+			GW::MATH::GVector::AddVectorF(a, b, sum);
+			GW::MATH::GVector::AddVectorF(sum, c, sum);
+			GW::MATH::GVector::ScaleF(sum, doubleArea / 3, sum);
+			GW::MATH::GVector::AddVectorF(center, sum, center);
+			area += doubleArea;
+		}
+		if (area > 0)
+			GW::MATH::GVector::ScaleF(center, 1.0f / area, center);
+		float length = sqrtf(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
+		float facing = 0;
+		if (length > 0 && area > 0)
+			facing = ((center.x - meshCenter.x) * normal.x + (center.y - meshCenter.y) * normal.y
+				+ (center.z - meshCenter.z) * normal.z) / length;
+		order[cluster] = { facing, cluster };
+	}
+	std::stable_sort(order.begin(), order.end(), [](const std::pair<float, size_t>& _a, const std::pair<float, size_t>& _b)
+		{
+			return _a.first > _b.first;
+		});
+
+	std::vector<unsigned int> sorted;
+	sorted.reserve(triangleCount * 3);
+	for (const std::pair<float, size_t>& cluster : order)
+		sorted.insert(sorted.end(), _indices + clusterStarts[cluster.second] * 3, _indices + clusterStarts[cluster.second + 1] * 3);
+
+	// reordering clusters breaks a little vertex reuse between them, keep it only if that stays small
+	unsigned int before = CountVertexCacheMisses(_indices, triangleCount * 3, _vertexCount);
+	unsigned int after = CountVertexCacheMisses(sorted.data(), sorted.size(), _vertexCount);
+	if (after <= before * OVERDRAW_CACHE_THRESHOLD)
+		memcpy(_indices, sorted.data(), sorted.size() * sizeof(unsigned int));
+}
+
+// Numbers vertices in the order _indices first use them and rewrites _indices with the new numbers.
+// _outRemap maps old vertices to new ones, unused vertices map to ~0u. Returns the new vertex count.
+unsigned int OptimizeVertexFetch(unsigned int* _indices, size_t _count, size_t _vertexCount, std::vector<unsigned int>& _outRemap)
+{
+	_outRemap.assign(_vertexCount, ~0u);
+	unsigned int next = 0;
+	for (size_t i = 0; i < _count; i++)
+	{
+		unsigned int& remapped = _outRemap[_indices[i]];
+		if (remapped == ~0u)
+			remapped = next++;
+		_indices[i] = remapped;
+	}
+	return next;
+}
+
+// bytes one element of a stream needs, padded to 4 like glTF pads vertex attributes
+unsigned int GetStreamElementSize(const VertexStream& _stream)
+{
+	int size = GetVertexComponentSize(_stream.componentType) * tinygltf::GetNumComponentsInType(_stream.type);
+	return (size > 0) ? ((static_cast<unsigned int>(size) + 3) & ~3u) : 0;
+}
+
+struct VertexCacheStats
+{
+	unsigned int triangles;
+	unsigned int vertices; // vertices the indices reference
+	unsigned int missesBefore;
+	unsigned int missesAfter;
+};
+
+// Runs every unique indexed primitive of _list through the cache, overdraw and fetch passes and
+// rebuilds _geometry with only the data the draws use, each stream tightly packed.
+// Prints ACMR (misses per triangle) and ATVR (misses per vertex) of every mesh before and after.
+void OptimizeDrawList(DrawList& _list, std::vector<unsigned char>& _geometry)
+{
+	std::vector<unsigned char> output;
+	auto append = [&](const void* _data, size_t _size)
+		{
+			size_t offset = (output.size() + 15) & ~size_t(15);
+			output.resize(offset + _size);
+			if (_size)
+				memcpy(output.data() + offset, _data, _size);
+			return offset;
+		};
+
+	std::vector<VertexLayout> layouts;
+	std::map<size_t, size_t> constants; // stride 0 streams, old offset to new
+	// instances of a primitive share one optimized copy
+	typedef std::array<size_t, DRAW_ATTRIBUTE_COUNT + 3> PrimitiveKey;
+	std::map<PrimitiveKey, DrawItem> optimized;
+	std::map<int, VertexCacheStats> stats;
+	std::vector<DrawItem> draws;
+
+	for (const DrawItem& draw : _list.draws)
+	{
+		PrimitiveKey key;
+		for (int i = 0; i < DRAW_ATTRIBUTE_COUNT; i++)
+			key[i] = draw.vertexOffsets[i];
+		key[DRAW_ATTRIBUTE_COUNT] = draw.indexOffset;
+		key[DRAW_ATTRIBUTE_COUNT + 1] = draw.indexSize;
+		key[DRAW_ATTRIBUTE_COUNT + 2] = draw.count;
+		auto found = optimized.find(key);
+		if (found != optimized.end())
+		{
+			DrawItem instance = found->second;
+			instance.material = draw.material;
+			instance.instance = draw.instance;
+			draws.push_back(instance);
+			continue;
+		}
+
+		const VertexLayout& layout = _list.layouts[draw.layout];
+		bool valid = draw.vertexCount > 0;
+		for (int i = 0; i < DRAW_ATTRIBUTE_COUNT && valid; i++)
+		{
+			size_t elementSize = G_SMALLER(static_cast<size_t>(GetStreamElementSize(layout.streams[i])),
+				(layout.streams[i].stride > 0) ? static_cast<size_t>(layout.streams[i].stride) : size_t(16));
+			size_t end = draw.vertexOffsets[i] + static_cast<size_t>(draw.vertexCount - 1) * layout.streams[i].stride + elementSize;
+			valid = elementSize > 0 && end <= _geometry.size();
+		}
+
+		// indexed or not, the passes work on a 32 bit index list
+		std::vector<unsigned int> indices(draw.count);
+		if (valid && draw.indexSize != 0)
+		{
+			valid = draw.indexOffset + static_cast<size_t>(draw.count) * draw.indexSize <= _geometry.size();
+			for (size_t i = 0; i < draw.count && valid; i++)
+			{
+				if (draw.indexSize == 2)
+				{
+					unsigned short index;
+					memcpy(&index, _geometry.data() + draw.indexOffset + i * 2, 2);
+					indices[i] = index;
+				}
+				else
+					memcpy(&indices[i], _geometry.data() + draw.indexOffset + i * 4, 4);
+				valid = indices[i] < draw.vertexCount;
+			}
+		}
+		else
+			for (size_t i = 0; i < draw.count; i++)
+				indices[i] = static_cast<unsigned int>(i);
+		if (!valid)
+		{
+			printf("Skipping primitive of mesh %d, its accessors reach outside the geometry\n", draw.mesh);
+			continue;
+		}
+
+		DrawItem result = draw;
+		std::vector<unsigned int> remap;
+		unsigned int vertexCount = draw.vertexCount;
+		if (draw.indexSize != 0 && draw.count % 3 == 0)
+		{
+			VertexCacheStats& meshStats = stats[draw.mesh];
+			meshStats.triangles += draw.count / 3;
+			meshStats.vertices += CountUniqueVertices(indices.data(), indices.size(), draw.vertexCount);
+			meshStats.missesBefore += CountVertexCacheMisses(indices.data(), indices.size(), draw.vertexCount);
+
+			OptimizeVertexCache(indices.data(), indices.size(), draw.vertexCount);
+			const VertexStream& positions = layout.streams[0];
+			if (positions.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT && positions.type == TINYGLTF_TYPE_VEC3)
+				OptimizeOverdraw(indices.data(), indices.size(), draw.vertexCount,
+					reinterpret_cast<const float*>(_geometry.data() + draw.vertexOffsets[0]), positions.stride);
+			vertexCount = OptimizeVertexFetch(indices.data(), indices.size(), draw.vertexCount, remap);
+
+			meshStats.missesAfter += CountVertexCacheMisses(indices.data(), indices.size(), vertexCount);
+		}
+		else
+		{
+			// nothing shared between triangles, only the streams get packed
+			remap.resize(draw.vertexCount);
+			for (unsigned int i = 0; i < draw.vertexCount; i++)
+				remap[i] = i;
+		}
+
+		VertexLayout packed = layout;
+		for (int i = 0; i < DRAW_ATTRIBUTE_COUNT; i++)
+		{
+			const VertexStream& stream = layout.streams[i];
+			if (stream.stride == 0)
+			{
+				auto constant = constants.find(draw.vertexOffsets[i]);
+				if (constant == constants.end())
+					constant = constants.insert({ draw.vertexOffsets[i], append(_geometry.data() + draw.vertexOffsets[i], 16) }).first;
+				result.vertexOffsets[i] = constant->second;
+				continue;
+			}
+			unsigned int elementSize = GetStreamElementSize(stream);
+			std::vector<unsigned char> vertices(static_cast<size_t>(vertexCount) * elementSize, 0);
+			for (unsigned int v = 0; v < draw.vertexCount; v++)
+				if (remap[v] != ~0u)
+					memcpy(vertices.data() + static_cast<size_t>(remap[v]) * elementSize,
+						_geometry.data() + draw.vertexOffsets[i] + static_cast<size_t>(v) * stream.stride,
+						G_SMALLER(elementSize, stream.stride));
+			result.vertexOffsets[i] = append(vertices.data(), vertices.size());
+			packed.streams[i].stride = elementSize;
+		}
+		result.vertexCount = vertexCount;
+
+		if (draw.indexSize != 0)
+		{
+			// the remapped indices may now fit in 16 bits
+			if (vertexCount <= 0x10000)
+			{
+				std::vector<unsigned short> narrow(indices.begin(), indices.end());
+				result.indexOffset = append(narrow.data(), narrow.size() * sizeof(unsigned short));
+				result.indexSize = 2;
+			}
+			else
+			{
+				result.indexOffset = append(indices.data(), indices.size() * sizeof(unsigned int));
+				result.indexSize = 4;
+			}
+		}
+
+		result.layout = 0;
+		while (result.layout < layouts.size() && !(layouts[result.layout] == packed))
+			result.layout++;
+		if (result.layout == layouts.size())
+			layouts.push_back(packed);
+
+		optimized.insert({ key, result });
+		draws.push_back(result);
+	}
+
+	for (const std::pair<const int, VertexCacheStats>& mesh : stats)
+	{
+		const VertexCacheStats& s = mesh.second;
+		printf("Mesh %d: %u triangles, ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n", mesh.first, s.triangles,
+			s.missesBefore / float(s.triangles), s.missesAfter / float(s.triangles),
+			s.missesBefore / float(G_LARGER(s.vertices, 1u)), s.missesAfter / float(G_LARGER(s.vertices, 1u)));
+	}
+
+	_list.draws = draws;
+	_list.layouts = layouts;
+	_list.extraGeometry.clear();
+	_list.extraOffset = 0;
+	SortDrawList(_list);
+	_geometry.swap(output);
+}
+
+// Quantized layout: 16 bit positions dequantized per mesh, octahedral normal and tangent in 32 bits
+// each, half float uvs. The vertex shaders decode it when compiled with QUANTIZED_VERTICES.
+const VertexLayout QUANTIZED_VERTEX_LAYOUT = { {
+	{ 8, TINYGLTF_COMPONENT_TYPE_SHORT, TINYGLTF_TYPE_VEC3, true },
+	{ 4, TINYGLTF_COMPONENT_TYPE_SHORT, TINYGLTF_TYPE_VEC2, true },
+	{ 4, VERTEX_COMPONENT_TYPE_HALF_FLOAT, TINYGLTF_TYPE_VEC2, false },
+	{ 4, TINYGLTF_COMPONENT_TYPE_SHORT, TINYGLTF_TYPE_VEC2, true } } };
+
+// decodes one element of any glTF accessor to floats, normalized integers as the glTF spec defines them
+void ReadStreamElement(const VertexStream& _stream, const unsigned char* _element, float _out[4])
+{
+	int components = tinygltf::GetNumComponentsInType(_stream.type);
+	for (int i = 0; i < 4; i++)
+	{
+		if (i >= components)
+		{
+			_out[i] = (i == 3) ? 1.0f : 0.0f;
+			continue;
+		}
+		switch (_stream.componentType)
+		{
+		case TINYGLTF_COMPONENT_TYPE_FLOAT:
+			memcpy(&_out[i], _element + i * 4, 4);
+			break;
+		case TINYGLTF_COMPONENT_TYPE_BYTE:
+		{
+			float value = static_cast<signed char>(_element[i]);
+			_out[i] = (_stream.normalized) ? G_LARGER(value / 127.0f, -1.0f) : value;
+			break;
+		}
+		case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+			_out[i] = (_stream.normalized) ? _element[i] / 255.0f : _element[i];
+			break;
+		case TINYGLTF_COMPONENT_TYPE_SHORT:
+		{
+			short value;
+			memcpy(&value, _element + i * 2, 2);
+			_out[i] = (_stream.normalized) ? G_LARGER(value / 32767.0f, -1.0f) : value;
+			break;
+		}
+		case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+		{
+			unsigned short value;
+			memcpy(&value, _element + i * 2, 2);
+			_out[i] = (_stream.normalized) ? value / 65535.0f : value;
+			break;
+		}
+		default:
+			_out[i] = 0.0f;
+		}
+	}
+}
+
+short QuantizeSnorm16(float _value)
+{
+	return static_cast<short>(roundf(G_LARGER(-1.0f, G_SMALLER(1.0f, _value)) * 32767.0f));
+}
+
+// IEEE half, rounded to nearest and clamped to the largest finite half
+unsigned short QuantizeHalf(float _value)
+{
+	unsigned int bits;
+	memcpy(&bits, &_value, 4);
+	unsigned int sign = (bits >> 16) & 0x8000u;
+	float magnitude = fabsf(_value);
+	if (!(magnitude == magnitude))
+		return static_cast<unsigned short>(sign | 0x7e00u); // NaN
+	if (magnitude >= 65504.0f)
+		return static_cast<unsigned short>(sign | 0x7bffu);
+	if (magnitude < 6.103515625e-05f)
+		return static_cast<unsigned short>(sign | static_cast<unsigned int>(roundf(magnitude * 16777216.0f))); // subnormal
+	memcpy(&bits, &magnitude, 4);
+	bits += 0xfffu + ((bits >> 13) & 1u); // round the dropped mantissa bits to nearest even
+	return static_cast<unsigned short>(sign | ((bits - (112u << 23)) >> 13));
+}
+
+// folds a unit vector onto the octahedron and unfolds it into the [-1,1] square
+void EncodeOctahedral(const float _vector[3], float& _outX, float& _outY)
+{
+	float length = fabsf(_vector[0]) + fabsf(_vector[1]) + fabsf(_vector[2]);
+	if (length == 0)
+	{
+		_outX = 0;
+		_outY = 0;
+		return;
+	}
+	float x = _vector[0] / length, y = _vector[1] / length;
+	if (_vector[2] < 0)
+	{
+		float foldedX = (1 - fabsf(y)) * ((x >= 0) ? 1.0f : -1.0f);
+		y = (1 - fabsf(x)) * ((y >= 0) ? 1.0f : -1.0f);
+		x = foldedX;
+	}
+	_outX = x;
+	_outY = y;
+}
+
+// Rewrites every primitive of _list into QUANTIZED_VERTEX_LAYOUT and fills _list.dequantization.
+// The tangent's handedness lives in the sign of its y, y itself is remapped to [0,1] to make room.
+void QuantizeDrawList(DrawList& _list, std::vector<unsigned char>& _geometry)
+{
+	std::vector<unsigned char> output;
+	auto append = [&](const void* _data, size_t _size)
+		{
+			size_t offset = (output.size() + 15) & ~size_t(15);
+			output.resize(offset + _size);
+			if (_size)
+				memcpy(output.data() + offset, _data, _size);
+			return offset;
+		};
+	auto element = [&](const DrawItem& _draw, int _attribute, unsigned int _vertex, float _out[4])
+		{
+			const VertexStream& stream = _list.layouts[_draw.layout].streams[_attribute];
+			ReadStreamElement(stream, _geometry.data() + _draw.vertexOffsets[_attribute] + static_cast<size_t>(_vertex) * stream.stride, _out);
+		};
+
+	// every primitive of a mesh shares the mesh's bounds
+	int meshCount = 0;
+	for (const DrawItem& draw : _list.draws)
+		meshCount = G_LARGER(meshCount, draw.mesh + 1);
+	std::vector<GW::MATH::GVECTORF> minimum(meshCount, GW::MATH::GVECTORF{ FLT_MAX, FLT_MAX, FLT_MAX, 0 });
+	std::vector<GW::MATH::GVECTORF> maximum(meshCount, GW::MATH::GVECTORF{ -FLT_MAX, -FLT_MAX, -FLT_MAX, 0 });
+	for (const DrawItem& draw : _list.draws)
+		for (unsigned int v = 0; v < draw.vertexCount; v++)
+		{
+			float position[4];
+			element(draw, 0, v, position);
+			for (int i = 0; i < 3; i++)
+			{
+				minimum[draw.mesh].data[i] = G_SMALLER(minimum[draw.mesh].data[i], position[i]);
+				maximum[draw.mesh].data[i] = G_LARGER(maximum[draw.mesh].data[i], position[i]);
+			}
+		}
+	_list.dequantization.assign(meshCount, PositionDequantization{ { 1, 1, 1, 0 }, { 0, 0, 0, 0 } });
+	for (int mesh = 0; mesh < meshCount; mesh++)
+		if (minimum[mesh].x <= maximum[mesh].x)
+			for (int i = 0; i < 3; i++)
+			{
+				float extent = (maximum[mesh].data[i] - minimum[mesh].data[i]) * 0.5f;
+				_list.dequantization[mesh].scale.data[i] = (extent > 0) ? extent : 1.0f;
+				_list.dequantization[mesh].offset.data[i] = (maximum[mesh].data[i] + minimum[mesh].data[i]) * 0.5f;
+			}
+
+	typedef std::array<size_t, DRAW_ATTRIBUTE_COUNT + 1> StreamKey;
+	std::map<StreamKey, DrawItem> quantized; // instances share one copy
+	for (DrawItem& draw : _list.draws)
+	{
+		StreamKey key;
+		for (int i = 0; i < DRAW_ATTRIBUTE_COUNT; i++)
+			key[i] = draw.vertexOffsets[i];
+		key[DRAW_ATTRIBUTE_COUNT] = draw.indexOffset;
+		auto found = quantized.find(key);
+		if (found != quantized.end())
+		{
+			memcpy(draw.vertexOffsets, found->second.vertexOffsets, sizeof(draw.vertexOffsets));
+			draw.indexOffset = found->second.indexOffset;
+			draw.layout = 0;
+			continue;
+		}
+
+		const PositionDequantization& dequantization = _list.dequantization[draw.mesh];
+		std::vector<short> positions(draw.vertexCount * 4, 0);
+		std::vector<short> normals(draw.vertexCount * 2);
+		std::vector<unsigned short> uvs(draw.vertexCount * 2);
+		std::vector<short> tangents(draw.vertexCount * 2);
+		for (unsigned int v = 0; v < draw.vertexCount; v++)
+		{
+			float value[4], x, y;
+			element(draw, 0, v, value);
+			for (int i = 0; i < 3; i++)
+				positions[v * 4 + i] = QuantizeSnorm16((value[i] - dequantization.offset.data[i]) / dequantization.scale.data[i]);
+
+			element(draw, 1, v, value);
+			EncodeOctahedral(value, x, y);
+			normals[v * 2] = QuantizeSnorm16(x);
+			normals[v * 2 + 1] = QuantizeSnorm16(y);
+
+			element(draw, 2, v, value);
+			uvs[v * 2] = QuantizeHalf(value[0]);
+			uvs[v * 2 + 1] = QuantizeHalf(value[1]);
+
+			element(draw, 3, v, value);
+			EncodeOctahedral(value, x, y);
+			// never 0 so the sign always survives
+			y = G_LARGER(y * 0.5f + 0.5f, 1.0f / 32767.0f);
+			tangents[v * 2] = QuantizeSnorm16(x);
+			tangents[v * 2 + 1] = QuantizeSnorm16((value[3] < 0) ? -y : y);
+		}
+		draw.vertexOffsets[0] = append(positions.data(), positions.size() * sizeof(short));
+		draw.vertexOffsets[1] = append(normals.data(), normals.size() * sizeof(short));
+		draw.vertexOffsets[2] = append(uvs.data(), uvs.size() * sizeof(unsigned short));
+		draw.vertexOffsets[3] = append(tangents.data(), tangents.size() * sizeof(short));
+		if (draw.indexSize != 0)
+			draw.indexOffset = append(_geometry.data() + draw.indexOffset, static_cast<size_t>(draw.count) * draw.indexSize);
+		for (unsigned int i = 0; i < draw.lodCount; i++)
+		{
+			DrawLod& lod = _list.lods[draw.lodFirst + i];
+			lod.indexOffset = (i == 0) ? draw.indexOffset
+				: append(_geometry.data() + lod.indexOffset, static_cast<size_t>(lod.count) * draw.indexSize);
+		}
+		draw.layout = 0;
+		quantized.insert({ key, draw });
+	}
+
+	_list.layouts.assign(1, QUANTIZED_VERTEX_LAYOUT);
+	_list.extraGeometry.clear();
+	_list.extraOffset = 0;
+	SortDrawList(_list);
+	_geometry.swap(output);
+}
+
+#endif // !MESHOPTIMIZER_H
@@ -0,0 +1,329 @@
+#ifndef MESHLETUTILS_H
+#define MESHLETUTILS_H
+
+// Requires tinygltf.h, Gateware.h (MATH), ModelUtils.h and MeshOptimizer.h
+
+// Import time meshlets. The full resolution index list of every indexed primitive is cut into
+// small clusters of triangles, each with a bounding sphere and a cone bounding its normals. The
+// index list is already in vertex cache order so consecutive triangles are close together and a
+// meshlet is just a slice of it, the index data stays as it is.
+// At draw time CullDrawMeshlets drops clusters that are outside the frustum or face away from the
+// camera and merges what is left into as few index ranges as possible. It tests MESHLET_CULL_WIDTH
+// meshlets at a time from DrawList::meshletBounds, with SSE or NEON where the target has them.
+#include <cmath>
+#include <cfloat>
+#include <vector>
+#include <map>
+#include <array>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MESHLET_CULL_SSE
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define MESHLET_CULL_NEON
+#endif
+
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+#define MESHLET_MIN_COUNT 4 // primitives that make fewer meshlets than this are drawn whole
+#define MESHLET_CONE_MIN_SPREAD 0.1f // cosine of the widest normal a cone may keep before it stops culling
+#define MESHLET_CULL_WIDTH 4 // meshlets tested together, MeshletBounds is padded by one less
+
+// an index range that survived culling, ready for vkCmdDrawIndexed
+struct MeshletRange
+{
+	unsigned int firstIndex; // absolute, in indices
+	unsigned int count;
+};
+
+// Cuts _indices into meshlets and appends them to _outMeshlets, _positions holds 3 floats per vertex
+void BuildMeshlets(const std::vector<unsigned int>& _indices, const std::vector<float>& _positions, unsigned int _vertexCount,
+					std::vector<Meshlet>& _outMeshlets)
+{
+	std::vector<unsigned int> stamp(_vertexCount, ~0u); // meshlet that last used each vertex
+	std::vector<unsigned int> vertices;
+	vertices.reserve(MESHLET_MAX_VERTICES);
+
+	auto finish = [&](size_t _first, size_t _end)
+		{
+			Meshlet meshlet = {};
+			meshlet.firstIndex = static_cast<unsigned int>(_first);
+			meshlet.count = static_cast<unsigned int>(_end - _first);
+
+			// sphere around the cluster's box, then grown to reach every vertex
+			float minimum[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, maximum[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+			for (unsigned int v : vertices)
+				for (int k = 0; k < 3; k++)
+				{
+					minimum[k] = G_SMALLER(minimum[k], _positions[v * 3 + k]);
+					maximum[k] = G_LARGER(maximum[k], _positions[v * 3 + k]);
+				}
+			for (int k = 0; k < 3; k++)
+				meshlet.center[k] = (minimum[k] + maximum[k]) * 0.5f;
+			float radius = 0;
+			for (unsigned int v : vertices)
+			{
+				float dx = _positions[v * 3] - meshlet.center[0], dy = _positions[v * 3 + 1] - meshlet.center[1], dz = _positions[v * 3 + 2] - meshlet.center[2];
+				radius = G_LARGER(radius, dx * dx + dy * dy + dz * dz);
+			}
+			meshlet.radius = sqrtf(radius);
+
+			// the cone's axis is the average triangle normal, its spread the one furthest from it
+			std::vector<float> normals;
+			float axis[3] = { 0, 0, 0 };
+			for (size_t i = _first; i < _end; i += 3)
+			{
+				const float* a = &_positions[_indices[i] * 3];
+				const float* b = &_positions[_indices[i + 1] * 3];
+				const float* c = &_positions[_indices[i + 2] * 3];
+				float e0[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+				float e1[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+				float n[3] = { e0[1] * e1[2] - e0[2] * e1[1], e0[2] * e1[0] - e0[0] * e1[2], e0[0] * e1[1] - e0[1] * e1[0] };
+				float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+				if (length <= 0)
+					continue; // degenerate, it never shows anyway
+				for (int k = 0; k < 3; k++)
+				{
+					normals.push_back(n[k] / length);
+					axis[k] += n[k] / length;
+				}
+			}
+			float axisLength = sqrtf(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+			meshlet.coneCutoff = 1.0f;
+			if (axisLength > 0)
+			{
+				float spread = 1.0f;
+				for (size_t n = 0; n < normals.size(); n += 3)
+					spread = G_SMALLER(spread, (normals[n] * axis[0] + normals[n + 1] * axis[1] + normals[n + 2] * axis[2]) / axisLength);
+				for (int k = 0; k < 3; k++)
+					meshlet.coneAxis[k] = axis[k] / axisLength;
+				if (spread > MESHLET_CONE_MIN_SPREAD)
+					meshlet.coneCutoff = sqrtf(1.0f - spread * spread);
+			}
+			_outMeshlets.push_back(meshlet);
+		};
+
+	size_t first = 0;
+	unsigned int id = 0;
+	for (size_t i = 0; i + 2 < _indices.size(); i += 3)
+	{
+		unsigned int a = _indices[i], b = _indices[i + 1], c = _indices[i + 2];
+		size_t added = (stamp[a] != id) + (stamp[b] != id && b != a) + (stamp[c] != id && c != a && c != b);
+		if (vertices.size() + added > MESHLET_MAX_VERTICES || (i - first) / 3 >= MESHLET_MAX_TRIANGLES)
+		{
+			finish(first, i);
+			first = i;
+			vertices.clear();
+			id++;
+		}
+		for (int k = 0; k < 3; k++)
+			if (stamp[_indices[i + k]] != id)
+			{
+				stamp[_indices[i + k]] = id;
+				vertices.push_back(_indices[i + k]);
+			}
+	}
+	if (first < _indices.size())
+		finish(first, _indices.size());
+}
+
+// Splits the spheres and cones of _list.meshlets into _list.meshletBounds, the padding at the end
+// lets the last group of a draw read past its meshlets
+void BuildMeshletBounds(DrawList& _list)
+{
+	MeshletBounds& bounds = _list.meshletBounds;
+	std::vector<float>* arrays[8] = { &bounds.centerX, &bounds.centerY, &bounds.centerZ, &bounds.radius,
+		&bounds.axisX, &bounds.axisY, &bounds.axisZ, &bounds.cutoff };
+	for (std::vector<float>* array : arrays)
+		array->assign(_list.meshlets.size() + MESHLET_CULL_WIDTH - 1, 0.0f);
+	for (size_t m = 0; m < _list.meshlets.size(); m++)
+	{
+		const Meshlet& meshlet = _list.meshlets[m];
+		bounds.centerX[m] = meshlet.center[0];
+		bounds.centerY[m] = meshlet.center[1];
+		bounds.centerZ[m] = meshlet.center[2];
+		bounds.radius[m] = meshlet.radius;
+		bounds.axisX[m] = meshlet.coneAxis[0];
+		bounds.axisY[m] = meshlet.coneAxis[1];
+		bounds.axisZ[m] = meshlet.coneAxis[2];
+		bounds.cutoff[m] = meshlet.coneCutoff;
+	}
+}
+
+// Gives every indexed primitive of _list meshlets over its full resolution index list
+void BuildDrawMeshlets(DrawList& _list, const std::vector<unsigned char>& _geometry)
+{
+	std::map<std::array<size_t, DRAW_ATTRIBUTE_COUNT + 1>, DrawItem> built; // instances share the meshlets
+	for (DrawItem& draw : _list.draws)
+	{
+		std::array<size_t, DRAW_ATTRIBUTE_COUNT + 1> key;
+		for (int i = 0; i < DRAW_ATTRIBUTE_COUNT; i++)
+			key[i] = draw.vertexOffsets[i];
+		key[DRAW_ATTRIBUTE_COUNT] = draw.indexOffset;
+		auto found = built.find(key);
+		if (found != built.end())
+		{
+			draw.meshletFirst = found->second.meshletFirst;
+			draw.meshletCount = found->second.meshletCount;
+			continue;
+		}
+
+		draw.meshletFirst = static_cast<unsigned int>(_list.meshlets.size());
+		draw.meshletCount = 0;
+		if (draw.indexSize != 0 && draw.count % 3 == 0
+			&& draw.count / 3 >= MESHLET_MAX_TRIANGLES * MESHLET_MIN_COUNT)
+		{
+			const VertexLayout& layout = _list.layouts[draw.layout];
+			std::vector<float> positions(draw.vertexCount * 3);
+			for (unsigned int v = 0; v < draw.vertexCount; v++)
+			{
+				float value[4];
+				ReadStreamElement(layout.streams[0], _geometry.data() + draw.vertexOffsets[0] + static_cast<size_t>(v) * layout.streams[0].stride, value);
+				memcpy(&positions[v * 3], value, sizeof(float) * 3);
+			}
+			std::vector<unsigned int> indices(draw.count);
+			for (unsigned int i = 0; i < draw.count; i++)
+			{
+				if (draw.indexSize == 2)
+				{
+					unsigned short index;
+					memcpy(&index, _geometry.data() + draw.indexOffset + i * 2, 2);
+					indices[i] = index;
+				}
+				else
+					memcpy(&indices[i], _geometry.data() + draw.indexOffset + i * 4, 4);
+			}
+			BuildMeshlets(indices, positions, draw.vertexCount, _list.meshlets);
+			draw.meshletCount = static_cast<unsigned int>(_list.meshlets.size()) - draw.meshletFirst;
+		}
+		built.insert({ key, draw });
+	}
+}
+
+// Tests the MESHLET_CULL_WIDTH meshlets of _bounds starting at _first against the frustum _planes and
+// the camera at _camera, bit i of the result is set when meshlet _first + i may be visible
+unsigned int CullMeshletGroup(const MeshletBounds& _bounds, size_t _first, const float _planes[4][4], const float _camera[3])
+{
+#if defined(MESHLET_CULL_SSE)
+	__m128 x = _mm_loadu_ps(&_bounds.centerX[_first]), y = _mm_loadu_ps(&_bounds.centerY[_first]), z = _mm_loadu_ps(&_bounds.centerZ[_first]);
+	__m128 radius = _mm_loadu_ps(&_bounds.radius[_first]);
+	__m128 reach = _mm_sub_ps(_mm_setzero_ps(), radius);
+	__m128 visible = _mm_castsi128_ps(_mm_set1_epi32(-1));
+	for (int p = 0; p < 4; p++)
+	{
+		__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(_planes[p][0]), x), _mm_mul_ps(_mm_set1_ps(_planes[p][1]), y)),
+			_mm_add_ps(_mm_mul_ps(_mm_set1_ps(_planes[p][2]), z), _mm_set1_ps(_planes[p][3])));
+		visible = _mm_and_ps(visible, _mm_cmpge_ps(distance, reach));
+	}
+	// every triangle faces away when the camera sits inside the cone behind the cluster
+	x = _mm_sub_ps(x, _mm_set1_ps(_camera[0]));
+	y = _mm_sub_ps(y, _mm_set1_ps(_camera[1]));
+	z = _mm_sub_ps(z, _mm_set1_ps(_camera[2]));
+	__m128 distance = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+	__m128 facing = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_loadu_ps(&_bounds.axisX[_first])), _mm_mul_ps(y, _mm_loadu_ps(&_bounds.axisY[_first]))),
+		_mm_mul_ps(z, _mm_loadu_ps(&_bounds.axisZ[_first])));
+	__m128 behind = _mm_cmpge_ps(facing, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&_bounds.cutoff[_first]), distance), radius));
+	return static_cast<unsigned int>(_mm_movemask_ps(_mm_andnot_ps(behind, visible)));
+#elif defined(MESHLET_CULL_NEON)
+	float32x4_t x = vld1q_f32(&_bounds.centerX[_first]), y = vld1q_f32(&_bounds.centerY[_first]), z = vld1q_f32(&_bounds.centerZ[_first]);
+	float32x4_t radius = vld1q_f32(&_bounds.radius[_first]);
+	float32x4_t reach = vnegq_f32(radius);
+	uint32x4_t visible = vdupq_n_u32(~0u);
+	for (int p = 0; p < 4; p++)
+	{
+		float32x4_t distance = vmlaq_n_f32(vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(_planes[p][3]), x, _planes[p][0]), y, _planes[p][1]), z, _planes[p][2]);
+		visible = vandq_u32(visible, vcgeq_f32(distance, reach));
+	}
+	// every triangle faces away when the camera sits inside the cone behind the cluster
+	x = vsubq_f32(x, vdupq_n_f32(_camera[0]));
+	y = vsubq_f32(y, vdupq_n_f32(_camera[1]));
+	z = vsubq_f32(z, vdupq_n_f32(_camera[2]));
+	float32x4_t distance = vsqrtq_f32(vmlaq_f32(vmlaq_f32(vmulq_f32(x, x), y, y), z, z));
+	float32x4_t facing = vmlaq_f32(vmlaq_f32(vmulq_f32(x, vld1q_f32(&_bounds.axisX[_first])), y, vld1q_f32(&_bounds.axisY[_first])),
+		z, vld1q_f32(&_bounds.axisZ[_first]));
+	uint32x4_t behind = vcgeq_f32(facing, vmlaq_f32(radius, vld1q_f32(&_bounds.cutoff[_first]), distance));
+	static const uint32_t bits[4] = { 1, 2, 4, 8 };
+	return vaddvq_u32(vandq_u32(vbicq_u32(visible, behind), vld1q_u32(bits)));
+#else
+	unsigned int mask = 0;
+	for (unsigned int i = 0; i < MESHLET_CULL_WIDTH; i++)
+	{
+		size_t m = _first + i;
+		bool visible = true;
+		for (int p = 0; p < 4 && visible; p++)
+			visible = _planes[p][0] * _bounds.centerX[m] + _planes[p][1] * _bounds.centerY[m] + _planes[p][2] * _bounds.centerZ[m]
+				+ _planes[p][3] >= -_bounds.radius[m];
+
+		// every triangle faces away when the camera sits inside the cone behind the cluster
+		float toCenter[3] = { _bounds.centerX[m] - _camera[0], _bounds.centerY[m] - _camera[1], _bounds.centerZ[m] - _camera[2] };
+		float distance = sqrtf(toCenter[0] * toCenter[0] + toCenter[1] * toCenter[1] + toCenter[2] * toCenter[2]);
+		if (visible && toCenter[0] * _bounds.axisX[m] + toCenter[1] * _bounds.axisY[m] + toCenter[2] * _bounds.axisZ[m]
+			>= _bounds.cutoff[m] * distance + _bounds.radius[m])
+			visible = false;
+		if (visible)
+			mask |= 1u << i;
+	}
+	return mask;
+#endif
+}
+
+// Appends the index ranges of _draw's meshlets that can be seen to _outRanges, adjacent survivors
+// are merged into one range. Culling happens in mesh space so it holds for any _world, mirrored or not.
+void CullDrawMeshlets(const DrawList& _list, const DrawItem& _draw, const GW::MATH::GMATRIXF& _world,
+						const GW::MATH::GMATRIXF& _view, const GW::MATH::GMATRIXF& _projection, std::vector<MeshletRange>& _outRanges)
+{
+	unsigned int base = static_cast<unsigned int>(_draw.indexOffset / _draw.indexSize);
+	if (_draw.meshletCount == 0)
+	{
+		_outRanges.push_back({ base, _draw.count });
+		return;
+	}
+
+	// camera position in mesh space
+	GW::MATH::GMATRIXF worldView, toMesh;
+	GW::MATH::GMatrix::MultiplyMatrixF(_world, _view, worldView);
+	GW::MATH::GMatrix::InverseF(worldView, toMesh);
+	const float camera[3] = { toMesh.row4.x, toMesh.row4.y, toMesh.row4.z };
+
+	// left, right, bottom and top planes of the frustum in mesh space, near and far are left to the rasterizer
+	GW::MATH::GMATRIXF clip;
+	GW::MATH::GMatrix::MultiplyMatrixF(worldView, _projection, clip);
+	float planes[4][4];
+	for (int p = 0; p < 4; p++)
+	{
+		int column = p / 2;
+		float sign = (p % 2 == 0) ? 1.0f : -1.0f;
+		float length = 0;
+		for (int row = 0; row < 4; row++)
+		{
+			planes[p][row] = clip.data[row * 4 + 3] + sign * clip.data[row * 4 + column];
+			if (row < 3)
+				length += planes[p][row] * planes[p][row];
+		}
+		length = (length > 0) ? 1.0f / sqrtf(length) : 0.0f;
+		for (int row = 0; row < 4; row++)
+			planes[p][row] *= length;
+	}
+
+	const Meshlet* meshlets = _list.meshlets.data() + _draw.meshletFirst;
+	size_t open = _outRanges.size(); // range the next visible meshlet may extend
+	for (unsigned int group = 0; group < _draw.meshletCount; group += MESHLET_CULL_WIDTH)
+	{
+		unsigned int visible = CullMeshletGroup(_list.meshletBounds, _draw.meshletFirst + group, planes, camera);
+		unsigned int last = G_SMALLER(group + MESHLET_CULL_WIDTH, _draw.meshletCount);
+		for (unsigned int m = group; m < last; m++)
+		{
+			if ((visible & (1u << (m - group))) == 0)
+			{
+				open = _outRanges.size();
+				continue;
+			}
+			if (open < _outRanges.size())
+				_outRanges[open].count += meshlets[m].count;
+			else
+				_outRanges.push_back({ base + meshlets[m].firstIndex, meshlets[m].count });
+		}
+	}
+}
+
+#endif // !MESHLETUTILS_H
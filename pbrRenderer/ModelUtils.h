@@ -0,0 +1,657 @@
+#ifndef MODELUTILS_H
+#define MODELUTILS_H
+
+// Requires tinygltf.h, Gateware.h (MATH) and MappedFile.h
+
+// Where the bytes of every glTF buffer live once a model is loaded.
+// Mapped loads point straight into the .glb/.bin files, otherwise into model.buffers[i].data.
+struct ModelBuffers
+{
+	std::vector<MappedFile> files; // keeps the mappings alive
+	std::vector<const unsigned char*> data; // one entry per model.buffers
+	std::vector<size_t> sizes;
+};
+
+// prefix used to hand embedded .glb images to TinyGLTF through the file system callbacks
+#define MAPPED_IMAGE_URI "__mapped_glb_image_"
+
+struct MappedImageSources
+{
+	std::vector<const unsigned char*> data; // one entry per model.images, nullptr if not embedded
+	std::vector<size_t> sizes;
+};
+
+int FindMappedImage(const std::string& _path, const MappedImageSources* _sources)
+{
+	size_t found = _path.rfind(MAPPED_IMAGE_URI);
+	if (found == std::string::npos)
+		return -1;
+	int index = atoi(_path.c_str() + found + strlen(MAPPED_IMAGE_URI));
+	if (index < 0 || index >= static_cast<int>(_sources->data.size()) || _sources->data[index] == nullptr)
+		return -1;
+	return index;
+}
+
+bool MappedFileExists(const std::string& _path, void* _user)
+{
+	if (FindMappedImage(_path, static_cast<MappedImageSources*>(_user)) >= 0)
+		return true;
+	return tinygltf::FileExists(_path, nullptr);
+}
+
+bool MappedReadWholeFile(std::vector<unsigned char>* _out, std::string* _err, const std::string& _path, void* _user)
+{
+	const MappedImageSources* sources = static_cast<MappedImageSources*>(_user);
+	int index = FindMappedImage(_path, sources);
+	if (index < 0)
+		return tinygltf::ReadWholeFile(_out, _err, _path, nullptr);
+	// only the (compressed) image bytes are copied, stb needs them while decoding anyway
+	_out->assign(sources->data[index], sources->data[index] + sources->sizes[index]);
+	return true;
+}
+
+bool MappedGetFileSize(size_t* _size, std::string* _err, const std::string& _path, void* _user)
+{
+	const MappedImageSources* sources = static_cast<MappedImageSources*>(_user);
+	int index = FindMappedImage(_path, sources);
+	if (index < 0)
+		return tinygltf::GetFileSizeInBytes(_size, _err, _path, nullptr);
+	*_size = sources->sizes[index];
+	return true;
+}
+
+std::string GetModelDirectory(const std::string& _path)
+{
+	size_t slash = _path.find_last_of("/\\");
+	return (slash == std::string::npos) ? std::string() : _path.substr(0, slash + 1);
+}
+
+bool HasExtension(const std::string& _path, const char* _ext)
+{
+	size_t length = strlen(_ext);
+	if (_path.size() < length)
+		return false;
+	for (size_t i = 0; i < length; i++)
+		if (tolower(_path[_path.size() - length + i]) != _ext[i])
+			return false;
+	return true;
+}
+
+// Parses only the JSON of a .gltf/.glb with TinyGLTF while the geometry stays in the mapped files.
+// Buffers are swapped for a one byte placeholder so TinyGLTF never allocates or copies them.
+bool LoadMappedGLTF(tinygltf::TinyGLTF& _loader, tinygltf::Model& _model, ModelBuffers& _outBuffers,
+					std::string& _err, std::string& _warn, const std::string& _path)
+{
+	MappedFile source;
+	if (!source.Open(_path))
+	{
+		_err = "Failed to map \"" + _path + "\"\n";
+		return false;
+	}
+
+	const unsigned char* json = source.data;
+	size_t jsonSize = source.size;
+	const unsigned char* bin = nullptr;
+	size_t binSize = 0;
+
+	if (HasExtension(_path, ".glb"))
+	{
+		// 12 byte header followed by a JSON chunk and an optional BIN chunk
+		uint32_t header[5] = {};
+		if (source.size < sizeof(header))
+		{
+			_err = "GLB file too small\n";
+			return false;
+		}
+		memcpy(header, source.data, sizeof(header));
+		if (header[0] != 0x46546C67 || header[1] != 2 || header[2] > source.size || header[4] != 0x4E4F534A)
+		{
+			_err = "Invalid GLB header\n";
+			return false;
+		}
+		json = source.data + 20;
+		jsonSize = header[3];
+		size_t binChunk = 20 + static_cast<size_t>(header[3]);
+		if (jsonSize > source.size - 20)
+		{
+			_err = "Invalid GLB JSON chunk\n";
+			return false;
+		}
+		if (binChunk + 8 <= header[2])
+		{
+			uint32_t chunk[2] = {};
+			memcpy(chunk, source.data + binChunk, sizeof(chunk));
+			if (chunk[1] == 0x004E4942 && binChunk + 8 + chunk[0] <= header[2])
+			{
+				bin = source.data + binChunk + 8;
+				binSize = chunk[0];
+			}
+		}
+	}
+
+	nlohmann::json document = nlohmann::json::parse(json, json + jsonSize, nullptr, false);
+	if (document.is_discarded() || !document.is_object())
+	{
+		_err = "Failed to parse glTF JSON\n";
+		return false;
+	}
+
+	std::string directory = GetModelDirectory(_path);
+	size_t bufferCount = document.contains("buffers") ? document["buffers"].size() : 0;
+	_outBuffers = ModelBuffers();
+	_outBuffers.data.resize(bufferCount, nullptr);
+	_outBuffers.sizes.resize(bufferCount, 0);
+
+	std::vector<bool> mapped(bufferCount, false);
+	std::vector<std::string> uris(bufferCount);
+	for (size_t i = 0; i < bufferCount; i++)
+	{
+		nlohmann::json& buffer = document["buffers"][i];
+		size_t byteLength = buffer.value("byteLength", size_t(0));
+		std::string uri = buffer.value("uri", std::string());
+		uris[i] = uri;
+
+		if (uri.compare(0, 5, "data:") == 0)
+			continue; // base64 buffers can only be decoded onto the heap, leave them to TinyGLTF
+
+		const unsigned char* bytes = nullptr;
+		size_t available = 0;
+		if (uri.empty())
+		{
+			bytes = bin;
+			available = binSize;
+		}
+		else
+		{
+			MappedFile external;
+			if (!external.Open(directory + uri))
+			{
+				_err = "Failed to map buffer \"" + directory + uri + "\"\n";
+				return false;
+			}
+			bytes = external.data;
+			available = external.size;
+			_outBuffers.files.push_back(std::move(external));
+		}
+
+		if (bytes == nullptr || byteLength > available)
+		{
+			_err = "Buffer " + std::to_string(i) + " is larger than its binary data\n";
+			return false;
+		}
+
+		_outBuffers.data[i] = bytes;
+		_outBuffers.sizes[i] = byteLength;
+		mapped[i] = true;
+		buffer["byteLength"] = 1;
+		buffer["uri"] = "data:application/octet-stream;base64,AA==";
+	}
+
+	// images embedded in a buffer view would make TinyGLTF read the placeholder buffers
+	MappedImageSources images;
+	size_t imageCount = document.contains("images") ? document["images"].size() : 0;
+	images.data.resize(imageCount, nullptr);
+	images.sizes.resize(imageCount, 0);
+	for (size_t i = 0; i < imageCount; i++)
+	{
+		nlohmann::json& image = document["images"][i];
+		if (!image.contains("bufferView") || !document.contains("bufferViews")
+			|| image["bufferView"].get<size_t>() >= document["bufferViews"].size())
+			continue;
+		const nlohmann::json& view = document["bufferViews"][image["bufferView"].get<size_t>()];
+		size_t buffer = view.value("buffer", size_t(0));
+		if (buffer >= bufferCount || !mapped[buffer])
+			continue;
+		images.data[i] = _outBuffers.data[buffer] + view.value("byteOffset", size_t(0));
+		images.sizes[i] = view.value("byteLength", size_t(0));
+		image.erase("bufferView");
+		image.erase("mimeType");
+		image["uri"] = MAPPED_IMAGE_URI + std::to_string(i);
+	}
+
+	std::string rewritten = document.dump();
+	document = nlohmann::json(); // the parsed tree is no longer needed
+
+	tinygltf::FsCallbacks mappedCallbacks = { &MappedFileExists, &tinygltf::ExpandFilePath,
+		&MappedReadWholeFile, &tinygltf::WriteWholeFile, &MappedGetFileSize, &images };
+	tinygltf::FsCallbacks defaultCallbacks = { &tinygltf::FileExists, &tinygltf::ExpandFilePath,
+		&tinygltf::ReadWholeFile, &tinygltf::WriteWholeFile, &tinygltf::GetFileSizeInBytes, nullptr };
+
+	_loader.SetFsCallbacks(mappedCallbacks);
+	bool ret = _loader.LoadASCIIFromString(&_model, &_err, &_warn, rewritten.c_str(),
+		static_cast<unsigned int>(rewritten.size()), directory);
+	_loader.SetFsCallbacks(defaultCallbacks);
+
+	if (!ret)
+		return false;
+
+	// drop the placeholders, restore their uris and point the remaining (data uri) buffers at TinyGLTF's copies
+	for (size_t i = 0; i < _model.buffers.size() && i < bufferCount; i++)
+	{
+		if (mapped[i])
+		{
+			_model.buffers[i].data.clear();
+			_model.buffers[i].data.shrink_to_fit();
+			_model.buffers[i].uri = uris[i];
+		}
+		else
+		{
+			_outBuffers.data[i] = _model.buffers[i].data.data();
+			_outBuffers.sizes[i] = _model.buffers[i].data.size();
+		}
+	}
+	for (size_t i = 0; i < _model.images.size() && i < imageCount; i++)
+		if (images.data[i])
+			_model.images[i].uri.clear();
+
+	// the .gltf JSON itself is not needed, a .glb must stay mapped for its BIN chunk
+	if (bin)
+		_outBuffers.files.push_back(std::move(source));
+	return true;
+}
+
+// Loads a .gltf or .glb, memory mapping its binary data when _mapped is set
+bool LoadModel(tinygltf::TinyGLTF& _loader, tinygltf::Model& _model, ModelBuffers& _outBuffers,
+				std::string& _err, std::string& _warn, const std::string& _path, bool _mapped)
+{
+	if (_mapped)
+		return LoadMappedGLTF(_loader, _model, _outBuffers, _err, _warn, _path);
+
+	bool ret = HasExtension(_path, ".glb")
+		? _loader.LoadBinaryFromFile(&_model, &_err, &_warn, _path)
+		: _loader.LoadASCIIFromFile(&_model, &_err, &_warn, _path);
+
+	_outBuffers = ModelBuffers();
+	for (size_t i = 0; i < _model.buffers.size(); i++)
+	{
+		_outBuffers.data.push_back(_model.buffers[i].data.data());
+		_outBuffers.sizes.push_back(_model.buffers[i].data.size());
+	}
+	return ret;
+}
+
+// Places every glTF buffer in one geometry buffer, returns the total size.
+// Buffer view and accessor offsets stay valid relative to _outBufferOffsets[view.buffer].
+size_t LayoutModelBuffers(const ModelBuffers& _buffers, std::vector<size_t>& _outBufferOffsets)
+{
+	size_t total = 0;
+	_outBufferOffsets.resize(_buffers.sizes.size());
+	for (size_t i = 0; i < _buffers.sizes.size(); i++)
+	{
+		_outBufferOffsets[i] = total;
+		total += (_buffers.sizes[i] + 15) & ~size_t(15); // keep every buffer 16 byte aligned
+	}
+	return total;
+}
+
+// Copies the buffer views used by accessors straight from the source buffers into _dst,
+// skipping views that only hold images
+void CopyModelBufferViews(const tinygltf::Model& _model, const ModelBuffers& _buffers,
+						const std::vector<size_t>& _bufferOffsets, unsigned char* _dst)
+{
+	std::vector<bool> used(_model.bufferViews.size(), false);
+	for (const tinygltf::Accessor& accessor : _model.accessors)
+		if (accessor.bufferView >= 0)
+			used[accessor.bufferView] = true;
+
+	for (size_t i = 0; i < _model.bufferViews.size(); i++)
+	{
+		const tinygltf::BufferView& view = _model.bufferViews[i];
+		if (!used[i] || view.buffer < 0 || view.buffer >= static_cast<int>(_buffers.data.size()))
+			continue;
+		if (_buffers.data[view.buffer] == nullptr || view.byteOffset + view.byteLength > _buffers.sizes[view.buffer])
+			continue;
+		memcpy(_dst + _bufferOffsets[view.buffer] + view.byteOffset,
+			_buffers.data[view.buffer] + view.byteOffset, view.byteLength);
+	}
+}
+
+// Vertex streams every pipeline in these samples consumes, in binding/location order
+#define DRAW_ATTRIBUTE_COUNT 4
+const char* const DRAW_ATTRIBUTES[DRAW_ATTRIBUTE_COUNT] = { "POSITION", "NORMAL", "TEXCOORD_0", "TANGENT" };
+
+// GL_HALF_FLOAT, glTF has no 16 bit float so only cooked quantized streams use it
+#define VERTEX_COMPONENT_TYPE_HALF_FLOAT 5131
+
+// bytes per component of a VertexStream::componentType, -1 if unknown
+int GetVertexComponentSize(int _componentType)
+{
+	return (_componentType == VERTEX_COMPONENT_TYPE_HALF_FLOAT) ? 2 : tinygltf::GetComponentSizeInBytes(_componentType);
+}
+
+// How one attribute is laid out in the geometry buffer, a missing attribute reads a constant with stride 0
+struct VertexStream
+{
+	unsigned int stride;
+	int componentType; // TINYGLTF_COMPONENT_TYPE_* or VERTEX_COMPONENT_TYPE_HALF_FLOAT
+	int type; // TINYGLTF_TYPE_*
+	bool normalized;
+
+	bool operator==(const VertexStream& _other) const
+	{
+		return stride == _other.stride && componentType == _other.componentType
+			&& type == _other.type && normalized == _other.normalized;
+	}
+};
+
+// Every unique layout needs its own pipeline
+struct VertexLayout
+{
+	VertexStream streams[DRAW_ATTRIBUTE_COUNT];
+
+	bool operator==(const VertexLayout& _other) const
+	{
+		for (int i = 0; i < DRAW_ATTRIBUTE_COUNT; i++)
+			if (!(streams[i] == _other.streams[i]))
+				return false;
+		return true;
+	}
+};
+
+// One glTF primitive placed in the scene by one node
+struct DrawItem
+{
+	size_t vertexOffsets[DRAW_ATTRIBUTE_COUNT]; // byte offsets into the geometry buffer
+	size_t indexOffset; // byte offset into the geometry buffer
+	unsigned int indexSize; // 2 or 4 bytes, 0 for non indexed primitives
+	unsigned int count; // index count, or vertex count when not indexed
+	unsigned int vertexCount; // vertices the primitive's streams hold
+	int mesh; // index into model.meshes
+	float center[3]; // bounding sphere in mesh space
+	float radius;
+	unsigned int lodFirst; // index into DrawList::lods
+	unsigned int lodCount; // 0 for non indexed primitives
+	unsigned int meshletFirst; // index into DrawList::meshlets
+	unsigned int meshletCount; // 0 when the primitive is drawn whole
+	int material; // -1 when the primitive has none
+	unsigned int instance; // index into DrawList::worldMatrices
+	unsigned int layout; // index into DrawList::layouts
+};
+
+// image indices of a material's textures, -1 when it has none
+struct MaterialTextures
+{
+	int baseColor;
+	int metallicRoughness;
+	int normal;
+	int emissive;
+	float alphaCutoff; // pixels with less base color alpha are discarded, negative unless the alpha mode is MASK
+};
+
+// One LOD of a primitive, an index list over the same vertices as the full resolution one
+struct DrawLod
+{
+	size_t indexOffset; // byte offset into the geometry buffer
+	unsigned int count;
+	float error; // largest distance the LOD strays from the full mesh, in mesh units
+};
+
+// a slice of a primitive's full resolution index list
+struct Meshlet
+{
+	unsigned int firstIndex; // relative to the draw's indexOffset, in indices
+	unsigned int count; // index count
+	float center[3]; // bounding sphere in mesh space
+	float radius;
+	float coneAxis[3]; // average facing of the triangles
+	float coneCutoff; // sine of the cone's half angle, 1 when the cluster can't be back face culled
+};
+
+// the spheres and cones of DrawList::meshlets with one array per component, so culling reads
+// several meshlets per SIMD load. Rebuilt from the meshlets on load, it is never cooked.
+struct MeshletBounds
+{
+	std::vector<float> centerX, centerY, centerZ, radius;
+	std::vector<float> axisX, axisY, axisZ, cutoff;
+};
+
+// quantized positions decode as position * scale + offset
+struct PositionDequantization
+{
+	GW::MATH::GVECTORF scale;
+	GW::MATH::GVECTORF offset;
+};
+
+// Flattened scene built once at load time
+struct DrawList
+{
+	std::vector<DrawItem> draws;
+	std::vector<GW::MATH::GMATRIXF> worldMatrices;
+	std::vector<VertexLayout> layouts;
+	std::vector<MaterialTextures> materials; // one entry per model.materials
+	std::vector<PositionDequantization> dequantization; // one entry per model.meshes, empty unless quantized
+	std::vector<DrawLod> lods; // LOD chains of the draws, finest first
+	std::vector<Meshlet> meshlets; // clusters of the draws' full resolution index lists
+	MeshletBounds meshletBounds; // culling data of meshlets, see BuildMeshletBounds
+	// data the glTF buffers don't have, appended to the geometry buffer at extraOffset
+	std::vector<unsigned char> extraGeometry;
+	size_t extraOffset = 0;
+};
+
+// identity when the positions are not quantized
+PositionDequantization GetDequantization(const DrawList& _list, int _mesh)
+{
+	if (_mesh < 0 || _mesh >= static_cast<int>(_list.dequantization.size()))
+		return PositionDequantization{ { 1, 1, 1, 0 }, { 0, 0, 0, 0 } };
+	return _list.dequantization[_mesh];
+}
+
+// Local transform of a node, glTF is column major so its matrices read as row major are
+// exactly what our row vector math expects
+GW::MATH::GMATRIXF GetNodeMatrix(const tinygltf::Node& _node)
+{
+	GW::MATH::GMATRIXF local = GW::MATH::GIdentityMatrixF;
+	if (_node.matrix.size() == 16)
+	{
+		for (int i = 0; i < 16; i++)
+			local.data[i] = static_cast<float>(_node.matrix[i]);
+		return local;
+	}
+
+	// glTF applies scale, then rotation, then translation
+	if (_node.scale.size() == 3)
+		GW::MATH::GMatrix::ScaleGlobalF(local, GW::MATH::GVECTORF{ static_cast<float>(_node.scale[0]),
+			static_cast<float>(_node.scale[1]), static_cast<float>(_node.scale[2]), 0 }, local);
+	if (_node.rotation.size() == 4)
+	{
+		// ConvertQuaternionF builds a column vector matrix, the conjugate gives us the row vector one
+		GW::MATH::GQUATERNIONF rotation = { -static_cast<float>(_node.rotation[0]), -static_cast<float>(_node.rotation[1]),
+			-static_cast<float>(_node.rotation[2]), static_cast<float>(_node.rotation[3]) };
+		GW::MATH::GMATRIXF rotationMatrix;
+		GW::MATH::GMatrix::ConvertQuaternionF(rotation, rotationMatrix);
+		GW::MATH::GMatrix::MultiplyMatrixF(local, rotationMatrix, local);
+	}
+	if (_node.translation.size() == 3)
+	{
+		local.row4.x += static_cast<float>(_node.translation[0]);
+		local.row4.y += static_cast<float>(_node.translation[1]);
+		local.row4.z += static_cast<float>(_node.translation[2]);
+	}
+	return local;
+}
+
+// image index of a glTF texture, -1 if there is none
+int GetTextureImage(const tinygltf::Model& _model, int _texture)
+{
+	if (_texture < 0 || _texture >= static_cast<int>(_model.textures.size()))
+		return -1;
+	return _model.textures[_texture].source;
+}
+
+unsigned int AppendExtraGeometry(DrawList& _list, const void* _data, size_t _size)
+{
+	size_t offset = (_list.extraGeometry.size() + 15) & ~size_t(15);
+	_list.extraGeometry.resize(offset + _size);
+	memcpy(_list.extraGeometry.data() + offset, _data, _size);
+	return static_cast<unsigned int>(offset);
+}
+
+// sort so consecutive draws share as much bound state as possible
+void SortDrawList(DrawList& _list)
+{
+	std::sort(_list.draws.begin(), _list.draws.end(), [](const DrawItem& _a, const DrawItem& _b)
+		{
+			if (_a.layout != _b.layout)
+				return _a.layout < _b.layout;
+			if (_a.material != _b.material)
+				return _a.material < _b.material;
+			if (_a.vertexOffsets[0] != _b.vertexOffsets[0])
+				return _a.vertexOffsets[0] < _b.vertexOffsets[0];
+			return _a.indexSize < _b.indexSize;
+		});
+}
+
+// Adds a draw for every triangle primitive of _mesh placed with _world
+void AddMeshDraws(const tinygltf::Model& _model, const ModelBuffers& _buffers, const std::vector<size_t>& _bufferOffsets,
+				int _mesh, const GW::MATH::GMATRIXF& _world, const size_t* _defaults, DrawList& _outList)
+{
+	unsigned int instance = static_cast<unsigned int>(_outList.worldMatrices.size());
+	bool instanceUsed = false;
+
+	for (const tinygltf::Primitive& primitive : _model.meshes[_mesh].primitives)
+	{
+		if (primitive.mode != TINYGLTF_MODE_TRIANGLES && primitive.mode != -1)
+			continue; // only triangle lists have a pipeline
+
+		DrawItem draw = {};
+		VertexLayout layout = {};
+		bool valid = true;
+		for (int i = 0; i < DRAW_ATTRIBUTE_COUNT; i++)
+		{
+			auto attribute = primitive.attributes.find(DRAW_ATTRIBUTES[i]);
+			const tinygltf::Accessor* accessor = (attribute != primitive.attributes.end())
+				? &_model.accessors[attribute->second] : nullptr;
+			if (accessor == nullptr || accessor->bufferView < 0 || accessor->sparse.isSparse)
+			{
+				if (i == 0)
+					valid = false; // nothing to draw without positions
+				// read the constant default for this attribute
+				draw.vertexOffsets[i] = _outList.extraOffset + _defaults[i];
+				layout.streams[i] = { 0, TINYGLTF_COMPONENT_TYPE_FLOAT, (i == 2) ? TINYGLTF_TYPE_VEC2
+					: (i == 3) ? TINYGLTF_TYPE_VEC4 : TINYGLTF_TYPE_VEC3, false };
+				continue;
+			}
+
+			const tinygltf::BufferView& view = _model.bufferViews[accessor->bufferView];
+			int stride = accessor->ByteStride(view);
+			if (stride <= 0)
+			{
+				valid = false;
+				break;
+			}
+			draw.vertexOffsets[i] = _bufferOffsets[view.buffer] + view.byteOffset + accessor->byteOffset;
+			layout.streams[i] = { static_cast<unsigned int>(stride), accessor->componentType, accessor->type, accessor->normalized };
+			if (i == 0)
+				draw.count = draw.vertexCount = static_cast<unsigned int>(accessor->count);
+		}
+		if (!valid)
+			continue;
+
+		if (primitive.indices >= 0)
+		{
+			const tinygltf::Accessor& indices = _model.accessors[primitive.indices];
+			if (indices.bufferView < 0)
+				continue;
+			const tinygltf::BufferView& view = _model.bufferViews[indices.bufferView];
+			size_t offset = _bufferOffsets[view.buffer] + view.byteOffset + indices.byteOffset;
+			draw.count = static_cast<unsigned int>(indices.count);
+
+			if (indices.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE)
+			{
+				// 8 bit indices need an extension, widen them once here instead
+				const unsigned char* source = _buffers.data[view.buffer];
+				if (source == nullptr)
+					continue;
+				source += view.byteOffset + indices.byteOffset;
+				int stride = indices.ByteStride(view);
+				std::vector<unsigned short> widened(indices.count);
+				for (size_t i = 0; i < indices.count; i++)
+					widened[i] = source[i * stride];
+				offset = _outList.extraOffset + AppendExtraGeometry(_outList, widened.data(), widened.size() * sizeof(unsigned short));
+				draw.indexSize = 2;
+			}
+			else
+				draw.indexSize = (indices.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT) ? 4 : 2;
+			draw.indexOffset = offset;
+		}
+
+		draw.mesh = _mesh;
+		draw.material = primitive.material;
+		draw.instance = instance;
+		instanceUsed = true;
+
+		draw.layout = 0;
+		while (draw.layout < _outList.layouts.size() && !(_outList.layouts[draw.layout] == layout))
+			draw.layout++;
+		if (draw.layout == _outList.layouts.size())
+			_outList.layouts.push_back(layout);
+
+		_outList.draws.push_back(draw);
+	}
+
+	if (instanceUsed)
+		_outList.worldMatrices.push_back(_world);
+}
+
+// Walks the default scene and flattens every mesh, primitive and node into one list of draws.
+// _geometrySize is where the glTF buffers end, returns the geometry size including the extra data.
+size_t BuildDrawList(const tinygltf::Model& _model, const ModelBuffers& _buffers, const std::vector<size_t>& _bufferOffsets,
+					size_t _geometrySize, const GW::MATH::GMATRIXF& _root, DrawList& _outList)
+{
+	_outList = DrawList();
+	_outList.extraOffset = _geometrySize;
+
+	// constants read by primitives missing an attribute: normal +Z, uv 0, tangent +X
+	const float defaultValues[] = { 0, 0, 0, 0,  0, 0, 1, 0,  0, 0, 0, 0,  1, 0, 0, 1 };
+	size_t defaults[DRAW_ATTRIBUTE_COUNT] = {};
+	size_t base = AppendExtraGeometry(_outList, defaultValues, sizeof(defaultValues));
+	for (int i = 0; i < DRAW_ATTRIBUTE_COUNT; i++)
+		defaults[i] = base + i * 4 * sizeof(float);
+
+	if (_model.scenes.empty())
+	{
+		// no scene graph, draw every mesh once
+		for (size_t i = 0; i < _model.meshes.size(); i++)
+			AddMeshDraws(_model, _buffers, _bufferOffsets, static_cast<int>(i), _root, defaults, _outList);
+	}
+	else
+	{
+		int scene = (_model.defaultScene >= 0) ? _model.defaultScene : 0;
+		std::vector<std::pair<int, GW::MATH::GMATRIXF>> stack;
+		for (int node : _model.scenes[scene].nodes)
+			stack.push_back({ node, _root });
+
+		while (!stack.empty())
+		{
+			int node = stack.back().first;
+			GW::MATH::GMATRIXF parent = stack.back().second;
+			stack.pop_back();
+
+			GW::MATH::GMATRIXF world;
+			GW::MATH::GMatrix::MultiplyMatrixF(GetNodeMatrix(_model.nodes[node]), parent, world);
+
+			if (_model.nodes[node].mesh >= 0)
+				AddMeshDraws(_model, _buffers, _bufferOffsets, _model.nodes[node].mesh, world, defaults, _outList);
+
+			for (int child : _model.nodes[node].children)
+				stack.push_back({ child, world });
+		}
+	}
+
+	for (const tinygltf::Material& material : _model.materials)
+	{
+		MaterialTextures textures;
+		textures.baseColor = GetTextureImage(_model, material.pbrMetallicRoughness.baseColorTexture.index);
+		textures.metallicRoughness = GetTextureImage(_model, material.pbrMetallicRoughness.metallicRoughnessTexture.index);
+		textures.normal = GetTextureImage(_model, material.normalTexture.index);
+		textures.emissive = GetTextureImage(_model, material.emissiveTexture.index);
+		textures.alphaCutoff = (material.alphaMode == "MASK") ? static_cast<float>(material.alphaCutoff) : -1.0f;
+		_outList.materials.push_back(textures);
+	}
+
+	SortDrawList(_outList);
+
+	return _geometrySize + _outList.extraGeometry.size();
+}
+
+#endif // !MODELUTILS_H
@@ -0,0 +1,462 @@
+#ifndef SHADERCACHE_H
+#define SHADERCACHE_H
+
+// Requires Gateware.h and FileIntoString.h, and shaderc.h when RUNTIME_SHADERS is defined
+
+// Runtime HLSL -> SPIR-V compilation with a disk cache. The SPIR-V of every shader is kept next to
+// its source, one file per set of options, and reused as long as the source, the files it includes,
+// the entry point, the stage and the options are the same. A launch where nothing changed never
+// starts shaderc. ShaderCompileService runs the compiles in parallel on worker threads.
+// Unless the build defines RUNTIME_SHADERS, shaderc isn't linked at all and ShaderCompiler hands out the
+// SPIR-V that EmbedShaders.cmake compiled into the executable instead.
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <utility>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <algorithm>
+
+// bump whenever the cache layout changes or SPIR-V from an older shaderc should be thrown away
+#define SHADER_CACHE_VERSION 1
+#define SHADER_CACHE_EXTENSION ".spv"
+#define SHADER_INCLUDE_DEPTH 16 // nested includes followed when hashing, past it the cache is skipped
+
+// the stages the samples compile, numbered like shaderc's shader kinds which the cache keys hash
+enum ShaderStage
+{
+	SHADER_STAGE_VERTEX = 0,
+	SHADER_STAGE_FRAGMENT = 1,
+};
+
+struct ShaderCacheHeader
+{
+	char magic[4]; // "SPVC"
+	unsigned int version; // SHADER_CACHE_VERSION
+	unsigned long long key; // GetShaderKey of what the SPIR-V was compiled from
+	unsigned long long size; // bytes of SPIR-V after the header
+};
+
+// 64 bit FNV-1a
+unsigned long long HashShaderBytes(const void* _data, size_t _size, unsigned long long _hash = 14695981039346656037ull)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(_data);
+	for (size_t i = 0; i < _size; i++)
+	{
+		_hash ^= bytes[i];
+		_hash *= 1099511628211ull;
+	}
+	return _hash;
+}
+
+std::string GetShaderDirectory(const std::string& _path)
+{
+	size_t slash = _path.find_last_of("/\\");
+	return (slash == std::string::npos) ? std::string() : _path.substr(0, slash + 1);
+}
+
+// reads a whole file, false if it can't be opened
+bool ReadShaderFile(const std::string& _path, std::string& _outText)
+{
+	FILE* file = fopen(_path.c_str(), "rb");
+	if (file == nullptr)
+		return false;
+	_outText.clear();
+	char buffer[4096];
+	size_t read = 0;
+	while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		_outText.append(buffer, read);
+	fclose(file);
+	return true;
+}
+
+#ifdef RUNTIME_SHADERS
+// a file shaderc asked for through ResolveShaderInclude
+struct ShaderInclude
+{
+	std::string name, content;
+	shaderc_include_result result;
+};
+
+// includes are looked up next to the file that includes them
+shaderc_include_result* ResolveShaderInclude(void* _userData, const char* _requested, int _type, const char* _requesting, size_t _depth)
+{
+	ShaderInclude* include = new ShaderInclude();
+	include->name = GetShaderDirectory(_requesting) + _requested;
+	if (!ReadShaderFile(include->name, include->content))
+	{
+		include->content = "cannot open " + include->name;
+		include->name.clear(); // an empty name tells shaderc the include failed
+	}
+	include->result.source_name = include->name.c_str();
+	include->result.source_name_length = include->name.size();
+	include->result.content = include->content.c_str();
+	include->result.content_length = include->content.size();
+	include->result.user_data = include;
+	return &include->result;
+}
+
+void ReleaseShaderInclude(void* _userData, shaderc_include_result* _result)
+{
+	delete static_cast<ShaderInclude*>(_result->user_data);
+}
+
+shaderc_shader_kind GetShadercKind(ShaderStage _stage)
+{
+	return (_stage == SHADER_STAGE_VERTEX) ? shaderc_vertex_shader : shaderc_fragment_shader;
+}
+#endif
+
+// Everything a shader is compiled with besides its source, kept as plain values so it can be hashed
+struct ShaderOptions
+{
+	std::vector<std::pair<std::string, std::string>> macros;
+	bool invertY = false;
+	bool debugInfo = false;
+
+	void Define(const std::string& _name, const std::string& _value = "1")
+	{
+		macros.push_back({ _name, _value });
+	}
+
+	unsigned long long Hash() const
+	{
+		unsigned int flags[2] = { (invertY) ? 1u : 0u, (debugInfo) ? 1u : 0u };
+		unsigned long long hash = HashShaderBytes(flags, sizeof(flags), HashShaderBytes("options", 7));
+		for (const std::pair<std::string, std::string>& macro : macros)
+		{
+			hash = HashShaderBytes(macro.first.c_str(), macro.first.size() + 1, hash);
+			hash = HashShaderBytes(macro.second.c_str(), macro.second.size() + 1, hash);
+		}
+		return hash;
+	}
+
+	// names these options among the shaders the build embedded, "INVERT_Y|NAME=VALUE|..." with the macros
+	// sorted the way embed_shader writes it. Debug info isn't part of it, debug builds embed it everywhere.
+	std::string GetEmbeddedKey() const
+	{
+		std::vector<std::string> defines;
+		for (const std::pair<std::string, std::string>& macro : macros)
+			defines.push_back(macro.first + "=" + macro.second);
+		std::sort(defines.begin(), defines.end());
+		std::string key = (invertY) ? "INVERT_Y|" : "";
+		for (const std::string& define : defines)
+			key += define + "|";
+		return key;
+	}
+
+#ifdef RUNTIME_SHADERS
+	// the shaderc options these stand for, release them with shaderc_compile_options_release
+	shaderc_compile_options_t Create() const
+	{
+		shaderc_compile_options_t options = shaderc_compile_options_initialize();
+		shaderc_compile_options_set_source_language(options, shaderc_source_language_hlsl);
+		shaderc_compile_options_set_invert_y(options, invertY);
+		for (const std::pair<std::string, std::string>& macro : macros)
+			shaderc_compile_options_add_macro_definition(options, macro.first.c_str(), macro.first.size(),
+				macro.second.c_str(), macro.second.size());
+		if (debugInfo)
+			shaderc_compile_options_set_generate_debug_info(options);
+		shaderc_compile_options_set_include_callbacks(options, &ResolveShaderInclude, &ReleaseShaderInclude, nullptr);
+		return options;
+	}
+#endif
+};
+
+// mixes the files _source includes into _hash, paths are relative to the including file the way
+// ShaderCompiler resolves them. False when an include can't be read or they nest too deep.
+bool HashShaderIncludes(const std::string& _source, const std::string& _directory, unsigned int _depth, unsigned long long& _hash)
+{
+	if (_depth > SHADER_INCLUDE_DEPTH)
+		return false;
+	for (size_t line = 0; line < _source.size();)
+	{
+		size_t end = G_SMALLER(_source.find('\n', line), _source.size());
+		size_t start = _source.find_first_not_of(" \t", line);
+		if (start < end && _source.compare(start, 8, "#include") == 0)
+		{
+			size_t open = _source.find_first_of("\"<", start + 8);
+			size_t close = (open < end) ? _source.find_first_of("\">", open + 1) : std::string::npos;
+			if (close >= end)
+				return false;
+			std::string path = _directory + _source.substr(open + 1, close - open - 1);
+			std::string text;
+			if (!ReadShaderFile(path, text))
+				return false;
+			_hash = HashShaderBytes(path.c_str(), path.size() + 1, _hash);
+			_hash = HashShaderBytes(text.data(), text.size(), _hash);
+			if (!HashShaderIncludes(text, GetShaderDirectory(path), _depth + 1, _hash))
+				return false;
+		}
+		line = end + 1;
+	}
+	return true;
+}
+
+// key of the SPIR-V _source compiles to, false if it can't be worked out and the cache must be skipped
+bool GetShaderKey(const std::string& _path, const std::string& _source, ShaderStage _stage, const char* _entry,
+				const ShaderOptions& _options, unsigned long long& _outKey)
+{
+	unsigned int stage = static_cast<unsigned int>(_stage);
+	_outKey = HashShaderBytes("shader", 6) ^ SHADER_CACHE_VERSION;
+	_outKey = HashShaderBytes(_source.data(), _source.size(), _outKey);
+	_outKey = HashShaderBytes(_entry, strlen(_entry) + 1, _outKey);
+	_outKey = HashShaderBytes(&stage, sizeof(stage), _outKey);
+	unsigned long long options = _options.Hash();
+	_outKey = HashShaderBytes(&options, sizeof(options), _outKey);
+	return HashShaderIncludes(_source, GetShaderDirectory(_path), 1, _outKey);
+}
+
+// cache file of _path compiled for _stage and _entry with _options, the source itself isn't part
+// of the name so an edited shader replaces its old SPIR-V instead of piling up next to it
+std::string GetShaderCachePath(const std::string& _path, ShaderStage _stage, const char* _entry, const ShaderOptions& _options)
+{
+	unsigned int stage = static_cast<unsigned int>(_stage);
+	unsigned long long name = HashShaderBytes(&stage, sizeof(stage), _options.Hash());
+	name = HashShaderBytes(_entry, strlen(_entry) + 1, name);
+	char hex[17];
+	snprintf(hex, sizeof(hex), "%016llx", name);
+	return _path + "." + hex + SHADER_CACHE_EXTENSION;
+}
+
+// loads cached SPIR-V if it was compiled from _key, false otherwise
+bool ReadShaderCache(const std::string& _cachePath, unsigned long long _key, std::vector<uint32_t>& _outSpirv)
+{
+	FILE* file = fopen(_cachePath.c_str(), "rb");
+	if (file == nullptr)
+		return false;
+	ShaderCacheHeader header;
+	bool valid = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, "SPVC", 4) == 0
+		&& header.version == SHADER_CACHE_VERSION && header.key == _key && header.size > 0 && header.size % sizeof(uint32_t) == 0
+		&& header.size < (1ull << 30);
+	if (valid)
+	{
+		_outSpirv.resize(static_cast<size_t>(header.size / sizeof(uint32_t)));
+		valid = fread(_outSpirv.data(), 1, static_cast<size_t>(header.size), file) == header.size;
+	}
+	fclose(file);
+	return valid;
+}
+
+// writes to a temporary file first so a crash never leaves a half written cache behind, it is named
+// after the thread so two threads writing the same shader don't write into each other's file
+bool WriteShaderCache(const std::string& _cachePath, unsigned long long _key, const std::vector<uint32_t>& _spirv)
+{
+	std::string temporary = _cachePath + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+	FILE* file = fopen(temporary.c_str(), "wb");
+	if (file == nullptr)
+		return false;
+	ShaderCacheHeader header = { { 'S', 'P', 'V', 'C' }, SHADER_CACHE_VERSION, _key, _spirv.size() * sizeof(uint32_t) };
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(_spirv.data(), 1, static_cast<size_t>(header.size), file) == header.size;
+	written = (fclose(file) == 0) && written;
+	remove(_cachePath.c_str());
+	if (!written || rename(temporary.c_str(), _cachePath.c_str()) != 0)
+	{
+		remove(temporary.c_str());
+		return false;
+	}
+	return true;
+}
+
+#ifdef RUNTIME_SHADERS
+// Compiles HLSL files to SPIR-V through the disk cache. The shaderc compiler is only created on the
+// first cache miss. A shaderc compiler must not be used by two threads at once, so neither may this.
+class ShaderCompiler
+{
+	shaderc_compiler_t compiler = nullptr;
+
+public:
+	ShaderCompiler() = default;
+	ShaderCompiler(const ShaderCompiler&) = delete;
+	ShaderCompiler& operator=(const ShaderCompiler&) = delete;
+
+	~ShaderCompiler()
+	{
+		if (compiler != nullptr)
+			shaderc_compiler_release(compiler);
+	}
+
+	// SPIR-V of the HLSL file at _path, from the cache when it is up to date. On failure _outErrors holds shaderc's messages.
+	bool Compile(const char* _path, ShaderStage _stage, const char* _entry, const ShaderOptions& _options,
+				std::vector<uint32_t>& _outSpirv, std::string& _outErrors)
+	{
+		std::string source = ReadFileIntoString(_path);
+		unsigned long long key = 0;
+		bool cacheable = GetShaderKey(_path, source, _stage, _entry, _options, key);
+		std::string cachePath = GetShaderCachePath(_path, _stage, _entry, _options);
+		if (cacheable && ReadShaderCache(cachePath, key, _outSpirv))
+			return true;
+
+		if (compiler == nullptr)
+			compiler = shaderc_compiler_initialize();
+		shaderc_compile_options_t options = _options.Create();
+		shaderc_compilation_result_t result = shaderc_compile_into_spv(compiler, source.c_str(), source.length(),
+			GetShadercKind(_stage), _path, _entry, options);
+		bool compiled = shaderc_result_get_compilation_status(result) == shaderc_compilation_status_success;
+		if (compiled)
+		{
+			const char* bytes = shaderc_result_get_bytes(result);
+			_outSpirv.resize(shaderc_result_get_length(result) / sizeof(uint32_t));
+			memcpy(_outSpirv.data(), bytes, _outSpirv.size() * sizeof(uint32_t));
+			if (cacheable)
+				WriteShaderCache(cachePath, key, _outSpirv);
+		}
+		else
+			_outErrors = shaderc_result_get_error_message(result);
+		shaderc_result_release(result);
+		shaderc_compile_options_release(options);
+		return compiled;
+	}
+};
+#else
+// SPIR-V compiled by the build
+struct EmbeddedShader
+{
+	const char* name; // file name of the HLSL, without its directory
+	ShaderStage stage;
+	const char* key; // ShaderOptions::GetEmbeddedKey of what it was compiled with
+	const uint32_t* spirv;
+	size_t size; // in words
+};
+
+#include "EmbeddedShaders.h" // generated by EmbedShaders.cmake, defines embeddedShaders
+
+// Looks shaders up among the ones the build embedded, by file name so the working directory doesn't
+// matter. Only the variants CMakeLists.txt lists are there, asking for any other is an error.
+class ShaderCompiler
+{
+public:
+	// copies the SPIR-V of the HLSL file at _path compiled for _stage with _options, the entry point is always main
+	bool Compile(const char* _path, ShaderStage _stage, const char* _entry, const ShaderOptions& _options,
+				std::vector<uint32_t>& _outSpirv, std::string& _outErrors)
+	{
+		std::string name = _path;
+		name = name.substr(name.find_last_of("/\\") + 1);
+		std::string key = _options.GetEmbeddedKey();
+		for (const EmbeddedShader& shader : embeddedShaders)
+			if (name == shader.name && _stage == shader.stage && key == shader.key && strcmp(_entry, "main") == 0)
+			{
+				_outSpirv.assign(shader.spirv, shader.spirv + shader.size);
+				return true;
+			}
+		_outErrors = name + " (" + _entry + ", \"" + key + "\") was not embedded, add it with embed_shader in CMakeLists.txt"
+			" or configure with -DRUNTIME_SHADERS=ON\n";
+		return false;
+	}
+};
+#endif
+
+// what ShaderCompileService hands back for one shader
+struct CompiledShader
+{
+	bool compiled = false;
+	std::vector<uint32_t> spirv;
+	std::string errors; // the compiler's messages when it didn't compile
+};
+
+// Compiles shaders on a pool of worker threads, each with its own ShaderCompiler. Compile returns right
+// away with a future, so everything a renderer needs is compiled at once while it does other work, and
+// whatever builds the pipeline waits on the futures. Workers are started as shaders are queued, up to
+// one per core, and stopped with the service.
+class ShaderCompileService
+{
+	struct Job
+	{
+		std::string path, entry;
+		ShaderStage stage;
+		ShaderOptions options;
+		std::promise<CompiledShader> result;
+	};
+
+	std::vector<std::thread> workers;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<Job> jobs; // guarded by lock
+	unsigned int idle = 0; // workers waiting for a job, guarded by lock
+	bool stop = false; // guarded by lock
+
+	void Work()
+	{
+		ShaderCompiler compiler;
+		std::unique_lock<std::mutex> guard(lock);
+		while (true)
+		{
+			idle++;
+			wake.wait(guard, [this]() { return stop || !jobs.empty(); });
+			idle--;
+			if (stop)
+				return;
+			Job job = std::move(jobs.front());
+			jobs.pop_front();
+			guard.unlock();
+
+			CompiledShader shader;
+			shader.compiled = compiler.Compile(job.path.c_str(), job.stage, job.entry.c_str(), job.options, shader.spirv, shader.errors);
+			job.result.set_value(std::move(shader));
+			guard.lock();
+		}
+	}
+
+public:
+	ShaderCompileService() = default;
+	ShaderCompileService(const ShaderCompileService&) = delete;
+	ShaderCompileService& operator=(const ShaderCompileService&) = delete;
+
+	~ShaderCompileService()
+	{
+		Stop();
+	}
+
+	// queues the HLSL file at _path, the future is ready once it is compiled or read from the cache
+	std::future<CompiledShader> Compile(const std::string& _path, ShaderStage _stage, const ShaderOptions& _options,
+										const std::string& _entry = "main")
+	{
+#ifndef RUNTIME_SHADERS
+		// embedded SPIR-V is only copied, that isn't worth a worker
+		std::promise<CompiledShader> embedded;
+		CompiledShader shader;
+		shader.compiled = ShaderCompiler().Compile(_path.c_str(), _stage, _entry.c_str(), _options, shader.spirv, shader.errors);
+		embedded.set_value(std::move(shader));
+		return embedded.get_future();
+#else
+		Job job;
+		job.path = _path;
+		job.entry = _entry;
+		job.stage = _stage;
+		job.options = _options;
+		std::future<CompiledShader> result = job.result.get_future();
+
+		std::lock_guard<std::mutex> guard(lock);
+		jobs.push_back(std::move(job));
+		unsigned int cores = G_LARGER(std::thread::hardware_concurrency(), 1u);
+		if (idle < jobs.size() && workers.size() < cores)
+			workers.emplace_back(&ShaderCompileService::Work, this);
+		wake.notify_one();
+		return result;
+#endif
+	}
+
+	// waits for the shader being compiled, queued ones are dropped and their futures report a broken promise
+	void Stop()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stop = true;
+		}
+		wake.notify_all();
+		for (std::thread& worker : workers)
+			worker.join();
+		workers.clear();
+		jobs.clear();
+		stop = false;
+	}
+};
+
+#endif // !SHADERCACHE_H
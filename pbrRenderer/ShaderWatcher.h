@@ -0,0 +1,190 @@
+#ifndef SHADERWATCHER_H
+#define SHADERWATCHER_H
+
+// Watches shader sources for edits on a thread of its own. On Linux inotify reports every HLSL file
+// written, created or moved into the directories of the watched files, which also covers the files
+// they include and editors that save by replacing the file. Elsewhere the modification times of the
+// watched files, as fine as the file system keeps them, and their sizes are polled so two saves within
+// a second are still told apart. A burst of saves settles into a single change, the renderer compares
+// GetVersion with the version its shaders were compiled at.
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#define SHADER_WATCH_INTERVAL 100 // milliseconds between checks, changes are reported once they stay quiet this long
+
+class ShaderWatcher
+{
+	// what a save changes about a file
+	struct FileStamp
+	{
+		long long modified; // in the file system's own unit, 0 for a file that is missing (mid save)
+		long long size;
+
+		bool operator==(const FileStamp& _other) const
+		{
+			return modified == _other.modified && size == _other.size;
+		}
+	};
+
+	std::vector<std::string> files;
+	std::thread watcher;
+	std::atomic<bool> stop;
+	std::atomic<unsigned int> version;
+	int notify = -1; // inotify instance, -1 when the stamps are polled
+
+	static bool IsShaderFile(const std::string& _name)
+	{
+		size_t dot = _name.find_last_of('.');
+		return dot != std::string::npos && (_name.compare(dot, std::string::npos, ".hlsl") == 0 || _name.compare(dot, std::string::npos, ".hlsli") == 0);
+	}
+
+	static std::string GetDirectory(const std::string& _path)
+	{
+		size_t slash = _path.find_last_of("/\\");
+		return (slash == std::string::npos) ? std::string(".") : _path.substr(0, slash);
+	}
+
+	// last modification and size of every watched file
+	void GetStamps(std::vector<FileStamp>& _outStamps) const
+	{
+		_outStamps.assign(files.size(), FileStamp{ 0, 0 });
+		for (size_t i = 0; i < files.size(); i++)
+		{
+#ifdef _WIN32
+			WIN32_FILE_ATTRIBUTE_DATA info; // last write time in 100 ns steps
+			if (GetFileAttributesExA(files[i].c_str(), GetFileExInfoStandard, &info))
+			{
+				_outStamps[i].modified = static_cast<long long>((static_cast<unsigned long long>(info.ftLastWriteTime.dwHighDateTime) << 32)
+					| info.ftLastWriteTime.dwLowDateTime);
+				_outStamps[i].size = static_cast<long long>((static_cast<unsigned long long>(info.nFileSizeHigh) << 32) | info.nFileSizeLow);
+			}
+#else
+			struct stat info; // st_mtime alone only counts whole seconds
+			if (stat(files[i].c_str(), &info) == 0)
+			{
+#ifdef __APPLE__
+				_outStamps[i].modified = static_cast<long long>(info.st_mtimespec.tv_sec) * 1000000000ll + info.st_mtimespec.tv_nsec;
+#else
+				_outStamps[i].modified = static_cast<long long>(info.st_mtim.tv_sec) * 1000000000ll + info.st_mtim.tv_nsec;
+#endif
+				_outStamps[i].size = static_cast<long long>(info.st_size);
+			}
+#endif
+		}
+	}
+
+	// true when a shader in a watched directory changed since the last call, waits up to SHADER_WATCH_INTERVAL
+	bool WaitForNotify()
+	{
+#ifdef __linux__
+		pollfd request = { notify, POLLIN, 0 };
+		if (poll(&request, 1, SHADER_WATCH_INTERVAL) <= 0)
+			return false;
+		alignas(inotify_event) char buffer[4096];
+		ssize_t length = read(notify, buffer, sizeof(buffer));
+		bool changed = false;
+		for (ssize_t offset = 0; offset < length;)
+		{
+			const inotify_event* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+			changed = changed || (event->len > 0 && IsShaderFile(event->name));
+			offset += sizeof(inotify_event) + event->len;
+		}
+		return changed;
+#else
+		return false;
+#endif
+	}
+
+	void Watch()
+	{
+		std::vector<FileStamp> stamps, current;
+		GetStamps(stamps);
+		bool settling = false;
+		while (!stop)
+		{
+			bool changed = false;
+			if (notify >= 0)
+				changed = WaitForNotify();
+			else
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(SHADER_WATCH_INTERVAL));
+				GetStamps(current);
+				changed = !(current == stamps);
+				stamps.swap(current);
+			}
+
+			// a change is reported in the first interval without one
+			if (changed)
+				settling = true;
+			else if (settling)
+			{
+				settling = false;
+				version++;
+			}
+		}
+	}
+
+public:
+	ShaderWatcher() : stop(false), version(0) {}
+	ShaderWatcher(const ShaderWatcher&) = delete;
+	ShaderWatcher& operator=(const ShaderWatcher&) = delete;
+
+	~ShaderWatcher()
+	{
+		Stop();
+	}
+
+	// starts watching _files, they are only read, never locked
+	void Start(const std::vector<std::string>& _files)
+	{
+		Stop();
+		files = _files;
+#ifdef __linux__
+		notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		for (size_t i = 0; i < files.size() && notify >= 0; i++)
+			if (inotify_add_watch(notify, GetDirectory(files[i]).c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+			{
+				close(notify); // the stamps are polled instead
+				notify = -1;
+			}
+#endif
+		stop = false;
+		watcher = std::thread(&ShaderWatcher::Watch, this);
+	}
+
+	// goes up by one after every edit that has settled
+	unsigned int GetVersion() const
+	{
+		return version;
+	}
+
+	void Stop()
+	{
+		stop = true;
+		if (watcher.joinable())
+			watcher.join();
+#ifdef __linux__
+		if (notify >= 0)
+			close(notify);
+#endif
+		notify = -1;
+	}
+};
+
+#endif // !SHADERWATCHER_H
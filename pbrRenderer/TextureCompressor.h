@@ -0,0 +1,632 @@
+#ifndef TEXTURECOMPRESSOR_H
+#define TEXTURECOMPRESSOR_H
+
+// Requires Gateware.h and MipGenerator.h
+
+// Cook time block compression. 8 bit RGBA images are encoded into 4x4 texel blocks: BC7 for colour,
+// BC5 for normal maps, BC4 for single channel data and BC1 for opaque colour nobody reads alpha from.
+// Compressed images can't be blitted, so every level of the chain MipGenerator builds is encoded,
+// block rows are spread over all cores. The result is cached next to the model as a KTX2 file so
+// a model that has to be cooked again doesn't pay for the encoding twice.
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+
+// ModelImage::compression values
+#define TEXTURE_COMPRESSION_NONE 0 // RGBA pixels
+#define TEXTURE_COMPRESSION_BC1 1 // opaque colour
+#define TEXTURE_COMPRESSION_BC4 2 // red only
+#define TEXTURE_COMPRESSION_BC5 3 // red and green
+#define TEXTURE_COMPRESSION_BC7 4 // colour and alpha
+
+// bump whenever an encoder changes, cached KTX2 files from older encoders are encoded again
+#define TEXTURE_ENCODER_VERSION 1
+
+#define TEXTURE_CACHE_EXTENSION ".ktx2"
+#define TEXTURE_CACHE_KEY "CookedSourceHash" // KTX2 key/value entry the cache is validated against
+
+VkFormat GetCompressedFormat(unsigned int _compression)
+{
+	switch (_compression)
+	{
+	case TEXTURE_COMPRESSION_BC1: return VK_FORMAT_BC1_RGB_UNORM_BLOCK;
+	case TEXTURE_COMPRESSION_BC4: return VK_FORMAT_BC4_UNORM_BLOCK;
+	case TEXTURE_COMPRESSION_BC5: return VK_FORMAT_BC5_UNORM_BLOCK;
+	case TEXTURE_COMPRESSION_BC7: return VK_FORMAT_BC7_UNORM_BLOCK;
+	}
+	return VK_FORMAT_UNDEFINED;
+}
+
+// bytes in one 4x4 block
+unsigned int GetCompressedBlockSize(unsigned int _compression)
+{
+	return (_compression == TEXTURE_COMPRESSION_BC1 || _compression == TEXTURE_COMPRESSION_BC4) ? 8 : 16;
+}
+
+// bytes of mip _level of a compressed image
+size_t GetCompressedLevelSize(unsigned int _width, unsigned int _height, unsigned int _compression, unsigned int _level)
+{
+	size_t width = G_LARGER(_width >> _level, 1u), height = G_LARGER(_height >> _level, 1u);
+	return ((width + 3) / 4) * ((height + 3) / 4) * GetCompressedBlockSize(_compression);
+}
+
+// bytes of the whole mip chain of a compressed image, levels are stored largest first
+size_t GetCompressedSize(unsigned int _width, unsigned int _height, unsigned int _compression)
+{
+	size_t size = 0;
+	for (unsigned int level = 0; level < GetMipLevelCount(_width, _height); level++)
+		size += GetCompressedLevelSize(_width, _height, _compression, level);
+	return size;
+}
+
+// principal axis of _count points with _channels floats each, found by power iteration
+void GetPrincipalAxis(const float* _points, int _count, int _channels, const float* _mean, float* _outAxis)
+{
+	float covariance[4][4] = {};
+	for (int i = 0; i < _count; i++)
+		for (int a = 0; a < _channels; a++)
+			for (int b = 0; b < _channels; b++)
+				covariance[a][b] += (_points[i * _channels + a] - _mean[a]) * (_points[i * _channels + b] - _mean[b]);
+
+	for (int a = 0; a < _channels; a++)
+		_outAxis[a] = 1.0f;
+	for (int iteration = 0; iteration < 8; iteration++)
+	{
+		float next[4] = {};
+		float length = 0;
+		for (int a = 0; a < _channels; a++)
+		{
+			for (int b = 0; b < _channels; b++)
+				next[a] += covariance[a][b] * _outAxis[b];
+			length += next[a] * next[a];
+		}
+		if (length <= 0)
+			return; // every point is the same, any axis will do
+		length = 1.0f / sqrtf(length);
+		for (int a = 0; a < _channels; a++)
+			_outAxis[a] = next[a] * length;
+	}
+}
+
+// the two ends of _points along their principal axis
+void GetPrincipalEndpoints(const float* _points, int _count, int _channels, float* _outLow, float* _outHigh)
+{
+	float mean[4] = {};
+	for (int i = 0; i < _count; i++)
+		for (int c = 0; c < _channels; c++)
+			mean[c] += _points[i * _channels + c] / _count;
+	float axis[4];
+	GetPrincipalAxis(_points, _count, _channels, mean, axis);
+
+	float low = 0, high = 0;
+	for (int i = 0; i < _count; i++)
+	{
+		float t = 0;
+		for (int c = 0; c < _channels; c++)
+			t += (_points[i * _channels + c] - mean[c]) * axis[c];
+		low = G_SMALLER(low, t);
+		high = G_LARGER(high, t);
+	}
+	for (int c = 0; c < _channels; c++)
+	{
+		_outLow[c] = G_LARGER(0.0f, G_SMALLER(255.0f, mean[c] + axis[c] * low));
+		_outHigh[c] = G_LARGER(0.0f, G_SMALLER(255.0f, mean[c] + axis[c] * high));
+	}
+}
+
+// Least squares endpoints for _points given the weight of the second endpoint at each of them,
+// false when the weights can't tell the two apart
+bool FitEndpoints(const float* _points, const float* _weights, int _count, int _channels, float* _outLow, float* _outHigh)
+{
+	float aa = 0, ab = 0, bb = 0, ax[4] = {}, bx[4] = {};
+	for (int i = 0; i < _count; i++)
+	{
+		float b = _weights[i], a = 1.0f - b;
+		aa += a * a;
+		ab += a * b;
+		bb += b * b;
+		for (int c = 0; c < _channels; c++)
+		{
+			ax[c] += a * _points[i * _channels + c];
+			bx[c] += b * _points[i * _channels + c];
+		}
+	}
+	float determinant = aa * bb - ab * ab;
+	if (fabsf(determinant) < 1e-6f)
+		return false;
+	for (int c = 0; c < _channels; c++)
+	{
+		_outLow[c] = G_LARGER(0.0f, G_SMALLER(255.0f, (ax[c] * bb - bx[c] * ab) / determinant));
+		_outHigh[c] = G_LARGER(0.0f, G_SMALLER(255.0f, (bx[c] * aa - ax[c] * ab) / determinant));
+	}
+	return true;
+}
+
+unsigned short PackRGB565(const float* _color)
+{
+	unsigned int r = static_cast<unsigned int>(_color[0] * 31.0f / 255.0f + 0.5f);
+	unsigned int g = static_cast<unsigned int>(_color[1] * 63.0f / 255.0f + 0.5f);
+	unsigned int b = static_cast<unsigned int>(_color[2] * 31.0f / 255.0f + 0.5f);
+	return static_cast<unsigned short>((r << 11) | (g << 5) | b);
+}
+
+void UnpackRGB565(unsigned short _color, int* _outColor)
+{
+	int r = (_color >> 11) & 31, g = (_color >> 5) & 63, b = _color & 31;
+	_outColor[0] = (r << 3) | (r >> 2);
+	_outColor[1] = (g << 2) | (g >> 4);
+	_outColor[2] = (b << 3) | (b >> 2);
+}
+
+// picks the closest of the 4 colours between _color0 > _color1 for every texel, returns the squared error
+unsigned int GetBC1Indices(const float* _texels, unsigned short _color0, unsigned short _color1, unsigned int& _outIndices)
+{
+	int palette[4][3];
+	UnpackRGB565(_color0, palette[0]);
+	UnpackRGB565(_color1, palette[1]);
+	for (int c = 0; c < 3; c++)
+	{
+		palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+		palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+	}
+	unsigned int error = 0;
+	_outIndices = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		unsigned int best = ~0u, bestIndex = 0;
+		for (unsigned int p = 0; p < 4; p++)
+		{
+			unsigned int distance = 0;
+			for (int c = 0; c < 3; c++)
+			{
+				int d = static_cast<int>(_texels[i * 3 + c]) - palette[p][c];
+				distance += d * d;
+			}
+			if (distance < best)
+			{
+				best = distance;
+				bestIndex = p;
+			}
+		}
+		error += best;
+		_outIndices |= bestIndex << (i * 2);
+	}
+	return error;
+}
+
+// encodes 16 RGB texels (3 floats each) as a 4 colour BC1 block
+void EncodeBC1Block(const float* _texels, unsigned char _outBlock[8])
+{
+	static const float weights[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f }; // of color1 at each index
+
+	float low[3], high[3];
+	GetPrincipalEndpoints(_texels, 16, 3, low, high);
+	unsigned short color0 = PackRGB565(high), color1 = PackRGB565(low);
+	unsigned int indices = 0, error = ~0u;
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		// the 4 colour mode needs color0 > color1
+		if (color0 < color1)
+		{
+			unsigned short swap = color0;
+			color0 = color1;
+			color1 = swap;
+		}
+		unsigned int candidateIndices = 0, candidateError = 0;
+		if (color0 != color1)
+			candidateError = GetBC1Indices(_texels, color0, color1, candidateIndices);
+		else
+		{
+			// a single colour, which the 3 colour mode draws at index 0
+			int color[3];
+			UnpackRGB565(color0, color);
+			for (int i = 0; i < 16; i++)
+				for (int c = 0; c < 3; c++)
+					candidateError += static_cast<unsigned int>((_texels[i * 3 + c] - color[c]) * (_texels[i * 3 + c] - color[c]));
+		}
+		if (candidateError >= error)
+			break;
+		error = candidateError;
+		indices = candidateIndices;
+		memcpy(_outBlock, &color0, 2);
+		memcpy(_outBlock + 2, &color1, 2);
+		memcpy(_outBlock + 4, &indices, 4);
+
+		// refit the endpoints to the texels each index ended up with
+		float fitted[16];
+		for (int i = 0; i < 16; i++)
+			fitted[i] = weights[(indices >> (i * 2)) & 3];
+		if (color0 == color1 || !FitEndpoints(_texels, fitted, 16, 3, high, low))
+			break;
+		color0 = PackRGB565(high);
+		color1 = PackRGB565(low);
+	}
+}
+
+// encodes 16 single channel values as a BC4 block
+void EncodeBC4Block(const unsigned char _values[16], unsigned char _outBlock[8])
+{
+	unsigned char low = 255, high = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		low = G_SMALLER(low, _values[i]);
+		high = G_LARGER(high, _values[i]);
+	}
+	_outBlock[0] = high;
+	_outBlock[1] = low;
+	unsigned long long indices = 0;
+	if (high != low)
+	{
+		// 8 values from high at index 0 to low at index 1 with 6 steps in between
+		int palette[8] = { high, low };
+		for (int k = 2; k < 8; k++)
+			palette[k] = ((8 - k) * high + (k - 1) * low + 3) / 7;
+		for (int i = 0; i < 16; i++)
+		{
+			int best = 256;
+			unsigned long long bestIndex = 0;
+			for (int k = 0; k < 8; k++)
+				if (abs(palette[k] - _values[i]) < best)
+				{
+					best = abs(palette[k] - _values[i]);
+					bestIndex = k;
+				}
+			indices |= bestIndex << (i * 3);
+		}
+	}
+	memcpy(_outBlock + 2, &indices, 6); // little endian, the low 48 bits
+}
+
+// writes _count bits of _value at bit _offset of a 16 byte block
+void WriteBlockBits(unsigned char _block[16], unsigned int& _offset, unsigned int _value, unsigned int _count)
+{
+	for (unsigned int i = 0; i < _count; i++, _offset++)
+		if ((_value >> i) & 1)
+			_block[_offset / 8] |= static_cast<unsigned char>(1 << (_offset % 8));
+}
+
+// encodes 16 RGBA texels (4 floats each) as a BC7 mode 6 block, one subset with 7 bit endpoints,
+// a p-bit each and 16 colours between them
+void EncodeBC7Block(const float* _texels, unsigned char _outBlock[16])
+{
+	static const int weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+	float low[4], high[4];
+	GetPrincipalEndpoints(_texels, 16, 4, low, high);
+
+	unsigned int bestError = ~0u;
+	int bestEndpoints[2][4] = {}, bestBits[2] = {}, bestIndices[16] = {};
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		const float* ends[2] = { low, high };
+		int attemptIndices[16];
+		bool improved = false;
+		for (int bits = 0; bits < 4; bits++)
+		{
+			// 7 bits of every channel plus the endpoint's p-bit make the 8 bit value
+			int endpoints[2][4], palette[16][4];
+			int pbit[2] = { bits & 1, bits >> 1 };
+			for (int e = 0; e < 2; e++)
+				for (int c = 0; c < 4; c++)
+				{
+					int quantized = static_cast<int>((ends[e][c] - pbit[e]) / 2.0f + 0.5f);
+					endpoints[e][c] = G_LARGER(0, G_SMALLER(127, quantized));
+				}
+			for (int w = 0; w < 16; w++)
+				for (int c = 0; c < 4; c++)
+				{
+					int e0 = (endpoints[0][c] << 1) | pbit[0], e1 = (endpoints[1][c] << 1) | pbit[1];
+					palette[w][c] = ((64 - weights[w]) * e0 + weights[w] * e1 + 32) >> 6;
+				}
+
+			unsigned int error = 0;
+			int indices[16];
+			for (int i = 0; i < 16 && error < bestError; i++)
+			{
+				unsigned int best = ~0u;
+				for (int w = 0; w < 16; w++)
+				{
+					unsigned int distance = 0;
+					for (int c = 0; c < 4; c++)
+					{
+						int d = static_cast<int>(_texels[i * 4 + c]) - palette[w][c];
+						distance += d * d;
+					}
+					if (distance < best)
+					{
+						best = distance;
+						indices[i] = w;
+					}
+				}
+				error += best;
+			}
+			if (error < bestError)
+			{
+				bestError = error;
+				memcpy(bestEndpoints, endpoints, sizeof(endpoints));
+				bestBits[0] = pbit[0];
+				bestBits[1] = pbit[1];
+				memcpy(bestIndices, indices, sizeof(indices));
+				memcpy(attemptIndices, indices, sizeof(indices));
+				improved = true;
+			}
+		}
+
+		// refit the endpoints to the texels each index ended up with
+		float fitted[16];
+		for (int i = 0; i < 16; i++)
+			fitted[i] = weights[attemptIndices[i]] / 64.0f;
+		if (!improved || bestError == 0 || !FitEndpoints(_texels, fitted, 16, 4, low, high))
+			break;
+	}
+
+	// the first index is stored with 3 bits, so its top bit has to be 0
+	if (bestIndices[0] & 8)
+	{
+		for (int c = 0; c < 4; c++)
+		{
+			int swap = bestEndpoints[0][c];
+			bestEndpoints[0][c] = bestEndpoints[1][c];
+			bestEndpoints[1][c] = swap;
+		}
+		int swap = bestBits[0];
+		bestBits[0] = bestBits[1];
+		bestBits[1] = swap;
+		for (int i = 0; i < 16; i++)
+			bestIndices[i] = 15 - bestIndices[i];
+	}
+
+	memset(_outBlock, 0, 16);
+	unsigned int offset = 0;
+	WriteBlockBits(_outBlock, offset, 1 << 6, 7); // mode 6
+	for (int c = 0; c < 4; c++)
+		for (int e = 0; e < 2; e++)
+			WriteBlockBits(_outBlock, offset, bestEndpoints[e][c], 7);
+	WriteBlockBits(_outBlock, offset, bestBits[0], 1);
+	WriteBlockBits(_outBlock, offset, bestBits[1], 1);
+	for (int i = 0; i < 16; i++)
+		WriteBlockBits(_outBlock, offset, bestIndices[i], (i == 0) ? 3 : 4);
+}
+
+// encodes one 8 bit RGBA level into _outBlocks, block rows are spread over all cores
+void CompressLevel(const unsigned char* _pixels, unsigned int _width, unsigned int _height, unsigned int _compression, unsigned char* _outBlocks)
+{
+	unsigned int blocksWide = (_width + 3) / 4, blocksHigh = (_height + 3) / 4;
+	unsigned int blockSize = GetCompressedBlockSize(_compression);
+	std::atomic<unsigned int> next(0);
+	auto encode = [&]()
+		{
+			for (unsigned int by = next++; by < blocksHigh; by = next++)
+				for (unsigned int bx = 0; bx < blocksWide; bx++)
+				{
+					// texels past the edge repeat the last row or column
+					unsigned char texels[16][4];
+					for (unsigned int i = 0; i < 16; i++)
+					{
+						unsigned int x = G_SMALLER(bx * 4 + i % 4, _width - 1), y = G_SMALLER(by * 4 + i / 4, _height - 1);
+						memcpy(texels[i], _pixels + (static_cast<size_t>(y) * _width + x) * 4, 4);
+					}
+					unsigned char* block = _outBlocks + (static_cast<size_t>(by) * blocksWide + bx) * blockSize;
+					if (_compression == TEXTURE_COMPRESSION_BC1 || _compression == TEXTURE_COMPRESSION_BC7)
+					{
+						int channels = (_compression == TEXTURE_COMPRESSION_BC1) ? 3 : 4;
+						float points[16 * 4];
+						for (int i = 0; i < 16; i++)
+							for (int c = 0; c < channels; c++)
+								points[i * channels + c] = texels[i][c];
+						if (_compression == TEXTURE_COMPRESSION_BC1)
+							EncodeBC1Block(points, block);
+						else
+							EncodeBC7Block(points, block);
+					}
+					else
+					{
+						// BC4 is the red channel, BC5 a BC4 block for red followed by one for green
+						for (unsigned int channel = 0; channel < blockSize / 8; channel++)
+						{
+							unsigned char values[16];
+							for (int i = 0; i < 16; i++)
+								values[i] = texels[i][channel];
+							EncodeBC4Block(values, block + channel * 8);
+						}
+					}
+				}
+		};
+	unsigned int threads = G_SMALLER(std::thread::hardware_concurrency(), blocksHigh);
+	std::vector<std::thread> workers;
+	for (unsigned int i = 1; i < threads; i++)
+		workers.emplace_back(encode);
+	encode();
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+// encodes every level of a BuildMipChain chain, largest first
+void CompressImage(const unsigned char* _levels, unsigned int _width, unsigned int _height, unsigned int _compression,
+					std::vector<unsigned char>& _outData)
+{
+	_outData.resize(GetCompressedSize(_width, _height, _compression));
+	const unsigned char* pixels = _levels;
+	size_t offset = 0;
+	for (unsigned int i = 0; i < GetMipLevelCount(_width, _height); i++)
+	{
+		unsigned int width = G_LARGER(_width >> i, 1u), height = G_LARGER(_height >> i, 1u);
+		CompressLevel(pixels, width, height, _compression, _outData.data() + offset);
+		pixels += static_cast<size_t>(width) * height * 4;
+		offset += GetCompressedLevelSize(_width, _height, _compression, i);
+	}
+}
+
+static const unsigned char KTX2_IDENTIFIER[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+struct KTX2Header
+{
+	unsigned char identifier[12];
+	unsigned int vkFormat;
+	unsigned int typeSize;
+	unsigned int pixelWidth;
+	unsigned int pixelHeight;
+	unsigned int pixelDepth;
+	unsigned int layerCount;
+	unsigned int faceCount;
+	unsigned int levelCount;
+	unsigned int supercompressionScheme;
+	unsigned int dfdByteOffset;
+	unsigned int dfdByteLength;
+	unsigned int kvdByteOffset;
+	unsigned int kvdByteLength;
+	unsigned long long sgdByteOffset;
+	unsigned long long sgdByteLength;
+};
+
+struct KTX2Level
+{
+	unsigned long long byteOffset;
+	unsigned long long byteLength;
+	unsigned long long uncompressedByteLength;
+};
+
+// Writes a compressed mip chain as a KTX2 file, _key is stored alongside so ReadCompressedImage can
+// tell whether the file still matches its source
+bool WriteCompressedImage(const std::string& _path, unsigned int _width, unsigned int _height, unsigned int _compression,
+						const std::vector<unsigned char>& _data, unsigned long long _key)
+{
+	unsigned int levelCount = GetMipLevelCount(_width, _height);
+	unsigned int blockSize = GetCompressedBlockSize(_compression);
+
+	// basic data format descriptor, one sample per 64 bits of the block
+	static const unsigned int models[] = { 0, 128, 131, 132, 134 }; // KHR_DF_MODEL_BC1A, BC4, BC5 and BC7 by compression
+	unsigned int samples = (_compression == TEXTURE_COMPRESSION_BC5) ? 2 : 1;
+	std::vector<unsigned int> dfd = { 0, 0, 2u | ((24 + 16 * samples) << 16) }; // total size, vendor and type, version and block size
+	dfd.push_back(models[_compression] | (1u << 8) | (1u << 16)); // BT.709 primaries, linear
+	dfd.push_back(3 | (3 << 8)); // 4x4 texel blocks
+	dfd.push_back(blockSize);
+	dfd.push_back(0);
+	for (unsigned int s = 0; s < samples; s++)
+	{
+		unsigned int bits = (samples == 1) ? blockSize * 8 : 64;
+		dfd.push_back((s * 64) | ((bits - 1) << 16) | (s << 24));
+		dfd.push_back(0);
+		dfd.push_back(0);
+		dfd.push_back(0xFFFFFFFFu);
+	}
+	dfd[0] = static_cast<unsigned int>(dfd.size() * sizeof(unsigned int));
+
+	// a single key/value entry holding the source key as hex
+	char value[17];
+	snprintf(value, sizeof(value), "%016llx", _key);
+	std::string entry = std::string(TEXTURE_CACHE_KEY) + '\0' + value + '\0';
+	std::vector<unsigned char> kvd(4);
+	unsigned int entryLength = static_cast<unsigned int>(entry.size());
+	memcpy(kvd.data(), &entryLength, 4);
+	kvd.insert(kvd.end(), entry.begin(), entry.end());
+	kvd.resize((kvd.size() + 3) & ~size_t(3));
+
+	KTX2Header header = {};
+	memcpy(header.identifier, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER));
+	header.vkFormat = GetCompressedFormat(_compression);
+	header.typeSize = 1;
+	header.pixelWidth = _width;
+	header.pixelHeight = _height;
+	header.faceCount = 1;
+	header.levelCount = levelCount;
+	header.dfdByteOffset = static_cast<unsigned int>(sizeof(KTX2Header) + levelCount * sizeof(KTX2Level));
+	header.dfdByteLength = dfd[0];
+	header.kvdByteOffset = header.dfdByteOffset + header.dfdByteLength;
+	header.kvdByteLength = static_cast<unsigned int>(kvd.size());
+
+	// the file holds the smallest level first, each one aligned to a block
+	std::vector<KTX2Level> levels(levelCount);
+	std::vector<size_t> sourceOffsets(levelCount);
+	size_t sourceOffset = 0;
+	for (unsigned int i = 0; i < levelCount; i++)
+	{
+		sourceOffsets[i] = sourceOffset;
+		levels[i].byteLength = levels[i].uncompressedByteLength = GetCompressedLevelSize(_width, _height, _compression, i);
+		sourceOffset += static_cast<size_t>(levels[i].byteLength);
+	}
+	unsigned long long fileOffset = header.kvdByteOffset + header.kvdByteLength;
+	for (unsigned int i = levelCount; i-- > 0;)
+	{
+		fileOffset = (fileOffset + blockSize - 1) / blockSize * blockSize;
+		levels[i].byteOffset = fileOffset;
+		fileOffset += levels[i].byteLength;
+	}
+
+	std::vector<unsigned char> file(static_cast<size_t>(fileOffset));
+	memcpy(file.data(), &header, sizeof(header));
+	memcpy(file.data() + sizeof(header), levels.data(), levels.size() * sizeof(KTX2Level));
+	memcpy(file.data() + header.dfdByteOffset, dfd.data(), header.dfdByteLength);
+	memcpy(file.data() + header.kvdByteOffset, kvd.data(), kvd.size());
+	for (unsigned int i = 0; i < levelCount; i++)
+		memcpy(file.data() + levels[i].byteOffset, _data.data() + sourceOffsets[i], static_cast<size_t>(levels[i].byteLength));
+
+	// written to a temporary file first like the cooked model
+	std::string temporary = _path + ".tmp";
+	FILE* output = fopen(temporary.c_str(), "wb");
+	if (output == nullptr)
+		return false;
+	bool written = fwrite(file.data(), 1, file.size(), output) == file.size();
+	written = (fclose(output) == 0) && written;
+	remove(_path.c_str());
+	if (!written || rename(temporary.c_str(), _path.c_str()) != 0)
+	{
+		remove(temporary.c_str());
+		return false;
+	}
+	return true;
+}
+
+// reads a mip chain written by WriteCompressedImage, false if it is missing or doesn't match
+bool ReadCompressedImage(const std::string& _path, unsigned int _width, unsigned int _height, unsigned int _compression,
+						unsigned long long _key, std::vector<unsigned char>& _outData)
+{
+	FILE* input = fopen(_path.c_str(), "rb");
+	if (input == nullptr)
+		return false;
+	std::vector<unsigned char> file;
+	unsigned char chunk[1 << 16];
+	for (size_t read; (read = fread(chunk, 1, sizeof(chunk), input)) > 0;)
+		file.insert(file.end(), chunk, chunk + read);
+	fclose(input);
+
+	KTX2Header header;
+	unsigned int levelCount = GetMipLevelCount(_width, _height);
+	if (file.size() < sizeof(header) + levelCount * sizeof(KTX2Level))
+		return false;
+	memcpy(&header, file.data(), sizeof(header));
+	if (memcmp(header.identifier, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER)) != 0 || header.vkFormat != static_cast<unsigned int>(GetCompressedFormat(_compression))
+		|| header.pixelWidth != _width || header.pixelHeight != _height || header.levelCount != levelCount
+		|| header.supercompressionScheme != 0 || header.kvdByteOffset > file.size() || header.kvdByteLength > file.size() - header.kvdByteOffset)
+		return false;
+
+	char value[17];
+	snprintf(value, sizeof(value), "%016llx", _key);
+	std::string entry = std::string(TEXTURE_CACHE_KEY) + '\0' + value + '\0';
+	unsigned int entryLength = 0;
+	if (header.kvdByteLength < 4 + entry.size())
+		return false;
+	memcpy(&entryLength, file.data() + header.kvdByteOffset, 4);
+	if (entryLength != entry.size() || memcmp(file.data() + header.kvdByteOffset + 4, entry.data(), entry.size()) != 0)
+		return false;
+
+	_outData.clear();
+	for (unsigned int i = 0; i < levelCount; i++)
+	{
+		KTX2Level level;
+		memcpy(&level, file.data() + sizeof(header) + i * sizeof(KTX2Level), sizeof(level));
+		if (level.byteLength != GetCompressedLevelSize(_width, _height, _compression, i)
+			|| level.byteOffset > file.size() || level.byteLength > file.size() - level.byteOffset)
+			return false;
+		_outData.insert(_outData.end(), file.begin() + static_cast<size_t>(level.byteOffset),
+			file.begin() + static_cast<size_t>(level.byteOffset + level.byteLength));
+	}
+	return true;
+}
+
+#endif // !TEXTURECOMPRESSOR_H
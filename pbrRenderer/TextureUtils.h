@@ -1,104 +1,333 @@
 #ifndef TEXTUREUTILS_H
 #define TEXTUREUTILS_H
 
-// Requires tinygltf.h and Gateware.h
+// Requires tinygltf.h, Gateware.h, StagingRing.h, MipGenerator.h, TextureCompressor.h and ModelCache.h
 
-// function to upload a texture to the GPU
-void UploadTextureToGPU(GW::GRAPHICS::GVulkanSurface _surface, const tinygltf::Image& _img, 
-						VkBuffer& _outTextureBuffer, VkDeviceMemory& _outTextureMemory, 
-						VkImage& _outTextureImage, VkImageView& _outTextureImageView)
+// format of the GPU image for RGBA pixels with 8, 16 or 32 bits per channel
+VkFormat GetTextureFormat(unsigned int _bits)
 {
-	// grab all the needed handles
-	VkQueue vkQGX;
-	VkDevice vkDev;
-	VkPhysicalDevice vkPDev;
-	VkCommandPool vkCmdPool;
-	_surface.GetDevice(reinterpret_cast<void**>(&vkDev));
-	_surface.GetGraphicsQueue(reinterpret_cast<void**>(&vkQGX));
-	_surface.GetPhysicalDevice(reinterpret_cast<void**>(&vkPDev));
-	_surface.GetCommandPool(reinterpret_cast<void**>(&vkCmdPool));
-	
-	//Set up Texture staging buffer
-	VkDeviceSize imageSize = _img.width * _img.height * _img.component;
-	VkBuffer staging_bufferIM; // temp, will be cleaned up
-	VkDeviceMemory staging_buffer_memoryIM; // temp, will be cleaned up
-	VkDeviceMemory transitionMemory; // temp, will be cleaned up
-
 	// determine format 8bit default
 	VkFormat format = VK_FORMAT_R8G8B8A8_UNORM;
-	if (_img.bits == 16)
+	if (_bits == 16)
 		format = VK_FORMAT_R16G16B16A16_SFLOAT;
-	else if (_img.bits == 32)
+	else if (_bits == 32)
 		format = VK_FORMAT_R32G32B32A32_SFLOAT;
+	return format;
+}
+
+// format of the GPU image for cooked pixels, block compressed or with 1, 2 or 4 channels of 8 bits
+VkFormat GetCookedFormat(unsigned int _compression, unsigned int _channels)
+{
+	if (_compression != TEXTURE_COMPRESSION_NONE)
+		return GetCompressedFormat(_compression);
+	return (_channels == 1) ? VK_FORMAT_R8_UNORM : (_channels == 2) ? VK_FORMAT_R8G8_UNORM : VK_FORMAT_R8G8B8A8_UNORM;
+}
 
-	//Create the staging buffers
-	GvkHelper::create_buffer(vkPDev, vkDev, imageSize,
-		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		&staging_bufferIM, &staging_buffer_memoryIM);
+// the view mapping that reads channels stored as TEXTURE_SWIZZLE_* back as RGBA, shaders never see the difference
+VkComponentMapping GetTextureSwizzle(unsigned int _swizzle)
+{
+	switch (_swizzle)
+	{
+	case TEXTURE_SWIZZLE_GREY:
+		return { VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_ONE };
+	case TEXTURE_SWIZZLE_GREY_ALPHA:
+		return { VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_G };
+	case TEXTURE_SWIZZLE_GREEN_BLUE:
+		return { VK_COMPONENT_SWIZZLE_ONE, VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_G, VK_COMPONENT_SWIZZLE_ONE };
+	}
+	return { VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_G, VK_COMPONENT_SWIZZLE_B, VK_COMPONENT_SWIZZLE_A };
+}
 
-	//Copy the staging information over
-	GvkHelper::write_to_buffer(vkDev, staging_buffer_memoryIM,
-		_img.image.data(), static_cast<unsigned int>(imageSize));
-	//Create the new Buffer
-	GvkHelper::create_buffer(vkPDev, vkDev, imageSize,
-		VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-		&_outTextureBuffer, &transitionMemory);
+// view of every level and layer of _image reading its channels through _swizzle
+VkResult CreateTextureView(VkDevice _device, VkImage _image, VkFormat _format, VkImageViewType _type, uint32_t _levels, uint32_t _layers,
+						unsigned int _swizzle, VkImageView& _outImageView)
+{
+	VkImageViewCreateInfo viewInfo = {};
+	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	viewInfo.image = _image;
+	viewInfo.format = _format;
+	viewInfo.viewType = _type;
+	viewInfo.components = GetTextureSwizzle(_swizzle);
+	viewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, _levels, 0, _layers };
+	return vkCreateImageView(_device, &viewInfo, nullptr, &_outImageView);
+}
 
-	//Copy the staging buffer data to the new buffer
-	GvkHelper::copy_buffer(vkDev, vkCmdPool, vkQGX, staging_bufferIM, _outTextureBuffer, imageSize);
+// whether the surface's device can sample BC compressed images, Gateware enables every feature the GPU has
+bool IsTextureCompressionSupported(GW::GRAPHICS::GVulkanSurface _surface)
+{
+	VkPhysicalDevice physicalDevice;
+	_surface.GetPhysicalDevice(reinterpret_cast<void**>(&physicalDevice));
+	VkPhysicalDeviceFeatures features;
+	vkGetPhysicalDeviceFeatures(physicalDevice, &features);
+	return features.textureCompressionBC == VK_TRUE;
+}
 
-	VkExtent3D tempExtent = { _img.width, _img.height, 1 };
-	uint32_t mipLevels = static_cast<uint32_t>( floor( log2( G_LARGER(_img.width, _img.height))) + 1);
-	GvkHelper::create_image(vkPDev, vkDev, tempExtent, mipLevels, VK_SAMPLE_COUNT_1_BIT, format, VK_IMAGE_TILING_OPTIMAL, 
-		VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, nullptr, &_outTextureImage, &_outTextureMemory);
+// records the blits building every mip of _image from level 0, each level ends up shader readable
+void RecordTextureMipmaps(VkCommandBuffer _commandBuffer, VkImage _image, unsigned int _width, unsigned int _height, uint32_t _mipLevels)
+{
+	VkImageMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.image = _image;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.baseArrayLayer = 0;
+	barrier.subresourceRange.layerCount = 1;
+	barrier.subresourceRange.levelCount = 1;
 
-	//transition
-	GvkHelper::transition_image_layout(vkDev, vkCmdPool, vkQGX, mipLevels, _outTextureImage, format,
-		VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+	int32_t mipWidth = static_cast<int32_t>(_width);
+	int32_t mipHeight = static_cast<int32_t>(_height);
+	for (uint32_t i = 1; i < _mipLevels; i++)
+	{
+		// the previous level becomes the blit source
+		barrier.subresourceRange.baseMipLevel = i - 1;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+		vkCmdPipelineBarrier(_commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+			0, nullptr, 0, nullptr, 1, &barrier);
 
-	GvkHelper::copy_buffer_to_image(vkDev, vkCmdPool, vkQGX, staging_bufferIM, _outTextureImage, tempExtent);
+		VkImageBlit blit = {};
+		blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		blit.srcSubresource.mipLevel = i - 1;
+		blit.srcSubresource.layerCount = 1;
+		blit.srcOffsets[1] = { mipWidth, mipHeight, 1 };
+		blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		blit.dstSubresource.mipLevel = i;
+		blit.dstSubresource.layerCount = 1;
+		blit.dstOffsets[1] = { (mipWidth > 1) ? mipWidth / 2 : 1, (mipHeight > 1) ? mipHeight / 2 : 1, 1 };
+		vkCmdBlitImage(_commandBuffer, _image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, _image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			1, &blit, VK_FILTER_LINEAR);
 
-	//create mipmaps
-	GvkHelper::create_mipmaps(vkDev, vkCmdPool, vkQGX, _outTextureImage, _img.width, _img.height, mipLevels);
+		// and is done, the shader may read it
+		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		vkCmdPipelineBarrier(_commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+			0, nullptr, 0, nullptr, 1, &barrier);
 
-	GvkHelper::create_image_view(vkDev, _outTextureImage, format,
-		VK_IMAGE_ASPECT_COLOR_BIT, mipLevels, nullptr, &_outTextureImageView);
+		mipWidth = G_LARGER(mipWidth / 2, 1);
+		mipHeight = G_LARGER(mipHeight / 2, 1);
+	}
 
-	vkDestroyBuffer(vkDev, staging_bufferIM, nullptr);
-	vkFreeMemory(vkDev, staging_buffer_memoryIM, nullptr); //staging buffer IM cleaned
-	vkFreeMemory(vkDev, transitionMemory, nullptr); //staging buffer IM cleaned
+	// the last level was only ever written to
+	barrier.subresourceRange.baseMipLevel = _mipLevels - 1;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(_commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+		0, nullptr, 0, nullptr, 1, &barrier);
 }
 
-// same as above but can be passed a file instead
-void UploadTextureToGPU(GW::GRAPHICS::GVulkanSurface _surface, const std::string& _file,
-	VkBuffer& _outTextureBuffer, VkDeviceMemory& _outTextureMemory,
-	VkImage& _outTextureImage, VkImageView& _outTextureImageView)
+// Records the uploads of any number of textures into one command buffer. Submit runs all of their
+// copies, layout transitions and mip blits behind a single fence instead of draining the queue
+// after every step of every texture. Pixels are staged through the ring, row by row when a
+// texture is too big for it.
+class TextureUploadBatch : public TransferBatch
+{
+public:
+	// queues the upload of RGBA pixels with 8, 16 or 32 bits per channel, the pixels are copied right away
+	// and the image and view can be used once Submit returns, or SubmitAsync's value completes
+	bool Add(const unsigned char* _pixels, unsigned int _width, unsigned int _height, unsigned int _bits,
+			VkDeviceMemory& _outTextureMemory, VkImage& _outTextureImage, VkImageView& _outTextureImageView)
+	{
+		return Add(_pixels, _width, _height, _bits, 4, TEXTURE_SWIZZLE_NONE, _outTextureMemory, _outTextureImage, _outTextureImageView);
+	}
+
+	// same as above for 8 bit pixels with only _channels of the four stored, read back through _swizzle
+	bool Add(const unsigned char* _pixels, unsigned int _width, unsigned int _height, unsigned int _bits, unsigned int _channels,
+			unsigned int _swizzle, VkDeviceMemory& _outTextureMemory, VkImage& _outTextureImage, VkImageView& _outTextureImageView)
+	{
+		VkDeviceSize rowSize = static_cast<VkDeviceSize>(_width) * _channels * (_bits / 8);
+		VkFormat format = (_bits == 8) ? GetCookedFormat(TEXTURE_COMPRESSION_NONE, _channels) : GetTextureFormat(_bits);
+
+		VkExtent3D tempExtent = { _width, _height, 1 };
+		uint32_t mipLevels = static_cast<uint32_t>( floor( log2( G_LARGER(_width, _height))) + 1);
+		GvkHelper::create_image(physicalDevice, device, tempExtent, mipLevels, VK_SAMPLE_COUNT_1_BIT, format, VK_IMAGE_TILING_OPTIMAL, 
+			VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, nullptr, &_outTextureImage, &_outTextureMemory);
+
+		//transition every level so the copies and the blits can write them
+		VkImageMemoryBarrier barrier = {};
+		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.image = _outTextureImage;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.srcAccessMask = 0;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, mipLevels, 0, 1 };
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+			0, nullptr, 0, nullptr, 1, &barrier);
+
+		// level 0 goes in as many rows at a time as a quarter of the ring holds
+		unsigned int rowsPerCopy = static_cast<unsigned int>(G_LARGER(staging->GetCapacity() / 4 / rowSize, VkDeviceSize(1)));
+		for (unsigned int row = 0; row < _height; row += rowsPerCopy)
+		{
+			unsigned int rows = G_SMALLER(rowsPerCopy, _height - row);
+			VkDeviceSize stagingOffset = 0;
+			unsigned char* destination = Stage(rows * rowSize, stagingOffset);
+			if (destination == nullptr)
+				return false;
+			memcpy(destination, _pixels + row * rowSize, static_cast<size_t>(rows * rowSize));
+
+			VkBufferImageCopy copy = {};
+			copy.bufferOffset = stagingOffset;
+			copy.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+			copy.imageOffset = { 0, static_cast<int32_t>(row), 0 };
+			copy.imageExtent = { _width, rows, 1 };
+			vkCmdCopyBufferToImage(commandBuffer, staging->GetBuffer(), _outTextureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy);
+		}
+
+		//create mipmaps
+		RecordTextureMipmaps(commandBuffer, _outTextureImage, _width, _height, mipLevels);
+
+		return CreateTextureView(device, _outTextureImage, format, VK_IMAGE_VIEW_TYPE_2D, mipLevels, 1, _swizzle, _outTextureImageView) == VK_SUCCESS;
+	}
+
+	// copies a mip chain, largest first, into every level of layer _layer of _image, the layer's old
+	// contents are dropped and it is left ready for fragment shaders
+	bool CopyLevels(const unsigned char* _levels, unsigned int _width, unsigned int _height, unsigned int _compression, unsigned int _channels,
+					VkImage _image, uint32_t _layer)
+	{
+		bool compressed = _compression != TEXTURE_COMPRESSION_NONE;
+		unsigned int blockHeight = (compressed) ? 4 : 1;
+		uint32_t mipLevels = GetMipLevelCount(_width, _height);
+
+		VkImageMemoryBarrier barrier = {};
+		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.image = _image;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.srcAccessMask = 0;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, mipLevels, _layer, 1 };
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+			0, nullptr, 0, nullptr, 1, &barrier);
+
+		// every level is copied in rows of texels or blocks, as many at a time as a quarter of the ring holds
+		const unsigned char* level = _levels;
+		for (uint32_t i = 0; i < mipLevels; i++)
+		{
+			unsigned int width = G_LARGER(_width >> i, 1u), height = G_LARGER(_height >> i, 1u);
+			VkDeviceSize rowSize = (compressed) ? static_cast<VkDeviceSize>((width + 3) / 4) * GetCompressedBlockSize(_compression)
+				: static_cast<VkDeviceSize>(width) * _channels;
+			unsigned int blockRows = (height + blockHeight - 1) / blockHeight;
+			unsigned int rowsPerCopy = static_cast<unsigned int>(G_LARGER(staging->GetCapacity() / 4 / rowSize, VkDeviceSize(1)));
+			for (unsigned int row = 0; row < blockRows; row += rowsPerCopy)
+			{
+				unsigned int rows = G_SMALLER(rowsPerCopy, blockRows - row);
+				VkDeviceSize stagingOffset = 0;
+				unsigned char* destination = Stage(rows * rowSize, stagingOffset);
+				if (destination == nullptr)
+					return false;
+				memcpy(destination, level + row * rowSize, static_cast<size_t>(rows * rowSize));
+
+				// the extent may run past the level's edge only up to the end of its last block
+				VkBufferImageCopy copy = {};
+				copy.bufferOffset = stagingOffset;
+				copy.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, i, _layer, 1 };
+				copy.imageOffset = { 0, static_cast<int32_t>(row * blockHeight), 0 };
+				copy.imageExtent = { width, G_SMALLER(rows * blockHeight, height - row * blockHeight), 1 };
+				vkCmdCopyBufferToImage(commandBuffer, staging->GetBuffer(), _image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy);
+			}
+			level += blockRows * rowSize;
+		}
+
+		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+			0, nullptr, 0, nullptr, 1, &barrier);
+		return true;
+	}
+
+	// queues the upload of a mip chain built at cook time, largest level first, 8 bit pixels with _channels
+	// as made by BuildMipChain and PackImageChannels or block compressed as made by CompressImage, read
+	// through _swizzle. Nothing is blitted, each level is a single copy unless it is bigger than a quarter of the ring
+	bool AddLevels(const unsigned char* _levels, unsigned int _width, unsigned int _height, unsigned int _compression, unsigned int _channels,
+			unsigned int _swizzle, VkDeviceMemory& _outTextureMemory, VkImage& _outTextureImage, VkImageView& _outTextureImageView)
+	{
+		VkFormat format = GetCookedFormat(_compression, _channels);
+		VkExtent3D tempExtent = { _width, _height, 1 };
+		uint32_t mipLevels = GetMipLevelCount(_width, _height);
+		GvkHelper::create_image(physicalDevice, device, tempExtent, mipLevels, VK_SAMPLE_COUNT_1_BIT, format, VK_IMAGE_TILING_OPTIMAL,
+			VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, nullptr, &_outTextureImage, &_outTextureMemory);
+		if (!CopyLevels(_levels, _width, _height, _compression, _channels, _outTextureImage, 0))
+			return false;
+
+		return CreateTextureView(device, _outTextureImage, format, VK_IMAGE_VIEW_TYPE_2D, mipLevels, 1, _swizzle, _outTextureImageView) == VK_SUCCESS;
+	}
+
+	// queues the upload of a model image, compressed or not, the GPU only builds mips the cook didn't
+	bool Add(const ModelImage& _image, VkDeviceMemory& _outTextureMemory, VkImage& _outTextureImage, VkImageView& _outTextureImageView)
+	{
+		if (_image.compression != TEXTURE_COMPRESSION_NONE || _image.levels > 1)
+			return AddLevels(_image.pixels, _image.width, _image.height, _image.compression, _image.channels, _image.swizzle,
+				_outTextureMemory, _outTextureImage, _outTextureImageView);
+		return Add(_image.pixels, _image.width, _image.height, _image.bits, _image.channels, _image.swizzle,
+			_outTextureMemory, _outTextureImage, _outTextureImageView);
+	}
+
+	// same as above but loads an 8 bit image file with stb_image, false if it can't be read. Grey files stay
+	// one or two channels, RGB ones get an alpha since few devices sample three channel formats
+	bool Add(const std::string& _file, VkDeviceMemory& _outTextureMemory, VkImage& _outTextureImage, VkImageView& _outTextureImageView)
+	{
+		int width, height, component;
+		if (!stbi_info(_file.c_str(), &width, &height, &component))
+			return false;
+		int channels = (component == 1 || component == 2) ? component : STBI_rgb_alpha;
+		stbi_uc* data = stbi_load(_file.c_str(), &width, &height, &component, channels);
+		if (data == nullptr)
+			return false;
+		unsigned int swizzle = (channels == 1) ? TEXTURE_SWIZZLE_GREY : (channels == 2) ? TEXTURE_SWIZZLE_GREY_ALPHA : TEXTURE_SWIZZLE_NONE;
+		bool ret = Add(data, width, height, 8, channels, swizzle, _outTextureMemory, _outTextureImage, _outTextureImageView);
+		stbi_image_free(data);
+		return ret;
+	}
+};
+
+// function to upload RGBA pixels with 8, 16 or 32 bits per channel to the GPU
+void UploadTextureToGPU(GW::GRAPHICS::GVulkanSurface _surface, StagingRing& _staging, const unsigned char* _pixels,
+						unsigned int _width, unsigned int _height, unsigned int _bits,
+						VkDeviceMemory& _outTextureMemory, VkImage& _outTextureImage, VkImageView& _outTextureImageView)
 {
-	tinygltf::Image img = {};
-	// open a file using stb_image
-	int width, height, component;
-	auto data = stbi_load(_file.c_str(), &width, &height, &component, STBI_rgb_alpha); // force 4 channels
-	img.width = width;
-	img.height = height;
-	img.component = 4; // always 4 channels even if the image is 3
-	img.bits = 8; // always 8 bits per channel
-	img.image.resize(img.width * img.height * img.component);
-	memcpy(img.image.data(), data, img.image.size());
-	UploadTextureToGPU(_surface, img, _outTextureBuffer, _outTextureMemory, _outTextureImage, _outTextureImageView);
-	stbi_image_free(data);
+	TextureUploadBatch batch;
+	batch.Begin(_surface, _staging);
+	batch.Add(_pixels, _width, _height, _bits, _outTextureMemory, _outTextureImage, _outTextureImageView);
+	batch.Submit();
 }
 
-VkResult CreateSampler(	GW::GRAPHICS::GVulkanSurface _surface, VkSampler& _outSampler,
-						VkSamplerAddressMode _addressMode = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
-						VkFilter _filter = VK_FILTER_LINEAR, float _anisotropy = 4.0f)
+// same as above but can be passed an image decoded by TinyGLTF (must be 4 channels)
+void UploadTextureToGPU(GW::GRAPHICS::GVulkanSurface _surface, StagingRing& _staging, const tinygltf::Image& _img,
+	VkDeviceMemory& _outTextureMemory, VkImage& _outTextureImage, VkImageView& _outTextureImageView)
 {
-	// grab all the needed handles
-	VkDevice vkDev;
-	_surface.GetDevice(reinterpret_cast<void**>(&vkDev));
+	UploadTextureToGPU(_surface, _staging, _img.image.data(), _img.width, _img.height, _img.bits,
+		_outTextureMemory, _outTextureImage, _outTextureImageView);
+}
+
+// same as above but can be passed a file instead
+void UploadTextureToGPU(GW::GRAPHICS::GVulkanSurface _surface, StagingRing& _staging, const std::string& _file,
+	VkDeviceMemory& _outTextureMemory, VkImage& _outTextureImage, VkImageView& _outTextureImageView)
+{
+	TextureUploadBatch batch;
+	batch.Begin(_surface, _staging);
+	batch.Add(_file, _outTextureMemory, _outTextureImage, _outTextureImageView);
+	batch.Submit();
+}
 
-	// create the the image view and sampler
+// the create info of the samplers CreateSampler makes
+VkSamplerCreateInfo GetSamplerCreateInfo(	VkSamplerAddressMode _addressMode = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+											VkFilter _filter = VK_FILTER_LINEAR, float _anisotropy = 4.0f)
+{
 	VkSamplerCreateInfo samplerInfo = {};
 	// Set the struct values
 	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
@@ -121,6 +350,19 @@ VkResult CreateSampler(	GW::GRAPHICS::GVulkanSurface _surface, VkSampler& _outSa
 	samplerInfo.unnormalizedCoordinates = VK_FALSE;
 	samplerInfo.pNext = nullptr;
 
+	return samplerInfo;
+}
+
+VkResult CreateSampler(	GW::GRAPHICS::GVulkanSurface _surface, VkSampler& _outSampler,
+						VkSamplerAddressMode _addressMode = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+						VkFilter _filter = VK_FILTER_LINEAR, float _anisotropy = 4.0f)
+{
+	// grab all the needed handles
+	VkDevice vkDev;
+	_surface.GetDevice(reinterpret_cast<void**>(&vkDev));
+
+	// create the sampler
+	VkSamplerCreateInfo samplerInfo = GetSamplerCreateInfo(_addressMode, _filter, _anisotropy);
 	return vkCreateSampler(vkDev, &samplerInfo, nullptr, &_outSampler);
 }
 
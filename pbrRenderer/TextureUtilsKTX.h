@@ -1,74 +1,215 @@
 #ifndef TEXTUREUTILSKTX_H
 #define TEXTUREUTILSKTX_H
 
-// Requires KTX Texture Library and Gateware.h
+// Requires KTX Texture Library, Gateware.h, StagingRing.h, ModelCache.h and TextureUtils.h
+
+// KTX and KTX2 loading. Files are read and inflated by libktx (zstd supercompression included), Basis
+// Universal payloads, ETC1S or UASTC, are then transcoded to the best block format the GPU samples.
+// Both happen on worker threads, one per file. The levels go to the GPU through the staging ring one
+// face at a time, smallest first, instead of through a staging buffer holding the whole texture.
 #define KHRONOS_STATIC
 #include <ktxvulkan.h>
+#include <thread>
+
+#define KTX_TRANSFER_SRGB 2 // KHR_DF_TRANSFER_SRGB, khr_df.h doesn't ship with the library headers
+
+// format a Basis payload is transcoded to, block compressed whenever the GPU can sample one
+ktx_transcode_fmt_e GetKTXTranscodeFormat(VkPhysicalDevice _physicalDevice, ktxTexture2* _texture)
+{
+	auto sampled = [&](VkFormat _format)
+		{
+			VkFormatProperties properties;
+			vkGetPhysicalDeviceFormatProperties(_physicalDevice, _format, &properties);
+			return (properties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) != 0;
+		};
+
+	// the one and two channel formats have no sRGB variants
+	unsigned int components = ktxTexture2_GetNumComponents(_texture);
+	bool linear = ktxTexture2_GetOETF(_texture) != KTX_TRANSFER_SRGB;
+	if (sampled(VK_FORMAT_BC7_UNORM_BLOCK))
+	{
+		if (linear && components == 1)
+			return KTX_TTF_BC4_R;
+		if (linear && components == 2)
+			return KTX_TTF_BC5_RG;
+		return KTX_TTF_BC7_RGBA;
+	}
+	if (sampled(VK_FORMAT_ASTC_4x4_UNORM_BLOCK))
+		return KTX_TTF_ASTC_4x4_RGBA;
+	if (sampled(VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK))
+	{
+		if (linear && components == 1)
+			return KTX_TTF_ETC2_EAC_R11;
+		if (linear && components == 2)
+			return KTX_TTF_ETC2_EAC_RG11;
+		return KTX_TTF_ETC;
+	}
+	return KTX_TTF_RGBA32;
+}
+
+// reads a KTX or KTX2 file with its image data, transcoding it if it holds Basis data. nullptr on failure
+ktxTexture* LoadKTXTexture(VkPhysicalDevice _physicalDevice, const std::string& _ktx_img)
+{
+	ktxTexture* kTexture = nullptr;
+	if (ktxTexture_CreateFromNamedFile(_ktx_img.c_str(), KTX_TEXTURE_CREATE_LOAD_IMAGE_DATA_BIT, &kTexture) != KTX_SUCCESS)
+		return nullptr;
+	if (kTexture->classId == ktxTexture2_c && ktxTexture2_NeedsTranscoding(reinterpret_cast<ktxTexture2*>(kTexture)))
+	{
+		ktxTexture2* kTexture2 = reinterpret_cast<ktxTexture2*>(kTexture);
+		if (ktxTexture2_TranscodeBasis(kTexture2, GetKTXTranscodeFormat(_physicalDevice, kTexture2), KTX_TF_HIGH_QUALITY) != KTX_SUCCESS)
+		{
+			ktxTexture_Destroy(kTexture);
+			return nullptr;
+		}
+	}
+	return kTexture;
+}
 
-// function to upload a texture to the GPU
-bool UploadKTXTextureToGPU(	GW::GRAPHICS::GVulkanSurface _surface, const std::string& _ktx_img,
-							VkBuffer& _outTextureBuffer, VkDeviceMemory& _outTextureMemory,
-							VkImage& _outTextureImage, VkImageView& _outTextureImageView)
+// loads every file in _files at once, one worker each, failed ones come back as nullptr
+void LoadKTXTextures(GW::GRAPHICS::GVulkanSurface _surface, const std::vector<std::string>& _files, std::vector<ktxTexture*>& _outTextures)
 {
-	// Gateware, access to underlying Vulkan queue and command pool & physical device
-	VkDevice device;
-	VkQueue graphicsQueue;
-	VkCommandPool cmdPool;
 	VkPhysicalDevice physicalDevice;
-	_surface.GetDevice((void**)&device);
-	_surface.GetGraphicsQueue((void**)&graphicsQueue);
-	_surface.GetCommandPool((void**)&cmdPool);
-	_surface.GetPhysicalDevice((void**)&physicalDevice);
-	// libktx, temporary variables
-	ktxVulkanTexture texture;
-	ktxTexture* kTexture;
-	KTX_error_code ktxresult;
-	ktxVulkanDeviceInfo vdi;
-	// used to transfer texture CPU memory to GPU. just need one
-	ktxresult = ktxVulkanDeviceInfo_Construct(&vdi, physicalDevice, device,
-		graphicsQueue, cmdPool, nullptr);
-	if (ktxresult != KTX_error_code::KTX_SUCCESS)
-		return false;
-	// load texture into CPU memory from file
-	ktxresult = ktxTexture_CreateFromNamedFile(_ktx_img.c_str(),
-		KTX_TEXTURE_CREATE_NO_FLAGS, &kTexture);
-	if (ktxresult != KTX_error_code::KTX_SUCCESS)
-		return false;
-	// This gets mad if you don't encode/save the .ktx file in a format Vulkan likes
-	ktxresult = ktxTexture_VkUploadEx(kTexture, &vdi, &texture,
-		VK_IMAGE_TILING_OPTIMAL,
-		VK_IMAGE_USAGE_SAMPLED_BIT,
-		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-	if (ktxresult != KTX_error_code::KTX_SUCCESS)
+	_surface.GetPhysicalDevice(reinterpret_cast<void**>(&physicalDevice));
+	_outTextures.assign(_files.size(), nullptr);
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < _files.size(); i++)
+		workers.emplace_back([&, i]() { _outTextures[i] = LoadKTXTexture(physicalDevice, _files[i]); });
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+// TextureCache key of a loaded texture, a hash of its (transcoded) data mixed with its format and layout
+unsigned long long GetKTXTextureKey(ktxTexture* _texture)
+{
+	unsigned int format[6] = { static_cast<unsigned int>(ktxTexture_GetVkFormat(_texture)), _texture->baseWidth, _texture->baseHeight,
+		_texture->numLevels, _texture->numLayers, _texture->numFaces };
+	return HashBytes(format, sizeof(format), HashBytes(ktxTexture_GetData(_texture), ktxTexture_GetDataSize(_texture)));
+}
+
+// A TextureUploadBatch that also takes textures loaded by libktx, cube maps and arrays included
+class KTXUploadBatch : public TextureUploadBatch
+{
+public:
+	using TextureUploadBatch::Add;
+
+	// queues the upload of every level, layer and face of _texture, it may be destroyed as soon as this returns
+	bool Add(ktxTexture* _texture, VkDeviceMemory& _outTextureMemory, VkImage& _outTextureImage, VkImageView& _outTextureImageView)
+	{
+		if (_texture == nullptr || _texture->numDimensions != 2)
+			return false;
+		VkFormat format = ktxTexture_GetVkFormat(_texture);
+		uint32_t layers = _texture->numLayers * _texture->numFaces;
+
+		VkImageCreateInfo imageInfo = {};
+		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+		imageInfo.flags = (_texture->isCubemap) ? VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT : 0;
+		imageInfo.imageType = VK_IMAGE_TYPE_2D;
+		imageInfo.format = format;
+		imageInfo.extent = { _texture->baseWidth, _texture->baseHeight, 1 };
+		imageInfo.mipLevels = _texture->numLevels;
+		imageInfo.arrayLayers = layers;
+		imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+		imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+		imageInfo.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+		imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		if (vkCreateImage(device, &imageInfo, nullptr, &_outTextureImage) != VK_SUCCESS)
+			return false;
+		VkMemoryRequirements requirements;
+		vkGetImageMemoryRequirements(device, _outTextureImage, &requirements);
+		VkMemoryAllocateInfo allocateInfo = {};
+		allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		allocateInfo.allocationSize = requirements.size;
+		GvkHelper::find_memory_type(physicalDevice, requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &allocateInfo.memoryTypeIndex);
+		if (vkAllocateMemory(device, &allocateInfo, nullptr, &_outTextureMemory) != VK_SUCCESS)
+			return false;
+		vkBindImageMemory(device, _outTextureImage, _outTextureMemory, 0);
+
+		VkImageMemoryBarrier barrier = {};
+		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.image = _outTextureImage;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.srcAccessMask = 0;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, _texture->numLevels, 0, layers };
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+			0, nullptr, 0, nullptr, 1, &barrier);
+
+		// every block format libktx hands out covers 4x4 texels, a face goes in as many block rows
+		// at a time as a quarter of the ring holds
+		const unsigned char* data = ktxTexture_GetData(_texture);
+		unsigned int blockHeight = (_texture->isCompressed) ? 4 : 1;
+		for (uint32_t level = _texture->numLevels; level-- > 0;)
+		{
+			unsigned int width = G_LARGER(_texture->baseWidth >> level, 1u), height = G_LARGER(_texture->baseHeight >> level, 1u);
+			unsigned int blockRows = (height + blockHeight - 1) / blockHeight;
+			VkDeviceSize rowSize = ktxTexture_GetImageSize(_texture, level) / blockRows;
+			unsigned int rowsPerCopy = static_cast<unsigned int>(G_LARGER(staging->GetCapacity() / 4 / rowSize, VkDeviceSize(1)));
+			for (uint32_t layer = 0; layer < _texture->numLayers; layer++)
+				for (uint32_t face = 0; face < _texture->numFaces; face++)
+				{
+					ktx_size_t offset = 0;
+					ktxTexture_GetImageOffset(_texture, level, layer, face, &offset);
+					for (unsigned int row = 0; row < blockRows; row += rowsPerCopy)
+					{
+						unsigned int rows = G_SMALLER(rowsPerCopy, blockRows - row);
+						VkDeviceSize stagingOffset = 0;
+						unsigned char* destination = Stage(rows * rowSize, stagingOffset);
+						if (destination == nullptr)
+							return false;
+						memcpy(destination, data + offset + row * rowSize, static_cast<size_t>(rows * rowSize));
+
+						VkBufferImageCopy copy = {};
+						copy.bufferOffset = stagingOffset;
+						copy.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level, layer * _texture->numFaces + face, 1 };
+						copy.imageOffset = { 0, static_cast<int32_t>(row * blockHeight), 0 };
+						copy.imageExtent = { width, G_SMALLER(rows * blockHeight, height - row * blockHeight), 1 };
+						vkCmdCopyBufferToImage(commandBuffer, staging->GetBuffer(), _outTextureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy);
+					}
+				}
+		}
+
+		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+			0, nullptr, 0, nullptr, 1, &barrier);
+
+		VkImageViewCreateInfo viewInfo = {};
+		viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+		viewInfo.image = _outTextureImage;
+		viewInfo.format = format;
+		if (_texture->isCubemap)
+			viewInfo.viewType = (_texture->isArray) ? VK_IMAGE_VIEW_TYPE_CUBE_ARRAY : VK_IMAGE_VIEW_TYPE_CUBE;
+		else
+			viewInfo.viewType = (_texture->isArray) ? VK_IMAGE_VIEW_TYPE_2D_ARRAY : VK_IMAGE_VIEW_TYPE_2D;
+		viewInfo.components = {
+			VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_G,
+			VK_COMPONENT_SWIZZLE_B, VK_COMPONENT_SWIZZLE_A
+		};
+		viewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, _texture->numLevels, 0, layers };
+		return vkCreateImageView(device, &viewInfo, nullptr, &_outTextureImageView) == VK_SUCCESS;
+	}
+};
+
+// function to upload a .ktx or .ktx2 texture to the GPU, Basis payloads are transcoded first
+bool UploadKTXTextureToGPU(	GW::GRAPHICS::GVulkanSurface _surface, StagingRing& _staging, const std::string& _ktx_img,
+							VkDeviceMemory& _outTextureMemory, VkImage& _outTextureImage, VkImageView& _outTextureImageView)
+{
+	VkPhysicalDevice physicalDevice;
+	_surface.GetPhysicalDevice(reinterpret_cast<void**>(&physicalDevice));
+	ktxTexture* kTexture = LoadKTXTexture(physicalDevice, _ktx_img);
+	if (kTexture == nullptr)
 		return false;
-	// after loading all textures you don't need these anymore
+	KTXUploadBatch batch;
+	batch.Begin(_surface, _staging);
+	bool ret = batch.Add(kTexture, _outTextureMemory, _outTextureImage, _outTextureImageView);
+	batch.Submit();
 	ktxTexture_Destroy(kTexture);
-	ktxVulkanDeviceInfo_Destruct(&vdi);
-	// Create image view.
-	VkImageViewCreateInfo viewInfo = {};
-	// Set the non-default values.
-	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-	viewInfo.flags = 0;
-	viewInfo.components = {
-		VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_G,
-		VK_COMPONENT_SWIZZLE_B, VK_COMPONENT_SWIZZLE_A
-	};
-	viewInfo.image = texture.image;
-	viewInfo.format = texture.imageFormat;
-	viewInfo.viewType = texture.viewType;
-	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	viewInfo.subresourceRange.layerCount = texture.layerCount;
-	viewInfo.subresourceRange.levelCount = texture.levelCount;
-	viewInfo.subresourceRange.baseMipLevel = 0;
-	viewInfo.subresourceRange.baseArrayLayer = 0;
-	viewInfo.pNext = nullptr;
-	VkResult vr = vkCreateImageView(device, &viewInfo, nullptr, &_outTextureImageView);
-	if (vr != VkResult::VK_SUCCESS)
-		return false;
-	// transfer all the data to the output variables
-	_outTextureBuffer = nullptr; // handled by the ktx library
-	_outTextureMemory = texture.deviceMemory;
-	_outTextureImage = texture.image;
-	return true;
+	return ret;
 }
-#endif // !TEXTUREUTILSKTX_H
\ No newline at end of file
+#endif // !TEXTUREUTILSKTX_H
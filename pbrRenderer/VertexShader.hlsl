@@ -24,23 +24,64 @@ struct INSTANCE_DATA
 
 StructuredBuffer<INSTANCE_DATA> instanceData : register(b1, space0);
 
+// which instance and textures the current draw uses
+[[vk::push_constant]]
+cbuffer DRAW_VARS
+{
+    float4 positionScale, positionOffset; // dequantizes positions with QUANTIZED_VERTICES
+    uint instance;
+    int albedoMap, roughnessMetalOcclusionMap, normalMap, emissiveMap;
+    int brdfMap, irradianceMap, specularMap;
+    float alphaCutoff;
+};
+
+#ifdef QUANTIZED_VERTICES
+// unfolds a unit vector stored in the [-1,1] square by octahedral encoding
+float3 DecodeOctahedral(float2 encoded)
+{
+    float3 v = float3(encoded, 1.0f - abs(encoded.x) - abs(encoded.y));
+    float fold = saturate(-v.z);
+    v.xy += (1.0f - 2.0f * step(0.0f, v.xy)) * fold;
+    return normalize(v);
+}
+#endif
+
 OUT_V main( float3 inputVertex : POSITION,
+#ifdef QUANTIZED_VERTICES
+			float2 inputNormal : NORMAL,
+			float2 inputUV : UV,
+			float2 inputTangent : TANGENT) 
+#else
 			float3 inputNormal : NORMAL,
 			float2 inputUV : UV,
 			float4 inputTangent : TANGENT) 
+#endif
 {
     OUT_V vOut;
     
-    vOut.pos = mul(float4(inputVertex, 1.0f), instanceData[0].world);
+#ifdef QUANTIZED_VERTICES
+    float3 position = inputVertex * positionScale.xyz + positionOffset.xyz;
+    float3 normal = DecodeOctahedral(inputNormal);
+    // the sign of y is the handedness, y itself was remapped to [0,1]
+    float4 tangent = float4(DecodeOctahedral(float2(inputTangent.x, abs(inputTangent.y) * 2.0f - 1.0f)),
+                            (inputTangent.y < 0) ? -1.0f : 1.0f);
+#else
+    float3 position = inputVertex;
+    float3 normal = inputNormal;
+    float4 tangent = inputTangent;
+#endif
+    
+    vOut.pos = mul(float4(position, 1.0f), instanceData[instance].world);
     
     // get the vertex position in worldspace
     vOut.posW = vOut.pos.xyz;
     
     vOut.pos = mul(vOut.pos, view);
     vOut.pos = mul(vOut.pos, projection);
-    vOut.nrm = mul(float4(inputNormal, 0), instanceData[0].world);
+    vOut.nrm = mul(float4(normal, 0), instanceData[instance].world);
     vOut.uv = inputUV;
-    vOut.tan = mul(inputTangent, instanceData[0].world);
+    // w holds the handedness, keep it out of the transform
+    vOut.tan = float4(mul(float4(tangent.xyz, 0), instanceData[instance].world).xyz, tangent.w);
     
     return vOut;
 }
\ No newline at end of file
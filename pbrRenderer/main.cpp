@@ -40,7 +40,7 @@ int main()
 		};
 		if (+vulkan.Create(win, GW::GRAPHICS::DEPTH_BUFFER_SUPPORT | GW::GRAPHICS::BINDLESS_SUPPORT,
 			sizeof(debugLayers) / sizeof(debugLayers[0]),
-			debugLayers, 0, nullptr, 0, nullptr, false))
+			debugLayers, 0, nullptr, 0, nullptr, true)) // every feature, BC textures included
 #else
 		if (+vulkan.Create(win, GW::GRAPHICS::DEPTH_BUFFER_SUPPORT | GW::GRAPHICS::BINDLESS_SUPPORT))
 #endif
@@ -1,16 +1,70 @@
+#ifdef RUNTIME_SHADERS
 #include "shaderc/shaderc.h" // needed for compiling shaders at runtime
 #ifdef _WIN32 // must use MT platform DLL libraries on windows
 #pragma comment(lib, "shaderc_combined.lib") 
 #endif
+#endif
+#include "ShaderCache.h"
+#include "PipelineCache.h"
+#include "ShaderWatcher.h"
+
+// where the HLSL files are
+#define SHADER_PATH "../../pbrRenderer/"
+
+// recompile the shaders when their files are saved and swap the new pipelines in while running,
+// needs the runtime compiler (configure with -DRUNTIME_SHADERS=ON), embedded shaders never change
+#ifdef RUNTIME_SHADERS
+#define HOT_RELOAD_SHADERS true
+#else
+#define HOT_RELOAD_SHADERS false
+#endif
+
+// ambient light from the environment maps, the flat sun ambient otherwise
+#define IMAGE_BASED_LIGHTING true
+
+// features of the fragment shader, each combination the materials use is compiled as its own variant
+#define SHADER_FEATURE_NORMAL_MAP 1
+#define SHADER_FEATURE_EMISSIVE_MAP 2
+#define SHADER_FEATURE_IMAGE_BASED_LIGHTING 4
+#define SHADER_FEATURE_ALPHA_MASK 8
+#define SHADER_FEATURE_COUNT 4
 
 // define the path to the model files
 #define MODEL_PATH "../../pbrRenderer/Models/"
 
+// memory map .glb/.bin files and stream their buffer views straight to the GPU
+// instead of letting TinyGLTF copy them to the heap first
+#define LOAD_MODEL_MAPPED true
+
+// keep a cooked copy of the model next to it and load that instead when it is up to date
+#define LOAD_MODEL_COOKED true
+
+// cook the vertices into 16 bit positions, octahedral normals/tangents and half uvs,
+// the vertex shader is compiled with QUANTIZED_VERTICES to decode them
+#define QUANTIZE_MODEL_VERTICES true
+
+// cook 8 bit images into BC1/BC4/BC5/BC7 mip chains by what the materials use them for,
+// ignored when the GPU can't sample them
+#define COMPRESS_MODEL_TEXTURES true
+
+// filter the cook builds the mips of 8 bit images with, MIP_FILTER_BOX or MIP_FILTER_KAISER
+#define MODEL_MIP_FILTER MIP_FILTER_KAISER
+
 #define TINYGLTF_IMPLEMENTATION
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "TinyGLTF/tiny_gltf.h"
+#include "MappedFile.h"
+#include "ModelUtils.h"
+#include "MeshOptimizer.h"
+#include "MeshSimplifier.h"
+#include "MeshletUtils.h"
+#include "MipGenerator.h"
+#include "TextureCompressor.h"
+#include "ModelCache.h"
+#include "StagingRing.h"
 #include "TextureUtils.h"
+#include "TextureCache.h"
 #include "TextureUtilsKTX.h"
 #include <chrono>
 
@@ -41,29 +95,51 @@ class Renderer
 	VkBuffer geometryHandle = nullptr;
 	VkDeviceMemory geometryData = nullptr;
 
-	// Texture Data
-	struct TextureData
-	{
-		VkBuffer buffer;
-		VkDeviceMemory memory;
-		VkImage image;
-		VkImageView imageView;
-	};
-	std::vector<TextureData> textures;
+	// Texture Data, one view per descriptor, equal textures share one
+	TextureCache textureCache;
+	std::vector<VkImageView> textures;
 
-	// Texture Sampler
+	// Texture Sampler, they all have the same state so they are all the same one
+	SamplerCache samplerCache;
 	std::vector<VkSampler> textureSamplers;
 
+	// shaders compile on worker threads while the textures load, the pipeline waits for them
+	ShaderCompileService shaderCompiler;
+	std::future<CompiledShader> vertexShaderSpirv;
+	std::vector<std::future<CompiledShader>> fragmentShaderSpirv; // by shader variant
 	VkShaderModule vertexShader = nullptr;
-	VkShaderModule fragmentShader = nullptr;
-	// pipeline settings for drawing (also required)
-	VkPipeline pipeline = nullptr;
+	std::vector<VkShaderModule> fragmentShaders; // by shader variant
+	// fragment shader variants, see EnumerateShaderVariants
+	std::vector<unsigned int> shaderVariants; // SHADER_FEATURE_* bits of each
+	std::vector<unsigned int> materialVariants; // variant of each material, the first entry is for draws without one
+	// pipeline settings for drawing (also required), one pipeline per shader variant and vertex layout in the draw list
+	std::vector<VkPipeline> pipelines;
 	VkPipelineLayout pipelineLayout = nullptr;
+	PipelineCache pipelineCache; // every pipeline is created through it, kept on disk between launches
+
+	// shaders and the pipelines built from them
+	struct PipelineSet
+	{
+		VkShaderModule vertexShader = nullptr;
+		std::vector<VkShaderModule> fragmentShaders;
+		std::vector<VkPipeline> pipelines;
+		unsigned long long retired = 0; // frame from which no frame in flight draws with it
+	};
+
+	// hot reload, see UpdateShaders
+	ShaderWatcher shaderWatcher;
+	unsigned int shaderVersion = 0; // watcher version the shaders in use or being compiled were read at
+	PipelineSet reloadedPipelines; // built on a worker while frames keep drawing with the current ones
+	std::future<bool> reloading;
+	std::vector<PipelineSet> retiredPipelines; // replaced ones, destroyed once no frame in flight uses them
+	unsigned long long frameCount = 0;
 
 	unsigned int windowWidth, windowHeight;
 
-	Model model;
 	TinyGLTF loader;
+	CookedModel scene; // draw list, geometry and images of the model
+	StagingRing staging; // every upload to device local memory goes through it
+	std::vector<MeshletRange> visibleRanges; // reused by DrawScene every frame
 	std::string err;
 	std::string warn;
 
@@ -80,6 +156,16 @@ class Renderer
 	};
 	std::vector<INSTANCE_DATA> instances;
 
+	// pushed per draw, -1 means the material has no such texture
+	struct DRAW_VARS
+	{
+		PositionDequantization dequantization;
+		unsigned int instance;
+		int albedoMap, roughnessMetalOcclusionMap, normalMap, emissiveMap;
+		int brdfMap, irradianceMap, specularMap;
+		float alphaCutoff;
+	};
+
 	// Declare Uniform Buffers
 	std::vector<VkBuffer> uniformHandle;
 	std::vector<VkDeviceMemory> uniformData;
@@ -96,6 +182,9 @@ class Renderer
 	std::vector<VkDescriptorSet> descriptorSets;
 	VkDescriptorSet textureDescriptorSet;
 
+	// converts the model into our coordinate system
+	GW::MATH::GMATRIXF rootMatrix;
+
 	// Sun Direction
 	GW::MATH::GMATRIXF sunMatrix = GW::MATH::GIdentityMatrixF;
 	GW::MATH::GVECTORF sunDirection;
@@ -118,8 +207,12 @@ public:
 	{
 		win = _win;
 		vlk = _vlk;
+		staging.Create(vlk);
+		if (HOT_RELOAD_SHADERS)
+			shaderWatcher.Start({ SHADER_PATH "VertexShader.hlsl", SHADER_PATH "FragmentShader_PBR.hlsl" });
 
-		bool ret = loader.LoadASCIIFromFile(&model, &err, &warn, "../../pbrRenderer/Models/WaterBottle2.gltf");
+		bool ret = LoadCookedModel(loader, "../../pbrRenderer/Models/WaterBottle2.gltf", LOAD_MODEL_MAPPED, LOAD_MODEL_COOKED, QUANTIZE_MODEL_VERTICES,
+			COMPRESS_MODEL_TEXTURES && IsTextureCompressionSupported(vlk), MODEL_MIP_FILTER, true, scene, err, warn);
 
 		if (!warn.empty())
 			printf("Warn %s\n", warn.c_str());
@@ -130,68 +223,59 @@ public:
 		if (!ret)
 			printf("Failed to parse glTF\n");
 
-		instances.resize(model.meshes.size());
-		for (size_t i = 0; i < model.meshes.size(); i++)
-		{
-			GW::MATH::GMATRIXF newMatrix;
-			// change from left hand coordinate to right hand coordinate system
-			GW::MATH::GMATRIXF scaleMatrix;
-			GW::MATH::GMatrix::ScaleGlobalF(GW::MATH::GIdentityMatrixF, GW::MATH::GVECTORF{ 1, 1, -1 }, scaleMatrix);
-			GW::MATH::GMatrix::MultiplyMatrixF(scaleMatrix, GW::MATH::GIdentityMatrixF, newMatrix);
-			GW::MATH::GMATRIXF rotMatrix;
-			GW::MATH::GMatrix::RotateYLocalF(GW::MATH::GIdentityMatrixF, (-90.f * 3.14f) / 180.f, rotMatrix);
-			GW::MATH::GMatrix::MultiplyMatrixF(rotMatrix, newMatrix, newMatrix);
-			instances[i].worldMatrices = newMatrix;
-		}
+		// the materials pick the shader variants, they compile while the textures load
+		EnumerateShaderVariants();
+		CompileShaders();
 
-		textures.resize(model.images.size() + 3);
-		textureSamplers.resize(model.images.size() + 3);
-		std::string baseTexturePath;
-		std::string ambientMetallicRoughnessTexturePath;
-		std::string normalTexturePath;
-		std::string emmissiveTexturePath;
-		std::string fullTexturePath;
-		for (size_t i = 0; i < model.images.size(); i++)
-		{
-			if (baseTexturePath.empty())
-			{
-				baseTexturePath = model.images[model.materials[model.meshes[0].primitives[0].material].pbrMetallicRoughness.baseColorTexture.index].uri;
-				fullTexturePath = MODEL_PATH + baseTexturePath;
-			}
-			else if (ambientMetallicRoughnessTexturePath.empty())
-			{
-				ambientMetallicRoughnessTexturePath = model.images[model.materials[model.meshes[0].primitives[0].material].pbrMetallicRoughness.metallicRoughnessTexture.index].uri;
-				fullTexturePath = MODEL_PATH + ambientMetallicRoughnessTexturePath;
-			}
-			else if (normalTexturePath.empty())
-			{
-				normalTexturePath = model.images[model.materials[model.meshes[0].primitives[0].material].normalTexture.index].uri;
-				fullTexturePath = MODEL_PATH + normalTexturePath;
-			}
-			else if (emmissiveTexturePath.empty())
+		// change from left hand coordinate to right hand coordinate system, applied on top of the node hierarchy
+		GW::MATH::GMatrix::ScaleGlobalF(GW::MATH::GIdentityMatrixF, GW::MATH::GVECTORF{ 1, 1, -1 }, rootMatrix);
+		GW::MATH::GMATRIXF rotMatrix;
+		GW::MATH::GMatrix::RotateYLocalF(GW::MATH::GIdentityMatrixF, (-90.f * 3.14f) / 180.f, rotMatrix);
+		GW::MATH::GMatrix::MultiplyMatrixF(rotMatrix, rootMatrix, rootMatrix);
+
+		// the environment maps are read and transcoded on worker threads while the model textures are recorded
+		std::vector<ktxTexture*> environment;
+		std::thread environmentLoader([&]()
 			{
-				emmissiveTexturePath = model.images[model.materials[model.meshes[0].primitives[0].material].emissiveTexture.index].uri;
-				fullTexturePath = MODEL_PATH + emmissiveTexturePath;
-			}
+				LoadKTXTextures(vlk, { "../../pbrRenderer/PBR IBL ENV/diffuse.ktx2", "../../pbrRenderer/PBR IBL ENV/specular.ktx2" }, environment);
+			});
 
-			UploadTextureToGPU(vlk, fullTexturePath, textures[i].buffer, textures[i].memory, textures[i].image, textures[i].imageView);
-			CreateSampler(vlk, textureSamplers[i]);
+		// texture i is model.images[i], the material table points at them
+		// they, the lut and the environment maps are recorded into one batch so loading waits on the queue only once
+		textures.resize(scene.images.size() + 3);
+		textureSamplers.resize(scene.images.size() + 3);
+		textureCache.Create(vlk);
+		samplerCache.Create(vlk);
+		KTXUploadBatch uploads;
+		uploads.Begin(vlk, staging);
+		for (size_t i = 0; i < scene.images.size(); i++)
+		{
+			textureCache.Acquire(uploads, scene.images[i], textures[i]);
+			samplerCache.Acquire(textureSamplers[i]);
 		}
 
 		// load lut_ggx.png
-		UploadTextureToGPU(vlk, "../../pbrRenderer/PBR IBL ENV/lut_ggx.png", textures[model.images.size()].buffer, textures[model.images.size()].memory, 
-							textures[model.images.size()].image, textures[model.images.size()].imageView);
-		CreateSampler(vlk, textureSamplers[model.images.size()]);
-
-		// load diffuse.ktx2
-		UploadKTXTextureToGPU(vlk, "../../pbrRenderer/PBR IBL ENV/diffuse.ktx2", textures[model.images.size()+1].buffer, textures[model.images.size()+1].memory,
-							textures[model.images.size()+1].image, textures[model.images.size()+1].imageView);
-		CreateSampler(vlk, textureSamplers[model.images.size() + 1]);
+		textureCache.Acquire(uploads, "../../pbrRenderer/PBR IBL ENV/lut_ggx.png", textures[scene.images.size()]);
+		samplerCache.Acquire(textureSamplers[scene.images.size()]);
 
-		// load specular.ktx2
-		UploadKTXTextureToGPU(vlk, "../../pbrRenderer/PBR IBL ENV/specular.ktx2", textures[model.images.size() + 2].buffer, textures[model.images.size() + 2].memory,
-			textures[model.images.size() + 2].image, textures[model.images.size() + 2].imageView);
-		CreateSampler(vlk, textureSamplers[model.images.size() + 2]);
+		// load diffuse.ktx2 and specular.ktx2
+		environmentLoader.join();
+		for (size_t i = 0; i < environment.size(); i++)
+		{
+			size_t index = scene.images.size() + 1 + i;
+			ktxTexture* texture = environment[i];
+			if (texture == nullptr || !textureCache.Acquire(GetKTXTextureKey(texture),
+				[&](VkDeviceMemory& _outMemory, VkImage& _outImage, VkImageView& _outImageView)
+				{
+					return uploads.Add(texture, _outMemory, _outImage, _outImageView);
+				}, textures[index]))
+				printf("Failed to load environment map %zu\n", i);
+			samplerCache.Acquire(textureSamplers[index]);
+		}
+		uploads.Submit();
+		for (ktxTexture* texture : environment)
+			if (texture != nullptr)
+				ktxTexture_Destroy(texture);
 
 		// Set up the camera
 		float aspect = 0.f;
@@ -341,12 +425,12 @@ private:
 	void InitializeGraphics()
 	{
 		GetHandlesFromSurface();
+		pipelineCache.Create(vlk, "../../pbrRenderer/Pipelines.vkcache");
 		InitializeGeometry();
 
 		// Function to setup Descritor Sets
 		SetupDescriptorSets();
 
-		CompileShaders();
 		InitializeGraphicsPipeline();
 	}
 
@@ -361,6 +445,8 @@ private:
 		descriptorSets.resize(maxFrames);
 
 		// write to the uniform buffer
+		TransferBatch uploads;
+		uploads.Begin(vlk, staging);
 		for (unsigned int i = 0; i < maxFrames; i++)
 		{
 			GvkHelper::create_buffer(physicalDevice, device, sizeof(SHADER_VARS),
@@ -368,11 +454,13 @@ private:
 				VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &uniformHandle[i], &uniformData[i]);
 			GvkHelper::write_to_buffer(device, uniformData[i], &shaderVars, sizeof(SHADER_VARS));
 
-			GvkHelper::create_buffer(physicalDevice, device, sizeof(INSTANCE_DATA),
-				VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-				VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &storageHandle[i], &storageData[i]);
-			GvkHelper::write_to_buffer(device, storageData[i], &instances[i], sizeof(INSTANCE_DATA));
+			// the scene is static, every draw's world matrix is uploaded once here
+			size_t instanceCount = (instances.empty()) ? 1 : instances.size();
+			CreateDeviceBuffer(uploads, physicalDevice, device, (instances.empty()) ? nullptr : instances.data(),
+				sizeof(INSTANCE_DATA) * instanceCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, storageHandle[i], storageData[i]);
 		}
+		uploads.BufferBarrier(VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+		uploads.Submit();
 
 		// setup descriptor pool size
 		VkDescriptorPoolSize arrPoolSize[3] = {};
@@ -509,7 +597,7 @@ private:
 		for (size_t i = 0; i < textures.size(); i++)
 		{
 			textureDescriptors[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-			textureDescriptors[i].imageView = textures[i].imageView;
+			textureDescriptors[i].imageView = textures[i];
 			textureDescriptors[i].sampler = textureSamplers[i];
 		}
 
@@ -532,150 +620,154 @@ private:
 
 	void InitializeGeometry()
 	{
-		CreateGeometryBuffer(model.buffers[0].data.data(), sizeof(unsigned char) * model.buffers[0].data.size());
+		// the cooked draw list is relative to the model, put it into our coordinate system
+		instances.resize(scene.drawList.worldMatrices.size());
+		for (size_t i = 0; i < scene.drawList.worldMatrices.size(); i++)
+			GW::MATH::GMatrix::MultiplyMatrixF(scene.drawList.worldMatrices[i], rootMatrix, instances[i].worldMatrices);
+
+		CreateGeometryBuffer(scene.geometrySize);
+
+		// everything is on the GPU now, let go of the cooked data
+		scene.ReleaseData();
 	}
 
-	void CreateGeometryBuffer(const void* data, unsigned int sizeInBytes)
+	void CreateGeometryBuffer(size_t sizeInBytes)
 	{
-		GvkHelper::create_buffer(physicalDevice, device, sizeInBytes,
-			VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &geometryHandle, &geometryData);
-		// Transfer triangle data to the vertex buffer. (staging would be prefered here)
-		GvkHelper::write_to_buffer(device, geometryData, data, sizeInBytes);
+		// The cooked geometry is already laid out the way the draw list expects it, it goes to device local memory through the staging ring
+		TransferBatch uploads;
+		uploads.Begin(vlk, staging);
+		CreateDeviceBuffer(uploads, physicalDevice, device, scene.geometry, sizeInBytes,
+			VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, geometryHandle, geometryData);
+		uploads.BufferBarrier(VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT);
+		uploads.Submit();
 	}
 
-	void CompileShaders()
+	// SHADER_FEATURE_* bits a material needs, _material is -1 for draws without one
+	unsigned int GetMaterialFeatures(int _material)
 	{
-		// Intialize runtime shader compiler HLSL -> SPIRV
-		shaderc_compiler_t compiler = shaderc_compiler_initialize();
-		shaderc_compile_options_t options = CreateCompileOptions();
+		unsigned int features = (IMAGE_BASED_LIGHTING) ? SHADER_FEATURE_IMAGE_BASED_LIGHTING : 0;
+		if (_material < 0)
+			return features;
+		const MaterialTextures& material = scene.drawList.materials[_material];
+		if (material.normal >= 0)
+			features |= SHADER_FEATURE_NORMAL_MAP;
+		if (material.emissive >= 0)
+			features |= SHADER_FEATURE_EMISSIVE_MAP;
+		if (material.alphaCutoff >= 0.0f)
+			features |= SHADER_FEATURE_ALPHA_MASK;
+		return features;
+	}
 
-		CompileVertexShader(compiler, options);
-		CompilePixelShader(compiler, options);
+	// one fragment shader variant per distinct feature set of the materials
+	void EnumerateShaderVariants()
+	{
+		shaderVariants.clear();
+		materialVariants.clear();
+		for (int i = -1; i < static_cast<int>(scene.drawList.materials.size()); i++)
+		{
+			unsigned int features = GetMaterialFeatures(i);
+			size_t variant = std::find(shaderVariants.begin(), shaderVariants.end(), features) - shaderVariants.begin();
+			if (variant == shaderVariants.size())
+				shaderVariants.push_back(features);
+			materialVariants.push_back(static_cast<unsigned int>(variant));
+		}
+		printf("%zu fragment shader variants for %zu materials\n", shaderVariants.size(), scene.drawList.materials.size());
+	}
 
-		// Free runtime shader compiler resources
-		shaderc_compile_options_release(options);
-		shaderc_compiler_release(compiler);
+	void CompileShaders()
+	{
+		// Queue shader compiles HLSL -> SPIRV, at runtime shaderc only starts for shaders the cache doesn't have
+		vertexShaderSpirv = shaderCompiler.Compile(SHADER_PATH "VertexShader.hlsl", SHADER_STAGE_VERTEX, CreateCompileOptions());
+		fragmentShaderSpirv.resize(shaderVariants.size());
+		for (size_t i = 0; i < shaderVariants.size(); i++)
+			fragmentShaderSpirv[i] = shaderCompiler.Compile(SHADER_PATH "FragmentShader_PBR.hlsl", SHADER_STAGE_FRAGMENT,
+				CreateCompileOptions(shaderVariants[i]));
 	}
 
-	shaderc_compile_options_t CreateCompileOptions()
+	ShaderOptions CreateCompileOptions(unsigned int _features = 0)
 	{
-		shaderc_compile_options_t retval = shaderc_compile_options_initialize();
-		shaderc_compile_options_set_source_language(retval, shaderc_source_language_hlsl);
-		shaderc_compile_options_set_invert_y(retval, false);
+		static const char* const features[SHADER_FEATURE_COUNT] = { "NORMAL_MAP", "EMISSIVE_MAP", "IMAGE_BASED_LIGHTING", "ALPHA_MASK" };
+		ShaderOptions retval;
+		retval.invertY = false;
+		if (QUANTIZE_MODEL_VERTICES)
+			retval.Define("QUANTIZED_VERTICES");
+		for (unsigned int i = 0; i < SHADER_FEATURE_COUNT; i++)
+			if (_features & (1u << i))
+				retval.Define(features[i]);
 #ifndef NDEBUG
-		shaderc_compile_options_set_generate_debug_info(retval);
+		retval.debugInfo = true;
 #endif
 		return retval;
 	}
 
-	void CompileVertexShader(const shaderc_compiler_t& compiler, const shaderc_compile_options_t& options)
+	// names the variant in error messages
+	std::string GetFragmentShaderLabel(unsigned int _variant)
 	{
-		std::string vertexShaderSource = ReadFileIntoString("../../pbrRenderer/VertexShader.hlsl");
-
-		shaderc_compilation_result_t result = shaderc_compile_into_spv( // compile
-			compiler, vertexShaderSource.c_str(), vertexShaderSource.length(),
-			shaderc_vertex_shader, "main.vert", "main", options);
+		std::string label = "Fragment Shader";
+		const ShaderOptions options = CreateCompileOptions(shaderVariants[_variant]);
+		for (const std::pair<std::string, std::string>& macro : options.macros)
+			label += " " + macro.first;
+		return label + " Errors:\n";
+	}
 
-		if (shaderc_result_get_compilation_status(result) != shaderc_compilation_status_success) // errors?
+	// waits for a queued shader and loads it into Vulkan
+	void LoadShaderModule(std::future<CompiledShader>& compiling, const char* label, VkShaderModule& module)
+	{
+		CompiledShader shader = compiling.get();
+		if (!shader.compiled) // errors?
 		{
-			PrintLabeledDebugString("Vertex Shader Errors:\n", shaderc_result_get_error_message(result));
+			PrintLabeledDebugString(label, shader.errors.c_str());
 			abort();
 			return;
 		}
 
-		GvkHelper::create_shader_module(device, shaderc_result_get_length(result), // load into Vulkan
-			(char*)shaderc_result_get_bytes(result), &vertexShader);
-
-		shaderc_result_release(result); // done
+		GvkHelper::create_shader_module(device, shader.spirv.size() * sizeof(uint32_t), // load into Vulkan
+			reinterpret_cast<char*>(shader.spirv.data()), &module);
 	}
 
-	void CompilePixelShader(const shaderc_compiler_t& compiler, const shaderc_compile_options_t& options)
+	void InitializeGraphicsPipeline()
 	{
-		std::string fragmentShaderSource = ReadFileIntoString("../../pbrRenderer/FragmentShader_PBR.hlsl");
-
-		shaderc_compilation_result_t result;
-
-		result = shaderc_compile_into_spv( // compile
-			compiler, fragmentShaderSource.c_str(), fragmentShaderSource.length(),
-			shaderc_fragment_shader, "main.frag", "main", options);
+		LoadShaderModule(vertexShaderSpirv, "Vertex Shader Errors:\n", vertexShader);
+		fragmentShaders.resize(fragmentShaderSpirv.size());
+		for (size_t i = 0; i < fragmentShaderSpirv.size(); i++)
+			LoadShaderModule(fragmentShaderSpirv[i], GetFragmentShaderLabel(static_cast<unsigned int>(i)).c_str(), fragmentShaders[i]);
+		fragmentShaderSpirv.clear();
 
-		if (shaderc_result_get_compilation_status(result) != shaderc_compilation_status_success) // errors?
+		CreatePipelineLayout();
+		if (!CreatePipelines(vertexShader, fragmentShaders, CreateViewportFromWindowDimensions(), CreateScissorFromWindowDimensions(), pipelines))
 		{
-			PrintLabeledDebugString("Fragment Shader Errors:\n", shaderc_result_get_error_message(result));
+			// unlike a reload there are no previous pipelines to keep drawing with
+			PrintLabeledDebugString("Pipeline Errors:\n", "vkCreateGraphicsPipelines failed for a shader variant or vertex layout");
 			abort();
-			return;
 		}
+	}
 
-		GvkHelper::create_shader_module(device, shaderc_result_get_length(result), // load into Vulkan
-			(char*)shaderc_result_get_bytes(result), &fragmentShader);
-
-		shaderc_result_release(result); // done
+	// pipeline a draw is recorded with, the one of its material's shader variant and its vertex layout
+	unsigned int GetDrawPipeline(const DrawItem& _draw)
+	{
+		return materialVariants[_draw.material + 1] * static_cast<unsigned int>(scene.drawList.layouts.size()) + _draw.layout;
 	}
 
-	void InitializeGraphicsPipeline()
+	// one pipeline per shader variant and vertex layout in the draw list, only reads state that is fixed
+	// after loading so a reload can build them on a worker
+	bool CreatePipelines(VkShaderModule _vertexShader, const std::vector<VkShaderModule>& _fragmentShaders, VkViewport _viewport, VkRect2D _scissor,
+						std::vector<VkPipeline>& _outPipelines)
 	{
 		// Create Pipeline & Layout (Thanks Tiny!)
 		VkPipelineShaderStageCreateInfo stage_create_info[2] = {};
 		// Create Stage Info for Vertex Shader
 		stage_create_info[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 		stage_create_info[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
-		stage_create_info[0].module = vertexShader;
+		stage_create_info[0].module = _vertexShader;
 		stage_create_info[0].pName = "main";
 
-		// Create Stage Info for Fragment Shader
+		// Create Stage Info for Fragment Shader, its module is the variant's
 		stage_create_info[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 		stage_create_info[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-		stage_create_info[1].module = fragmentShader;
 		stage_create_info[1].pName = "main";
 
 		VkPipelineInputAssemblyStateCreateInfo assembly_create_info = CreateVkPipelineInputAssemblyStateCreateInfo();
-		VkVertexInputBindingDescription vertex_binding_description[4] = {};
-
-		// create string for attributes
-		std::string attr[] =
-		{
-			"POSITION",
-			"NORMAL",
-			"TEXCOORD_0",
-			"TANGENT"
-		};
-
-		for (int i = 0; i < 4; i++)
-		{
-			Accessor& Accessor = model.accessors[model.meshes[0].primitives[0].attributes[attr[i]]];
-			BufferView& BufferView = model.bufferViews[Accessor.bufferView];
-
-			vertex_binding_description[i].binding = i;
-			vertex_binding_description[i].stride = Accessor.ByteStride(BufferView);
-			vertex_binding_description[i].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-		}
-
-		VkVertexInputAttributeDescription vertex_attribute_description[4];
-		vertex_attribute_description[0].binding = 0;
-		vertex_attribute_description[0].location = 0;
-		vertex_attribute_description[0].format = VK_FORMAT_R32G32B32_SFLOAT;
-		vertex_attribute_description[0].offset = 0;
-
-		vertex_attribute_description[1].binding = 1;
-		vertex_attribute_description[1].location = 1;
-		vertex_attribute_description[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-		vertex_attribute_description[1].offset = 0;
-
-		vertex_attribute_description[2].binding = 2;
-		vertex_attribute_description[2].location = 2;
-		vertex_attribute_description[2].format = VK_FORMAT_R32G32_SFLOAT;
-		vertex_attribute_description[2].offset = 0;
-
-		vertex_attribute_description[3].binding = 3;
-		vertex_attribute_description[3].location = 3;
-		vertex_attribute_description[3].format = VK_FORMAT_R32G32B32A32_SFLOAT;
-		vertex_attribute_description[3].offset = 0;
-
-		VkPipelineVertexInputStateCreateInfo input_vertex_info = CreateVkPipelineVertexInputStateCreateInfo(vertex_binding_description, 4, vertex_attribute_description, 4);
-		VkViewport viewport = CreateViewportFromWindowDimensions();
-		VkRect2D scissor = CreateScissorFromWindowDimensions();
-		VkPipelineViewportStateCreateInfo viewport_create_info = CreateVkPipelineViewportStateCreateInfo(&viewport, 1, &scissor, 1);
+		VkPipelineViewportStateCreateInfo viewport_create_info = CreateVkPipelineViewportStateCreateInfo(&_viewport, 1, &_scissor, 1);
 		VkPipelineRasterizationStateCreateInfo rasterization_create_info = CreateVkPipelineRasterizationStateCreateInfo();
 		VkPipelineMultisampleStateCreateInfo multisample_create_info = CreateVkPipelineMultisampleStateCreateInfo();
 		VkPipelineDepthStencilStateCreateInfo depth_stencil_create_info = CreateVkPipelineDepthStencilStateCreateInfo();
@@ -691,15 +783,12 @@ private:
 		};
 		VkPipelineDynamicStateCreateInfo dynamic_create_info = CreateVkPipelineDynamicStateCreateInfo(dynamic_states, 2);
 
-		CreatePipelineLayout();
-
 		// Pipeline State... (FINALLY) 
 		VkGraphicsPipelineCreateInfo pipeline_create_info = {};
 		pipeline_create_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
 		pipeline_create_info.stageCount = 2;
 		pipeline_create_info.pStages = stage_create_info;
 		pipeline_create_info.pInputAssemblyState = &assembly_create_info;
-		pipeline_create_info.pVertexInputState = &input_vertex_info;
 		pipeline_create_info.pViewportState = &viewport_create_info;
 		pipeline_create_info.pRasterizationState = &rasterization_create_info;
 		pipeline_create_info.pMultisampleState = &multisample_create_info;
@@ -711,7 +800,86 @@ private:
 		pipeline_create_info.subpass = 0;
 		pipeline_create_info.basePipelineHandle = VK_NULL_HANDLE;
 
-		vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipeline_create_info, nullptr, &pipeline);
+		// every shader variant gets its own pipeline for each vertex layout used by the draw list
+		size_t layouts = scene.drawList.layouts.size();
+		_outPipelines.assign(_fragmentShaders.size() * layouts, VK_NULL_HANDLE);
+		for (size_t p = 0; p < _outPipelines.size(); p++)
+		{
+			size_t i = p % layouts;
+			stage_create_info[1].module = _fragmentShaders[p / layouts];
+
+			VkVertexInputBindingDescription vertex_binding_description[DRAW_ATTRIBUTE_COUNT] = {};
+			VkVertexInputAttributeDescription vertex_attribute_description[DRAW_ATTRIBUTE_COUNT] = {};
+			for (unsigned int j = 0; j < DRAW_ATTRIBUTE_COUNT; j++)
+			{
+				// one binding per attribute so glTF buffer views can be bound as they are
+				vertex_binding_description[j].binding = j;
+				vertex_binding_description[j].stride = scene.drawList.layouts[i].streams[j].stride;
+				vertex_binding_description[j].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+				vertex_attribute_description[j].binding = j;
+				vertex_attribute_description[j].location = j;
+				vertex_attribute_description[j].format = GetVertexFormat(scene.drawList.layouts[i].streams[j]);
+				vertex_attribute_description[j].offset = 0;
+			}
+
+			VkPipelineVertexInputStateCreateInfo input_vertex_info = CreateVkPipelineVertexInputStateCreateInfo(vertex_binding_description, DRAW_ATTRIBUTE_COUNT,
+				vertex_attribute_description, DRAW_ATTRIBUTE_COUNT);
+			pipeline_create_info.pVertexInputState = &input_vertex_info;
+
+			if (vkCreateGraphicsPipelines(device, pipelineCache.Get(), 1, &pipeline_create_info, nullptr, &_outPipelines[p]) != VK_SUCCESS)
+				return false;
+		}
+		return true;
+	}
+
+	// Vulkan format matching a glTF accessor, integer data without normalization is converted to float as is
+	VkFormat GetVertexFormat(const VertexStream& _stream)
+	{
+		int components = GetNumComponentsInType(_stream.type);
+		if (components < 1 || components > 4)
+			return VK_FORMAT_UNDEFINED;
+
+		// glTF pads 3 component 8 and 16 bit attributes to 4 bytes, those are read as 4 components
+		switch (_stream.componentType)
+		{
+		case TINYGLTF_COMPONENT_TYPE_FLOAT:
+		{
+			const VkFormat formats[] = { VK_FORMAT_R32_SFLOAT, VK_FORMAT_R32G32_SFLOAT, VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32B32A32_SFLOAT };
+			return formats[components - 1];
+		}
+		case TINYGLTF_COMPONENT_TYPE_BYTE:
+		{
+			const VkFormat normalized[] = { VK_FORMAT_R8_SNORM, VK_FORMAT_R8G8_SNORM, VK_FORMAT_R8G8B8A8_SNORM, VK_FORMAT_R8G8B8A8_SNORM };
+			const VkFormat scaled[] = { VK_FORMAT_R8_SSCALED, VK_FORMAT_R8G8_SSCALED, VK_FORMAT_R8G8B8A8_SSCALED, VK_FORMAT_R8G8B8A8_SSCALED };
+			return (_stream.normalized) ? normalized[components - 1] : scaled[components - 1];
+		}
+		case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+		{
+			const VkFormat normalized[] = { VK_FORMAT_R8_UNORM, VK_FORMAT_R8G8_UNORM, VK_FORMAT_R8G8B8A8_UNORM, VK_FORMAT_R8G8B8A8_UNORM };
+			const VkFormat scaled[] = { VK_FORMAT_R8_USCALED, VK_FORMAT_R8G8_USCALED, VK_FORMAT_R8G8B8A8_USCALED, VK_FORMAT_R8G8B8A8_USCALED };
+			return (_stream.normalized) ? normalized[components - 1] : scaled[components - 1];
+		}
+		case TINYGLTF_COMPONENT_TYPE_SHORT:
+		{
+			const VkFormat normalized[] = { VK_FORMAT_R16_SNORM, VK_FORMAT_R16G16_SNORM, VK_FORMAT_R16G16B16A16_SNORM, VK_FORMAT_R16G16B16A16_SNORM };
+			const VkFormat scaled[] = { VK_FORMAT_R16_SSCALED, VK_FORMAT_R16G16_SSCALED, VK_FORMAT_R16G16B16A16_SSCALED, VK_FORMAT_R16G16B16A16_SSCALED };
+			return (_stream.normalized) ? normalized[components - 1] : scaled[components - 1];
+		}
+		case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+		{
+			const VkFormat normalized[] = { VK_FORMAT_R16_UNORM, VK_FORMAT_R16G16_UNORM, VK_FORMAT_R16G16B16A16_UNORM, VK_FORMAT_R16G16B16A16_UNORM };
+			const VkFormat scaled[] = { VK_FORMAT_R16_USCALED, VK_FORMAT_R16G16_USCALED, VK_FORMAT_R16G16B16A16_USCALED, VK_FORMAT_R16G16B16A16_USCALED };
+			return (_stream.normalized) ? normalized[components - 1] : scaled[components - 1];
+		}
+		case VERTEX_COMPONENT_TYPE_HALF_FLOAT:
+		{
+			const VkFormat formats[] = { VK_FORMAT_R16_SFLOAT, VK_FORMAT_R16G16_SFLOAT, VK_FORMAT_R16G16B16A16_SFLOAT, VK_FORMAT_R16G16B16A16_SFLOAT };
+			return formats[components - 1];
+		}
+		default:
+			return VK_FORMAT_UNDEFINED;
+		}
 	}
 
 	VkPipelineInputAssemblyStateCreateInfo CreateVkPipelineInputAssemblyStateCreateInfo()
@@ -853,16 +1021,21 @@ private:
 
 	void CreatePipelineLayout()
 	{
-		// Descriptor pipeline layout
+		// per draw instance and texture indices
+		VkPushConstantRange push_constants = {};
+		push_constants.offset = 0;
+		push_constants.size = sizeof(DRAW_VARS);
+		push_constants.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
 
+		// Descriptor pipeline layout
 		VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
 		pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
 		pipeline_layout_create_info.setLayoutCount = 2;
 
 		VkDescriptorSetLayout layouts[2] = { descriptor_set_layout, pixel_descriptor_set_layout };
 		pipeline_layout_create_info.pSetLayouts = layouts;
-		pipeline_layout_create_info.pushConstantRangeCount = 0;
-		pipeline_layout_create_info.pPushConstantRanges = nullptr;
+		pipeline_layout_create_info.pushConstantRangeCount = 1;
+		pipeline_layout_create_info.pPushConstantRanges = &push_constants;
 
 		vkCreatePipelineLayout(device, &pipeline_layout_create_info, nullptr, &pipelineLayout);
 	}
@@ -882,6 +1055,7 @@ public:
 	void Render()
 	{
 		t1 = std::chrono::high_resolution_clock::now();
+		UpdateShaders(); // nothing is recorded yet, the pipelines can still be swapped
 
 
 		VkCommandBuffer commandBuffer = GetCurrentCommandBuffer();
@@ -902,23 +1076,116 @@ public:
 		GW::MATH::GVector::NormalizeF(sunDirection, sunDirection);
 		shaderVars.sunDir = sunDirection;
 
-		for (size_t i = 0; i < model.meshes.size(); i++)
-		{
-			GvkHelper::write_to_buffer(device, uniformData[i], &shaderVars, sizeof(SHADER_VARS));
-			GvkHelper::write_to_buffer(device, storageData[i], &instances[i], sizeof(INSTANCE_DATA) * instances.size());
+		// only the buffers of the frame being recorded may be touched
+		unsigned int currentImage;
+		vlk.GetSwapchainCurrentImage(currentImage);
+		GvkHelper::write_to_buffer(device, uniformData[currentImage], &shaderVars, sizeof(SHADER_VARS));
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[currentImage], 0, nullptr);
 
-			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[i], 0, nullptr);
-		}
+		DrawScene(commandBuffer);
+	}
+
+private:
 
-		Accessor& indexAccessor = model.accessors[model.meshes[0].primitives[0].indices];
+	template <typename T>
+	static bool IsReady(const std::future<T>& _future)
+	{
+		return _future.valid() && _future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+	}
 
-		Accessor& vertexAccessor = model.accessors[model.meshes[0].primitives[0].attributes["POSITION"]];
-		BufferView& vertexBufferView = model.bufferViews[vertexAccessor.bufferView];
+	// Hot reload, runs before every frame is recorded. A saved shader queues both shaders on the
+	// compile service, once they compiled the pipelines are built on a worker, and once those are
+	// built they replace the ones in use between two frames. The replaced ones are destroyed when no
+	// frame in flight can still draw with them, so the device is never waited on. Whatever fails keeps
+	// the pipelines in use and the errors are printed.
+	void UpdateShaders()
+	{
+		frameCount++;
+		for (size_t i = 0; i < retiredPipelines.size();)
+			if (retiredPipelines[i].retired <= frameCount)
+			{
+				DestroyPipelineSet(retiredPipelines[i]);
+				retiredPipelines.erase(retiredPipelines.begin() + i);
+			}
+			else
+				i++;
 
-		vkCmdDrawIndexed(commandBuffer, indexAccessor.count, 1, 0, vertexBufferView.byteOffset + vertexAccessor.byteOffset, 1);
+		if (!HOT_RELOAD_SHADERS)
+			return;
+		bool compiled = IsReady(vertexShaderSpirv);
+		for (size_t i = 0; i < fragmentShaderSpirv.size(); i++)
+			compiled = compiled && IsReady(fragmentShaderSpirv[i]);
+		if (!vertexShaderSpirv.valid() && !reloading.valid() && shaderWatcher.GetVersion() != shaderVersion)
+		{
+			shaderVersion = shaderWatcher.GetVersion();
+			CompileShaders();
+		}
+		else if (compiled)
+		{
+			std::vector<CompiledShader> shaders(1, vertexShaderSpirv.get()); // the vertex shader, then the variants
+			bool failed = !shaders[0].compiled;
+			if (failed)
+				PrintLabeledDebugString("Vertex Shader Errors:\n", shaders[0].errors.c_str());
+			for (size_t i = 0; i < fragmentShaderSpirv.size(); i++)
+			{
+				shaders.push_back(fragmentShaderSpirv[i].get());
+				if (!shaders.back().compiled) // errors?
+					PrintLabeledDebugString(GetFragmentShaderLabel(static_cast<unsigned int>(i)).c_str(), shaders.back().errors.c_str());
+				failed = failed || !shaders.back().compiled;
+			}
+			fragmentShaderSpirv.clear();
+			if (failed)
+			{
+				printf("Shader reload failed, still drawing with the previous shaders\n");
+				return;
+			}
+			VkViewport viewport = CreateViewportFromWindowDimensions();
+			VkRect2D scissor = CreateScissorFromWindowDimensions();
+			reloading = std::async(std::launch::async, [this, shaders, viewport, scissor]() mutable -> bool
+				{
+					std::vector<VkShaderModule> modules(shaders.size(), VK_NULL_HANDLE);
+					bool created = true;
+					for (size_t i = 0; i < shaders.size() && created; i++)
+						created = GvkHelper::create_shader_module(device, shaders[i].spirv.size() * sizeof(uint32_t),
+							reinterpret_cast<char*>(shaders[i].spirv.data()), &modules[i]) == VK_SUCCESS;
+					reloadedPipelines.vertexShader = modules[0];
+					reloadedPipelines.fragmentShaders.assign(modules.begin() + 1, modules.end());
+					return created && CreatePipelines(reloadedPipelines.vertexShader, reloadedPipelines.fragmentShaders, viewport, scissor,
+						reloadedPipelines.pipelines);
+				});
+		}
+		else if (IsReady(reloading))
+		{
+			if (!reloading.get())
+			{
+				DestroyPipelineSet(reloadedPipelines);
+				printf("Shader reload failed to create its pipelines, still drawing with the previous ones\n");
+				return;
+			}
+			PipelineSet replaced;
+			replaced.vertexShader = vertexShader;
+			replaced.fragmentShaders.swap(fragmentShaders);
+			replaced.pipelines.swap(pipelines);
+			replaced.retired = frameCount + maxFrames;
+			retiredPipelines.push_back(std::move(replaced));
+
+			vertexShader = reloadedPipelines.vertexShader;
+			fragmentShaders.swap(reloadedPipelines.fragmentShaders);
+			pipelines.swap(reloadedPipelines.pipelines);
+			reloadedPipelines = PipelineSet();
+			printf("Shaders reloaded\n");
+		}
 	}
 
-private:
+	void DestroyPipelineSet(PipelineSet& _set)
+	{
+		vkDestroyShaderModule(device, _set.vertexShader, nullptr);
+		for (size_t i = 0; i < _set.fragmentShaders.size(); i++)
+			vkDestroyShaderModule(device, _set.fragmentShaders[i], nullptr);
+		for (size_t i = 0; i < _set.pipelines.size(); i++)
+			vkDestroyPipeline(device, _set.pipelines[i], nullptr);
+		_set = PipelineSet();
+	}
 
 	VkCommandBuffer GetCurrentCommandBuffer()
 	{
@@ -934,9 +1201,6 @@ private:
 		UpdateWindowDimensions(); // what is the current client area dimensions?
 		SetViewport(commandBuffer);
 		SetScissor(commandBuffer);
-
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
-		BindGeometryBuffers(commandBuffer);
 	}
 
 	void SetViewport(const VkCommandBuffer& commandBuffer)
@@ -951,37 +1215,93 @@ private:
 		vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
 	}
 
-	void BindGeometryBuffers(VkCommandBuffer& commandBuffer)
+	DRAW_VARS GetDrawVars(const DrawItem& _draw)
 	{
-		// bind the vertex buffer from the geometry
-
-		std::string attr[] =
+		DRAW_VARS retval = { GetDequantization(scene.drawList, _draw.mesh), _draw.instance, -1, -1, -1, -1 };
+		retval.alphaCutoff = -1.0f;
+		if (_draw.material >= 0)
 		{
-			"POSITION",
-			"NORMAL",
-			"TEXCOORD_0",
-			"TANGENT"
-		};
+			const MaterialTextures& material = scene.drawList.materials[_draw.material];
+			retval.albedoMap = material.baseColor;
+			retval.roughnessMetalOcclusionMap = material.metallicRoughness;
+			retval.normalMap = material.normal;
+			retval.emissiveMap = material.emissive;
+			retval.alphaCutoff = material.alphaCutoff;
+		}
+		// the environment textures are the last three, after the model's images
+		retval.brdfMap = static_cast<int>(textures.size()) - 3;
+		retval.irradianceMap = retval.brdfMap + 1;
+		retval.specularMap = retval.brdfMap + 2;
+		return retval;
+	}
+
+	// walks the sorted draw list, only rebinding what changed since the previous draw
+	void DrawScene(VkCommandBuffer& commandBuffer)
+	{
+		const DrawItem* previous = nullptr;
+		unsigned int boundPipeline = 0;
+		unsigned int boundIndexSize = 0;
+		VkBuffer vertexBuffers[DRAW_ATTRIBUTE_COUNT] = { geometryHandle, geometryHandle, geometryHandle, geometryHandle };
 
-		for (size_t i = 0; i < 4; i++)
+		for (const DrawItem& draw : scene.drawList.draws)
 		{
-			Accessor& Accessor = model.accessors[model.meshes[0].primitives[0].attributes[attr[i]]];
-			BufferView& BufferView = model.bufferViews[Accessor.bufferView];
+			// the material picks the shader variant, draws are sorted by layout then material so it rarely changes
+			unsigned int pipeline = GetDrawPipeline(draw);
+			if (previous == nullptr || pipeline != boundPipeline)
+			{
+				vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines[pipeline]);
+				boundPipeline = pipeline;
+			}
 
-			VkDeviceSize offset[] = { BufferView.byteOffset + Accessor.byteOffset };
-			vkCmdBindVertexBuffers(commandBuffer, i, 1, &geometryHandle, offset);
-		}
+			if (previous == nullptr || memcmp(previous->vertexOffsets, draw.vertexOffsets, sizeof(draw.vertexOffsets)) != 0)
+			{
+				VkDeviceSize offsets[DRAW_ATTRIBUTE_COUNT];
+				for (int i = 0; i < DRAW_ATTRIBUTE_COUNT; i++)
+					offsets[i] = draw.vertexOffsets[i];
+				vkCmdBindVertexBuffers(commandBuffer, 0, DRAW_ATTRIBUTE_COUNT, vertexBuffers, offsets);
+			}
 
-		// bind the index buffer from the geometry
-		Accessor& indexAccessor = model.accessors[model.meshes[0].primitives[0].indices];
-		BufferView& indexBufferView = model.bufferViews[indexAccessor.bufferView];
-		vkCmdBindIndexBuffer(commandBuffer, geometryHandle, indexBufferView.byteOffset + indexAccessor.byteOffset, VK_INDEX_TYPE_UINT16);
+			if (previous == nullptr || previous->instance != draw.instance || previous->material != draw.material
+				|| previous->mesh != draw.mesh)
+			{
+				DRAW_VARS drawVars = GetDrawVars(draw);
+				vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(DRAW_VARS), &drawVars);
+			}
+			previous = &draw;
+
+			if (draw.indexSize == 0)
+			{
+				vkCmdDraw(commandBuffer, draw.count, 1, 0, 0);
+				continue;
+			}
+
+			// the index buffer stays bound to the start of the geometry, draws pick their range with firstIndex
+			if (boundIndexSize != draw.indexSize)
+			{
+				vkCmdBindIndexBuffer(commandBuffer, geometryHandle, 0, (draw.indexSize == 4) ? VK_INDEX_TYPE_UINT32 : VK_INDEX_TYPE_UINT16);
+				boundIndexSize = draw.indexSize;
+			}
+			// the coarsest LOD that still looks the same from where the camera is
+			const DrawLod* lod = SelectDrawLod(scene.drawList, draw, instances[draw.instance].worldMatrices, shaderVars.camPos,
+				fabsf(projectionMatrix.row2.y), static_cast<float>(windowHeight));
+			if (lod != nullptr && lod->indexOffset != draw.indexOffset)
+			{
+				vkCmdDrawIndexed(commandBuffer, lod->count, 1, static_cast<uint32_t>(lod->indexOffset / draw.indexSize), 0, 0);
+				continue;
+			}
+			// full detail, only the meshlets on screen and facing the camera are drawn
+			visibleRanges.clear();
+			CullDrawMeshlets(scene.drawList, draw, instances[draw.instance].worldMatrices, viewMatrix, projectionMatrix, visibleRanges);
+			for (const MeshletRange& range : visibleRanges)
+				vkCmdDrawIndexed(commandBuffer, range.count, 1, range.firstIndex, 0, 0);
+		}
 	}
 
 	void CleanUp()
 	{
 		// wait till everything has completed
 		vkDeviceWaitIdle(device);
+		staging.Destroy();
 
 		// release allocated descriptor sets
 		for (unsigned int i = 0; i < maxFrames; i++)
@@ -1000,18 +1320,24 @@ private:
 		vkDestroyBuffer(device, geometryHandle, nullptr);
 		vkFreeMemory(device, geometryData, nullptr);
 		vkDestroyShaderModule(device, vertexShader, nullptr);
-		vkDestroyShaderModule(device, fragmentShader, nullptr);
+		for (size_t i = 0; i < fragmentShaders.size(); i++)
+			vkDestroyShaderModule(device, fragmentShaders[i], nullptr);
+		// a reload still being built is finished first so everything it created can be destroyed
+		shaderWatcher.Stop();
+		if (reloading.valid())
+			reloading.get();
+		DestroyPipelineSet(reloadedPipelines);
+		for (size_t i = 0; i < retiredPipelines.size(); i++)
+			DestroyPipelineSet(retiredPipelines[i]);
+		retiredPipelines.clear();
+		pipelineCache.Save(); // back to disk while the device is still alive
+		pipelineCache.Destroy();
 		vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
-		vkDestroyPipeline(device, pipeline, nullptr);
+		for (size_t i = 0; i < pipelines.size(); i++)
+			vkDestroyPipeline(device, pipelines[i], nullptr);
 
-		// clean up texture variables
-		for (size_t i = 0; i < textures.size(); i++)
-		{
-			vkDestroyImageView(device, textures[i].imageView, nullptr);
-			vkDestroyImage(device, textures[i].image, nullptr);
-			vkDestroySampler(device, textureSamplers[i], nullptr);
-			vkDestroyBuffer(device, textures[i].buffer, nullptr);
-			vkFreeMemory(device, textures[i].memory, nullptr);
-		}
+		// clean up texture variables, each shared one is destroyed once
+		textureCache.Destroy();
+		samplerCache.Destroy();
 	}
 };
@@ -1,8 +1,12 @@
 // minimalistic code to draw a single triangle, this is not part of the API.
+#ifdef RUNTIME_SHADERS
 #include "shaderc/shaderc.h" // needed for compiling shaders at runtime
 #ifdef _WIN32 // must use MT platform DLL libraries on windows
 	#pragma comment(lib, "shaderc_combined.lib") 
 #endif
+#endif
+#include "ShaderCache.h"
+#include "PipelineCache.h"
 
 // Includes
 #include <chrono>
@@ -31,12 +35,19 @@ class Renderer
 	VkPhysicalDevice physicalDevice = nullptr;
 	VkBuffer vertexHandle = nullptr;
 	VkDeviceMemory vertexData = nullptr;
+	// shaders compile on worker threads, the pipeline waits for them
+	ShaderCompileService shaderCompiler;
+	std::future<CompiledShader> vertexShaderSpirv;
+	std::future<CompiledShader> fragmentShaderSpirv;
+	std::future<CompiledShader> vertexShaderTwoSpirv;
+	std::future<CompiledShader> fragmentShaderTwoSpirv;
 	VkShaderModule vertexShader = nullptr;
 	VkShaderModule fragmentShader = nullptr;
 
 	// pipeline settings for drawing (also required)
 	VkPipeline pipeline = nullptr;
 	VkPipelineLayout pipelineLayout = nullptr;
+	PipelineCache pipelineCache; // every pipeline is created through it, kept on disk between launches
 
 	GW::MATH::GMatrix matrixMath;
 	GW::MATH::GMATRIXF plusMatrix = GW::MATH::GIdentityMatrixF;
@@ -120,9 +131,10 @@ public:
 	void InitializeGraphics()
 	{
 		GetHandlesFromSurface();
+		pipelineCache.Create(vlk, "../../push_constants/Pipelines.vkcache");
+		CompileShaders();
 		InitializeVertexBuffer();
 
-		CompileShaders();
 		InitializeGraphicsPipeline();
 	}
 
@@ -253,28 +265,21 @@ public:
 
 	void CompileShaders()
 	{
-		// Intialize runtime shader compiler HLSL -> SPIRV
-		shaderc_compiler_t compiler = shaderc_compiler_initialize();
-		shaderc_compile_options_t options = CreateCompileOptions();
+		// Queue shader compiles HLSL -> SPIRV, at runtime shaderc only starts for shaders the cache doesn't have
+		ShaderOptions options = CreateCompileOptions();
+		vertexShaderSpirv = shaderCompiler.Compile("../../push_constants/VertexShader.hlsl", SHADER_STAGE_VERTEX, options);
+		fragmentShaderSpirv = shaderCompiler.Compile("../../push_constants/FragmentShader.hlsl", SHADER_STAGE_FRAGMENT, options);
 
-		CompileVertexShader(compiler, options, vertexShader, "../../push_constants/VertexShader.hlsl");
-		CompileFragmentShader(compiler, options, fragmentShader, "../../push_constants/FragmentShader.hlsl");
-		
-		CompileVertexShader(compiler, options, vertexShaderTwo, "../../push_constants/VertexShader2.hlsl");
-		CompileFragmentShader(compiler, options, fragmentShaderTwo, "../../push_constants/FragmentShader2.hlsl");
-		
-		// Free runtime shader compiler resources
-		shaderc_compile_options_release(options);
-		shaderc_compiler_release(compiler);
+		vertexShaderTwoSpirv = shaderCompiler.Compile("../../push_constants/VertexShader2.hlsl", SHADER_STAGE_VERTEX, options);
+		fragmentShaderTwoSpirv = shaderCompiler.Compile("../../push_constants/FragmentShader2.hlsl", SHADER_STAGE_FRAGMENT, options);
 	}
 
-	shaderc_compile_options_t CreateCompileOptions()
+	ShaderOptions CreateCompileOptions()
 	{
-		shaderc_compile_options_t retval = shaderc_compile_options_initialize();
-		shaderc_compile_options_set_source_language(retval, shaderc_source_language_hlsl);
-		shaderc_compile_options_set_invert_y(retval, true);
+		ShaderOptions retval;
+		retval.invertY = true;
 #ifndef NDEBUG
-		shaderc_compile_options_set_generate_debug_info(retval);
+		retval.debugInfo = true;
 #endif
 	return retval;
 	}
@@ -289,48 +294,28 @@ public:
 			});
 	}
 
-	void CompileVertexShader(const shaderc_compiler_t& compiler, const shaderc_compile_options_t& options, VkShaderModule& _vertexShader, const char* filepath)
-	{
-		std::string vertexShaderSource = ReadFileIntoString(filepath);
-
-		shaderc_compilation_result_t result = shaderc_compile_into_spv( // compile
-			compiler, vertexShaderSource.c_str(), vertexShaderSource.size(),
-			shaderc_vertex_shader, "main.vert", "main", options);
-
-		if (shaderc_result_get_compilation_status(result) != shaderc_compilation_status_success) // errors?
-		{
-			PrintLabeledDebugString("Vertex Shader Errors:\n", shaderc_result_get_error_message(result));
-			abort();
-			return;
-		}
-
-		GvkHelper::create_shader_module(device, shaderc_result_get_length(result), // load into Vulkan
-			(char*)shaderc_result_get_bytes(result), &_vertexShader);
-		shaderc_result_release(result); // done
-	}
-
-	void CompileFragmentShader(const shaderc_compiler_t& compiler, const shaderc_compile_options_t& options, VkShaderModule& _fragShader, const char* filepath)
+	// waits for a queued shader and loads it into Vulkan
+	void LoadShaderModule(std::future<CompiledShader>& compiling, const char* label, VkShaderModule& module)
 	{
-		std::string fragmentShaderSource = ReadFileIntoString(filepath);
-
-		shaderc_compilation_result_t result = shaderc_compile_into_spv( // compile
-			compiler, fragmentShaderSource.c_str(), fragmentShaderSource.length(),
-			shaderc_fragment_shader, "main.frag", "main", options);
-
-		if (shaderc_result_get_compilation_status(result) != shaderc_compilation_status_success) // errors?
+		CompiledShader shader = compiling.get();
+		if (!shader.compiled) // errors?
 		{
-			PrintLabeledDebugString("Fragment Shader Errors:\n", shaderc_result_get_error_message(result));
+			PrintLabeledDebugString(label, shader.errors.c_str());
 			abort();
 			return;
 		}
 
-		GvkHelper::create_shader_module(device, shaderc_result_get_length(result), // load into Vulkan
-			(char*)shaderc_result_get_bytes(result), &_fragShader);
-		shaderc_result_release(result); // done
+		GvkHelper::create_shader_module(device, shader.spirv.size() * sizeof(uint32_t), // load into Vulkan
+			reinterpret_cast<char*>(shader.spirv.data()), &module);
 	}
 
 	void InitializeGraphicsPipeline()
 	{
+		LoadShaderModule(vertexShaderSpirv, "Vertex Shader Errors:\n", vertexShader);
+		LoadShaderModule(fragmentShaderSpirv, "Fragment Shader Errors:\n", fragmentShader);
+		LoadShaderModule(vertexShaderTwoSpirv, "Vertex Shader Errors:\n", vertexShaderTwo);
+		LoadShaderModule(fragmentShaderTwoSpirv, "Fragment Shader Errors:\n", fragmentShaderTwo);
+
 		VkPipelineShaderStageCreateInfo stage_create_info[2] = {};
 
 		// Create Stage Info for Vertex Shader
@@ -400,7 +385,7 @@ public:
 		pipeline_create_info.renderPass = renderPass;
 		pipeline_create_info.subpass = 0;
 		pipeline_create_info.basePipelineHandle = VK_NULL_HANDLE;
-		vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1,
+		vkCreateGraphicsPipelines(device, pipelineCache.Get(), 1,
 			&pipeline_create_info, nullptr, &pipeline);
 
 		assembly_create_info.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
@@ -408,7 +393,7 @@ public:
 		stage_create_info[0].module = vertexShaderTwo;
 		stage_create_info[1].module = fragmentShaderTwo;
 
-		vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1,
+		vkCreateGraphicsPipelines(device, pipelineCache.Get(), 1,
 			&pipeline_create_info, nullptr, &pipelineTwo);
 
 	}
@@ -675,6 +660,8 @@ private:
 		vkFreeMemory(device, vertexData, nullptr);
 		vkDestroyShaderModule(device, vertexShader, nullptr);
 		vkDestroyShaderModule(device, fragmentShader, nullptr);
+		pipelineCache.Save(); // back to disk while the device is still alive
+		pipelineCache.Destroy();
 		vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
 		vkDestroyPipeline(device, pipeline, nullptr);
 		vkDestroyPipeline(device, pipelineTwo, nullptr);
@@ -1,7 +1,11 @@
+#ifdef RUNTIME_SHADERS
 #include "shaderc/shaderc.h" // needed for compiling shaders at runtime
 #ifdef _WIN32 // must use MT platform DLL libraries on windows
 #pragma comment(lib, "shaderc_combined.lib") 
 #endif
+#endif
+#include "ShaderCache.h"
+#include "PipelineCache.h"
 
 void PrintLabeledDebugString(const char* label, const char* toPrint)
 {
@@ -31,11 +35,16 @@ class Renderer
 	VkBuffer indexHandle = nullptr;
 	VkDeviceMemory indexData = nullptr;
 
+	// shaders compile on worker threads, the pipeline waits for them
+	ShaderCompileService shaderCompiler;
+	std::future<CompiledShader> vertexShaderSpirv;
+	std::future<CompiledShader> fragmentShaderSpirv;
 	VkShaderModule vertexShader = nullptr;
 	VkShaderModule fragmentShader = nullptr;
 	// pipeline settings for drawing (also required)
 	VkPipeline pipeline = nullptr;
 	VkPipelineLayout pipelineLayout = nullptr;
+	PipelineCache pipelineCache; // every pipeline is created through it, kept on disk between launches
 
 	std::vector<VkBuffer> uniformHandle;
 	std::vector<VkDeviceMemory> uniformData;
@@ -137,11 +146,12 @@ private:
 	void InitializeGraphics()
 	{
 		GetHandlesFromSurface();
+		pipelineCache.Create(vlk, "../../storage_buffers/Pipelines.vkcache");
+		CompileShaders();
 		InitializeVertexIndexBuffer();
 
 		SetupDescriptorsets();
 
-		CompileShaders();
 		InitializeGraphicsPipeline();
 	}
 
@@ -277,75 +287,42 @@ private:
 
 	void CompileShaders()
 	{
-		// Intialize runtime shader compiler HLSL -> SPIRV
-		shaderc_compiler_t compiler = shaderc_compiler_initialize();
-		shaderc_compile_options_t options = CreateCompileOptions();
-
-		CompileVertexShader(compiler, options);
-		CompilePixelShader(compiler, options);
-
-		// Free runtime shader compiler resources
-		shaderc_compile_options_release(options);
-		shaderc_compiler_release(compiler);
+		// Queue shader compiles HLSL -> SPIRV, at runtime shaderc only starts for shaders the cache doesn't have
+		ShaderOptions options = CreateCompileOptions();
+		vertexShaderSpirv = shaderCompiler.Compile("../../storage_buffers/VertexShader.hlsl", SHADER_STAGE_VERTEX, options);
+		fragmentShaderSpirv = shaderCompiler.Compile("../../storage_buffers/FragmentShader.hlsl", SHADER_STAGE_FRAGMENT, options);
 	}
 
-	shaderc_compile_options_t CreateCompileOptions()
+	ShaderOptions CreateCompileOptions()
 	{
-		shaderc_compile_options_t retval = shaderc_compile_options_initialize();
-		shaderc_compile_options_set_source_language(retval, shaderc_source_language_hlsl);
-		shaderc_compile_options_set_invert_y(retval, false);
+		ShaderOptions retval;
+		retval.invertY = false;
 #ifndef NDEBUG
-		shaderc_compile_options_set_generate_debug_info(retval);
+		retval.debugInfo = true;
 #endif
 		return retval;
 	}
 
-	void CompileVertexShader(const shaderc_compiler_t& compiler, const shaderc_compile_options_t& options)
+	// waits for a queued shader and loads it into Vulkan
+	void LoadShaderModule(std::future<CompiledShader>& compiling, const char* label, VkShaderModule& module)
 	{
-		std::string vertexShaderSource = ReadFileIntoString("../../storage_buffers/VertexShader.hlsl");
-
-		shaderc_compilation_result_t result = shaderc_compile_into_spv( // compile
-			compiler, vertexShaderSource.c_str(), vertexShaderSource.length(),
-			shaderc_vertex_shader, "main.vert", "main", options);
-
-		if (shaderc_result_get_compilation_status(result) != shaderc_compilation_status_success) // errors?
+		CompiledShader shader = compiling.get();
+		if (!shader.compiled) // errors?
 		{
-			PrintLabeledDebugString("Vertex Shader Errors:\n", shaderc_result_get_error_message(result));
+			PrintLabeledDebugString(label, shader.errors.c_str());
 			abort();
 			return;
 		}
 
-		GvkHelper::create_shader_module(device, shaderc_result_get_length(result), // load into Vulkan
-			(char*)shaderc_result_get_bytes(result), &vertexShader);
-
-		shaderc_result_release(result); // done
-	}
-
-	void CompilePixelShader(const shaderc_compiler_t& compiler, const shaderc_compile_options_t& options)
-	{
-		std::string fragmentShaderSource = ReadFileIntoString("../../storage_buffers/FragmentShader.hlsl");
-
-		shaderc_compilation_result_t result;
-
-		result = shaderc_compile_into_spv( // compile
-			compiler, fragmentShaderSource.c_str(), fragmentShaderSource.length(),
-			shaderc_fragment_shader, "main.frag", "main", options);
-
-		if (shaderc_result_get_compilation_status(result) != shaderc_compilation_status_success) // errors?
-		{
-			PrintLabeledDebugString("Fragment Shader Errors:\n", shaderc_result_get_error_message(result));
-			abort();
-			return;
-		}
-
-		GvkHelper::create_shader_module(device, shaderc_result_get_length(result), // load into Vulkan
-			(char*)shaderc_result_get_bytes(result), &fragmentShader);
-
-		shaderc_result_release(result); // done
+		GvkHelper::create_shader_module(device, shader.spirv.size() * sizeof(uint32_t), // load into Vulkan
+			reinterpret_cast<char*>(shader.spirv.data()), &module);
 	}
 
 	void InitializeGraphicsPipeline()
 	{
+		LoadShaderModule(vertexShaderSpirv, "Vertex Shader Errors:\n", vertexShader);
+		LoadShaderModule(fragmentShaderSpirv, "Fragment Shader Errors:\n", fragmentShader);
+
 		// Create Pipeline & Layout (Thanks Tiny!)
 		VkPipelineShaderStageCreateInfo stage_create_info[2] = {};
 		// Create Stage Info for Vertex Shader
@@ -420,7 +397,7 @@ private:
 		pipeline_create_info.subpass = 0;
 		pipeline_create_info.basePipelineHandle = VK_NULL_HANDLE;
 
-		vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipeline_create_info, nullptr, &pipeline);
+		vkCreateGraphicsPipelines(device, pipelineCache.Get(), 1, &pipeline_create_info, nullptr, &pipeline);
 	}
 
 	VkPipelineInputAssemblyStateCreateInfo CreateVkPipelineInputAssemblyStateCreateInfo()
@@ -685,6 +662,8 @@ private:
 		vkFreeMemory(device, vertexData, nullptr);
 		vkDestroyShaderModule(device, vertexShader, nullptr);
 		vkDestroyShaderModule(device, fragmentShader, nullptr);
+		pipelineCache.Save(); // back to disk while the device is still alive
+		pipelineCache.Destroy();
 		vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
 		vkDestroyPipeline(device, pipeline, nullptr);
 	}